@@ -0,0 +1,105 @@
+#!/bin/sh
+#
+# Copyright (c)2021- Alligator Descartes <http://www.hermitretro.com>
+#
+# This file is part of spi-fat-fuse.
+#
+#     spi-fat-fuse is free software: you can redistribute it and/or modify
+#     it under the terms of the GNU General Public License as published by
+#     the Free Software Foundation, either version 3 of the License, or
+#     (at your option) any later version.
+#
+#     spi-fat-fuse is distributed in the hope that it will be useful,
+#     but WITHOUT ANY WARRANTY; without even the implied warranty of
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#     GNU General Public License for more details.
+#
+#     You should have received a copy of the GNU General Public License
+#     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+#
+# Compares the cluster allocation policies on an aged volume: whole
+# directory read time and how many separate cluster runs a directory's
+# files occupy, in directory order (each one a seek the reads can't be
+# merged across):
+#
+#   bench/locality.sh card.img /mnt/bench
+#
+# Each policy gets a fresh copy of the image. It is aged by creating and
+# deleting files of random sizes, then eight directories are filled with
+# files written a round at a time, one file per directory per round, as
+# a front-end downloading to several systems at once would. The image
+# should be empty and at least 64MB.
+
+set -e
+
+IMAGE=${1:?usage: locality.sh <image> <mountpoint>}
+MNT=${2:?usage: locality.sh <image> <mountpoint>}
+BUILD=${BUILD:-build}
+DIRS="D0 D1 D2 D3 D4 D5 D6 D7"
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+mount_image() {
+    "$BUILD/spi-fat-fuse" --image="$TMP/bench.img" --alloc="$1" "$MNT"
+    sleep 1
+}
+
+age() {
+    mkdir "$MNT/OLD"
+    i=0
+    while [ $i -lt 400 ]; do
+        head -c $(( (i * 7919 % 16 + 1) * 4096 )) /dev/zero > "$MNT/OLD/O$i.BIN"
+        i=$((i + 1))
+    done
+    i=0
+    while [ $i -lt 400 ]; do
+        rm "$MNT/OLD/O$i.BIN"
+        i=$((i + 2))
+    done
+}
+
+fill() {
+    for d in $DIRS; do
+        mkdir "$MNT/$d"
+    done
+    i=0
+    while [ $i -lt 40 ]; do
+        for d in $DIRS; do
+            head -c $(( (i * 104729 % 24 + 1) * 4096 )) /dev/urandom > "$MNT/$d/F$i.BIN"
+        done
+        i=$((i + 1))
+    done
+}
+
+# Cluster runs of the files in $1, in directory order, joined across files
+runs() {
+    for f in $(ls -U "$1"); do
+        getfattr --only-values -n user.spifat.extentmap "$1/$f"
+    done | awk -F'[+ ]' '{ if ($1 != next_clst) n++; next_clst = $1 + $2 } END { print n }'
+}
+
+run() {
+    cp "$IMAGE" "$TMP/bench.img"
+    mount_image "$1"
+    age
+    fill
+    fusermount3 -u "$MNT"
+
+    mount_image "$1"
+    total=0
+    for d in $DIRS; do
+        total=$((total + $(runs "$MNT/$d")))
+    done
+    start=$(date +%s.%N)
+    for d in $DIRS; do
+        cat "$MNT/$d"/* > /dev/null
+    done
+    end=$(date +%s.%N)
+    fusermount3 -u "$MNT"
+
+    awk -v p="$1" -v n="$total" -v s="$start" -v e="$end" 'BEGIN { printf "%-6s %6s %8.2f\n", p, n, e - s }'
+}
+
+printf "%-6s %6s %8s\n" policy runs seconds
+run next
+run near
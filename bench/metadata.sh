@@ -0,0 +1,71 @@
+#!/bin/sh
+#
+# Copyright (c)2021- Alligator Descartes <http://www.hermitretro.com>
+#
+# This file is part of spi-fat-fuse.
+#
+#     spi-fat-fuse is free software: you can redistribute it and/or modify
+#     it under the terms of the GNU General Public License as published by
+#     the Free Software Foundation, either version 3 of the License, or
+#     (at your option) any later version.
+#
+#     spi-fat-fuse is distributed in the hope that it will be useful,
+#     but WITHOUT ANY WARRANTY; without even the implied warranty of
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#     GNU General Public License for more details.
+#
+#     You should have received a copy of the GNU General Public License
+#     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+#
+# Metadata-heavy workload for comparing a spi-fat-fuse mount with vfat over
+# spifat-nbd. Run it against each mount point with the same card:
+#
+#   bench/metadata.sh /mnt/fuse
+#   bench/metadata.sh /mnt/nbd
+#
+# Caches are dropped between phases so each one starts cold on the host.
+
+set -e
+
+MNT=${1:?usage: metadata.sh <mountpoint> [dirs] [files per dir]}
+DIRS=${2:-8}
+FILES=${3:-32}
+DIR="$MNT/BENCH"
+
+now() {
+    date +%s.%N
+}
+
+phase() {
+    name=$1
+    shift
+    sync
+    echo 3 > /proc/sys/vm/drop_caches 2>/dev/null || true
+    start=$(now)
+    "$@" > /dev/null
+    end=$(now)
+    awk -v n="$name" -v s="$start" -v e="$end" 'BEGIN { printf "%-8s %8.3fs\n", n, e - s }'
+}
+
+create() {
+    mkdir "$DIR"
+    d=0
+    while [ $d -lt "$DIRS" ]; do
+        mkdir "$DIR/D$d"
+        f=0
+        while [ $f -lt "$FILES" ]; do
+            head -c 2048 /dev/urandom > "$DIR/D$d/F$f.BIN"
+            f=$((f + 1))
+        done
+        d=$((d + 1))
+    done
+    sync
+}
+
+rm -rf "$DIR"
+echo "$DIRS directories x $FILES files on $MNT"
+phase create create
+phase ls ls -lR "$DIR"
+phase stat find "$DIR" -exec stat {} +
+phase read cat $(find "$DIR" -type f)
+phase delete sh -c "rm -rf '$DIR' && sync"
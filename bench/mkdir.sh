@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# Copyright (c)2021- Alligator Descartes <http://www.hermitretro.com>
+#
+# This file is part of spi-fat-fuse.
+#
+#     spi-fat-fuse is free software: you can redistribute it and/or modify
+#     it under the terms of the GNU General Public License as published by
+#     the Free Software Foundation, either version 3 of the License, or
+#     (at your option) any later version.
+#
+#     spi-fat-fuse is distributed in the hope that it will be useful,
+#     but WITHOUT ANY WARRANTY; without even the implied warranty of
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#     GNU General Public License for more details.
+#
+#     You should have received a copy of the GNU General Public License
+#     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+#
+# mkdir latency and bus traffic on a spi-fat-fuse mount, the way an
+# installer creates a tree of directories:
+#
+#   bench/mkdir.sh /mnt/sd [dirs]
+#
+# The bus counters are reset first, so bytes and commands are for the
+# mkdirs alone (plus the FAT and directory updates they cause).
+
+set -e
+
+MNT=${1:?usage: mkdir.sh <mountpoint> [dirs]}
+DIRS=${2:-200}
+DIR="$MNT/MKBENCH"
+
+now() {
+    date +%s.%N
+}
+
+busstat() {
+    getfattr --only-values -n user.spifat.busstats "$MNT" | awk -v k="$1" '$1 == k { print $2 }'
+}
+
+rm -rf "$DIR"
+mkdir "$DIR"
+sync
+setfattr -n user.spifat.busstats -v reset "$MNT"
+
+start=$(now)
+d=0
+while [ $d -lt "$DIRS" ]; do
+    mkdir "$DIR/D$d"
+    d=$((d + 1))
+done
+sync
+end=$(now)
+
+awk -v n="$DIRS" -v s="$start" -v e="$end" -v b="$(busstat bytes)" -v c="$(busstat commands)" 'BEGIN {
+    printf "%d mkdirs  %.3fs  %.2fms/mkdir\n", n, e - s, (e - s) * 1000 / n
+    printf "bus bytes %d (%.0f/mkdir)  commands %d (%.1f/mkdir)\n", b, b / n, c, c / n
+}'
+
+rm -rf "$DIR"
@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+# Copyright (c)2021- Alligator Descartes <http://www.hermitretro.com>
+#
+# This file is part of spi-fat-fuse.
+#
+#     spi-fat-fuse is free software: you can redistribute it and/or modify
+#     it under the terms of the GNU General Public License as published by
+#     the Free Software Foundation, either version 3 of the License, or
+#     (at your option) any later version.
+#
+#     spi-fat-fuse is distributed in the hope that it will be useful,
+#     but WITHOUT ANY WARRANTY; without even the implied warranty of
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#     GNU General Public License for more details.
+#
+#     You should have received a copy of the GNU General Public License
+#     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+#
+# Compares FUSE request rates over the classic /dev/fuse loop and over
+# io_uring, serving a FAT image file so the card doesn't limit them:
+#
+#   bench/reqrate.sh card.img /mnt/bench GAMES/PACMAN.ZIP
+#
+# The io_uring run needs libfuse 3.18 and the fuse module loaded with
+# enable_uring=1, otherwise it falls back to the classic loop as well.
+
+set -e
+
+IMAGE=${1:?usage: reqrate.sh <image> <mountpoint> <file in image> [seconds]}
+MNT=${2:?usage: reqrate.sh <image> <mountpoint> <file in image> [seconds]}
+FILE=${3:?usage: reqrate.sh <image> <mountpoint> <file in image> [seconds]}
+DURATION=${4:-5}
+BUILD=${BUILD:-build}
+
+run() {
+    name=$1
+    shift
+    "$BUILD/spi-fat-fuse" --image="$IMAGE" "$@" "$MNT"
+    sleep 1
+    echo "$name"
+    "$BUILD/spifat-reqbench" -t "$DURATION" "$MNT/$FILE"
+    fusermount3 -u "$MNT"
+}
+
+run "/dev/fuse" --no-io-uring
+run "io_uring"
@@ -0,0 +1,101 @@
+#!/bin/sh
+#
+# Copyright (c)2021- Alligator Descartes <http://www.hermitretro.com>
+#
+# This file is part of spi-fat-fuse.
+#
+#     spi-fat-fuse is free software: you can redistribute it and/or modify
+#     it under the terms of the GNU General Public License as published by
+#     the Free Software Foundation, either version 3 of the License, or
+#     (at your option) any later version.
+#
+#     spi-fat-fuse is distributed in the hope that it will be useful,
+#     but WITHOUT ANY WARRANTY; without even the implied warranty of
+#     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#     GNU General Public License for more details.
+#
+#     You should have received a copy of the GNU General Public License
+#     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+#
+# Write amplification per workload on a spi-fat-fuse mount: card sectors
+# written by cause (file data, partial sector rewrites, FAT, FAT mirror,
+# directory entries, FSINFO, directory zeroing) against the bytes written:
+#
+#   bench/wramp.sh /mnt/sd
+#
+# Each workload starts from reset user.spifat.wrstats counters and ends
+# with a sync, so the sectors include the metadata it left behind.
+
+set -e
+
+MNT=${1:?usage: wramp.sh <mountpoint>}
+DIR="$MNT/WRBENCH"
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+head -c 4194304 /dev/urandom > "$TMP/copy.bin"
+head -c 2048 /dev/urandom > "$TMP/save.bin"
+head -c 1024 /dev/urandom > "$TMP/small.bin"
+
+row() {
+    printf "%-8s %9s %7s %6s %6s %6s %6s %6s %6s %6s %6s %6s\n" "$@"
+}
+
+run() {
+    name=$1
+    shift
+    sync
+    setfattr -n user.spifat.wrstats -v reset "$MNT"
+    "$@"
+    sync
+    getfattr --only-values -n user.spifat.wrstats "$MNT" > "$TMP/stats"
+    w() {
+        awk -v k="$1" '$1 == k { print $2 }' "$TMP/stats"
+    }
+    row "$name" "$(w logical)" "$(w sectors)" "$(w amplification)" "$(w metadata%)" \
+        "$(w data)" "$(w rmw)" "$(w fat)" "$(w fat_mirror)" "$(w dir)" "$(w fsinfo)" "$(w zero)"
+}
+
+# One large sequential copy
+copy() {
+    cp "$TMP/copy.bin" "$DIR/COPY.BIN"
+}
+
+# A game saving its state: the same small file rewritten and fsynced
+save() {
+    i=0
+    while [ $i -lt 50 ]; do
+        dd if="$TMP/save.bin" of="$DIR/SAVE.DAT" bs=2048 conv=fsync 2>/dev/null
+        i=$((i + 1))
+    done
+}
+
+# Many small files, as an installer unpacks them
+small() {
+    mkdir "$DIR/SMALL"
+    i=0
+    while [ $i -lt 200 ]; do
+        cp "$TMP/small.bin" "$DIR/SMALL/F$i.DAT"
+        i=$((i + 1))
+    done
+}
+
+# A log growing by short records, the file closed after each one
+append() {
+    i=0
+    while [ $i -lt 200 ]; do
+        echo "record $i of the append workload, padded out to a line" >> "$DIR/LOG.TXT"
+        i=$((i + 1))
+    done
+}
+
+rm -rf "$DIR"
+mkdir "$DIR"
+
+row workload logical sectors amp meta% data rmw fat fat2 dir fsinfo zero
+run copy copy
+run save save
+run small small
+run append append
+
+rm -rf "$DIR"
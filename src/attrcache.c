@@ -0,0 +1,228 @@
+/**
+ * Lock-free attribute cache for read-only mounts
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * An open addressed table of pointers to immutable entries. A lookup
+ * hashes the path and follows the probe sequence with acquire loads until
+ * it finds the path or an empty slot. An insert publishes a fully built
+ * entry into an empty slot with a compare-and-swap, so readers see either
+ * nothing or the whole entry. Nothing is ever freed while the cache is
+ * live, which is what makes reclamation (and so RCU or epochs) unnecessary:
+ * on a read-only volume a path's attributes can't change.
+ *
+ * If the card is swapped, attrcache_invalidate() moves the cache to a new
+ * generation. Lookups ignore older entries and inserts replace them; the
+ * replaced entries are kept on a retired list until attrcache_free().
+ *
+ * The table is not resized. Once a probe sequence is full, further paths
+ * on it simply aren't cached.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "attrcache.h"
+
+/** Slots examined per lookup or insert */
+#define ATTRCACHE_PROBES 16
+
+typedef struct AttrEntry {
+    uint32_t hash;
+    unsigned int generation;
+    int result;             /** 0 or the negative errno the lookup returned */
+    SPIFAT_STAT st;
+    struct AttrEntry *retired;
+    char path[];
+} AttrEntry;
+
+static AttrEntry **slots = NULL;
+static unsigned int slotMask = 0;
+static unsigned int generation = 0;
+static AttrEntry *retiredList = NULL;
+
+static ATTRCACHE_STATS stats;
+
+/** FNV-1a */
+static uint32_t hashPath( const char *path ) {
+
+    uint32_t h = 2166136261u;
+
+    while ( *path != '\0' ) {
+        h ^= (unsigned char)*path++;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+/**
+ * Sizes the table to nslots rounded up to a power of two. 0 disables
+ * the cache.
+ *
+ * Returns: 0 = success, -1 = allocation failure
+ */
+int attrcache_init( unsigned int nslots ) {
+
+    unsigned int n = 1;
+
+    attrcache_free();
+    if ( nslots == 0 ) {
+        return 0;
+    }
+
+    while ( n < nslots ) {
+        n <<= 1;
+    }
+
+    slots = calloc( n, sizeof( AttrEntry * ) );
+    if ( slots == NULL ) {
+        return -1;
+    }
+    slotMask = n - 1;
+
+    return 0;
+}
+
+void attrcache_free( void ) {
+
+    unsigned int i;
+
+    AttrEntry *e;
+
+    if ( slots != NULL ) {
+        for ( i = 0 ; i <= slotMask ; i++ ) {
+            free( slots[i] );
+        }
+        free( slots );
+        slots = NULL;
+    }
+    while ( retiredList != NULL ) {
+        e = retiredList;
+        retiredList = e->retired;
+        free( e );
+    }
+    slotMask = 0;
+    memset( &stats, 0, sizeof( stats ) );
+}
+
+/**
+ * Returns: 1 = cached, with the attributes in st and the lookup's result
+ * (0 or negative errno) in result; 0 = not cached
+ */
+int attrcache_lookup( const char *path, SPIFAT_STAT *st, int *result ) {
+
+    uint32_t h;
+    unsigned int i, n, gen;
+    AttrEntry *e;
+
+    if ( slots == NULL ) {
+        return 0;
+    }
+
+    gen = __atomic_load_n( &generation, __ATOMIC_ACQUIRE );
+    h = hashPath( path );
+    for ( n = 0, i = h & slotMask ; n < ATTRCACHE_PROBES ; n++, i = (i + 1) & slotMask ) {
+        e = __atomic_load_n( &slots[i], __ATOMIC_ACQUIRE );
+        if ( e == NULL ) {
+            break;
+        }
+        if ( e->generation == gen && e->hash == h && strcmp( e->path, path ) == 0 ) {
+            *st = e->st;
+            *result = e->result;
+            __atomic_fetch_add( &stats.hits, 1, __ATOMIC_RELAXED );
+            return 1;
+        }
+    }
+
+    __atomic_fetch_add( &stats.misses, 1, __ATOMIC_RELAXED );
+
+    return 0;
+}
+
+/** Records the result of looking up path. A path already cached is left as is */
+void attrcache_insert( const char *path, const SPIFAT_STAT *st, int result ) {
+
+    uint32_t h;
+    unsigned int i, n;
+    size_t len;
+    AttrEntry *e, *cur;
+
+    if ( slots == NULL ) {
+        return;
+    }
+
+    len = strlen( path );
+    e = malloc( sizeof( AttrEntry ) + len + 1 );
+    if ( e == NULL ) {
+        return;
+    }
+    h = hashPath( path );
+    e->hash = h;
+    e->generation = __atomic_load_n( &generation, __ATOMIC_ACQUIRE );
+    e->result = result;
+    if ( st != NULL ) {
+        e->st = *st;
+    } else {
+        memset( &e->st, 0, sizeof( e->st ) );
+    }
+    memcpy( e->path, path, len + 1 );
+
+    for ( n = 0, i = h & slotMask ; n < ATTRCACHE_PROBES ; n++, i = (i + 1) & slotMask ) {
+        cur = NULL;
+        if ( __atomic_compare_exchange_n( &slots[i], &cur, e, 0,
+                                          __ATOMIC_RELEASE, __ATOMIC_ACQUIRE ) ) {
+            __atomic_fetch_add( &stats.entries, 1, __ATOMIC_RELAXED );
+            return;
+        }
+        /** Lost the slot; cur is whoever holds it */
+        if ( cur->generation != e->generation ) {
+            if ( __atomic_compare_exchange_n( &slots[i], &cur, e, 0,
+                                              __ATOMIC_RELEASE, __ATOMIC_ACQUIRE ) ) {
+                /** Readers may still hold the old entry */
+                cur->retired = __atomic_load_n( &retiredList, __ATOMIC_RELAXED );
+                while ( !__atomic_compare_exchange_n( &retiredList, &cur->retired, cur, 0,
+                                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED ) ) {
+                }
+                return;
+            }
+        }
+        if ( cur->generation == e->generation && cur->hash == h && strcmp( cur->path, path ) == 0 ) {
+            free( e );
+            return;
+        }
+    }
+
+    free( e );
+    __atomic_fetch_add( &stats.dropped, 1, __ATOMIC_RELAXED );
+}
+
+/** Forgets every entry, e.g. when the card may have been swapped */
+void attrcache_invalidate( void ) {
+    __atomic_fetch_add( &generation, 1, __ATOMIC_RELEASE );
+}
+
+void attrcache_get_stats( ATTRCACHE_STATS *out ) {
+
+    out->hits = __atomic_load_n( &stats.hits, __ATOMIC_RELAXED );
+    out->misses = __atomic_load_n( &stats.misses, __ATOMIC_RELAXED );
+    out->entries = __atomic_load_n( &stats.entries, __ATOMIC_RELAXED );
+    out->dropped = __atomic_load_n( &stats.dropped, __ATOMIC_RELAXED );
+}
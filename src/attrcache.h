@@ -0,0 +1,60 @@
+/**
+ * Lock-free attribute cache for read-only mounts
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _ATTRCACHE_DEFINED
+#define _ATTRCACHE_DEFINED
+
+#include <stdint.h>
+
+#include "spifat.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t entries;
+    uint64_t dropped;       /** Inserts that found no free slot */
+} ATTRCACHE_STATS;
+
+/**
+ * Path lookups and their results, including misses (-ENOENT). Only valid
+ * while nothing can change on the card, i.e. a read-only mount.
+ *
+ * Lookups take no lock and may run concurrently with inserts; entries are
+ * never changed or freed until attrcache_free(), which must only be
+ * called once no lookups can be running.
+ */
+int attrcache_init( unsigned int nslots );
+void attrcache_free( void );
+int attrcache_lookup( const char *path, SPIFAT_STAT *st, int *result );
+void attrcache_insert( const char *path, const SPIFAT_STAT *st, int result );
+void attrcache_invalidate( void );
+void attrcache_get_stats( ATTRCACHE_STATS *stats );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
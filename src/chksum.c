@@ -0,0 +1,171 @@
+/**
+ * CRC32 and SHA-1 content checksums
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "chksum.h"
+
+static uint32_t crcTable[256];
+static int crcTableReady = 0;
+
+static void buildCrcTable( void ) {
+
+    uint32_t c;
+    int n, k;
+
+    for ( n = 0 ; n < 256 ; n++ ) {
+        c = (uint32_t)n;
+        for ( k = 0 ; k < 8 ; k++ ) {
+            c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+        }
+        crcTable[n] = c;
+    }
+    crcTableReady = 1;
+}
+
+uint32_t chksum_crc32( uint32_t crc, const void *data, size_t len ) {
+
+    const uint8_t *p = data;
+
+    if ( !crcTableReady ) {
+        buildCrcTable();
+    }
+
+    crc = ~crc;
+    while ( len-- ) {
+        crc = crcTable[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+/** SHA-1 (FIPS 180-4) */
+
+#define ROL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+static void sha1Block( SHA1_CTX *ctx, const uint8_t *block ) {
+
+    uint32_t w[80];
+    uint32_t a, b, c, d, e, f, k, t;
+    int i;
+
+    for ( i = 0 ; i < 16 ; i++ ) {
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+               ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+    }
+    for ( i = 16 ; i < 80 ; i++ ) {
+        w[i] = ROL32( w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1 );
+    }
+
+    a = ctx->state[0];
+    b = ctx->state[1];
+    c = ctx->state[2];
+    d = ctx->state[3];
+    e = ctx->state[4];
+
+    for ( i = 0 ; i < 80 ; i++ ) {
+        if ( i < 20 ) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if ( i < 40 ) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if ( i < 60 ) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        t = ROL32( a, 5 ) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = ROL32( b, 30 );
+        b = a;
+        a = t;
+    }
+
+    ctx->state[0] += a;
+    ctx->state[1] += b;
+    ctx->state[2] += c;
+    ctx->state[3] += d;
+    ctx->state[4] += e;
+}
+
+void chksum_sha1_init( SHA1_CTX *ctx ) {
+
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xEFCDAB89;
+    ctx->state[2] = 0x98BADCFE;
+    ctx->state[3] = 0x10325476;
+    ctx->state[4] = 0xC3D2E1F0;
+    ctx->nbytes = 0;
+    ctx->blocklen = 0;
+}
+
+void chksum_sha1_update( SHA1_CTX *ctx, const void *data, size_t len ) {
+
+    const uint8_t *p = data;
+
+    ctx->nbytes += len;
+
+    while ( len > 0 ) {
+        size_t n = 64 - ctx->blocklen;
+        if ( n > len ) {
+            n = len;
+        }
+        memcpy( ctx->block + ctx->blocklen, p, n );
+        ctx->blocklen += n;
+        p += n;
+        len -= n;
+
+        if ( ctx->blocklen == 64 ) {
+            sha1Block( ctx, ctx->block );
+            ctx->blocklen = 0;
+        }
+    }
+}
+
+void chksum_sha1_final( SHA1_CTX *ctx, uint8_t digest[SHA1_DIGEST_SIZE] ) {
+
+    uint64_t nbits = ctx->nbytes * 8;
+    int i;
+
+    /** Pad with 0x80 then zeros up to 56 bytes, then the 64-bit length */
+    ctx->block[ctx->blocklen++] = 0x80;
+    if ( ctx->blocklen > 56 ) {
+        memset( ctx->block + ctx->blocklen, 0, 64 - ctx->blocklen );
+        sha1Block( ctx, ctx->block );
+        ctx->blocklen = 0;
+    }
+    memset( ctx->block + ctx->blocklen, 0, 56 - ctx->blocklen );
+    for ( i = 0 ; i < 8 ; i++ ) {
+        ctx->block[56 + i] = (uint8_t)(nbits >> (56 - (i * 8)));
+    }
+    sha1Block( ctx, ctx->block );
+
+    for ( i = 0 ; i < 5 ; i++ ) {
+        digest[i * 4] = (uint8_t)(ctx->state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t)(ctx->state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t)(ctx->state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t)ctx->state[i];
+    }
+}
@@ -0,0 +1,52 @@
+/**
+ * CRC32 and SHA-1 content checksums
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CHKSUM_DEFINED
+#define _CHKSUM_DEFINED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** CRC32 as used by zip/PNG (reflected 0xEDB88320). Start with crc = 0 */
+uint32_t chksum_crc32( uint32_t crc, const void *data, size_t len );
+
+#define SHA1_DIGEST_SIZE 20
+
+typedef struct {
+    uint32_t state[5];
+    uint64_t nbytes;
+    uint8_t block[64];
+    size_t blocklen;
+} SHA1_CTX;
+
+void chksum_sha1_init( SHA1_CTX *ctx );
+void chksum_sha1_update( SHA1_CTX *ctx, const void *data, size_t len );
+void chksum_sha1_final( SHA1_CTX *ctx, uint8_t digest[SHA1_DIGEST_SIZE] );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,785 @@
+/**
+ * FatFs disk I/O layer: sector cache and transport serialisation
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * FatFs calls disk_*() here. Each call is serialised on a single lock
+ * (there is only one card and one set of GPIO lines) and reads are served
+ * from the sector cache where possible before falling through to the
+ * bit-banged transport (SPI mode in sdmm.c or 4-bit SD bus mode in
+ * sdnative.c, chosen with disk_set_transport()), the kernel's SPI driver
+ * (sdspidev.c, disk_set_spidev()) or an image file (sdimage.c,
+ * disk_set_image()). Writes are written through and refresh
+ * the cache so it never holds stale data.
+ *
+ * Background readers (e.g., directory warm-up) use disk_prefetch() which
+ * backs off whenever a foreground request is waiting for the card.
+ *
+ * Transfers that fail are retried, then retried after resynchronising the
+ * bus, then replayed after re-initialising the card before an error is
+ * returned to FatFs (see recoverXfer()).
+ *
+ * disk_readv() and disk_writev() run several sector ranges back-to-back
+ * inside one chip-select session. Reads whose ranges are separated by at
+ * most `gap` sectors are merged into one multi-block read through a
+ * bounce buffer; the gap sectors are cached rather than thrown away.
+ *
+ * disk_borrow() lends out a cached sector in place for zero-copy readers.
+ *
+ * Card time and cache use are also counted per calling thread, so the
+ * layer above can charge them to whoever the thread is working for
+ * (disk_get_thread_stats()).
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ff.h"
+#include "diskio.h"
+#include "sdmm.h"
+#include "sdnative.h"
+#include "sdimage.h"
+#include "sdspidev.h"
+#include "sdcache.h"
+#include "heatmap.h"
+#include "spifat-trace.h"
+
+/** Largest transfer handed to the transport in one command */
+#define MAX_XFER_SECTORS 128
+
+/** Card access functions of one bus wiring */
+typedef struct {
+    DSTATUS (*initialize)( BYTE pdrv );
+    DSTATUS (*status)( BYTE pdrv );
+    DRESULT (*read)( BYTE pdrv, BYTE *buff, LBA_t sector, UINT count );
+    DRESULT (*write)( BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count );
+    DRESULT (*ioctl)( BYTE pdrv, BYTE cmd, void *buff );
+    DRESULT (*readv)( BYTE pdrv, const DISKSEG *segs, UINT nsegs );
+    DRESULT (*writev)( BYTE pdrv, const DISKSEG *segs, UINT nsegs );
+} Transport;
+
+/** Indexed by DISK_TRANSPORT_* */
+static const Transport transports[] = {
+    { mmc_disk_initialize, mmc_disk_status, mmc_disk_read, mmc_disk_write,
+      mmc_disk_ioctl, mmc_disk_readv, mmc_disk_writev },
+    { sdn_disk_initialize, sdn_disk_status, sdn_disk_read, sdn_disk_write,
+      sdn_disk_ioctl, sdn_disk_readv, sdn_disk_writev },
+    { img_disk_initialize, img_disk_status, img_disk_read, img_disk_write,
+      img_disk_ioctl, img_disk_readv, img_disk_writev },
+    { spd_disk_initialize, spd_disk_status, spd_disk_read, spd_disk_write,
+      spd_disk_ioctl, spd_disk_readv, spd_disk_writev },
+};
+
+static const Transport *transport = &transports[DISK_TRANSPORT_SPI];
+
+static pthread_mutex_t diskLock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int foregroundWaiters = 0;
+
+/** Card work done by this thread, see disk_get_thread_stats() */
+static __thread DISKTHREADSTATS threadStats;
+
+/** Scratch area for prefetches that have no caller buffer */
+static BYTE prefetchBuf[MAX_XFER_SECTORS * FF_MAX_SS];
+
+static void lockForeground( void ) {
+
+    __sync_fetch_and_add( &foregroundWaiters, 1 );
+    pthread_mutex_lock( &diskLock );
+    __sync_fetch_and_sub( &foregroundWaiters, 1 );
+}
+
+/** Only take the card when no foreground request is queued for it */
+static void lockBackground( void ) {
+
+    for ( ;; ) {
+        while ( foregroundWaiters > 0 ) {
+            usleep( 1000 );
+        }
+        pthread_mutex_lock( &diskLock );
+        if ( foregroundWaiters == 0 ) {
+            return;
+        }
+        pthread_mutex_unlock( &diskLock );
+        sched_yield();
+    }
+}
+
+static void unlockDisk( void ) {
+    pthread_mutex_unlock( &diskLock );
+}
+
+/**
+ * Chooses how the card is wired. Takes effect at the next disk_initialize()
+ * so must be called before the volume is mounted.
+ *
+ * Returns: 0 = success, -1 = unknown transport
+ */
+int disk_set_transport( BYTE kind ) {
+
+    if ( kind >= sizeof( transports ) / sizeof( transports[0] ) ) {
+        return -1;
+    }
+
+    lockForeground();
+    transport = &transports[kind];
+    unlockDisk();
+
+    return 0;
+}
+
+/**
+ * Serves the disk from an image file instead of a card. Like
+ * disk_set_transport() this must be called before the volume is mounted.
+ *
+ * Returns: 0 = success
+ */
+int disk_set_image( const char *path ) {
+
+    lockForeground();
+    img_set_path( path );
+    transport = &transports[DISK_TRANSPORT_IMAGE];
+    unlockDisk();
+
+    return 0;
+}
+
+/**
+ * Talks to the card through a spidev device (e.g. /dev/spidev0.0), using
+ * the kernel's SPI controller driver instead of bit-banged GPIO. Must be
+ * called before the volume is mounted.
+ *
+ * Returns: 0 = success
+ */
+int disk_set_spidev( const char *path ) {
+
+    lockForeground();
+    spd_set_device( path );
+    transport = &transports[DISK_TRANSPORT_SPIDEV];
+    unlockDisk();
+
+    return 0;
+}
+
+/** Escalating steps taken by recoverXfer() */
+enum { RECOVER_RETRY, RECOVER_RESYNC, RECOVER_REINIT, RECOVER_GIVEUP };
+
+static DISKRECOVERYSTATS recoveryStats;
+
+static DRESULT xferOnce( BYTE pdrv, int write, const DISKSEG *segs, UINT nsegs ) {
+
+    if ( write ) {
+        if ( nsegs == 1 ) {
+            return transport->write( pdrv, segs[0].buff, segs[0].sector, segs[0].count );
+        }
+        return transport->writev( pdrv, segs, nsegs );
+    }
+
+    if ( nsegs == 1 ) {
+        return transport->read( pdrv, segs[0].buff, segs[0].sector, segs[0].count );
+    }
+    return transport->readv( pdrv, segs, nsegs );
+}
+
+/**
+ * Runs a transfer, hiding transient card glitches from FatFs. A failure
+ * is retried as is, then after resynchronising the bus, then after
+ * re-initialising the card (straight away if the card reports it is no
+ * longer initialised). Transfers are whole sectors so replaying a partly
+ * completed one is harmless.
+ *
+ * The sector cache is kept across a recovery re-init: it is the same card
+ * mid-request, unlike disk_initialize() which may follow a swap.
+ * Called with the lock held.
+ */
+static DRESULT recoverSteps( BYTE pdrv, int write, const DISKSEG *segs, UINT nsegs ) {
+
+    DRESULT res;
+    int step = RECOVER_RETRY;
+
+    res = xferOnce( pdrv, write, segs, nsegs );
+    if ( res != RES_ERROR && res != RES_NOTRDY ) {
+        return res;
+    }
+    recoveryStats.errors++;
+
+    while ( res == RES_ERROR || res == RES_NOTRDY ) {
+        if ( res == RES_NOTRDY && step < RECOVER_REINIT ) {
+            step = RECOVER_REINIT;
+        }
+
+        switch ( step ) {
+            case RECOVER_RETRY: {
+                recoveryStats.retries++;
+                break;
+            }
+            case RECOVER_RESYNC: {
+                recoveryStats.resyncs++;
+                transport->ioctl( pdrv, MMC_RESYNC, NULL );
+                break;
+            }
+            case RECOVER_REINIT: {
+                recoveryStats.reinits++;
+                if ( transport->initialize( pdrv ) & STA_NOINIT ) {
+                    recoveryStats.failed++;
+                    return RES_NOTRDY;
+                }
+                break;
+            }
+            default: {
+                recoveryStats.failed++;
+                return res;
+            }
+        }
+        step++;
+
+        res = xferOnce( pdrv, write, segs, nsegs );
+    }
+
+    if ( res == RES_OK ) {
+        recoveryStats.recovered++;
+    } else {
+        recoveryStats.failed++;
+    }
+
+    return res;
+}
+
+static QWORD monoMicros( void ) {
+
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return ((QWORD)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+/** recoverSteps(), charging the card time to the calling thread */
+static DRESULT recoverXfer( BYTE pdrv, int write, const DISKSEG *segs, UINT nsegs ) {
+
+    DRESULT res;
+    QWORD start = monoMicros();
+    UINT i;
+
+    res = recoverSteps( pdrv, write, segs, nsegs );
+
+    threadStats.card_us += monoMicros() - start;
+    for ( i = 0 ; i < nsegs ; i++ ) {
+        threadStats.card_sectors += segs[i].count;
+    }
+
+    return res;
+}
+
+/** Copies the calling thread's card time, sectors and cache hits */
+void disk_get_thread_stats( DISKTHREADSTATS *stats ) {
+
+    *stats = threadStats;
+}
+
+/** Copies the transient error recovery counters */
+void disk_get_recovery_stats( DISKRECOVERYSTATS *stats ) {
+
+    lockForeground();
+    *stats = recoveryStats;
+    unlockDisk();
+}
+
+/**
+ * Exports the LBA heat map (reuse = 0) or the reuse distance profile
+ * (reuse = 1) as CSV, see heatmap.c. Returns: the length written
+ */
+int disk_heatmap_csv( int reuse, char *buf, UINT size ) {
+
+    int len;
+
+    lockForeground();
+    len = reuse ? heatmap_reuse_csv( buf, size ) : heatmap_csv( buf, size );
+    unlockDisk();
+
+    return len;
+}
+
+void disk_heatmap_reset( void ) {
+
+    lockForeground();
+    heatmap_reset();
+    unlockDisk();
+}
+
+DSTATUS disk_status( BYTE pdrv ) {
+
+    return transport->status( pdrv );
+}
+
+DSTATUS disk_initialize( BYTE pdrv ) {
+
+    DSTATUS s;
+
+    lockForeground();
+
+    /** A (re-)initialise may follow a card swap so nothing cached is trusted */
+    sdcache_invalidate();
+    s = transport->initialize( pdrv );
+
+    unlockDisk();
+
+    return s;
+}
+
+/**
+ * Serves what it can from the cache and reads the span covering every
+ * missing sector from the card in one command. Cached sectors inside that
+ * span are re-read rather than splitting the transfer.
+ */
+static DRESULT cachedRead( BYTE pdrv, BYTE *buff, LBA_t sector, UINT count ) {
+
+    DRESULT res;
+    DISKSEG seg;
+    UINT i, first = count, last = 0;
+
+    for ( i = 0 ; i < count ; i++ ) {
+        if ( !sdcache_read( sector + i, buff + (i * FF_MAX_SS) ) ) {
+            if ( first == count ) {
+                first = i;
+            }
+            last = i;
+            threadStats.cache_misses++;
+        } else {
+            threadStats.cache_hits++;
+        }
+    }
+
+    if ( first == count ) {
+        return RES_OK;
+    }
+
+    seg.sector = sector + first;
+    seg.count = last - first + 1;
+    seg.buff = buff + (first * FF_MAX_SS);
+    res = recoverXfer( pdrv, 0, &seg, 1 );
+    if ( res == RES_OK ) {
+        for ( i = first ; i <= last ; i++ ) {
+            sdcache_store( sector + i, buff + (i * FF_MAX_SS) );
+        }
+    }
+
+    return res;
+}
+
+DRESULT disk_read( BYTE pdrv, BYTE *buff, LBA_t sector, UINT count ) {
+
+    DRESULT res;
+
+    SPIFAT_TRACE( disk_read_entry, sector, count );
+    lockForeground();
+    heatmap_access( sector, count, 0 );
+    res = cachedRead( pdrv, buff, sector, count );
+    unlockDisk();
+    SPIFAT_TRACE( disk_read_return, sector, count, res );
+
+    return res;
+}
+
+/**
+ * Points data at the cached copy of a sector, reading it in first on a
+ * miss, and pins it until disk_unborrow(). Lets a caller use file data
+ * straight out of the cache without another copy.
+ *
+ * Returns: RES_PARERR if the cache is disabled or every slot is borrowed
+ */
+DRESULT disk_borrow( BYTE pdrv, LBA_t sector, const BYTE **data ) {
+
+    static BYTE missBuf[FF_MAX_SS];
+    DRESULT res = RES_OK;
+
+    lockForeground();
+    heatmap_access( sector, 1, 0 );
+    *data = sdcache_pin( sector );
+    if ( *data != NULL ) {
+        threadStats.cache_hits++;
+    } else {
+        res = cachedRead( pdrv, missBuf, sector, 1 );
+        if ( res == RES_OK ) {
+            *data = sdcache_pin( sector );
+            if ( *data == NULL ) {
+                res = RES_PARERR;
+            }
+        }
+    }
+    unlockDisk();
+
+    return res;
+}
+
+/** Releases a sector handed out by disk_borrow() */
+void disk_unborrow( const BYTE *data ) {
+
+    lockForeground();
+    sdcache_unpin( data );
+    unlockDisk();
+}
+
+/** Cache refresh for a write, done a sector at a time while the card programs */
+typedef struct {
+    const DISKSEG *segs;
+    UINT nsegs;
+    UINT seg;
+    UINT offset;
+} CacheFill;
+
+static int cacheFillSlice( void *arg ) {
+
+    CacheFill *fill = arg;
+    const DISKSEG *seg;
+
+    while ( fill->seg < fill->nsegs && fill->offset >= fill->segs[fill->seg].count ) {
+        fill->seg++;
+        fill->offset = 0;
+    }
+    if ( fill->seg == fill->nsegs ) {
+        return 0;
+    }
+
+    seg = &fill->segs[fill->seg];
+    sdcache_store( seg->sector + fill->offset, seg->buff + (fill->offset * FF_MAX_SS) );
+    fill->offset++;
+
+    return 1;
+}
+
+/**
+ * Writes the ranges and refreshes the cache with them. The cache copies
+ * are handed to the transport as busy work so they happen while the card
+ * is programming rather than after the transfer. Called with the lock held.
+ */
+static DRESULT writeAndCache( BYTE pdrv, const DISKSEG *segs, UINT nsegs ) {
+
+    DRESULT res;
+    CacheFill fill = { segs, nsegs, 0, 0 };
+    DISKBUSYWORK work = { cacheFillSlice, &fill };
+    UINT i, j;
+
+    transport->ioctl( pdrv, MMC_SET_BUSYWORK, &work );
+    res = recoverXfer( pdrv, 1, segs, nsegs );
+    transport->ioctl( pdrv, MMC_SET_BUSYWORK, NULL );
+
+    if ( res == RES_OK ) {
+        while ( cacheFillSlice( &fill ) ) {
+        }
+    } else {
+        for ( i = 0 ; i < nsegs ; i++ ) {
+            for ( j = 0 ; j < segs[i].count ; j++ ) {
+                sdcache_discard( segs[i].sector + j );
+            }
+        }
+    }
+
+    return res;
+}
+
+DRESULT disk_write( BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count ) {
+
+    DRESULT res;
+    DISKSEG seg = { sector, count, (BYTE *)buff };
+
+    SPIFAT_TRACE( disk_write_entry, sector, count );
+    lockForeground();
+    heatmap_access( sector, count, 1 );
+    res = writeAndCache( pdrv, &seg, 1 );
+    unlockDisk();
+    SPIFAT_TRACE( disk_write_return, sector, count, res );
+
+    return res;
+}
+
+static int compareSegs( const void *a, const void *b ) {
+
+    const DISKSEG *sa = a;
+    const DISKSEG *sb = b;
+
+    if ( sa->sector < sb->sector ) {
+        return -1;
+    }
+    if ( sa->sector > sb->sector ) {
+        return 1;
+    }
+    return 0;
+}
+
+/** Copies a fully cached segment out of the cache. Returns: 1 = served */
+static int serveFromCache( const DISKSEG *seg ) {
+
+    UINT i;
+
+    for ( i = 0 ; i < seg->count ; i++ ) {
+        if ( !sdcache_contains( seg->sector + i ) ) {
+            return 0;
+        }
+    }
+    if ( seg->buff != NULL ) {
+        for ( i = 0 ; i < seg->count ; i++ ) {
+            sdcache_read( seg->sector + i, seg->buff + (i * FF_MAX_SS) );
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Vectored read. Segments are sorted by LBA and grouped while the next
+ * one starts within gap sectors of the group and the group fits a
+ * single transfer. Each group becomes one transport range; groups of more
+ * than one segment (or prefetches) are read through a bounce buffer and
+ * scattered afterwards. Called with the disk lock held.
+ */
+static DRESULT vectoredRead( BYTE pdrv, const DISKSEG *segs, UINT nsegs, UINT gap ) {
+
+    DRESULT res = RES_OK;
+    DISKSEG *sorted = NULL;
+    DISKSEG *ranges = NULL;
+    UINT *groupEnd = NULL;
+    BYTE *bounce = NULL;
+    UINT i, j, k, nsorted = 0, nranges = 0;
+    size_t nbounce = 0;
+
+    sorted = malloc( nsegs * sizeof( DISKSEG ) );
+    ranges = malloc( nsegs * sizeof( DISKSEG ) );
+    groupEnd = malloc( nsegs * sizeof( UINT ) );
+    if ( sorted == NULL || ranges == NULL || groupEnd == NULL ) {
+        res = RES_ERROR;
+        goto cleanup;
+    }
+
+    for ( i = 0 ; i < nsegs ; i++ ) {
+        if ( segs[i].count > 0 && !serveFromCache( &segs[i] ) ) {
+            sorted[nsorted++] = segs[i];
+            threadStats.cache_misses += segs[i].count;
+        } else {
+            threadStats.cache_hits += segs[i].count;
+        }
+    }
+    if ( nsorted == 0 ) {
+        goto cleanup;
+    }
+    qsort( sorted, nsorted, sizeof( DISKSEG ), compareSegs );
+
+    /** First pass: group segments and size the bounce buffer */
+    for ( i = 0 ; i < nsorted ; i = j ) {
+        LBA_t start = sorted[i].sector;
+        LBA_t end = start + sorted[i].count;
+
+        for ( j = i + 1 ; j < nsorted ; j++ ) {
+            LBA_t jend = sorted[j].sector + sorted[j].count;
+            if ( sorted[j].sector > end + gap ) {
+                break;
+            }
+            if ( (jend > end ? jend : end) - start > MAX_XFER_SECTORS ) {
+                break;
+            }
+            if ( jend > end ) {
+                end = jend;
+            }
+        }
+
+        ranges[nranges].sector = start;
+        ranges[nranges].count = (UINT)(end - start);
+        ranges[nranges].buff = NULL;
+        if ( j - i > 1 || sorted[i].buff == NULL ) {
+            nbounce += ranges[nranges].count;
+        } else {
+            ranges[nranges].buff = sorted[i].buff;
+        }
+        groupEnd[nranges] = j;
+        nranges++;
+    }
+
+    if ( nbounce > 0 ) {
+        bounce = malloc( nbounce * FF_MAX_SS );
+        if ( bounce == NULL ) {
+            res = RES_ERROR;
+            goto cleanup;
+        }
+        for ( i = 0, nbounce = 0 ; i < nranges ; i++ ) {
+            if ( ranges[i].buff == NULL ) {
+                ranges[i].buff = bounce + (nbounce * FF_MAX_SS);
+                nbounce += ranges[i].count;
+            }
+        }
+    }
+
+    res = recoverXfer( pdrv, 0, ranges, nranges );
+    if ( res != RES_OK ) {
+        goto cleanup;
+    }
+
+    /** Second pass: scatter bounced data and cache every sector read */
+    for ( i = 0, j = 0 ; i < nranges ; i++ ) {
+        for ( ; j < groupEnd[i] ; j++ ) {
+            if ( sorted[j].buff != NULL && sorted[j].buff != ranges[i].buff ) {
+                memcpy( sorted[j].buff,
+                        ranges[i].buff + ((sorted[j].sector - ranges[i].sector) * FF_MAX_SS),
+                        sorted[j].count * FF_MAX_SS );
+            }
+        }
+        for ( k = 0 ; k < ranges[i].count ; k++ ) {
+            sdcache_store( ranges[i].sector + k, ranges[i].buff + (k * FF_MAX_SS) );
+        }
+    }
+
+cleanup:
+    free( bounce );
+    free( groupEnd );
+    free( ranges );
+    free( sorted );
+
+    return res;
+}
+
+DRESULT disk_readv( BYTE pdrv, const DISKSEG *segs, UINT nsegs, UINT gap ) {
+
+    DRESULT res;
+    UINT i;
+
+    lockForeground();
+    for ( i = 0 ; i < nsegs ; i++ ) {
+        heatmap_access( segs[i].sector, segs[i].count, 0 );
+    }
+    res = vectoredRead( pdrv, segs, nsegs, gap );
+    unlockDisk();
+
+    return res;
+}
+
+/**
+ * As disk_readv() but only fills the cache (buffers are ignored) and
+ * waits for the card to be idle. The whole batch runs in one session so
+ * callers should keep batches to a few transfers.
+ */
+DRESULT disk_prefetchv( BYTE pdrv, const DISKSEG *segs, UINT nsegs, UINT gap ) {
+
+    DRESULT res;
+    DISKSEG *nobuf;
+    UINT i;
+
+    nobuf = malloc( nsegs * sizeof( DISKSEG ) );
+    if ( nobuf == NULL ) {
+        return RES_ERROR;
+    }
+    for ( i = 0 ; i < nsegs ; i++ ) {
+        nobuf[i] = segs[i];
+        nobuf[i].buff = NULL;
+    }
+
+    lockBackground();
+    res = vectoredRead( pdrv, nobuf, nsegs, gap );
+    unlockDisk();
+
+    free( nobuf );
+
+    return res;
+}
+
+DRESULT disk_writev( BYTE pdrv, const DISKSEG *segs, UINT nsegs ) {
+
+    DRESULT res;
+    UINT i;
+
+    lockForeground();
+    for ( i = 0 ; i < nsegs ; i++ ) {
+        heatmap_access( segs[i].sector, segs[i].count, 1 );
+    }
+    res = writeAndCache( pdrv, segs, nsegs );
+    unlockDisk();
+
+    return res;
+}
+
+DRESULT disk_ioctl( BYTE pdrv, BYTE cmd, void *buff ) {
+
+    DRESULT res;
+    LBA_t sector;
+
+    /** Only the heat map wants the layout; the transports never see it */
+    if ( cmd == MMC_SET_LAYOUT ) {
+        lockForeground();
+        heatmap_layout( ((LBA_t *)buff)[0], ((LBA_t *)buff)[1] );
+        unlockDisk();
+        return RES_OK;
+    }
+
+    lockForeground();
+    res = transport->ioctl( pdrv, cmd, buff );
+
+    /** Erased sectors read as zeros now, so cached copies are stale. A
+        failed or timed out erase may still have cleared part of the range */
+    if ( cmd == MMC_ZERO_RANGE && res != RES_PARERR ) {
+        for ( sector = ((LBA_t *)buff)[0] ; sector <= ((LBA_t *)buff)[1] ; sector++ ) {
+            sdcache_discard( sector );
+        }
+    }
+    unlockDisk();
+
+    return res;
+}
+
+/**
+ * Reads the uncached parts of a sector range into the cache. The card is
+ * released between transfers so foreground requests are never stuck
+ * behind a long prefetch.
+ */
+DRESULT disk_prefetch( BYTE pdrv, LBA_t sector, UINT count ) {
+
+    DRESULT res = RES_OK;
+    UINT i, n;
+
+    while ( count > 0 && res == RES_OK ) {
+
+        lockBackground();
+
+        /** Skip the already cached prefix */
+        while ( count > 0 && sdcache_contains( sector ) ) {
+            sector++;
+            count--;
+        }
+
+        /** Read up to the next cached sector in a single transfer */
+        for ( n = 0 ; n < count && n < MAX_XFER_SECTORS && !sdcache_contains( sector + n ) ; n++ ) ;
+
+        if ( n > 0 ) {
+            DISKSEG seg = { sector, n, prefetchBuf };
+            res = recoverXfer( pdrv, 0, &seg, 1 );
+            if ( res == RES_OK ) {
+                for ( i = 0 ; i < n ; i++ ) {
+                    sdcache_store( sector + i, prefetchBuf + (i * FF_MAX_SS) );
+                }
+            }
+            sector += n;
+            count -= n;
+        }
+
+        unlockDisk();
+    }
+
+    return res;
+}
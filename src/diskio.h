@@ -23,6 +23,66 @@ typedef enum {
 } DRESULT;
 
 
+/* Sector range for vectored I/O (disk_readv/disk_writev) */
+typedef struct {
+	LBA_t	sector;		/* Start sector (LBA) */
+	UINT	count;		/* Sector count */
+	BYTE*	buff;		/* Data buffer (not modified on write, may be NULL for prefetch) */
+} DISKSEG;
+
+
+/* Bus framing counters (MMC_GET_BUSSTATS) */
+typedef struct {
+	QWORD	ops;			/* Public read/write operations */
+	QWORD	bytes;			/* Bytes clocked in either direction, including framing */
+	QWORD	commands;		/* Command packets sent */
+	QWORD	selects;		/* CS# assertions */
+	QWORD	deselects;		/* CS# releases */
+	QWORD	ready_polls;	/* Busy polls (wait_ready) */
+	QWORD	ready_skipped;	/* Commands sent without a CS# cycle or busy poll */
+	QWORD	busy_slices;	/* Slices of host work run while the card was programming */
+	DWORD	prog_us;		/* Running average of the block programming time [us] */
+} DISKBUSSTATS;
+
+
+/* Transient error recovery counters (disk_get_recovery_stats) */
+typedef struct {
+	QWORD	errors;		/* Transfers that failed on the first attempt */
+	QWORD	retries;	/* Plain retries */
+	QWORD	resyncs;	/* Retries after resynchronising the bus */
+	QWORD	reinits;	/* Replays after re-initialising the card */
+	QWORD	recovered;	/* Failed transfers that then succeeded */
+	QWORD	failed;		/* Failures passed up to FatFs */
+} DISKRECOVERYSTATS;
+
+
+/* Card work done on behalf of the calling thread (disk_get_thread_stats) */
+typedef struct {
+	QWORD	card_us;		/* Time spent in card transfers, recovery included [us] */
+	QWORD	card_sectors;	/* Sectors transferred to or from the card */
+	QWORD	cache_hits;		/* Sectors read that were served from the sector cache */
+	QWORD	cache_misses;	/* Sectors read that had to come from the card */
+} DISKTHREADSTATS;
+
+
+/* Card initialization timing (MMC_GET_INITSTATS) */
+typedef struct {
+	QWORD	inits;			/* Initialization attempts */
+	QWORD	failures;		/* Attempts that left the card uninitialized */
+	QWORD	early_exits;	/* Attempts that found the card still initialized (OCR) */
+	DWORD	last_us;		/* Duration of the last attempt [us] */
+	DWORD	ready_us;		/* Time until the card left idle state in the last attempt [us] */
+	DWORD	polls;			/* ACMD41/CMD1 polls in the last attempt */
+} DISKINITSTATS;
+
+
+/* Host work run between busy polls of a multiple block write (MMC_SET_BUSYWORK) */
+typedef struct {
+	int		(*fn)(void* arg);	/* Runs one short slice, returns 0 when there is nothing left to do */
+	void*	arg;
+} DISKBUSYWORK;
+
+
 /*---------------------------------------*/
 /* Prototypes for disk control functions */
 
@@ -33,6 +93,27 @@ DRESULT disk_read (BYTE pdrv, BYTE* buff, LBA_t sector, UINT count);
 DRESULT disk_write (BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count);
 DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
 
+/* Cache-aware extensions (diskio.c) */
+DRESULT disk_prefetch (BYTE pdrv, LBA_t sector, UINT count);	/* Background priority read into the sector cache */
+DRESULT disk_readv (BYTE pdrv, const DISKSEG* segs, UINT nsegs, UINT gap);	/* Read several ranges in one card session */
+DRESULT disk_writev (BYTE pdrv, const DISKSEG* segs, UINT nsegs);	/* Write several ranges in one card session */
+DRESULT disk_prefetchv (BYTE pdrv, const DISKSEG* segs, UINT nsegs, UINT gap);	/* Background priority disk_readv into the cache */
+DRESULT disk_borrow (BYTE pdrv, LBA_t sector, const BYTE** data);	/* Pin a sector in the cache and point at it */
+void disk_unborrow (const BYTE* data);	/* Release a sector pinned by disk_borrow */
+void disk_get_recovery_stats (DISKRECOVERYSTATS* stats);	/* Copy the transient error recovery counters */
+void disk_get_thread_stats (DISKTHREADSTATS* stats);	/* Copy the calling thread's card counters */
+int disk_heatmap_csv (int reuse, char* buf, UINT size);	/* LBA heat map (0) or reuse distance profile (1) as CSV */
+void disk_heatmap_reset (void);	/* Zero the heat map and reuse profile */
+int disk_set_transport (BYTE kind);	/* Select the card wiring (DISK_TRANSPORT_*) before mounting */
+int disk_set_image (const char* path);	/* Serve the disk from an image file before mounting */
+int disk_set_spidev (const char* path);	/* Talk to the card through a spidev device before mounting */
+
+/* Transports (disk_set_transport) */
+#define DISK_TRANSPORT_SPI		0	/* SPI mode, 4 pins (sdmm.c) */
+#define DISK_TRANSPORT_SDNATIVE	1	/* SD bus mode, 4-bit, 6 pins (sdnative.c) */
+#define DISK_TRANSPORT_IMAGE	2	/* Image file (sdimage.c, disk_set_image) */
+#define DISK_TRANSPORT_SPIDEV	3	/* SPI mode over /dev/spidevX.Y (sdspidev.c, disk_set_spidev) */
+
 
 /* Disk Status Bits (DSTATUS) */
 #define STA_NOINIT		0x01	/* Drive not initialized */
@@ -67,6 +148,13 @@ DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
 #define ISDIO_READ			55	/* Read data form SD iSDIO register */
 #define ISDIO_WRITE			56	/* Write data to SD iSDIO register */
 #define ISDIO_MRITE			57	/* Masked write data to SD iSDIO register */
+#define MMC_GET_BUSSTATS	58	/* Get bus framing counters (DISKBUSSTATS) */
+#define MMC_RESET_BUSSTATS	59	/* Zero bus framing counters */
+#define MMC_SET_BUSYWORK	63	/* Set (DISKBUSYWORK*) or clear (NULL) work to run while the card is busy */
+#define MMC_RESYNC			64	/* Abort any transfer and resynchronise the bus */
+#define MMC_GET_INITSTATS	65	/* Get card initialization timing (DISKINITSTATS) */
+#define MMC_ZERO_RANGE		66	/* Erase sectors [0]-[1] (LBA_t[2]) where erased blocks read as zeros, RES_PARERR otherwise, RES_NOTRDY on erase timeout */
+#define MMC_SET_LAYOUT		67	/* Data area start [0] and volume end [1] (LBA_t[2]), for the heat map */
 
 /* ATA/CF specific command (Not used by FatFs) */
 #define ATA_GET_REV			60	/* Get F/W revision */
@@ -0,0 +1,353 @@
+/**
+ * On-card extent (cluster run) discovery for files
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fatextent.h"
+
+/** Initial cluster link map size in DWORDs. Grown on FR_NOT_ENOUGH_CORE */
+#define INITIAL_CLMT_SIZE 32
+
+/** Number of recently walked files whose maps are remembered */
+#define MAP_CACHE_SIZE 64
+
+typedef struct {
+    int valid;
+    FATEXTENTMAP map;
+} MapCacheEntry;
+
+static pthread_mutex_t mapCacheLock = PTHREAD_MUTEX_INITIALIZER;
+static MapCacheEntry mapCache[MAP_CACHE_SIZE];
+static UINT mapCacheNext = 0;
+
+/**
+ * Turns a filled CLMT into extents, clipping the sectors of each to the
+ * remaining sectors in use
+ */
+static FRESULT clmtToExtents( FATFS *fs, const DWORD *clmt, QWORD remaining, FATEXTENTMAP *map ) {
+
+    UINT i;
+
+    /** clmt[0] is the used size: 2 + 2 per fragment */
+    map->nextents = (clmt[0] - 2) / 2;
+    if ( map->nextents > 0 ) {
+        map->extents = calloc( map->nextents, sizeof( FATEXTENT ) );
+        if ( map->extents == NULL ) {
+            map->nextents = 0;
+            return FR_NOT_ENOUGH_CORE;
+        }
+    }
+
+    for ( i = 0 ; i < map->nextents ; i++ ) {
+        FATEXTENT *ext = &map->extents[i];
+        QWORD runsectors;
+
+        ext->nclst = clmt[1 + (i * 2)];
+        ext->clst = clmt[2 + (i * 2)];
+        ext->sector = fs->database + ((LBA_t)(ext->clst - 2) * fs->csize);
+
+        runsectors = (QWORD)ext->nclst * fs->csize;
+        ext->nsectors = (DWORD)(runsectors < remaining ? runsectors : remaining);
+        remaining -= ext->nsectors;
+    }
+
+    return FR_OK;
+}
+
+/**
+ * Builds the extent map for an open file using FatFs's fast seek cluster
+ * link map table (CLMT) which walks the FAT chain once and records each
+ * contiguous fragment as a (length, start cluster) pair.
+ */
+static FRESULT buildMap( FIL *fp, FATEXTENTMAP *map ) {
+
+    FRESULT res;
+    DWORD *clmt = NULL;
+    DWORD clmtsz = INITIAL_CLMT_SIZE;
+    DWORD *tbl;
+    FATFS *fs = fp->obj.fs;
+    QWORD remaining;
+
+    map->sclust = fp->obj.sclust;
+    map->fsize = f_size( fp );
+
+    for ( ;; ) {
+        tbl = realloc( clmt, clmtsz * sizeof( DWORD ) );
+        if ( tbl == NULL ) {
+            res = FR_NOT_ENOUGH_CORE;
+            goto cleanup;
+        }
+        clmt = tbl;
+        clmt[0] = clmtsz;
+        fp->cltbl = clmt;
+
+        res = f_lseek( fp, CREATE_LINKMAP );
+        if ( res != FR_NOT_ENOUGH_CORE ) {
+            break;
+        }
+
+        /** clmt[0] now holds the required table size */
+        clmtsz = clmt[0];
+    }
+
+    if ( res != FR_OK ) {
+        goto cleanup;
+    }
+
+    remaining = ((QWORD)map->fsize + FF_MAX_SS - 1) / FF_MAX_SS;
+    res = clmtToExtents( fs, clmt, remaining, map );
+
+cleanup:
+    fp->cltbl = NULL;
+    free( clmt );
+
+    if ( res != FR_OK ) {
+        fatextent_free( map );
+    }
+
+    return res;
+}
+
+/**
+ * Builds the extent map for the file at path by walking its FAT chain.
+ *
+ * Returns: FR_OK with map populated, otherwise a FatFs error
+ */
+FRESULT fatextent_file( const TCHAR *path, FATEXTENTMAP *map ) {
+
+    FRESULT res;
+    FIL fp;
+
+    if ( map == NULL ) {
+        return FR_INVALID_PARAMETER;
+    }
+    memset( map, 0, sizeof( FATEXTENTMAP ) );
+
+    res = f_open( &fp, path, FA_READ );
+    if ( res != FR_OK ) {
+        return res;
+    }
+
+    res = buildMap( &fp, map );
+    f_close( &fp );
+
+    return res;
+}
+
+/**
+ * Builds the extent map of the directory at path, every cluster of its
+ * chain. The fixed root directory of FAT12/16 has none.
+ *
+ * Returns: FR_OK with map populated, otherwise a FatFs error
+ */
+FRESULT fatextent_dir( const TCHAR *path, FATEXTENTMAP *map ) {
+
+    FRESULT res;
+    DIR dir;
+    DWORD *clmt = NULL;
+    DWORD clmtsz = INITIAL_CLMT_SIZE;
+    DWORD *tbl;
+    UINT i;
+
+    if ( map == NULL ) {
+        return FR_INVALID_PARAMETER;
+    }
+    memset( map, 0, sizeof( FATEXTENTMAP ) );
+
+    res = f_opendir( &dir, path );
+    if ( res != FR_OK ) {
+        return res;
+    }
+
+    for ( ;; ) {
+        tbl = realloc( clmt, clmtsz * sizeof( DWORD ) );
+        if ( tbl == NULL ) {
+            res = FR_NOT_ENOUGH_CORE;
+            goto cleanup;
+        }
+        clmt = tbl;
+        clmt[0] = clmtsz;
+
+        res = f_dirmap( &dir, clmt );
+        if ( res != FR_NOT_ENOUGH_CORE ) {
+            break;
+        }
+        clmtsz = clmt[0];
+    }
+
+    if ( res == FR_OK ) {
+        map->sclust = dir.obj.sclust;
+        res = clmtToExtents( dir.obj.fs, clmt, (QWORD)-1, map );
+        for ( i = 0 ; i < map->nextents ; i++ ) {
+            map->fsize += (FSIZE_t)map->extents[i].nsectors * FF_MAX_SS;
+        }
+    }
+
+cleanup:
+    free( clmt );
+    f_closedir( &dir );
+
+    if ( res != FR_OK ) {
+        fatextent_free( map );
+    }
+
+    return res;
+}
+
+static int copyMap( const FATEXTENTMAP *src, FATEXTENTMAP *dst ) {
+
+    *dst = *src;
+    dst->extents = NULL;
+    if ( src->nextents > 0 ) {
+        dst->extents = malloc( src->nextents * sizeof( FATEXTENT ) );
+        if ( dst->extents == NULL ) {
+            dst->nextents = 0;
+            return -1;
+        }
+        memcpy( dst->extents, src->extents, src->nextents * sizeof( FATEXTENT ) );
+    }
+
+    return 0;
+}
+
+/**
+ * As fatextent_file() but remembers recent maps keyed on start cluster
+ * and size so repeated layout queries don't re-walk the FAT. Callers own
+ * (and must free) the returned copy.
+ */
+FRESULT fatextent_cached( const TCHAR *path, FATEXTENTMAP *map ) {
+
+    FRESULT res;
+    FIL fp;
+    UINT i;
+
+    if ( map == NULL ) {
+        return FR_INVALID_PARAMETER;
+    }
+    memset( map, 0, sizeof( FATEXTENTMAP ) );
+
+    res = f_open( &fp, path, FA_READ );
+    if ( res != FR_OK ) {
+        return res;
+    }
+
+    pthread_mutex_lock( &mapCacheLock );
+    for ( i = 0 ; i < MAP_CACHE_SIZE ; i++ ) {
+        if ( mapCache[i].valid && mapCache[i].map.sclust == fp.obj.sclust &&
+             mapCache[i].map.fsize == f_size( &fp ) ) {
+            res = copyMap( &mapCache[i].map, map ) == 0 ? FR_OK : FR_NOT_ENOUGH_CORE;
+            pthread_mutex_unlock( &mapCacheLock );
+            f_close( &fp );
+            return res;
+        }
+    }
+    pthread_mutex_unlock( &mapCacheLock );
+
+    res = buildMap( &fp, map );
+    f_close( &fp );
+
+    if ( res == FR_OK && map->sclust != 0 ) {
+        pthread_mutex_lock( &mapCacheLock );
+        i = mapCacheNext;
+        mapCacheNext = (mapCacheNext + 1) % MAP_CACHE_SIZE;
+        if ( mapCache[i].valid ) {
+            fatextent_free( &mapCache[i].map );
+        }
+        mapCache[i].valid = copyMap( map, &mapCache[i].map ) == 0;
+        pthread_mutex_unlock( &mapCacheLock );
+    }
+
+    return res;
+}
+
+/** Forgets any cached map for the file starting at sclust, e.g., on write */
+void fatextent_invalidate( DWORD sclust ) {
+
+    UINT i;
+
+    pthread_mutex_lock( &mapCacheLock );
+    for ( i = 0 ; i < MAP_CACHE_SIZE ; i++ ) {
+        if ( mapCache[i].valid && mapCache[i].map.sclust == sclust ) {
+            fatextent_free( &mapCache[i].map );
+            mapCache[i].valid = 0;
+        }
+    }
+    pthread_mutex_unlock( &mapCacheLock );
+}
+
+void fatextent_free( FATEXTENTMAP *map ) {
+
+    if ( map == NULL ) {
+        return;
+    }
+
+    free( map->extents );
+    map->extents = NULL;
+    map->nextents = 0;
+}
+
+/**
+ * Formats one extent per line as
+ *
+ *   <first cluster>+<clusters> <first sector>-<last sector>
+ *
+ * Returns: length of the formatted string (as snprintf())
+ */
+int fatextent_format_map( const FATEXTENTMAP *map, char *buf, size_t bufsz ) {
+
+    size_t len = 0;
+    UINT i;
+
+    if ( bufsz > 0 ) {
+        buf[0] = '\0';
+    }
+
+    for ( i = 0 ; i < map->nextents ; i++ ) {
+        const FATEXTENT *ext = &map->extents[i];
+        LBA_t last = ext->sector + (ext->nsectors ? ext->nsectors - 1 : 0);
+        int n = snprintf( len < bufsz ? buf + len : NULL, len < bufsz ? bufsz - len : 0,
+                          "%u+%u %llu-%llu\n", ext->clst, ext->nclst,
+                          (unsigned long long)ext->sector, (unsigned long long)last );
+        if ( n < 0 ) {
+            return n;
+        }
+        len += n;
+    }
+
+    return (int)len;
+}
+
+/**
+ * Formats on-card attribute bits as hex followed by RHSDA flags, e.g.,
+ * "21 R---A" for a read-only archived file
+ */
+int fatextent_format_attr( BYTE fattrib, char *buf, size_t bufsz ) {
+
+    return snprintf( buf, bufsz, "%02x %c%c%c%c%c", fattrib,
+                     (fattrib & AM_RDO) ? 'R' : '-',
+                     (fattrib & AM_HID) ? 'H' : '-',
+                     (fattrib & AM_SYS) ? 'S' : '-',
+                     (fattrib & AM_DIR) ? 'D' : '-',
+                     (fattrib & AM_ARC) ? 'A' : '-' );
+}
@@ -0,0 +1,61 @@
+/**
+ * On-card extent (cluster run) discovery for files
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FATEXTENT_DEFINED
+#define _FATEXTENT_DEFINED
+
+#include <stddef.h>
+
+#include "ff.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** A contiguous run of clusters and the sectors backing it */
+typedef struct {
+    DWORD clst;         /** First cluster of the run */
+    DWORD nclst;        /** Number of clusters in the run */
+    LBA_t sector;       /** First sector of the run */
+    DWORD nsectors;     /** Sectors in use, clipped to the file size */
+} FATEXTENT;
+
+/** Extent map of a single file */
+typedef struct {
+    DWORD sclust;       /** Start cluster (0: empty file) */
+    FSIZE_t fsize;
+    UINT nextents;
+    FATEXTENT *extents; /** malloc()ed, release with fatextent_free() */
+} FATEXTENTMAP;
+
+FRESULT fatextent_file( const TCHAR *path, FATEXTENTMAP *map );
+FRESULT fatextent_dir( const TCHAR *path, FATEXTENTMAP *map );
+FRESULT fatextent_cached( const TCHAR *path, FATEXTENTMAP *map );
+void fatextent_invalidate( DWORD sclust );
+void fatextent_free( FATEXTENTMAP *map );
+int fatextent_format_map( const FATEXTENTMAP *map, char *buf, size_t bufsz );
+int fatextent_format_attr( BYTE fattrib, char *buf, size_t bufsz );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
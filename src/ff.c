@@ -21,6 +21,7 @@
 
 #include "ff.h"			/* Declarations of FatFs API */
 #include "diskio.h"		/* Declarations of device I/O functions */
+#include "spifat-trace.h"	/* USDT tracepoints */
 
 #include <time.h>
 
@@ -461,6 +462,22 @@ typedef struct {
 static FATFS* FatFs[FF_VOLUMES];	/* Pointer to the filesystem objects (logical drives) */
 static WORD Fsid;					/* Filesystem mount ID */
 
+#if !FF_FS_READONLY
+static FFWRSTATS WrStats;			/* Sectors written by cause */
+
+#define N_ALLOCHINT	16				/* Directories remembered by the near allocation policy */
+static BYTE AllocPolicy = AL_NEAR;	/* Cluster allocation policy (f_allocpolicy) */
+#define N_ALLOCZONE	64				/* Zones new directories are spread over */
+#define N_ZONEPROBE	4				/* Zones probed for a free one per new directory */
+static UINT AllocHintNext;			/* Next AllocHint[] item to replace */
+static UINT AllocZoneNext;			/* Zone to try first for the next new directory */
+static struct {
+	WORD	id;		/* Volume mount ID (0:unused) */
+	DWORD	dclst;	/* Directory start cluster (0:FAT12/16 root) */
+	DWORD	clst;	/* Cluster last allocated to an object in the directory */
+} AllocHint[N_ALLOCHINT];
+#endif
+
 #if FF_FS_RPATH != 0
 static BYTE CurrVol;				/* Current drive */
 #endif
@@ -1066,6 +1083,25 @@ static void clear_lock (	/* Clear lock entries of the volume */
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Write sectors, counting them against the cause                        */
+/*-----------------------------------------------------------------------*/
+#if !FF_FS_READONLY
+static DRESULT write_sect (
+	FATFS* fs,			/* Filesystem object */
+	BYTE cause,			/* What the sectors are (WR_xxx) */
+	const BYTE* buff,	/* Data to be written */
+	LBA_t sect,			/* Start sector */
+	UINT count			/* Number of sectors */
+)
+{
+	WrStats.nsect[cause] += count;
+	return disk_write(fs->pdrv, buff, sect, count);
+}
+#endif
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Move/Flush disk access window in the filesystem object                */
 /*-----------------------------------------------------------------------*/
@@ -1075,13 +1111,15 @@ static FRESULT sync_window (	/* Returns FR_OK or FR_DISK_ERR */
 )
 {
 	FRESULT res = FR_OK;
+	int isfat;
 
 
 	if (fs->wflag) {	/* Is the disk access window dirty? */
-		if (disk_write(fs->pdrv, fs->win, fs->winsect, 1) == RES_OK) {	/* Write it back into the volume */
+		isfat = (fs->winsect - fs->fatbase < fs->fsize);	/* Is it in the 1st FAT? (else a directory sector) */
+		if (write_sect(fs, isfat ? WR_FAT : WR_DIR, fs->win, fs->winsect, 1) == RES_OK) {	/* Write it back into the volume */
 			fs->wflag = 0;	/* Clear window dirty flag */
-			if (fs->winsect - fs->fatbase < fs->fsize) {	/* Is it in the 1st FAT? */
-				if (fs->n_fats == 2) disk_write(fs->pdrv, fs->win, fs->winsect + fs->fsize, 1);	/* Reflect it to 2nd FAT if needed */
+			if (isfat) {
+				if (fs->n_fats == 2) write_sect(fs, WR_FATMIRROR, fs->win, fs->winsect + fs->fsize, 1);	/* Reflect it to 2nd FAT if needed */
 			}
 		} else {
 			res = FR_DISK_ERR;
@@ -1101,6 +1139,7 @@ static FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERR */
 
 
 	if (sect != fs->winsect) {	/* Window offset changed? */
+		SPIFAT_TRACE(window_miss, fs->winsect, sect);
 #if !FF_FS_READONLY
 		res = sync_window(fs);		/* Flush the window */
 #endif
@@ -1141,7 +1180,7 @@ static FRESULT sync_fs (	/* Returns FR_OK or FR_DISK_ERR */
 			st_dword(fs->win + FSI_Free_Count, fs->free_clst);	/* Number of free clusters */
 			st_dword(fs->win + FSI_Nxt_Free, fs->last_clst);	/* Last allocated culuster */
 			fs->winsect = fs->volbase + 1;						/* Write it into the FSInfo sector (Next to VBR) */
-			disk_write(fs->pdrv, fs->win, fs->winsect, 1);
+			write_sect(fs, WR_FSINFO, fs->win, fs->winsect, 1);
 			fs->fsi_flag = 0;
 		}
 		/* Make sure that no pending write process in the lower layer */
@@ -1502,6 +1541,7 @@ static FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 #endif
 		clst = nxt;					/* Next cluster */
 	} while (clst < fs->n_fatent);	/* Repeat while not the last link */
+	obj->fsect = fs->winsect;		/* Last FAT sector changed for the object */
 
 #if FF_FS_EXFAT
 	/* Some post processes for chain status */
@@ -1535,6 +1575,82 @@ static FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Count the free clusters on the FAT                                    */
+/*-----------------------------------------------------------------------*/
+
+static FRESULT count_free (
+	FATFS* fs		/* Filesystem object */
+)
+{
+	FRESULT res = FR_OK;
+	DWORD nfree, clst, stat;
+	LBA_t sect;
+	UINT i;
+	FFOBJID obj;
+
+
+	/* Scan FAT to obtain number of free clusters */
+	nfree = 0;
+	if (fs->fs_type == FS_FAT12) {	/* FAT12: Scan bit field FAT entries */
+		clst = 2; obj.fs = fs;
+		do {
+			stat = get_fat(&obj, clst);
+			if (stat == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
+			if (stat == 1) { res = FR_INT_ERR; break; }
+			if (stat == 0) nfree++;
+		} while (++clst < fs->n_fatent);
+	} else {
+#if FF_FS_EXFAT
+		if (fs->fs_type == FS_EXFAT) {	/* exFAT: Scan allocation bitmap */
+			BYTE bm;
+			UINT b;
+
+			clst = fs->n_fatent - 2;	/* Number of clusters */
+			sect = fs->bitbase;			/* Bitmap sector */
+			i = 0;						/* Offset in the sector */
+			do {	/* Counts numbuer of bits with zero in the bitmap */
+				if (i == 0) {
+					res = move_window(fs, sect++);
+					if (res != FR_OK) break;
+				}
+				for (b = 8, bm = fs->win[i]; b && clst; b--, clst--) {
+					if (!(bm & 1)) nfree++;
+					bm >>= 1;
+				}
+				i = (i + 1) % SS(fs);
+			} while (clst);
+		} else
+#endif
+		{	/* FAT16/32: Scan WORD/DWORD FAT entries */
+			clst = fs->n_fatent;	/* Number of entries */
+			sect = fs->fatbase;		/* Top of the FAT */
+			i = 0;					/* Offset in the sector */
+			do {	/* Counts numbuer of entries with zero in the FAT */
+				if (i == 0) {
+					res = move_window(fs, sect++);
+					if (res != FR_OK) break;
+				}
+				if (fs->fs_type == FS_FAT16) {
+					if (ld_word(fs->win + i) == 0) nfree++;
+					i += 2;
+				} else {
+					if ((ld_dword(fs->win + i) & 0x0FFFFFFF) == 0) nfree++;
+					i += 4;
+				}
+				i %= SS(fs);
+			} while (--clst);
+		}
+	}
+	fs->free_clst = nfree;	/* Now free_clst is valid */
+	fs->fsi_flag |= 1;		/* FAT32: FSInfo is to be updated */
+
+	return res;
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* FAT handling - Stretch a chain or Create a new chain                  */
 /*-----------------------------------------------------------------------*/
@@ -1561,6 +1677,7 @@ static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:D
 		scl = clst;							/* Cluster to start to find */
 	}
 	if (fs->free_clst == 0) return 0;		/* No free cluster */
+	if (fs->free_clst <= fs->n_fatent - 2 && fs->free_clst <= fs->resv_clst) return 0;	/* The rest are held back for delayed writes */
 
 #if FF_FS_EXFAT
 	if (fs->fs_type == FS_EXFAT) {	/* On the exFAT volume */
@@ -1622,6 +1739,7 @@ static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:D
 	}
 
 	if (res == FR_OK) {			/* Update FSINFO if function succeeded. */
+		obj->fsect = fs->winsect;	/* Last FAT sector changed for the object */
 		fs->last_clst = ncl;
 		if (fs->free_clst <= fs->n_fatent - 2) fs->free_clst--;
 		fs->fsi_flag |= 1;
@@ -1632,6 +1750,101 @@ static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:D
 	return ncl;		/* Return new cluster number or error status */
 }
 
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Near allocation: steer new clusters towards the directory's own       */
+/*-----------------------------------------------------------------------*/
+/* create_chain() looks for free clusters from fs->last_clst. Under the
+/  AL_NEAR policy that is pointed, before an object grows, at the cluster
+/  last allocated to an object in the same directory, or at the directory
+/  table itself, so files in a directory end up together and behind each
+/  other instead of wherever the volume last allocated. New top level
+/  directories are spread over zones of the volume so that their trees do
+/  not interleave; directories below them stay near their parent. */
+
+static void near_steer (
+	FATFS* fs,		/* Filesystem object */
+	DWORD dclst		/* Start cluster of the directory the object is in */
+)
+{
+	UINT i;
+	DWORD clst = dclst;
+
+
+	if (AllocPolicy != AL_NEAR) return;
+	for (i = 0; i < N_ALLOCHINT; i++) {
+		if (AllocHint[i].id == fs->id && AllocHint[i].dclst == dclst) {
+			clst = AllocHint[i].clst; break;
+		}
+	}
+	if (clst >= 2 && clst < fs->n_fatent) fs->last_clst = clst;	/* Else global next-fit */
+}
+
+
+static void near_zone (
+	FATFS* fs,		/* Filesystem object */
+	DWORD dclst		/* Start cluster of the parent directory (0:root) */
+)
+{
+	FFOBJID obj;
+	DWORD zsize, nz, np, z, clst;
+	UINT i;
+
+
+	if (AllocPolicy != AL_NEAR) return;
+	if (dclst != 0 && !(fs->fs_type == FS_FAT32 && dclst == (DWORD)fs->dirbase)) {
+		near_steer(fs, dclst);	/* Not at the top: keep the tree together */
+		return;
+	}
+	obj.fs = fs;
+	nz = N_ALLOCZONE;
+	zsize = (fs->n_fatent - 2) / nz;
+	if (zsize < 256) {			/* Small volume: fewer, larger zones */
+		zsize = 256;
+		nz = (fs->n_fatent - 2) / zsize;
+		if (nz < 2) return;
+	}
+	np = N_ZONEPROBE;
+	if (fs->free_clst <= fs->n_fatent - 2 && fs->free_clst / zsize < np) {
+		np = fs->free_clst / zsize;	/* No more free zones than zones' worth of free space */
+		if (np == 0) return;		/* Nearly full: global next-fit */
+	}
+	if (np > nz) np = nz;
+	for (i = 0; i < np; i++) {	/* Find a zone whose middle is still free */
+		z = (AllocZoneNext + i) % nz;
+		if (get_fat(&obj, 2 + z * zsize + zsize / 2) == 0) break;
+	}
+	if (i == np) z = AllocZoneNext % nz;	/* All busy: just spread */
+	AllocZoneNext = z + 1;
+	clst = 2 + z * zsize;
+	fs->last_clst = clst > 2 ? clst - 1 : fs->n_fatent - 1;	/* Search from the top of the zone */
+}
+
+
+static void near_note (
+	FATFS* fs,		/* Filesystem object */
+	DWORD dclst,	/* Start cluster of the directory the object is in */
+	DWORD clst		/* Cluster to continue from next time */
+)
+{
+	UINT i;
+
+
+	if (AllocPolicy != AL_NEAR || clst < 2 || clst >= fs->n_fatent) return;
+	for (i = 0; i < N_ALLOCHINT; i++) {
+		if (AllocHint[i].id == fs->id && AllocHint[i].dclst == dclst) break;
+	}
+	if (i == N_ALLOCHINT) {		/* New directory: replace the oldest item */
+		i = AllocHintNext;
+		AllocHintNext = (AllocHintNext + 1) % N_ALLOCHINT;
+		AllocHint[i].id = fs->id;
+		AllocHint[i].dclst = dclst;
+	}
+	AllocHint[i].clst = clst;
+}
+
 #endif /* !FF_FS_READONLY */
 
 
@@ -1672,35 +1885,30 @@ static DWORD clmt_clust (	/* <2:Error, >=2:Cluster number */
 /*-----------------------------------------------------------------------*/
 
 #if !FF_FS_READONLY
+static BYTE ZeroClst[FF_MAX_SS * 128];	/* A cluster of zeros for dir_clear() (never written, stays in .bss) */
+
 static FRESULT dir_clear (	/* Returns FR_OK or FR_DISK_ERR */
 	FATFS *fs,		/* Filesystem object */
 	DWORD clst		/* Directory table to clear */
 )
 {
-	LBA_t sect;
-	UINT n, szb;
-	BYTE *ibuf;
+	LBA_t sect, rng[2];
 
 
 	if (sync_window(fs) != FR_OK) return FR_DISK_ERR;	/* Flush disk access window */
 	sect = clst2sect(fs, clst);		/* Top of the cluster */
 	fs->winsect = sect;				/* Set window to top of the cluster */
 	mem_set(fs->win, 0, sizeof fs->win);	/* Clear window buffer */
-#if FF_USE_LFN == 3		/* Quick table clear by using multi-secter write */
-	/* Allocate a temporary buffer */
-	for (szb = ((DWORD)fs->csize * SS(fs) >= MAX_MALLOC) ? MAX_MALLOC : fs->csize * SS(fs), ibuf = 0; szb > SS(fs) && (ibuf = ff_memalloc(szb)) == 0; szb /= 2) ;
-	if (szb > SS(fs)) {		/* Buffer allocated? */
-		mem_set(ibuf, 0, szb);
-		szb /= SS(fs);		/* Bytes -> Sectors */
-		for (n = 0; n < fs->csize && disk_write(fs->pdrv, ibuf, sect + n, szb) == RES_OK; n += szb) ;	/* Fill the cluster with 0 */
-		ff_memfree(ibuf);
-	} else
-#endif
-	{
-		ibuf = fs->win; szb = 1;	/* Use window buffer (many single-sector writes may take a time) */
-		for (n = 0; n < fs->csize && disk_write(fs->pdrv, ibuf, sect + n, szb) == RES_OK; n += szb) ;	/* Fill the cluster with 0 */
+
+	/* Erase the cluster where the card reads erased blocks as zeros, else
+	   write it with a single multiple block write instead of csize
+	   single-sector writes from the window */
+	rng[0] = sect; rng[1] = sect + fs->csize - 1;
+	if (disk_ioctl(fs->pdrv, MMC_ZERO_RANGE, rng) == RES_OK) {
+		WrStats.erased += fs->csize;
+		return FR_OK;
 	}
-	return (n == fs->csize) ? FR_OK : FR_DISK_ERR;
+	return (write_sect(fs, WR_ZERO, ZeroClst, sect, fs->csize) == RES_OK) ? FR_OK : FR_DISK_ERR;
 }
 #endif	/* !FF_FS_READONLY */
 
@@ -1789,10 +1997,12 @@ static FRESULT _dir_incdec (	/* FR_OK(0):succeeded, FR_NO_FILE:End of table, FR_
 					if (!stretch) {								/* If no stretch, report EOT */
 						dp->sect = 0; return FR_NO_FILE;
 					}
+					near_steer(fs, dp->obj.sclust);				/* Grow the table near its own files */
 					clst = create_chain(&dp->obj, dp->clust);	/* Allocate a cluster */
 					if (clst == 0) return FR_DENIED;			/* No free cluster */
 					if (clst == 1) return FR_INT_ERR;			/* Internal error */
 					if (clst == 0xFFFFFFFF) return FR_DISK_ERR;	/* Disk error */
+					near_note(fs, dp->obj.sclust, clst);
 					if (dir_clear(fs, clst) != FR_OK) return FR_DISK_ERR;	/* Clean up the stretched table */
 					if (FF_FS_EXFAT) dp->obj.stat |= 4;			/* exFAT: The directory has been stretched */
 #else
@@ -3531,6 +3741,7 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 
 #if !FF_FS_READONLY
 		fs->last_clst = fs->free_clst = 0xFFFFFFFF;		/* Initialize cluster allocation information */
+		fs->resv_clst = 0;
 #endif
 		fmt = FS_EXFAT;			/* FAT sub-type */
 	} else
@@ -3590,6 +3801,7 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 #if !FF_FS_READONLY
 		/* Get FSInfo if available */
 		fs->last_clst = fs->free_clst = 0xFFFFFFFF;		/* Initialize cluster allocation information */
+		fs->resv_clst = 0;
 		fs->fsi_flag = 0x80;
 #if (FF_FS_NOFSINFO & 3) != 3
 		if (fmt == FS_FAT32				/* Allow to update FSInfo only if BPB_FSInfo32 == 1 */
@@ -3615,6 +3827,13 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 
 	fs->fs_type = (BYTE)fmt;/* FAT sub-type */
 	fs->id = ++Fsid;		/* Volume mount ID */
+	{	/* Tell the disk where metadata ends (used for access statistics only) */
+		LBA_t lay[2];
+
+		lay[0] = fs->database;
+		lay[1] = fs->database + (LBA_t)(fs->n_fatent - 2) * fs->csize;
+		disk_ioctl(fs->pdrv, MMC_SET_LAYOUT, lay);
+	}
 #if FF_USE_LFN == 1
 	fs->lfnbuf = LfnBuf;	/* Static LFN working buffer */
 #if FF_FS_EXFAT
@@ -3729,7 +3948,7 @@ FRESULT f_mount (
 /* Open or Create a File                                                 */
 /*-----------------------------------------------------------------------*/
 
-FRESULT f_open (
+static FRESULT open_file (
 	FIL* fp,			/* Pointer to the blank file object */
 	const TCHAR* path,	/* Pointer to the file name */
 	BYTE mode			/* Access mode and file open mode flags */
@@ -3820,6 +4039,7 @@ FRESULT f_open (
 						if (res == FR_OK) {
 							res = move_window(fs, sc);
 							fs->last_clst = cl - 1;		/* Reuse the cluster hole */
+							near_note(fs, dj.obj.sclust, cl - 1);
 						}
 					}
 				}
@@ -3875,6 +4095,11 @@ FRESULT f_open (
 #endif
 			fp->obj.fs = fs;	 	/* Validate the file object */
 			fp->obj.id = fs->id;
+#if !FF_FS_READONLY
+			fp->obj.fsect = 0;		/* No FAT change of this session yet */
+			fp->dir_clst = dj.obj.sclust;	/* Allocation hint key */
+			fp->resv = 0;			/* No clusters held back */
+#endif
 			fp->flag = mode;		/* Set file access mode */
 			fp->err = 0;			/* Clear error flag */
 			fp->sect = 0;			/* Invalidate current data sector */
@@ -3917,13 +4142,31 @@ FRESULT f_open (
 }
 
 
+/* Traced entry point (spifat-trace.h) */
+
+FRESULT f_open (
+	FIL* fp,			/* Pointer to the blank file object */
+	const TCHAR* path,	/* Pointer to the file name */
+	BYTE mode			/* Access mode and file open mode flags */
+)
+{
+	FRESULT res;
+
+
+	SPIFAT_TRACE(f_open_entry, path, mode);
+	res = open_file(fp, path, mode);
+	SPIFAT_TRACE(f_open_return, path, res);
+	return res;
+}
+
+
 
 
 /*-----------------------------------------------------------------------*/
 /* Read File                                                             */
 /*-----------------------------------------------------------------------*/
 
-FRESULT f_read (
+static FRESULT read_file (
 	FIL* fp, 	/* Pointer to the file object */
 	void* buff,	/* Pointer to data buffer */
 	UINT btr,	/* Number of bytes to read */
@@ -3994,7 +4237,7 @@ FRESULT f_read (
 			if (fp->sect != sect) {			/* Load data sector if not in cache */
 #if !FF_FS_READONLY
 				if (fp->flag & FA_DIRTY) {		/* Write-back dirty sector cache */
-					if (disk_write(fs->pdrv, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
+					if (write_sect(fs, WR_RMW, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
 					fp->flag &= (BYTE)~FA_DIRTY;
 				}
 #endif
@@ -4017,6 +4260,25 @@ FRESULT f_read (
 }
 
 
+/* Traced entry point (spifat-trace.h) */
+
+FRESULT f_read (
+	FIL* fp, 	/* Pointer to the file object */
+	void* buff,	/* Pointer to data buffer */
+	UINT btr,	/* Number of bytes to read */
+	UINT* br	/* Pointer to number of bytes read */
+)
+{
+	FRESULT res;
+
+
+	SPIFAT_TRACE(f_read_entry, fp, fp ? fp->fptr : 0, btr);
+	res = read_file(fp, buff, btr, br);
+	SPIFAT_TRACE(f_read_return, fp, res, *br);
+	return res;
+}
+
+
 
 
 #if !FF_FS_READONLY
@@ -4024,7 +4286,7 @@ FRESULT f_read (
 /* Write File                                                            */
 /*-----------------------------------------------------------------------*/
 
-FRESULT f_write (
+static FRESULT write_file (
 	FIL* fp,			/* Pointer to the file object */
 	const void* buff,	/* Pointer to the data to be written */
 	UINT btw,			/* Number of bytes to write */
@@ -4033,7 +4295,7 @@ FRESULT f_write (
 {
 	FRESULT res;
 	FATFS *fs;
-	DWORD clst;
+	DWORD clst, aclst;
 	LBA_t sect;
 	UINT wcnt, cc, csect;
 	const BYTE *wbuff = (const BYTE*)buff;
@@ -4048,6 +4310,8 @@ FRESULT f_write (
 	if ((!FF_FS_EXFAT || fs->fs_type != FS_EXFAT) && (DWORD)(fp->fptr + btw) < (DWORD)fp->fptr) {
 		btw = (UINT)(0xFFFFFFFF - (DWORD)fp->fptr);
 	}
+	near_steer(fs, fp->dir_clst);			/* Allocate near the file's siblings */
+	aclst = fs->last_clst;
 
 	for ( ;  btw;							/* Repeat until all data written */
 		btw -= wcnt, *bw += wcnt, wbuff += wcnt, fp->fptr += wcnt, fp->obj.objsize = (fp->fptr > fp->obj.objsize) ? fp->fptr : fp->obj.objsize) {
@@ -4079,7 +4343,7 @@ FRESULT f_write (
 			if (fs->winsect == fp->sect && sync_window(fs) != FR_OK) ABORT(fs, FR_DISK_ERR);	/* Write-back sector cache */
 #else
 			if (fp->flag & FA_DIRTY) {		/* Write-back sector cache */
-				if (disk_write(fs->pdrv, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
+				if (write_sect(fs, WR_RMW, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
 				fp->flag &= (BYTE)~FA_DIRTY;
 			}
 #endif
@@ -4091,7 +4355,7 @@ FRESULT f_write (
 				if (csect + cc > fs->csize) {	/* Clip at cluster boundary */
 					cc = fs->csize - csect;
 				}
-				if (disk_write(fs->pdrv, wbuff, sect, cc) != RES_OK) ABORT(fs, FR_DISK_ERR);
+				if (write_sect(fs, WR_DATA, wbuff, sect, cc) != RES_OK) ABORT(fs, FR_DISK_ERR);
 #if FF_FS_MINIMIZE <= 2
 #if FF_FS_TINY
 				if (fs->winsect - sect < cc) {	/* Refill sector cache if it gets invalidated by the direct write */
@@ -4135,18 +4399,41 @@ FRESULT f_write (
 	}
 
 	fp->flag |= FA_MODIFIED;				/* Set file change flag */
+	if (fs->last_clst != aclst) {			/* Clusters allocated by this write */
+		near_note(fs, fp->dir_clst, fs->last_clst);	/* The next sibling follows on */
+	}
 
 	LEAVE_FF(fs, FR_OK);
 }
 
 
+/* Traced entry point (spifat-trace.h) */
+
+FRESULT f_write (
+	FIL* fp,			/* Pointer to the file object */
+	const void* buff,	/* Pointer to the data to be written */
+	UINT btw,			/* Number of bytes to write */
+	UINT* bw			/* Pointer to number of bytes written */
+)
+{
+	FRESULT res;
+
+
+	SPIFAT_TRACE(f_write_entry, fp, fp ? fp->fptr : 0, btw);
+	res = write_file(fp, buff, btw, bw);
+	WrStats.bytes += *bw;
+	SPIFAT_TRACE(f_write_return, fp, res, *bw);
+	return res;
+}
+
+
 
 
 /*-----------------------------------------------------------------------*/
 /* Synchronize the File                                                  */
 /*-----------------------------------------------------------------------*/
 
-FRESULT f_sync (
+static FRESULT sync_file (
 	FIL* fp		/* Pointer to the file object */
 )
 {
@@ -4161,7 +4448,7 @@ FRESULT f_sync (
 		if (fp->flag & FA_MODIFIED) {	/* Is there any change to the file? */
 #if !FF_FS_TINY
 			if (fp->flag & FA_DIRTY) {	/* Write-back cached data if needed */
-				if (disk_write(fs->pdrv, fp->buf, fp->sect, 1) != RES_OK) LEAVE_FF(fs, FR_DISK_ERR);
+				if (write_sect(fs, WR_RMW, fp->buf, fp->sect, 1) != RES_OK) LEAVE_FF(fs, FR_DISK_ERR);
 				fp->flag &= (BYTE)~FA_DIRTY;
 			}
 #endif
@@ -4218,6 +4505,393 @@ FRESULT f_sync (
 	LEAVE_FF(fs, res);
 }
 
+
+/* Traced entry point (spifat-trace.h) */
+
+FRESULT f_sync (
+	FIL* fp		/* Pointer to the file object */
+)
+{
+	FRESULT res;
+
+
+	SPIFAT_TRACE(f_sync_entry, fp);
+	res = sync_file(fp);
+	SPIFAT_TRACE(f_sync_return, fp, res);
+	return res;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Synchronize a File Alone                                              */
+/*-----------------------------------------------------------------------*/
+/* Only what belongs to the file goes to the card: its buffered sector,
+/  the FAT sector its chain last changed if that is still dirty in the
+/  window, and its directory entry. Dirty state of other objects stays in
+/  the window, and FSINFO is left to the next f_sync() or unmount. */
+
+FRESULT f_fsync (
+	FIL* fp		/* Pointer to the file object */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD tm;
+	BYTE *dir, sbuf[FF_MAX_SS];
+
+
+	res = validate(&fp->obj, &fs);	/* Check validity of the file object */
+	if (res != FR_OK) LEAVE_FF(fs, res);
+#if FF_FS_EXFAT
+	if (fs->fs_type == FS_EXFAT) LEAVE_FF(fs, FR_INVALID_PARAMETER);	/* The entry is located by sector on FAT/FAT32 only */
+#endif
+	if (fp->flag & FA_MODIFIED) {	/* Is there any change to the file? */
+#if !FF_FS_TINY
+		if (fp->flag & FA_DIRTY) {	/* Write-back cached data if needed */
+			if (write_sect(fs, WR_RMW, fp->buf, fp->sect, 1) != RES_OK) LEAVE_FF(fs, FR_DISK_ERR);
+			fp->flag &= (BYTE)~FA_DIRTY;
+		}
+#endif
+		if (fs->wflag && fs->winsect == fp->obj.fsect) {	/* The chain's last FAT change not written yet? */
+			res = sync_window(fs);
+		}
+		if (res == FR_OK) {
+			if (fs->winsect == fp->dir_sect) {	/* Update the entry in the window */
+				dir = fp->dir_ptr;
+			} else {							/* or in a private copy, leaving the window as it is */
+				if (disk_read(fs->pdrv, sbuf, fp->dir_sect, 1) != RES_OK) res = FR_DISK_ERR;
+				dir = sbuf + (fp->dir_ptr - fs->win);
+			}
+		}
+		if (res == FR_OK) {
+			tm = GET_FATTIME();				/* Modified time */
+			dir[DIR_Attr] |= AM_ARC;						/* Set archive attribute to indicate that the file has been changed */
+			st_clust(fs, dir, fp->obj.sclust);				/* Update file allocation information  */
+			st_dword(dir + DIR_FileSize, (DWORD)fp->obj.objsize);	/* Update file size */
+			st_dword(dir + DIR_ModTime, tm);				/* Update modified time */
+			st_word(dir + DIR_LstAccDate, 0);
+			if (dir == fp->dir_ptr) {
+				fs->wflag = 1;
+				res = sync_window(fs);
+			} else {
+				if (write_sect(fs, WR_DIR, sbuf, fp->dir_sect, 1) != RES_OK) res = FR_DISK_ERR;
+			}
+		}
+		if (res == FR_OK) {
+			fp->flag &= (BYTE)~FA_MODIFIED;
+			/* Make sure that no pending write process in the lower layer */
+			if (disk_ioctl(fs->pdrv, CTRL_SYNC, 0) != RES_OK) res = FR_DISK_ERR;
+		}
+	}
+
+	LEAVE_FF(fs, res);
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Synchronize a Directory Alone                                         */
+/*-----------------------------------------------------------------------*/
+/* Entries are changed in the window, so the only one of the directory's
+/  sectors that can be dirty is the one in the window. It is written if
+/  it belongs to this directory. The chain is followed on private copies
+/  of the FAT sectors so that looking does not move the window. */
+
+static int in_table (	/* 1:The sector is in the directory table, 0:not */
+	FATFS* fs,			/* Filesystem object */
+	DWORD clst,			/* Directory start cluster (0:root directory) */
+	LBA_t sect			/* Sector to test */
+)
+{
+	BYTE sbuf[FF_MAX_SS];
+	const BYTE *fat;
+	LBA_t fsect, bsect = 0;
+	LBA_t dsect;
+	DWORD n;
+
+
+	if (clst == 0) {	/* Root directory */
+		if (fs->fs_type != FS_FAT32) {	/* Static table on FAT12/16 */
+			return sect >= fs->dirbase && sect < fs->dirbase + fs->n_rootdir * SZDIRE / SS(fs);
+		}
+		clst = (DWORD)fs->dirbase;		/* Cluster chain on FAT32 */
+	}
+	if (fs->fs_type == FS_FAT12) return sect >= fs->database;	/* FAT12 entries can straddle sectors. Assume it is */
+
+	for (n = 0; clst >= 2 && clst < fs->n_fatent && n < fs->n_fatent; n++) {
+		dsect = clst2sect(fs, clst);
+		if (sect >= dsect && sect < dsect + fs->csize) return 1;
+		if (fs->fs_type == FS_FAT16) {
+			fsect = fs->fatbase + (clst / (SS(fs) / 2));
+		} else {
+			fsect = fs->fatbase + (clst / (SS(fs) / 4));
+		}
+		if (fsect == fs->winsect) {
+			fat = fs->win;
+		} else {
+			if (fsect != bsect) {
+				if (disk_read(fs->pdrv, sbuf, fsect, 1) != RES_OK) return 1;	/* Unknown. Assume it is */
+				bsect = fsect;
+			}
+			fat = sbuf;
+		}
+		if (fs->fs_type == FS_FAT16) {
+			clst = ld_word(fat + clst * 2 % SS(fs));
+		} else {
+			clst = ld_dword(fat + clst * 4 % SS(fs)) & 0x0FFFFFFF;
+		}
+	}
+	return 0;
+}
+
+
+FRESULT f_syncdir (
+	DIR* dp		/* Pointer to the directory object */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+
+
+	res = validate(&dp->obj, &fs);	/* Check validity of the directory object */
+	if (res == FR_OK && fs->wflag && in_table(fs, dp->obj.sclust, fs->winsect)) {
+		res = sync_window(fs);
+	}
+	if (res == FR_OK) {
+		/* Make sure that no pending write process in the lower layer */
+		if (disk_ioctl(fs->pdrv, CTRL_SYNC, 0) != RES_OK) res = FR_DISK_ERR;
+	}
+
+	LEAVE_FF(fs, res);
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Get Write Cause Counters                                              */
+/*-----------------------------------------------------------------------*/
+
+void f_wrstats (
+	FFWRSTATS* st,	/* Where to copy the counters (can be null) */
+	BYTE reset		/* Zero the counters after copying */
+)
+{
+	if (st) *st = WrStats;
+	if (reset) mem_set(&WrStats, 0, sizeof WrStats);
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Set Cluster Allocation Policy                                         */
+/*-----------------------------------------------------------------------*/
+
+void f_allocpolicy (
+	BYTE policy		/* AL_NEXT: volume-wide next-fit, AL_NEAR: near the directory */
+)
+{
+	AllocPolicy = policy;
+	mem_set(AllocHint, 0, sizeof AllocHint);
+	AllocZoneNext = 0;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Extend File Chain in One Contiguous Run                               */
+/*-----------------------------------------------------------------------*/
+/* Links the clusters needed to hold fsz bytes to the end of the file's
+/  chain before the data is written, as one run where a free one can be
+/  found: straight after the chain if possible, else the first run long
+/  enough from where the allocation policy would start. When no such run
+/  is found within N_EXTSCAN clusters the longest one seen is used and
+/  f_write() allocates the rest as usual. The file size is not changed;
+/  the clusters are followed by the writes that fill them. */
+
+#define N_EXTSCAN	16384			/* Clusters f_extend() looks through for a run */
+
+FRESULT f_extend (
+	FIL* fp,		/* Pointer to the file object */
+	FSIZE_t fsz		/* Size the chain has to hold */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD bcs, tcl, ncl, clst, lclst, nxt, stcl, scl, run, bscl, brun, n, i;
+
+
+	res = validate(&fp->obj, &fs);		/* Check validity of the file object */
+	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);
+	if (!(fp->flag & FA_WRITE)) LEAVE_FF(fs, FR_DENIED);
+	if (FF_FS_EXFAT && fs->fs_type == FS_EXFAT) LEAVE_FF(fs, FR_OK);	/* exFAT keeps its own contiguity */
+	bcs = (DWORD)fs->csize * SS(fs);	/* Cluster size */
+	tcl = (DWORD)(fsz / bcs) + ((fsz % bcs) ? 1 : 0);	/* Clusters required */
+
+	/* Find the end of the chain and its length */
+	lclst = 0; ncl = 0;
+	if (fp->fptr > 0 && fp->clust >= 2) {
+		lclst = fp->clust; ncl = (DWORD)((fp->fptr - 1) / bcs) + 1;
+	} else if (fp->obj.sclust >= 2) {
+		lclst = fp->obj.sclust; ncl = 1;
+	}
+	while (lclst && ncl < tcl) {
+		nxt = get_fat(&fp->obj, lclst);
+		if (nxt == 1) LEAVE_FF(fs, FR_INT_ERR);
+		if (nxt == 0xFFFFFFFF) LEAVE_FF(fs, FR_DISK_ERR);
+		if (nxt < 2 || nxt >= fs->n_fatent) break;	/* End of chain */
+		lclst = nxt; ncl++;
+	}
+	if (ncl >= tcl) LEAVE_FF(fs, FR_OK);	/* Already long enough */
+	tcl -= ncl;
+	if (fs->free_clst <= fs->n_fatent - 2 && tcl > fs->free_clst - fs->resv_clst) LEAVE_FF(fs, FR_DENIED);
+
+	/* Find a run of free clusters, following on from the chain first */
+	if (lclst) {
+		fs->last_clst = lclst;
+	} else {
+		near_steer(fs, fp->dir_clst);
+	}
+	stcl = fs->last_clst;
+	if (stcl < 2 || stcl >= fs->n_fatent) stcl = 2;
+	clst = stcl + 1;
+	if (clst >= fs->n_fatent) clst = 2;
+	scl = 0; run = 0; bscl = 0; brun = 0;
+	for (i = 0; i < N_EXTSCAN && i < fs->n_fatent - 2; i++) {
+		n = get_fat(&fp->obj, clst);
+		if (n == 1) LEAVE_FF(fs, FR_INT_ERR);
+		if (n == 0xFFFFFFFF) LEAVE_FF(fs, FR_DISK_ERR);
+		if (n == 0) {	/* Is it a free cluster? */
+			if (run++ == 0) scl = clst;
+			if (run > brun) { bscl = scl; brun = run; }
+			if (run == tcl) break;		/* Found a run long enough */
+		} else {
+			run = 0;
+		}
+		if (++clst >= fs->n_fatent) {	/* Runs don't wrap around */
+			clst = 2; run = 0;
+		}
+	}
+	if (brun == 0) LEAVE_FF(fs, FR_OK);	/* Leave it to f_write() */
+	if (brun > tcl) brun = tcl;
+
+	/* Create the run on the FAT and link it to the chain */
+	for (clst = bscl, n = brun; n; clst++, n--) {
+		res = put_fat(fs, clst, (n == 1) ? 0xFFFFFFFF : clst + 1);
+		if (res != FR_OK) LEAVE_FF(fs, res);
+	}
+	if (lclst) {
+		res = put_fat(fs, lclst, bscl);
+	} else {
+		fp->obj.sclust = bscl;			/* The file's first cluster */
+	}
+	if (res != FR_OK) LEAVE_FF(fs, res);
+	fp->obj.fsect = fs->winsect;		/* Last FAT sector changed for the object */
+	fs->last_clst = bscl + brun - 1;	/* Next allocation follows on */
+	near_note(fs, fp->dir_clst, fs->last_clst);
+	if (fs->free_clst <= fs->n_fatent - 2) {	/* Update FSINFO */
+		fs->free_clst -= brun;
+		fs->fsi_flag |= 1;
+	}
+	fp->flag |= FA_MODIFIED;
+
+	LEAVE_FF(fs, FR_OK);
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Free the Clusters Past the End of the File                            */
+/*-----------------------------------------------------------------------*/
+/* Gives back what f_extend() linked for a write that then failed or came
+/  up short. Unlike f_truncate() it works at any file pointer and on a
+/  file whose last write was aborted. */
+
+FRESULT f_trim (
+	FIL* fp		/* Pointer to the file object */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD bcs, ncl, lclst, nxt;
+
+
+	res = validate(&fp->obj, &fs);		/* Check validity of the file object */
+	if (res != FR_OK) LEAVE_FF(fs, res);
+	if (!(fp->flag & FA_WRITE)) LEAVE_FF(fs, FR_DENIED);
+	if (FF_FS_EXFAT && fs->fs_type == FS_EXFAT) LEAVE_FF(fs, FR_OK);
+	if (fp->obj.sclust < 2) LEAVE_FF(fs, FR_OK);	/* No chain */
+	bcs = (DWORD)fs->csize * SS(fs);	/* Cluster size */
+
+	if (fp->obj.objsize == 0) {			/* Empty file: the whole chain goes */
+		res = remove_chain(&fp->obj, fp->obj.sclust, 0);
+		fp->obj.sclust = 0;
+		fp->clust = 0;
+	} else {
+		ncl = (DWORD)((fp->obj.objsize - 1) / bcs) + 1;	/* Clusters holding data */
+		if (fp->fptr == fp->obj.objsize && fp->clust >= 2) {	/* Last data cluster is at hand */
+			lclst = fp->clust;
+		} else {
+			for (lclst = fp->obj.sclust; --ncl; lclst = nxt) {
+				nxt = get_fat(&fp->obj, lclst);
+				if (nxt == 1) LEAVE_FF(fs, FR_INT_ERR);
+				if (nxt == 0xFFFFFFFF) LEAVE_FF(fs, FR_DISK_ERR);
+				if (nxt < 2 || nxt >= fs->n_fatent) LEAVE_FF(fs, FR_OK);	/* Chain is no longer than the data */
+			}
+		}
+		nxt = get_fat(&fp->obj, lclst);
+		if (nxt == 1) LEAVE_FF(fs, FR_INT_ERR);
+		if (nxt == 0xFFFFFFFF) LEAVE_FF(fs, FR_DISK_ERR);
+		if (nxt >= 2 && nxt < fs->n_fatent) {	/* Anything past the last data cluster? */
+			res = remove_chain(&fp->obj, nxt, lclst);
+		}
+	}
+	if (res == FR_OK) fp->flag |= FA_MODIFIED;
+
+	LEAVE_FF(fs, res);
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Hold Back Free Clusters for Delayed Writes                            */
+/*-----------------------------------------------------------------------*/
+/* Sets how many free clusters, beyond its chain, the file holds back for
+/  data it has yet to write. Held back clusters are left out of f_getfree()
+/  and can't be taken by other files, directories or f_extend(). The file
+/  gives them back (ncl = 0) before writing the data and on f_close(). */
+
+FRESULT f_reserve (
+	FIL* fp,		/* Pointer to the file object */
+	DWORD ncl		/* Clusters to hold back, 0:Give them all back */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+
+
+	res = validate(&fp->obj, &fs);		/* Check validity of the file object */
+	if (res != FR_OK) LEAVE_FF(fs, res);
+	if (ncl > fp->resv) {				/* Holding back more? */
+		if (fs->free_clst > fs->n_fatent - 2) {	/* The free count has to be known */
+			res = count_free(fs);
+			if (res != FR_OK) LEAVE_FF(fs, res);
+		}
+		if (ncl - fp->resv > fs->free_clst - fs->resv_clst) LEAVE_FF(fs, FR_DENIED);
+	}
+	fs->resv_clst = fs->resv_clst - fp->resv + ncl;
+	fp->resv = ncl;
+
+	LEAVE_FF(fs, FR_OK);
+}
+
 #endif /* !FF_FS_READONLY */
 
 
@@ -4241,6 +4915,10 @@ FRESULT f_close (
 	{
 		res = validate(&fp->obj, &fs);	/* Lock volume */
 		if (res == FR_OK) {
+#if !FF_FS_READONLY
+			fs->resv_clst -= fp->resv;	/* Give back held back clusters */
+			fp->resv = 0;
+#endif
 #if FF_FS_LOCK != 0
 			res = dec_lock(fp->obj.lockid);		/* Decrement file open counter */
 			if (res == FR_OK) fp->obj.fs = 0;	/* Invalidate file object */
@@ -4505,7 +5183,7 @@ FRESULT f_lseek (
 #if !FF_FS_TINY
 #if !FF_FS_READONLY
 					if (fp->flag & FA_DIRTY) {		/* Write-back dirty sector cache */
-						if (disk_write(fs->pdrv, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
+						if (write_sect(fs, WR_RMW, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
 						fp->flag &= (BYTE)~FA_DIRTY;
 					}
 #endif
@@ -4539,6 +5217,7 @@ FRESULT f_lseek (
 				clst = fp->obj.sclust;					/* start from the first cluster */
 #if !FF_FS_READONLY
 				if (clst == 0) {						/* If no cluster chain, create a new chain */
+					near_steer(fs, fp->dir_clst);
 					clst = create_chain(&fp->obj, 0);
 					if (clst == 1) ABORT(fs, FR_INT_ERR);
 					if (clst == 0xFFFFFFFF) ABORT(fs, FR_DISK_ERR);
@@ -4585,7 +5264,7 @@ FRESULT f_lseek (
 #if !FF_FS_TINY
 #if !FF_FS_READONLY
 			if (fp->flag & FA_DIRTY) {			/* Write-back dirty sector cache */
-				if (disk_write(fs->pdrv, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
+				if (write_sect(fs, WR_RMW, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
 				fp->flag &= (BYTE)~FA_DIRTY;
 			}
 #endif
@@ -4697,6 +5376,58 @@ FRESULT f_closedir (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Get the Cluster Chain of a Directory                                  */
+/*-----------------------------------------------------------------------*/
+/* Fills tbl like the fast seek CLMT (CREATE_LINKMAP): tbl[0] is the size
+   of the table on entry and the number of items needed on return, then a
+   length and top cluster per fragment and a terminating 0. The fixed root
+   directory of FAT12/16 has no chain and gives an empty table. */
+
+FRESULT f_dirmap (
+	DIR* dp,		/* Pointer to the open directory object */
+	DWORD* tbl		/* Pointer to the link map table */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD cl, pcl, ncl, tcl, tlen, ulen, *tp;
+
+
+	res = validate(&dp->obj, &fs);	/* Check validity of the directory object */
+	if (res != FR_OK) LEAVE_FF(fs, res);
+
+	tp = tbl;
+	tlen = *tp++; ulen = 2;		/* Given table size and required table size */
+	cl = dp->obj.sclust;		/* Origin of the chain */
+	if (cl != 0) {
+		do {
+			/* Get a fragment */
+			tcl = cl; ncl = 0; ulen += 2;	/* Top, length and used items */
+			do {
+				pcl = cl; ncl++;
+				cl = get_fat(&dp->obj, cl);
+				if (cl <= 1) LEAVE_FF(fs, FR_INT_ERR);
+				if (cl == 0xFFFFFFFF) LEAVE_FF(fs, FR_DISK_ERR);
+			} while (cl == pcl + 1);
+			if (ulen <= tlen) {		/* Store the length and top of the fragment */
+				*tp++ = ncl; *tp++ = tcl;
+			}
+		} while (cl < fs->n_fatent);	/* Repeat until end of chain */
+	}
+	*tbl = ulen;	/* Number of items used */
+	if (ulen <= tlen) {
+		*tp = 0;		/* Terminate table */
+	} else {
+		res = FR_NOT_ENOUGH_CORE;	/* Given table size is smaller than required */
+	}
+
+	LEAVE_FF(fs, res);
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Read Directory Entries in Sequence                                    */
 /*-----------------------------------------------------------------------*/
@@ -4741,12 +5472,12 @@ FRESULT f_telldir (
 {
     FRESULT res;
 
+    res = FR_NO_FILE;
     if ( pos != 0 ) {
         *pos = dp->dptr;
         res = FR_OK;
     }
 
-    res = FR_NO_FILE;
     LEAVE_FF(fs, res);
 }
 
@@ -4872,10 +5603,6 @@ FRESULT f_getfree (
 {
 	FRESULT res;
 	FATFS *fs;
-	DWORD nfree, clst, stat;
-	LBA_t sect;
-	UINT i;
-	FFOBJID obj;
 
 
 	/* Get logical drive */
@@ -4883,65 +5610,60 @@ FRESULT f_getfree (
 	if (res == FR_OK) {
 		*fatfs = fs;				/* Return ptr to the fs object */
 		/* If free_clst is valid, return it without full FAT scan */
-		if (fs->free_clst <= fs->n_fatent - 2) {
-			*nclst = fs->free_clst;
-		} else {
-			/* Scan FAT to obtain number of free clusters */
-			nfree = 0;
-			if (fs->fs_type == FS_FAT12) {	/* FAT12: Scan bit field FAT entries */
-				clst = 2; obj.fs = fs;
-				do {
-					stat = get_fat(&obj, clst);
-					if (stat == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
-					if (stat == 1) { res = FR_INT_ERR; break; }
-					if (stat == 0) nfree++;
-				} while (++clst < fs->n_fatent);
-			} else {
+		if (fs->free_clst > fs->n_fatent - 2) {
+			res = count_free(fs);	/* Scan FAT to obtain number of free clusters */
+		}
+		*nclst = fs->free_clst - fs->resv_clst;	/* Less the ones held back for delayed writes */
+	}
+
+	LEAVE_FF(fs, res);
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Get Cluster Allocation Map                                            */
+/*-----------------------------------------------------------------------*/
+/* Sets bit (clst - 2) of map for each cluster in use, LSB first as in the
+/  exFAT allocation bitmap. The map must hold (n_fatent - 2 + 7) / 8 bytes
+/  of the volume's FATFS, which f_mount() with opt 1 makes available. */
+
+FRESULT f_allocmap (
+	const TCHAR* path,	/* Logical drive number */
+	BYTE* map			/* Pointer to the bitmap to fill */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD clst, stat;
+	UINT nb;
+	FFOBJID obj;
+
+
+	res = mount_volume(&path, &fs, 0);
+	if (res != FR_OK) LEAVE_FF(fs, res);
+	nb = (UINT)((fs->n_fatent - 2 + 7) / 8);
+	mem_set(map, 0, nb);
 #if FF_FS_EXFAT
-				if (fs->fs_type == FS_EXFAT) {	/* exFAT: Scan allocation bitmap */
-					BYTE bm;
-					UINT b;
-
-					clst = fs->n_fatent - 2;	/* Number of clusters */
-					sect = fs->bitbase;			/* Bitmap sector */
-					i = 0;						/* Offset in the sector */
-					do {	/* Counts numbuer of bits with zero in the bitmap */
-						if (i == 0) {
-							res = move_window(fs, sect++);
-							if (res != FR_OK) break;
-						}
-						for (b = 8, bm = fs->win[i]; b && clst; b--, clst--) {
-							if (!(bm & 1)) nfree++;
-							bm >>= 1;
-						}
-						i = (i + 1) % SS(fs);
-					} while (clst);
-				} else
-#endif
-				{	/* FAT16/32: Scan WORD/DWORD FAT entries */
-					clst = fs->n_fatent;	/* Number of entries */
-					sect = fs->fatbase;		/* Top of the FAT */
-					i = 0;					/* Offset in the sector */
-					do {	/* Counts numbuer of entries with zero in the FAT */
-						if (i == 0) {
-							res = move_window(fs, sect++);
-							if (res != FR_OK) break;
-						}
-						if (fs->fs_type == FS_FAT16) {
-							if (ld_word(fs->win + i) == 0) nfree++;
-							i += 2;
-						} else {
-							if ((ld_dword(fs->win + i) & 0x0FFFFFFF) == 0) nfree++;
-							i += 4;
-						}
-						i %= SS(fs);
-					} while (--clst);
-				}
-			}
-			*nclst = nfree;			/* Return the free clusters */
-			fs->free_clst = nfree;	/* Now free_clst is valid */
-			fs->fsi_flag |= 1;		/* FAT32: FSInfo is to be updated */
+	if (fs->fs_type == FS_EXFAT) {	/* exFAT: Copy the allocation bitmap */
+		LBA_t sect = fs->bitbase;
+		UINT i, n;
+
+		for (i = 0; i < nb && res == FR_OK; i += n) {
+			res = move_window(fs, sect++);
+			n = (nb - i < SS(fs)) ? nb - i : SS(fs);
+			if (res == FR_OK) mem_cpy(map + i, fs->win, n);
 		}
+		LEAVE_FF(fs, res);
+	}
+#endif
+	obj.fs = fs;
+	for (clst = 2; clst < fs->n_fatent; clst++) {	/* FAT: Any non-zero entry is in use */
+		stat = get_fat(&obj, clst);
+		if (stat == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
+		if (stat == 1) { res = FR_INT_ERR; break; }
+		if (stat != 0) map[(clst - 2) / 8] |= (BYTE)(1 << ((clst - 2) % 8));
 	}
 
 	LEAVE_FF(fs, res);
@@ -4984,7 +5706,7 @@ FRESULT f_truncate (
 		fp->flag |= FA_MODIFIED;
 #if !FF_FS_TINY
 		if (res == FR_OK && (fp->flag & FA_DIRTY)) {
-			if (disk_write(fs->pdrv, fp->buf, fp->sect, 1) != RES_OK) {
+			if (write_sect(fs, WR_RMW, fp->buf, fp->sect, 1) != RES_OK) {
 				res = FR_DISK_ERR;
 			} else {
 				fp->flag &= (BYTE)~FA_DIRTY;
@@ -5094,6 +5816,140 @@ FRESULT f_unlink (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Delete a Directory Tree                                               */
+/*-----------------------------------------------------------------------*/
+/* The whole subtree is walked once and every cluster it holds is marked
+/  in a bitmap. Only the top entry is removed: the entries below it live
+/  in clusters that are freed with it. The FAT is then cleared in cluster
+/  order, so each FAT sector is written back once however many files
+/  shared it. */
+
+static FRESULT mark_chain (	/* FR_OK(0):succeeded, !=0:error */
+	FFOBJID* obj,		/* Object to get the FAT */
+	DWORD clst,			/* Top of the chain */
+	BYTE* map			/* Cluster bitmap */
+)
+{
+	FATFS *fs = obj->fs;
+
+
+	while (clst >= 2 && clst < fs->n_fatent) {
+		if (map[clst / 8] & (1 << (clst % 8))) return FR_INT_ERR;	/* Cross-linked or looped chain? */
+		map[clst / 8] |= 1 << (clst % 8);
+		clst = get_fat(obj, clst);
+		if (clst == 0xFFFFFFFF) return FR_DISK_ERR;
+		if (clst < 2) return FR_INT_ERR;
+	}
+	return FR_OK;
+}
+
+
+FRESULT f_rmtree (
+	const TCHAR* path,		/* Pointer to the file or directory path */
+	void* work,				/* Pointer to working buffer (the bitmap and a directory stack) */
+	UINT len,				/* Size of working buffer [byte] */
+	void (*func)(DWORD)		/* Called with the top cluster of each removed object (can be null) */
+)
+{
+	FRESULT res;
+	DIR dj, sdj;
+	DWORD dclst, clst, *stk;
+	UINT szmap, nstk, sp = 0;
+	BYTE *map = (BYTE*)work;
+	FATFS *fs;
+	DEF_NAMBUF
+
+
+	/* Get logical drive */
+	res = mount_volume(&path, &fs, FA_WRITE);
+	if (res != FR_OK) LEAVE_FF(fs, res);
+#if FF_FS_EXFAT
+	if (fs->fs_type == FS_EXFAT) LEAVE_FF(fs, FR_INVALID_PARAMETER);	/* The bitmap walk is for FAT/FAT32 */
+#endif
+	szmap = (UINT)((fs->n_fatent + 7) / 8);
+	szmap = (szmap + 3) & ~3;					/* Keep the stack aligned */
+	if (!work || len < szmap + 4 * sizeof (DWORD)) LEAVE_FF(fs, FR_NOT_ENOUGH_CORE);
+	stk = (DWORD*)(map + szmap);
+	nstk = (len - szmap) / sizeof (DWORD);
+	mem_set(map, 0, szmap);
+
+	dj.obj.fs = fs;
+	INIT_NAMBUF(fs);
+	res = follow_path(&dj, path);		/* Follow the file path */
+	if (FF_FS_RPATH && res == FR_OK && (dj.fn[NSFLAG] & NS_DOT)) {
+		res = FR_INVALID_NAME;			/* Cannot remove dot entry */
+	}
+#if FF_FS_LOCK != 0
+	if (res == FR_OK) res = chk_lock(&dj, 2);	/* Check if it is an open object */
+#endif
+	if (res == FR_OK && (dj.fn[NSFLAG] & NS_NONAME)) res = FR_INVALID_NAME;	/* Cannot remove the origin directory */
+	if (res == FR_OK && (dj.obj.attr & AM_RDO)) res = FR_DENIED;			/* Cannot remove R/O object */
+
+	/* Collect the clusters of everything under the top entry. Nothing is modified yet */
+	if (res == FR_OK) {
+		dclst = ld_clust(fs, dj.dir);
+#if FF_FS_RPATH != 0
+		if ((dj.obj.attr & AM_DIR) && dclst == fs->cdir) res = FR_DENIED;	/* Is it the current directory? */
+#endif
+		if (res == FR_OK && dclst != 0) {
+			if (func) func(dclst);
+			res = mark_chain(&dj.obj, dclst, map);
+			if (res == FR_OK && (dj.obj.attr & AM_DIR)) stk[sp++] = dclst;
+		}
+		sdj.obj.fs = fs;
+		while (res == FR_OK && sp > 0) {	/* Scan the directories found so far */
+			sdj.obj.sclust = stk[--sp];
+			res = dir_sdi(&sdj, 0);
+			while (res == FR_OK) {
+				res = DIR_READ_FILE(&sdj);
+				if (res != FR_OK) break;
+				if (sdj.obj.attr & AM_RDO) {
+					res = FR_DENIED; break;		/* Cannot remove R/O object */
+				}
+				clst = ld_clust(fs, sdj.dir);
+				if (clst != 0) {
+					if (func) func(clst);
+					res = mark_chain(&sdj.obj, clst, map);
+					if (res != FR_OK) break;
+					if (sdj.obj.attr & AM_DIR) {
+						if (sp >= nstk) {
+							res = FR_NOT_ENOUGH_CORE; break;
+						}
+						stk[sp++] = clst;
+					}
+				}
+				res = dir_next(&sdj, 0);
+			}
+			if (res == FR_NO_FILE) res = FR_OK;	/* End of this directory */
+		}
+	}
+
+	/* Remove the top entry first, then free the clusters in FAT order */
+	if (res == FR_OK) res = dir_remove(&dj);
+	if (res == FR_OK) {
+		for (clst = 2; clst < fs->n_fatent && res == FR_OK; clst++) {
+			if (!map[clst / 8]) {				/* Skip an empty byte at once */
+				clst |= 7; continue;
+			}
+			if (map[clst / 8] & (1 << (clst % 8))) {
+				res = put_fat(fs, clst, 0);		/* Mark the cluster 'free' on the FAT */
+				if (fs->free_clst < fs->n_fatent - 2) {	/* Update FSINFO */
+					fs->free_clst++;
+					fs->fsi_flag |= 1;
+				}
+			}
+		}
+		if (res == FR_OK) res = sync_fs(fs);
+	}
+	FREE_NAMBUF();
+
+	LEAVE_FF(fs, res);
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Create a Directory                                                    */
 /*-----------------------------------------------------------------------*/
@@ -5121,6 +5977,7 @@ FRESULT f_mkdir (
 		}
 		if (res == FR_NO_FILE) {				/* It is clear to create a new directory */
 			sobj.fs = fs;						/* New object id to create a new chain */
+			near_zone(fs, dj.obj.sclust);		/* Away from other trees' files */
 			dcl = create_chain(&sobj, 0);		/* Allocate a cluster for the new directory */
 			res = FR_OK;
 			if (dcl == 0) res = FR_DENIED;		/* No space to allocate a new cluster? */
@@ -5622,6 +6479,7 @@ FRESULT f_expand (
 #endif
 	n = (DWORD)fs->csize * SS(fs);	/* Cluster size */
 	tcl = (DWORD)(fsz / n) + ((fsz & (n - 1)) ? 1 : 0);	/* Number of clusters required */
+	near_steer(fs, fp->dir_clst);	/* Look for the block near the file's siblings first */
 	stcl = fs->last_clst; lclst = 0;
 	if (stcl < 2 || stcl >= fs->n_fatent) stcl = 2;
 
@@ -5669,7 +6527,9 @@ FRESULT f_expand (
 
 	if (res == FR_OK) {
 		fs->last_clst = lclst;		/* Set suggested start cluster to start next */
+		near_note(fs, fp->dir_clst, lclst);
 		if (opt) {	/* Is it allocated now? */
+			fp->obj.fsect = fs->winsect;	/* Last FAT sector changed for the object */
 			fp->obj.sclust = scl;		/* Update object allocation information */
 			fp->obj.objsize = fsz;
 			if (FF_FS_EXFAT) fp->obj.stat = 2;	/* Set status 'contiguous chain' */
@@ -5739,7 +6599,7 @@ FRESULT f_forward (
 		if (fp->sect != sect) {		/* Fill sector cache with file data */
 #if !FF_FS_READONLY
 			if (fp->flag & FA_DIRTY) {		/* Write-back dirty sector cache */
-				if (disk_write(fs->pdrv, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
+				if (write_sect(fs, WR_RMW, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
 				fp->flag &= (BYTE)~FA_DIRTY;
 			}
 #endif
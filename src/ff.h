@@ -153,6 +153,7 @@ typedef struct {
 #if !FF_FS_READONLY
 	DWORD	last_clst;		/* Last allocated cluster */
 	DWORD	free_clst;		/* Number of free clusters */
+	DWORD	resv_clst;		/* Free clusters held back for files' delayed writes (f_reserve) */
 #endif
 #if FF_FS_RPATH
 	DWORD	cdir;			/* Current directory start cluster (0:root) */
@@ -186,6 +187,9 @@ typedef struct {
 	BYTE	stat;			/* Object chain status (b1-0: =0:not contiguous, =2:contiguous, =3:fragmented in this session, b2:sub-directory stretched) */
 	DWORD	sclust;			/* Object data start cluster (0:no cluster or root directory) */
 	FSIZE_t	objsize;		/* Object size (valid when sclust != 0) */
+#if !FF_FS_READONLY
+	LBA_t	fsect;			/* FAT sector last changed for the chain (may still be dirty in the win[]) */
+#endif
 #if FF_FS_EXFAT
 	DWORD	n_cont;			/* Size of first fragment - 1 (valid when stat == 3) */
 	DWORD	n_frag;			/* Size of last fragment needs to be written to FAT (valid when not zero) */
@@ -212,6 +216,8 @@ typedef struct {
 #if !FF_FS_READONLY
 	LBA_t	dir_sect;		/* Sector number containing the directory entry (not used at exFAT) */
 	BYTE*	dir_ptr;		/* Pointer to the directory entry in the win[] (not used at exFAT) */
+	DWORD	dir_clst;		/* Start cluster of the containing directory (near allocation hint key) */
+	DWORD	resv;			/* Clusters held back for the file's delayed writes (f_reserve) */
 #endif
 #if FF_USE_FASTSEEK
 	DWORD*	cltbl;			/* Pointer to the cluster link map table (nulled on open, set by application) */
@@ -271,6 +277,32 @@ typedef struct {
 
 
 
+/* Sectors written by cause (f_wrstats) */
+
+#define WR_DATA			0	/* File data written straight from the caller's buffer */
+#define WR_RMW			1	/* File data written back from the file's sector buffer (partial sectors) */
+#define WR_FAT			2	/* 1st FAT */
+#define WR_FATMIRROR	3	/* 2nd FAT */
+#define WR_DIR			4	/* Directory entries */
+#define WR_FSINFO		5	/* FAT32 FSINFO */
+#define WR_ZERO			6	/* Zeros filling new directory clusters */
+#define WR_CAUSES		7
+
+typedef struct {
+	QWORD	bytes;				/* Bytes passed to f_write() */
+	QWORD	nsect[WR_CAUSES];	/* Sectors written per cause */
+	QWORD	erased;				/* Sectors zeroed by an erase instead of a write */
+} FFWRSTATS;
+
+
+
+/* Cluster allocation policies (f_allocpolicy) */
+
+#define AL_NEXT			0	/* Next-fit from the volume's last allocation */
+#define AL_NEAR			1	/* Next-fit from the last allocation in the same directory */
+
+
+
 /* File function return code (FRESULT) */
 
 typedef enum {
@@ -308,8 +340,16 @@ FRESULT f_write (FIL* fp, const void* buff, UINT btw, UINT* bw);	/* Write data t
 FRESULT f_lseek (FIL* fp, FSIZE_t ofs);								/* Move file pointer of the file object */
 FRESULT f_truncate (FIL* fp);										/* Truncate the file */
 FRESULT f_sync (FIL* fp);											/* Flush cached data of the writing file */
+FRESULT f_fsync (FIL* fp);											/* Flush the file's own data, FAT and entry sectors */
+FRESULT f_syncdir (DIR* dp);										/* Flush the directory's own entries */
+void f_wrstats (FFWRSTATS* st, BYTE reset);						/* Get the write cause counters */
+void f_allocpolicy (BYTE policy);									/* Set the cluster allocation policy (AL_*) */
+FRESULT f_extend (FIL* fp, FSIZE_t fsz);							/* Allocate the clusters for fsz bytes in one run */
+FRESULT f_trim (FIL* fp);											/* Free the clusters past the end of the file */
+FRESULT f_reserve (FIL* fp, DWORD ncl);								/* Hold back free clusters for the file's delayed writes */
 FRESULT f_opendir (DIR* dp, const TCHAR* path);						/* Open a directory */
 FRESULT f_closedir (DIR* dp);										/* Close an open directory */
+FRESULT f_dirmap (DIR* dp, DWORD* tbl);								/* Get the cluster chain of an open directory as a CLMT */
 FRESULT f_readdir (DIR* dp, FILINFO* fno);							/* Read a directory item */
 FRESULT f_telldir (DIR* dp, DWORD *pos );							/* Get f_readdir position */
 FRESULT f_seekdir (DIR* dp, DWORD pos );							/* Set f_readdir position */
@@ -318,6 +358,7 @@ FRESULT f_findnext (DIR* dp, FILINFO* fno);							/* Find next file */
 FRESULT f_mkdir (const TCHAR* path);								/* Create a sub directory */
 FRESULT f_unlink (const TCHAR* path);								/* Delete an existing file or directory */
 FRESULT f_rename (const TCHAR* path_old, const TCHAR* path_new);	/* Rename/Move a file or directory */
+FRESULT f_rmtree (const TCHAR* path, void* work, UINT len, void (*func)(DWORD));	/* Delete a directory tree in one pass */
 FRESULT f_stat (const TCHAR* path, FILINFO* fno);					/* Get file status */
 #if FF_USE_CHMOD && !FF_FS_READONLY
 FRESULT f_chmod (const TCHAR* path, BYTE attr, BYTE mask);			/* Change attribute of a file/dir */
@@ -327,6 +368,7 @@ FRESULT f_chdir (const TCHAR* path);								/* Change current directory */
 FRESULT f_chdrive (const TCHAR* path);								/* Change current drive */
 FRESULT f_getcwd (TCHAR* buff, UINT len);							/* Get current directory */
 FRESULT f_getfree (const TCHAR* path, DWORD* nclst, FATFS** fatfs);	/* Get number of free clusters on the drive */
+FRESULT f_allocmap (const TCHAR* path, BYTE* map);					/* Get the drive's cluster allocation bitmap */
 FRESULT f_getlabel (const TCHAR* path, TCHAR* label, DWORD* vsn);	/* Get volume label */
 FRESULT f_setlabel (const TCHAR* label);							/* Set volume label */
 FRESULT f_forward (FIL* fp, UINT(*func)(const BYTE*,UINT), UINT btf, UINT* bf);	/* Forward data to the stream */
@@ -0,0 +1,390 @@
+/**
+ * Persistent index of file content hashes
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Hashes are gathered for free whenever a file handle reads a file from
+ * start to end, and the first time an attribute is asked for libspifat
+ * reads the file that way itself.
+ * They are kept in memory and, if a sidecar path was given, logged to a
+ * small text file on the host so they survive restarts. Each change is
+ * appended as one line, later lines superseding earlier ones:
+ *
+ *   <sclust> <size> <fdate> <ftime> <crc32> <sha1>     stored
+ *   - <sclust>                                         dropped
+ *
+ * Entries are dropped whenever more of a file is written to the card and
+ * when it is unlinked. The log is rewritten with just the live entries when
+ * it is loaded, when it grows to well over the size of the index and on
+ * close.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashidx.h"
+
+/** Stale lines allowed in the log, beyond one per entry, before it is rewritten */
+#define HASH_LOG_SLACK 256
+
+static pthread_mutex_t idxLock = PTHREAD_MUTEX_INITIALIZER;
+static HASHENTRY *entries = NULL;
+static UINT nentries = 0;
+static UINT maxentries = 0;
+static char *idxPath = NULL;
+static FILE *idxLog = NULL;
+static UINT logLines = 0;
+
+static int keysEqual( const HASHKEY *a, const HASHKEY *b ) {
+    return a->sclust == b->sclust && a->fsize == b->fsize &&
+           a->fdate == b->fdate && a->ftime == b->ftime;
+}
+
+/** Removes every entry starting at sclust. Returns the number removed */
+static UINT removeCluster( DWORD sclust ) {
+
+    UINT i = 0, nremoved = 0;
+
+    while ( i < nentries ) {
+        if ( entries[i].key.sclust == sclust ) {
+            entries[i] = entries[--nentries];
+            nremoved++;
+        } else {
+            i++;
+        }
+    }
+
+    return nremoved;
+}
+
+static int appendEntry( const HASHENTRY *entry ) {
+
+    if ( nentries == maxentries ) {
+        UINT newmax = maxentries ? maxentries * 2 : 256;
+        HASHENTRY *newentries = realloc( entries, newmax * sizeof( HASHENTRY ) );
+        if ( newentries == NULL ) {
+            return -1;
+        }
+        entries = newentries;
+        maxentries = newmax;
+    }
+    entries[nentries++] = *entry;
+
+    return 0;
+}
+
+static void writeEntry( FILE *fp, const HASHENTRY *entry ) {
+
+    int j;
+
+    fprintf( fp, "%u %llu %u %u %08x ", entry->key.sclust,
+             (unsigned long long)entry->key.fsize,
+             entry->key.fdate, entry->key.ftime, entry->crc32 );
+    for ( j = 0 ; j < SHA1_DIGEST_SIZE ; j++ ) {
+        fprintf( fp, "%02x", entry->sha1[j] );
+    }
+    fprintf( fp, "\n" );
+}
+
+/**
+ * Rewrites the sidecar file atomically with only the live entries and
+ * reopens it for appending. Called with idxLock held
+ */
+static void saveIndex( void ) {
+
+    char tmppath[4096];
+    FILE *fp;
+    UINT i;
+
+    if ( idxPath == NULL ) {
+        return;
+    }
+
+    if ( idxLog != NULL ) {
+        fclose( idxLog );
+        idxLog = NULL;
+    }
+
+    snprintf( tmppath, sizeof( tmppath ), "%s.tmp", idxPath );
+    fp = fopen( tmppath, "w" );
+    if ( fp == NULL ) {
+        fprintf( stderr, "hashidx: failed to write %s\n", tmppath );
+        return;
+    }
+
+    fprintf( fp, "# spi-fat-fuse hash index v1\n" );
+    for ( i = 0 ; i < nentries ; i++ ) {
+        writeEntry( fp, &entries[i] );
+    }
+
+    if ( fclose( fp ) != 0 || rename( tmppath, idxPath ) != 0 ) {
+        fprintf( stderr, "hashidx: failed to replace %s\n", idxPath );
+        return;
+    }
+
+    logLines = nentries;
+    idxLog = fopen( idxPath, "a" );
+    if ( idxLog == NULL ) {
+        fprintf( stderr, "hashidx: failed to append to %s\n", idxPath );
+    }
+}
+
+/**
+ * Appends one change to the sidecar, entry == NULL dropping sclust, and
+ * compacts it once it is mostly stale. Called with idxLock held
+ */
+static void logChange( const HASHENTRY *entry, DWORD sclust ) {
+
+    if ( idxLog == NULL ) {
+        return;
+    }
+
+    if ( entry != NULL ) {
+        writeEntry( idxLog, entry );
+    } else {
+        fprintf( idxLog, "- %u\n", sclust );
+    }
+    fflush( idxLog );
+
+    if ( ++logLines > nentries * 2 + HASH_LOG_SLACK ) {
+        saveIndex();
+    }
+}
+
+/**
+ * Loads the sidecar index from path and rewrites it without the stale
+ * lines. A missing file is not an error; it is created empty. A NULL path
+ * keeps the index in memory.
+ *
+ * Returns: 0 = success, -1 = failure
+ */
+int hashidx_open( const char *path ) {
+
+    FILE *fp;
+    char line[256];
+
+    pthread_mutex_lock( &idxLock );
+
+    if ( idxLog != NULL ) {
+        fclose( idxLog );
+        idxLog = NULL;
+    }
+    nentries = 0;
+    free( idxPath );
+    idxPath = path ? strdup( path ) : NULL;
+
+    if ( path == NULL ) {
+        pthread_mutex_unlock( &idxLock );
+        return 0;
+    }
+
+    fp = fopen( path, "r" );
+    while ( fp != NULL && fgets( line, sizeof( line ), fp ) != NULL ) {
+        HASHENTRY entry;
+        unsigned int sclust, fdate, ftime, crc;
+        unsigned long long fsize;
+        char sha1hex[SHA1_DIGEST_SIZE * 2 + 1];
+        int j;
+
+        if ( line[0] == '#' ) {
+            continue;
+        }
+        if ( line[0] == '-' ) {
+            if ( sscanf( line + 1, "%u", &sclust ) == 1 ) {
+                removeCluster( sclust );
+            }
+            continue;
+        }
+        if ( sscanf( line, "%u %llu %u %u %x %40s", &sclust, &fsize, &fdate, &ftime, &crc, sha1hex ) != 6 ||
+             strlen( sha1hex ) != SHA1_DIGEST_SIZE * 2 ) {
+            continue;
+        }
+
+        entry.key.sclust = sclust;
+        entry.key.fsize = fsize;
+        entry.key.fdate = fdate;
+        entry.key.ftime = ftime;
+        entry.crc32 = crc;
+        for ( j = 0 ; j < SHA1_DIGEST_SIZE ; j++ ) {
+            unsigned int b;
+            sscanf( sha1hex + (j * 2), "%2x", &b );
+            entry.sha1[j] = (uint8_t)b;
+        }
+
+        /** Later lines supersede earlier ones */
+        removeCluster( entry.key.sclust );
+        if ( appendEntry( &entry ) != 0 ) {
+            break;
+        }
+    }
+
+    if ( fp != NULL ) {
+        fclose( fp );
+    }
+    saveIndex();
+    pthread_mutex_unlock( &idxLock );
+
+    return 0;
+}
+
+/** Compacts and closes the sidecar. The in-memory index is kept */
+void hashidx_close( void ) {
+
+    pthread_mutex_lock( &idxLock );
+    if ( idxLog != NULL && logLines != nentries ) {
+        saveIndex();
+    }
+    if ( idxLog != NULL ) {
+        fclose( idxLog );
+        idxLog = NULL;
+    }
+    free( idxPath );
+    idxPath = NULL;
+    pthread_mutex_unlock( &idxLock );
+}
+
+/** Returns: 1 if a hash for key is cached (copied into entry), 0 otherwise */
+int hashidx_lookup( const HASHKEY *key, HASHENTRY *entry ) {
+
+    UINT i;
+    int found = 0;
+
+    pthread_mutex_lock( &idxLock );
+    for ( i = 0 ; i < nentries ; i++ ) {
+        if ( keysEqual( &entries[i].key, key ) ) {
+            *entry = entries[i];
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock( &idxLock );
+
+    return found;
+}
+
+void hashidx_store( const HASHENTRY *entry ) {
+
+    if ( entry->key.sclust == 0 ) {
+        /** Empty files have no cluster to key on and nothing to read */
+        return;
+    }
+
+    pthread_mutex_lock( &idxLock );
+    removeCluster( entry->key.sclust );
+    if ( appendEntry( entry ) == 0 ) {
+        logChange( entry, entry->key.sclust );
+    }
+    pthread_mutex_unlock( &idxLock );
+}
+
+/** Drops any hash for the file starting at sclust, e.g., on write */
+void hashidx_invalidate( DWORD sclust ) {
+
+    if ( sclust == 0 ) {
+        return;
+    }
+
+    pthread_mutex_lock( &idxLock );
+    if ( removeCluster( sclust ) > 0 ) {
+        logChange( NULL, sclust );
+    }
+    pthread_mutex_unlock( &idxLock );
+}
+
+/** Builds the index key for the file at path */
+FRESULT hashidx_key( const TCHAR *path, HASHKEY *key ) {
+
+    FRESULT res;
+    FILINFO finfo;
+    FIL fp;
+
+    res = f_stat( path, &finfo );
+    if ( res != FR_OK ) {
+        return res;
+    }
+    if ( (finfo.fattrib & AM_DIR) == AM_DIR ) {
+        return FR_NO_FILE;
+    }
+
+    res = f_open( &fp, path, FA_READ );
+    if ( res != FR_OK ) {
+        return res;
+    }
+
+    key->sclust = fp.obj.sclust;
+    key->fsize = finfo.fsize;
+    key->fdate = finfo.fdate;
+    key->ftime = finfo.ftime;
+
+    return f_close( &fp );
+}
+
+void hashidx_stream_init( HASHSTREAM *hs ) {
+
+    hs->offset = 0;
+    hs->crc32 = 0;
+    hs->broken = 0;
+    chksum_sha1_init( &hs->sha1 );
+}
+
+/**
+ * Feeds data read at offset into the running hash. Re-reads of already
+ * hashed data are ignored. Skipping ahead breaks the stream.
+ */
+void hashidx_stream_feed( HASHSTREAM *hs, FSIZE_t offset, const void *data, UINT len ) {
+
+    const BYTE *p = data;
+
+    if ( hs->broken || offset + len <= hs->offset ) {
+        return;
+    }
+    if ( offset > hs->offset ) {
+        hs->broken = 1;
+        return;
+    }
+
+    p += hs->offset - offset;
+    len -= (UINT)(hs->offset - offset);
+
+    hs->crc32 = chksum_crc32( hs->crc32, p, len );
+    chksum_sha1_update( &hs->sha1, p, len );
+    hs->offset += len;
+}
+
+/**
+ * Completes the hash if the whole file (entry->key.fsize bytes) has been
+ * fed. entry->key must already be filled in.
+ *
+ * Returns: 1 = entry hashes filled in, 0 = incomplete
+ */
+int hashidx_stream_finish( HASHSTREAM *hs, HASHENTRY *entry ) {
+
+    if ( hs->broken || hs->offset != entry->key.fsize ) {
+        return 0;
+    }
+
+    entry->crc32 = hs->crc32;
+    chksum_sha1_final( &hs->sha1, entry->sha1 );
+    hs->broken = 1;     /** Digest consumed, don't finish twice */
+
+    return 1;
+}
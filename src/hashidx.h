@@ -0,0 +1,72 @@
+/**
+ * Persistent index of file content hashes
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HASHIDX_DEFINED
+#define _HASHIDX_DEFINED
+
+#include "ff.h"
+#include "chksum.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A file is identified by where it starts on the card, its size and its
+ * modification stamp. Any rewrite changes at least one of these.
+ */
+typedef struct {
+    DWORD sclust;
+    FSIZE_t fsize;
+    WORD fdate;
+    WORD ftime;
+} HASHKEY;
+
+typedef struct {
+    HASHKEY key;
+    uint32_t crc32;
+    uint8_t sha1[SHA1_DIGEST_SIZE];
+} HASHENTRY;
+
+/** Running hash of a file read front-to-back through a file handle */
+typedef struct {
+    FSIZE_t offset;     /** Bytes hashed so far */
+    uint32_t crc32;
+    SHA1_CTX sha1;
+    int broken;         /** A gap was seen so the hash can't complete */
+} HASHSTREAM;
+
+int hashidx_open( const char *path );
+void hashidx_close( void );
+int hashidx_lookup( const HASHKEY *key, HASHENTRY *entry );
+void hashidx_store( const HASHENTRY *entry );
+void hashidx_invalidate( DWORD sclust );
+FRESULT hashidx_key( const TCHAR *path, HASHKEY *key );
+
+void hashidx_stream_init( HASHSTREAM *hs );
+void hashidx_stream_feed( HASHSTREAM *hs, FSIZE_t offset, const void *data, UINT len );
+int hashidx_stream_finish( HASHSTREAM *hs, HASHENTRY *entry );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,397 @@
+/**
+ * LBA access heat map and reuse distance profile
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "heatmap.h"
+
+/**
+ * Heat map: read and write counts per LBA bucket, the metadata area and
+ * the data area each split into their own buckets so the FAT isn't lost
+ * inside one bucket of a large card. Every DECAY_SECTORS accesses all
+ * counts are halved, so old workloads fade out.
+ */
+#define META_BUCKETS 64
+#define DATA_BUCKETS 512
+#define DECAY_SECTORS (1u << 20)
+
+typedef struct {
+    uint32_t reads;
+    uint32_t writes;
+} HeatBucket;
+
+static HeatBucket *heat = NULL;
+static LBA_t dataBase = 0;
+static LBA_t volEnd = 0;
+static LBA_t metaSpan = 1;
+static LBA_t dataSpan = 1;
+static uint32_t sinceDecay = 0;
+
+/**
+ * Reuse distance: for every metadata sector and one data sector in
+ * REUSE_RATE (picked by hash, so the same sectors every time) the number
+ * of distinct sectors touched since its last access, each sampled data
+ * sector standing in for REUSE_RATE of them. That is the LRU stack
+ * distance, and an LRU cache of C sectors hits every access whose
+ * distance is below C.
+ *
+ * Last access ticks live in an open addressed table, and a Fenwick tree
+ * over ticks holds each tracked sector's weight at its latest one, so a
+ * distance is a prefix sum. When the ticks or the table run out the newest half of the
+ * sectors are kept and renumbered; the rest come back as cold misses.
+ */
+#define REUSE_RATE 16
+#define REUSE_SLOTS 32768
+#define REUSE_LIVE (REUSE_SLOTS / 2)
+#define REUSE_WINDOW 65536
+#define REUSE_BINS 32
+
+typedef struct {
+    LBA_t sector;
+    uint32_t tick;      /** 0: empty */
+    uint32_t weight;    /** 1 for metadata, REUSE_RATE for data */
+} ReuseSlot;
+
+static ReuseSlot *reuse = NULL;
+static ReuseSlot *compactBuf = NULL;
+static uint32_t *fenwick = NULL;
+static uint32_t tick = 0;
+static uint32_t live = 0;
+static uint32_t liveWeight = 0;
+
+/** [0]: metadata, [1]: data */
+static uint64_t reuseHits[2][REUSE_BINS];
+static uint64_t reuseCold[2];
+
+static void fenwickAdd( uint32_t i, int v ) {
+
+    for ( ; i <= REUSE_WINDOW ; i += i & -i ) {
+        fenwick[i] += v;
+    }
+}
+
+static uint32_t fenwickSum( uint32_t i ) {
+
+    uint32_t s = 0;
+
+    for ( ; i > 0 ; i -= i & -i ) {
+        s += fenwick[i];
+    }
+
+    return s;
+}
+
+static int sampled( LBA_t sector ) {
+    return ((((uint32_t)sector * 0x9E3779B1u) >> 16) & (REUSE_RATE - 1)) == 0;
+}
+
+/** Returns: the slot holding sector, or the empty slot it would go in */
+static ReuseSlot *findSlot( LBA_t sector ) {
+
+    uint32_t i = ((uint32_t)sector * 0x85EBCA6Bu) >> 17;
+
+    while ( reuse[i].tick != 0 && reuse[i].sector != sector ) {
+        i = (i + 1) & (REUSE_SLOTS - 1);
+    }
+
+    return &reuse[i];
+}
+
+static int compareTicks( const void *a, const void *b ) {
+
+    const ReuseSlot *sa = a, *sb = b;
+
+    return sa->tick < sb->tick ? -1 : sa->tick > sb->tick;
+}
+
+static void compact( void ) {
+
+    uint32_t i, n = 0, keep;
+
+    for ( i = 0 ; i < REUSE_SLOTS ; i++ ) {
+        if ( reuse[i].tick != 0 ) {
+            compactBuf[n++] = reuse[i];
+        }
+    }
+    qsort( compactBuf, n, sizeof( ReuseSlot ), compareTicks );
+
+    keep = n < REUSE_LIVE / 2 ? n : REUSE_LIVE / 2;
+    memset( reuse, 0, REUSE_SLOTS * sizeof( ReuseSlot ) );
+    memset( fenwick, 0, (REUSE_WINDOW + 1) * sizeof( uint32_t ) );
+    liveWeight = 0;
+    for ( i = 0 ; i < keep ; i++ ) {
+        ReuseSlot *slot = findSlot( compactBuf[n - keep + i].sector );
+        *slot = compactBuf[n - keep + i];
+        slot->tick = i + 1;
+        fenwickAdd( i + 1, slot->weight );
+        liveWeight += slot->weight;
+    }
+    tick = keep;
+    live = keep;
+}
+
+static void reuseAccess( LBA_t sector, int cls ) {
+
+    ReuseSlot *slot;
+    uint32_t weight = cls ? REUSE_RATE : 1;
+    uint64_t d;
+    int bin = 0;
+
+    if ( tick >= REUSE_WINDOW || live >= REUSE_LIVE ) {
+        compact();
+    }
+
+    slot = findSlot( sector );
+    if ( slot->tick != 0 ) {
+        d = liveWeight - fenwickSum( slot->tick );
+        while ( d > 0 && bin < REUSE_BINS - 1 ) {
+            d >>= 1;
+            bin++;
+        }
+        reuseHits[cls][bin] += weight;
+        fenwickAdd( slot->tick, -(int)slot->weight );
+        liveWeight -= slot->weight;
+    } else {
+        reuseCold[cls] += weight;
+        slot->sector = sector;
+        live++;
+    }
+    slot->weight = weight;
+    slot->tick = ++tick;
+    fenwickAdd( tick, weight );
+    liveWeight += weight;
+}
+
+int heatmap_init( void ) {
+
+    heatmap_free();
+
+    heat = calloc( META_BUCKETS + DATA_BUCKETS, sizeof( HeatBucket ) );
+    reuse = calloc( REUSE_SLOTS, sizeof( ReuseSlot ) );
+    compactBuf = malloc( REUSE_SLOTS * sizeof( ReuseSlot ) );
+    fenwick = calloc( REUSE_WINDOW + 1, sizeof( uint32_t ) );
+    if ( heat == NULL || reuse == NULL || compactBuf == NULL || fenwick == NULL ) {
+        heatmap_free();
+        return -1;
+    }
+    heatmap_reset();
+
+    return 0;
+}
+
+void heatmap_free( void ) {
+
+    free( heat );
+    free( reuse );
+    free( compactBuf );
+    free( fenwick );
+    heat = NULL;
+    reuse = NULL;
+    compactBuf = NULL;
+    fenwick = NULL;
+}
+
+/** Called at mount time with the start of the data area and the end of the volume */
+void heatmap_layout( LBA_t database, LBA_t nsectors ) {
+
+    if ( database == dataBase && nsectors == volEnd ) {
+        return;
+    }
+
+    dataBase = database;
+    volEnd = nsectors;
+    metaSpan = (dataBase + META_BUCKETS - 1) / META_BUCKETS;
+    dataSpan = (volEnd - dataBase + DATA_BUCKETS - 1) / DATA_BUCKETS;
+    if ( metaSpan == 0 ) {
+        metaSpan = 1;
+    }
+    if ( dataSpan == 0 ) {
+        dataSpan = 1;
+    }
+    if ( heat != NULL ) {
+        memset( heat, 0, (META_BUCKETS + DATA_BUCKETS) * sizeof( HeatBucket ) );
+    }
+}
+
+void heatmap_access( LBA_t sector, UINT count, int write ) {
+
+    HeatBucket *b;
+    UINT i, j;
+
+    if ( heat == NULL ) {
+        return;
+    }
+
+    for ( i = 0 ; i < count ; i++, sector++ ) {
+        int cls = sector >= dataBase;
+
+        if ( volEnd > 0 && sector < volEnd ) {
+            if ( cls ) {
+                b = &heat[META_BUCKETS + (sector - dataBase) / dataSpan];
+            } else {
+                b = &heat[sector / metaSpan];
+            }
+            if ( write ) {
+                b->writes++;
+            } else {
+                b->reads++;
+            }
+        }
+
+        if ( ++sinceDecay == DECAY_SECTORS ) {
+            for ( j = 0 ; j < META_BUCKETS + DATA_BUCKETS ; j++ ) {
+                heat[j].reads >>= 1;
+                heat[j].writes >>= 1;
+            }
+            sinceDecay = 0;
+        }
+
+        if ( !cls || sampled( sector ) ) {
+            reuseAccess( sector, cls );
+        }
+    }
+}
+
+void heatmap_reset( void ) {
+
+    if ( heat == NULL ) {
+        return;
+    }
+
+    memset( heat, 0, (META_BUCKETS + DATA_BUCKETS) * sizeof( HeatBucket ) );
+    memset( reuse, 0, REUSE_SLOTS * sizeof( ReuseSlot ) );
+    memset( fenwick, 0, (REUSE_WINDOW + 1) * sizeof( uint32_t ) );
+    memset( reuseHits, 0, sizeof( reuseHits ) );
+    memset( reuseCold, 0, sizeof( reuseCold ) );
+    sinceDecay = 0;
+    tick = 0;
+    live = 0;
+    liveWeight = 0;
+}
+
+/** Appends to buf at *len, keeping the length within size */
+static void csvLine( char *buf, size_t size, int *len, const char *fmt, ... ) {
+
+    va_list ap;
+    int n;
+
+    if ( (size_t)*len >= size ) {
+        return;
+    }
+    va_start( ap, fmt );
+    n = vsnprintf( buf + *len, size - *len, fmt, ap );
+    va_end( ap );
+    *len = (size_t)(*len + n) < size ? *len + n : (int)size;
+}
+
+/**
+ * One row per bucket:
+ *
+ *   region,first_lba,last_lba,reads,writes
+ *
+ * with region "meta" or "data" and decayed sector access counts
+ */
+int heatmap_csv( char *buf, size_t size ) {
+
+    LBA_t first, last;
+    int i, len = 0;
+
+    csvLine( buf, size, &len, "region,first_lba,last_lba,reads,writes\n" );
+    if ( heat == NULL || volEnd == 0 ) {
+        return len;
+    }
+
+    for ( i = 0 ; i < META_BUCKETS + DATA_BUCKETS ; i++ ) {
+        if ( i < META_BUCKETS ) {
+            first = (LBA_t)i * metaSpan;
+            last = first + metaSpan - 1;
+            if ( first >= dataBase ) {
+                continue;
+            }
+            if ( last >= dataBase ) {
+                last = dataBase - 1;
+            }
+        } else {
+            first = dataBase + (LBA_t)(i - META_BUCKETS) * dataSpan;
+            last = first + dataSpan - 1;
+            if ( first >= volEnd ) {
+                continue;
+            }
+            if ( last >= volEnd ) {
+                last = volEnd - 1;
+            }
+        }
+        csvLine( buf, size, &len, "%s,%llu,%llu,%u,%u\n", i < META_BUCKETS ? "meta" : "data",
+                 (unsigned long long)first, (unsigned long long)last,
+                 (unsigned)heat[i].reads, (unsigned)heat[i].writes );
+    }
+
+    return len;
+}
+
+/**
+ * The hit rate an LRU cache of each size would have had, one row per
+ * power of two from the sampling granularity up to the volume size:
+ *
+ *   cache_kb,meta_accesses,meta_hits,data_accesses,data_hits,hit_rate
+ *
+ * Data counts are estimates, scaled up from the sampled sectors
+ */
+int heatmap_reuse_csv( char *buf, size_t size ) {
+
+    uint64_t acc[2] = { 0, 0 }, hits[2] = { 0, 0 };
+    int b, c, len = 0;
+
+    csvLine( buf, size, &len, "cache_kb,meta_accesses,meta_hits,data_accesses,data_hits,hit_rate\n" );
+    if ( heat == NULL ) {
+        return len;
+    }
+
+    for ( c = 0 ; c < 2 ; c++ ) {
+        acc[c] = reuseCold[c];
+        for ( b = 0 ; b < REUSE_BINS ; b++ ) {
+            acc[c] += reuseHits[c][b];
+        }
+    }
+
+    /** Bin b holds distances below 2^b, so a cache of 2^b sectors hits bins 0..b */
+    for ( b = 0 ; b < REUSE_BINS ; b++ ) {
+        hits[0] += reuseHits[0][b];
+        hits[1] += reuseHits[1][b];
+        if ( (1u << b) < REUSE_RATE ) {
+            continue;
+        }
+        csvLine( buf, size, &len, "%llu,%llu,%llu,%llu,%llu,%.4f\n",
+                 (unsigned long long)(((uint64_t)1 << b) * FF_MAX_SS / 1024),
+                 (unsigned long long)acc[0], (unsigned long long)hits[0],
+                 (unsigned long long)acc[1], (unsigned long long)hits[1],
+                 acc[0] + acc[1] ? (double)(hits[0] + hits[1]) / (acc[0] + acc[1]) : 0.0 );
+        if ( volEnd > 0 && ((LBA_t)1 << b) >= volEnd ) {
+            break;
+        }
+    }
+
+    return len;
+}
@@ -0,0 +1,55 @@
+/**
+ * LBA access heat map and reuse distance profile
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HEATMAP_DEFINED
+#define _HEATMAP_DEFINED
+
+#include <stddef.h>
+
+#include "ff.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Not locked internally. diskio.c records demand accesses with its lock
+ * held and takes the same lock around the exports.
+ *
+ * Sectors below the start of the data area (boot sector, FATs and the
+ * FAT12/16 root directory) count as metadata, everything else as data,
+ * so subdirectory tables fall on the data side.
+ */
+int heatmap_init( void );
+void heatmap_free( void );
+void heatmap_layout( LBA_t database, LBA_t nsectors );
+void heatmap_access( LBA_t sector, UINT count, int write );
+void heatmap_reset( void );
+
+/** CSV exports. Returns: the length written, truncated to size */
+int heatmap_csv( char *buf, size_t size );
+int heatmap_reuse_csv( char *buf, size_t size );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,397 @@
+/**
+ * Per-process I/O accounting
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Counters per requesting process, so a front-end's thumbnail scanner
+ * hammering the card can be told apart from the emulator it slows down.
+ *
+ * Card time limits are token buckets: a process earns limitMs of card
+ * time every second, up to one second's worth, and each request spends
+ * what it used. procstats_throttle() tells a process that has overspent
+ * how long it owes, so a request is never cut short, the process just
+ * gets fewer of them. The debt is capped at a second's worth too, as the
+ * caller only makes it wait while someone else wants the card.
+ *
+ * FUSE reports the requesting thread, so thread ids are mapped to their
+ * process (procstats_tgid()) before they get this far.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "procstats.h"
+
+typedef struct {
+    pid_t pid;              /** 0 with lastSeen 0: free */
+    uid_t uid;
+    char comm[16];
+    uint64_t ops;
+    PROCSTATS_COST cost;
+    uint64_t throttledUs;
+    int ownLimit;           /** 1 = limitMs was set for this process */
+    unsigned int limitMs;
+    int64_t budgetUs;
+    uint64_t refilled;      /** When budgetUs was last topped up [us] */
+    uint64_t lastSeen;      /** [us], 0 = free */
+} ProcEntry;
+
+static pthread_mutex_t procLock = PTHREAD_MUTEX_INITIALIZER;
+static ProcEntry *entries = NULL;
+static unsigned int nentries = 0;
+static unsigned int defaultLimit = 0;
+
+/**
+ * Thread to process ids, direct mapped. An entry is trusted for
+ * TGID_CACHE_US so a recycled thread id is picked up again soon after.
+ */
+#define TGID_CACHE_SLOTS 256
+#define TGID_CACHE_US 10000000
+
+typedef struct {
+    pid_t tid;
+    pid_t tgid;
+    uint64_t looked;        /** [us], 0 = empty */
+} TgidEntry;
+
+static TgidEntry tgidCache[TGID_CACHE_SLOTS];
+
+static uint64_t nowMicros( void ) {
+
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+/** The process name, so short-lived pids still mean something later */
+static void readComm( pid_t pid, char *comm, size_t size ) {
+
+    char path[32];
+    FILE *fp;
+
+    snprintf( comm, size, "%s", pid == 0 ? "kernel" : "?" );
+    if ( pid == 0 ) {
+        return;
+    }
+
+    snprintf( path, sizeof( path ), "/proc/%d/comm", (int)pid );
+    fp = fopen( path, "r" );
+    if ( fp == NULL ) {
+        return;
+    }
+    if ( fgets( comm, size, fp ) != NULL ) {
+        comm[strcspn( comm, "\n" )] = '\0';
+    }
+    fclose( fp );
+
+    /** Keeps procstats_text() one field per word */
+    for ( ; *comm != '\0' ; comm++ ) {
+        if ( *comm == ' ' ) {
+            *comm = '_';
+        }
+    }
+}
+
+/** The Tgid: line of /proc/<tid>/status, or tid itself if it can't be read */
+static pid_t readTgid( pid_t tid ) {
+
+    char path[32], line[64];
+    FILE *fp;
+    pid_t tgid = tid;
+    int v;
+
+    snprintf( path, sizeof( path ), "/proc/%d/status", (int)tid );
+    fp = fopen( path, "r" );
+    if ( fp == NULL ) {
+        return tid;
+    }
+    while ( fgets( line, sizeof( line ), fp ) != NULL ) {
+        if ( sscanf( line, "Tgid: %d", &v ) == 1 ) {
+            tgid = (pid_t)v;
+            break;
+        }
+    }
+    fclose( fp );
+
+    return tgid;
+}
+
+/**
+ * A slot with its own limit is kept while its process lives, so the
+ * limit isn't lost to a burst of short-lived processes. Called with
+ * procLock held.
+ */
+static int evictable( const ProcEntry *e ) {
+    return e->lastSeen == 0 || !e->ownLimit || (kill( e->pid, 0 ) != 0 && errno == ESRCH);
+}
+
+/** Returns: pid's entry, created (evicting the stalest) if new. Called with procLock held */
+static ProcEntry *findEntry( pid_t pid, uid_t uid, uint64_t now ) {
+
+    ProcEntry *e, *victim = NULL;
+    unsigned int i;
+
+    for ( i = 0 ; i < nentries ; i++ ) {
+        e = &entries[i];
+        if ( e->lastSeen != 0 && e->pid == pid ) {
+            return e;
+        }
+    }
+    for ( i = 0 ; i < nentries ; i++ ) {
+        e = &entries[i];
+        if ( (victim == NULL || e->lastSeen < victim->lastSeen) && evictable( e ) ) {
+            victim = e;
+        }
+    }
+    if ( victim == NULL ) {
+        return NULL;
+    }
+
+    memset( victim, 0, sizeof( ProcEntry ) );
+    victim->pid = pid;
+    victim->uid = uid;
+    victim->refilled = now;
+    victim->lastSeen = now;
+    readComm( pid, victim->comm, sizeof( victim->comm ) );
+
+    return victim;
+}
+
+static unsigned int limitOf( const ProcEntry *e ) {
+    return e->ownLimit ? e->limitMs : defaultLimit;
+}
+
+/** Tops the bucket up for the time since it was last refilled */
+static void refill( ProcEntry *e, uint64_t now ) {
+
+    unsigned int limit = limitOf( e );
+    int64_t cap = (int64_t)limit * 1000;
+
+    if ( limit == 0 ) {
+        e->budgetUs = 0;
+    } else {
+        e->budgetUs += (int64_t)((now - e->refilled) * limit / 1000);
+        if ( e->budgetUs > cap ) {
+            e->budgetUs = cap;
+        }
+    }
+    e->refilled = now;
+}
+
+/**
+ * Allocates room for nslots processes. A default limit of 0 leaves
+ * processes unthrottled unless procstats_set_limit() says otherwise.
+ *
+ * Returns: 0 = success, -1 = allocation failure
+ */
+int procstats_init( unsigned int nslots, unsigned int defaultLimitMs ) {
+
+    procstats_free();
+
+    pthread_mutex_lock( &procLock );
+    entries = calloc( nslots, sizeof( ProcEntry ) );
+    nentries = entries != NULL ? nslots : 0;
+    defaultLimit = defaultLimitMs;
+    pthread_mutex_unlock( &procLock );
+
+    return entries != NULL ? 0 : -1;
+}
+
+void procstats_free( void ) {
+
+    pthread_mutex_lock( &procLock );
+    free( entries );
+    entries = NULL;
+    nentries = 0;
+    pthread_mutex_unlock( &procLock );
+}
+
+pid_t procstats_tgid( pid_t tid ) {
+
+    TgidEntry *t = &tgidCache[(unsigned int)tid % TGID_CACHE_SLOTS];
+    uint64_t now = nowMicros();
+    pid_t tgid;
+
+    if ( tid <= 0 ) {
+        return tid;
+    }
+
+    pthread_mutex_lock( &procLock );
+    if ( t->looked != 0 && t->tid == tid && now - t->looked < TGID_CACHE_US ) {
+        tgid = t->tgid;
+        pthread_mutex_unlock( &procLock );
+        return tgid;
+    }
+    pthread_mutex_unlock( &procLock );
+
+    tgid = readTgid( tid );
+
+    pthread_mutex_lock( &procLock );
+    t->tid = tid;
+    t->tgid = tgid;
+    t->looked = now;
+    pthread_mutex_unlock( &procLock );
+
+    return tgid;
+}
+
+/** Adds one request and what it cost to pid's counters */
+void procstats_charge( pid_t pid, uid_t uid, const PROCSTATS_COST *cost ) {
+
+    ProcEntry *e;
+    uint64_t now = nowMicros();
+
+    pthread_mutex_lock( &procLock );
+    e = findEntry( pid, uid, now );
+    if ( e != NULL ) {
+        refill( e, now );
+        e->uid = uid;
+        e->ops++;
+        e->cost.readBytes += cost->readBytes;
+        e->cost.writtenBytes += cost->writtenBytes;
+        e->cost.cardUs += cost->cardUs;
+        e->cost.cardSectors += cost->cardSectors;
+        e->cost.cacheHits += cost->cacheHits;
+        e->cost.cacheMisses += cost->cacheMisses;
+        if ( limitOf( e ) != 0 ) {
+            e->budgetUs -= (int64_t)cost->cardUs;
+            if ( e->budgetUs < -(int64_t)limitOf( e ) * 1000 ) {
+                e->budgetUs = -(int64_t)limitOf( e ) * 1000;
+            }
+        }
+        e->lastSeen = now;
+    }
+    pthread_mutex_unlock( &procLock );
+}
+
+uint64_t procstats_throttle( pid_t pid ) {
+
+    ProcEntry *e = NULL;
+    uint64_t now = nowMicros(), wait = 0;
+    unsigned int i, limit;
+
+    pthread_mutex_lock( &procLock );
+    for ( i = 0 ; i < nentries ; i++ ) {
+        if ( entries[i].lastSeen != 0 && entries[i].pid == pid ) {
+            e = &entries[i];
+            break;
+        }
+    }
+    if ( e != NULL ) {
+        refill( e, now );
+        limit = limitOf( e );
+        if ( limit != 0 && e->budgetUs < 0 ) {
+            wait = (uint64_t)(-e->budgetUs) * 1000 / limit;
+        }
+    }
+    pthread_mutex_unlock( &procLock );
+
+    return wait;
+}
+
+void procstats_throttled( pid_t pid, uint64_t us ) {
+
+    unsigned int i;
+
+    pthread_mutex_lock( &procLock );
+    for ( i = 0 ; i < nentries ; i++ ) {
+        if ( entries[i].lastSeen != 0 && entries[i].pid == pid ) {
+            entries[i].throttledUs += us;
+            break;
+        }
+    }
+    pthread_mutex_unlock( &procLock );
+}
+
+/**
+ * Gives pid its own card time limit, 0 for unlimited. It stays in the
+ * table until the process exits.
+ *
+ * Returns: 0 = success, -1 if the table is not allocated or every slot
+ * holds a live process with its own limit
+ */
+int procstats_set_limit( pid_t pid, unsigned int limitMs ) {
+
+    ProcEntry *e;
+    uint64_t now = nowMicros();
+
+    pthread_mutex_lock( &procLock );
+    e = findEntry( pid, 0, now );
+    if ( e != NULL ) {
+        refill( e, now );
+        e->ownLimit = 1;
+        e->limitMs = limitMs;
+        e->budgetUs = 0;
+    }
+    pthread_mutex_unlock( &procLock );
+
+    return e != NULL ? 0 : -1;
+}
+
+/** Zeroes the counters, keeping the processes and their limits */
+void procstats_reset( void ) {
+
+    unsigned int i;
+
+    pthread_mutex_lock( &procLock );
+    for ( i = 0 ; i < nentries ; i++ ) {
+        entries[i].ops = 0;
+        memset( &entries[i].cost, 0, sizeof( PROCSTATS_COST ) );
+        entries[i].throttledUs = 0;
+    }
+    pthread_mutex_unlock( &procLock );
+}
+
+int procstats_text( char *buf, size_t size ) {
+
+    const ProcEntry *e;
+    unsigned int i;
+    size_t len = 0;
+    int n;
+
+    if ( size > 0 ) {
+        buf[0] = '\0';
+    }
+
+    pthread_mutex_lock( &procLock );
+    for ( i = 0 ; i < nentries && len < size ; i++ ) {
+        e = &entries[i];
+        if ( e->lastSeen == 0 ) {
+            continue;
+        }
+        n = snprintf( buf + len, size - len, "%d %u %s %llu %llu %llu %llu %llu %llu %llu %llu %u\n",
+                      (int)e->pid, (unsigned)e->uid, e->comm, (unsigned long long)e->ops,
+                      (unsigned long long)e->cost.readBytes, (unsigned long long)e->cost.writtenBytes,
+                      (unsigned long long)e->cost.cardUs, (unsigned long long)e->cost.cardSectors,
+                      (unsigned long long)e->cost.cacheHits, (unsigned long long)e->cost.cacheMisses,
+                      (unsigned long long)e->throttledUs, limitOf( e ) );
+        len = len + n < size ? len + n : size;
+    }
+    pthread_mutex_unlock( &procLock );
+
+    return (int)len;
+}
@@ -0,0 +1,83 @@
+/**
+ * Per-process I/O accounting
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PROCSTATS_DEFINED
+#define _PROCSTATS_DEFINED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** What one request cost, charged with procstats_charge() */
+typedef struct {
+    uint64_t readBytes;
+    uint64_t writtenBytes;
+    uint64_t cardUs;        /** Card transfer time, induced metadata I/O included */
+    uint64_t cardSectors;
+    uint64_t cacheHits;     /** Sectors read from the sector cache */
+    uint64_t cacheMisses;   /** Sectors read from the card */
+} PROCSTATS_COST;
+
+/**
+ * A fixed table of processes keyed by pid, the least recently seen one
+ * making way for a new pid once it is full. A process with a limit of its
+ * own keeps its slot while it runs. Safe to call from any thread.
+ *
+ * A card time limit (milliseconds of card time per second, 0 for none)
+ * applies to every process without one of its own.
+ */
+int procstats_init( unsigned int nslots, unsigned int defaultLimitMs );
+void procstats_free( void );
+void procstats_charge( pid_t pid, uid_t uid, const PROCSTATS_COST *cost );
+int procstats_set_limit( pid_t pid, unsigned int limitMs );
+void procstats_reset( void );
+
+/**
+ * Returns: how long pid must wait [us] before its next request to keep
+ * within its card time limit, 0 if it may go ahead
+ */
+uint64_t procstats_throttle( pid_t pid );
+
+/** Adds time pid actually spent held back to its throttled_us */
+void procstats_throttled( pid_t pid, uint64_t us );
+
+/** Returns: the process a thread id belongs to, cached */
+pid_t procstats_tgid( pid_t tid );
+
+/**
+ * One line per process:
+ *
+ *   pid uid comm ops read_bytes written_bytes card_us card_sectors
+ *   cache_hits cache_misses throttled_us limit_ms
+ *
+ * Returns: the length written, truncated to size
+ */
+int procstats_text( char *buf, size_t size );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
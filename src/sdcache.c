@@ -0,0 +1,338 @@
+/**
+ * Sector cache for the SD card transport
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdcache.h"
+
+/**
+ * Fixed pool of sector slots with a chained hash index and an LRU list.
+ * Slots are referenced by index so the whole cache is three allocations.
+ */
+typedef struct {
+    LBA_t sector;
+    int hnext;          /** Next slot in the same hash bucket (-1: end) */
+    int prev;           /** LRU neighbours (-1: end) */
+    int next;
+    UINT pins;          /** Outstanding sdcache_pin()s, off the LRU list while non-zero */
+    BYTE valid;
+} CacheSlot;
+
+static CacheSlot *slots = NULL;
+static BYTE *slotData = NULL;
+static int *buckets = NULL;
+static UINT nslots = 0;
+static UINT nbuckets = 0;
+
+/** LRU list: head is most recently used, tail is the next victim */
+static int lruHead = -1;
+static int lruTail = -1;
+
+static SDCACHE_STATS stats;
+
+#define SLOT_DATA(i) (slotData + ((size_t)(i) * FF_MAX_SS))
+
+static UINT hashSector( LBA_t sector ) {
+    return (UINT)((sector * 2654435761u) & (nbuckets - 1));
+}
+
+static void lruUnlink( int i ) {
+
+    if ( slots[i].prev != -1 ) {
+        slots[slots[i].prev].next = slots[i].next;
+    } else {
+        lruHead = slots[i].next;
+    }
+    if ( slots[i].next != -1 ) {
+        slots[slots[i].next].prev = slots[i].prev;
+    } else {
+        lruTail = slots[i].prev;
+    }
+    slots[i].prev = slots[i].next = -1;
+}
+
+static void lruPushHead( int i ) {
+
+    slots[i].prev = -1;
+    slots[i].next = lruHead;
+    if ( lruHead != -1 ) {
+        slots[lruHead].prev = i;
+    }
+    lruHead = i;
+    if ( lruTail == -1 ) {
+        lruTail = i;
+    }
+}
+
+static void lruPushTail( int i ) {
+
+    slots[i].next = -1;
+    slots[i].prev = lruTail;
+    if ( lruTail != -1 ) {
+        slots[lruTail].next = i;
+    }
+    lruTail = i;
+    if ( lruHead == -1 ) {
+        lruHead = i;
+    }
+}
+
+static int findSlot( LBA_t sector ) {
+
+    int i;
+
+    for ( i = buckets[hashSector( sector )] ; i != -1 ; i = slots[i].hnext ) {
+        if ( slots[i].valid && slots[i].sector == sector ) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static void hashRemove( int i ) {
+
+    int *link = &buckets[hashSector( slots[i].sector )];
+
+    while ( *link != -1 ) {
+        if ( *link == i ) {
+            *link = slots[i].hnext;
+            break;
+        }
+        link = &slots[*link].hnext;
+    }
+    slots[i].hnext = -1;
+}
+
+/** Empties the index and threads every slot onto the LRU list as a victim */
+static void resetSlots( void ) {
+
+    UINT i;
+
+    for ( i = 0 ; i < nbuckets ; i++ ) {
+        buckets[i] = -1;
+    }
+    lruHead = lruTail = -1;
+    for ( i = 0 ; i < nslots ; i++ ) {
+        slots[i].valid = 0;
+        slots[i].hnext = -1;
+        slots[i].prev = slots[i].next = -1;
+        if ( slots[i].pins == 0 ) {
+            lruPushTail( i );
+        }
+    }
+    stats.nused = 0;
+}
+
+/**
+ * Allocates the cache. Any previous cache is released first.
+ *
+ * Returns: 0 = success, -1 = allocation failure (cache left disabled)
+ */
+int sdcache_init( UINT nsectors ) {
+
+    sdcache_free();
+
+    if ( nsectors == 0 ) {
+        return 0;
+    }
+
+    for ( nbuckets = 1 ; nbuckets < nsectors * 2 ; nbuckets <<= 1 ) ;
+
+    slots = calloc( nsectors, sizeof( CacheSlot ) );
+    slotData = malloc( (size_t)nsectors * FF_MAX_SS );
+    buckets = malloc( nbuckets * sizeof( int ) );
+    if ( slots == NULL || slotData == NULL || buckets == NULL ) {
+        sdcache_free();
+        return -1;
+    }
+
+    nslots = nsectors;
+    stats.nsectors = nsectors;
+    resetSlots();
+
+    return 0;
+}
+
+void sdcache_free( void ) {
+
+    free( slots );
+    free( slotData );
+    free( buckets );
+    slots = NULL;
+    slotData = NULL;
+    buckets = NULL;
+    nslots = nbuckets = 0;
+    lruHead = lruTail = -1;
+    memset( &stats, 0, sizeof( stats ) );
+}
+
+/**
+ * Copies a cached sector into buff and marks it most recently used.
+ *
+ * Returns: 1 = hit, 0 = miss
+ */
+int sdcache_read( LBA_t sector, BYTE *buff ) {
+
+    int i;
+
+    if ( nslots == 0 ) {
+        return 0;
+    }
+
+    i = findSlot( sector );
+    if ( i == -1 ) {
+        stats.misses++;
+        return 0;
+    }
+
+    memcpy( buff, SLOT_DATA( i ), FF_MAX_SS );
+    lruUnlink( i );
+    lruPushHead( i );
+    stats.hits++;
+
+    return 1;
+}
+
+/** Returns: 1 if the sector is cached. Does not touch LRU order or counters */
+int sdcache_contains( LBA_t sector ) {
+
+    if ( nslots == 0 ) {
+        return 0;
+    }
+
+    return findSlot( sector ) != -1;
+}
+
+/** Inserts or refreshes a sector, evicting the least recently used slot */
+void sdcache_store( LBA_t sector, const BYTE *buff ) {
+
+    int i;
+
+    if ( nslots == 0 ) {
+        return;
+    }
+
+    i = findSlot( sector );
+    if ( i == -1 ) {
+        i = lruTail;
+        if ( i == -1 ) {
+            return;     /** Every slot is pinned */
+        }
+        if ( slots[i].valid ) {
+            hashRemove( i );
+            stats.evictions++;
+            stats.nused--;
+        }
+        slots[i].sector = sector;
+        slots[i].valid = 1;
+        slots[i].hnext = buckets[hashSector( sector )];
+        buckets[hashSector( sector )] = i;
+        stats.inserts++;
+        stats.nused++;
+    }
+
+    memcpy( SLOT_DATA( i ), buff, FF_MAX_SS );
+    if ( slots[i].pins == 0 ) {
+        lruUnlink( i );
+        lruPushHead( i );
+    }
+}
+
+/** Drops a single sector, e.g., after a failed write left its contents unknown */
+void sdcache_discard( LBA_t sector ) {
+
+    int i;
+
+    if ( nslots == 0 ) {
+        return;
+    }
+
+    i = findSlot( sector );
+    if ( i != -1 ) {
+        hashRemove( i );
+        slots[i].valid = 0;
+        if ( slots[i].pins == 0 ) {
+            lruUnlink( i );
+            lruPushTail( i );
+        }
+        stats.nused--;
+    }
+}
+
+/**
+ * Hands out the cached copy of a sector without copying it. The slot is
+ * taken off the LRU list so it can't be recycled until every pin has been
+ * released with sdcache_unpin(). A write to the sector still refreshes
+ * the data in place; a discard or invalidate drops it from the index but
+ * leaves the memory alone until it is unpinned.
+ *
+ * Returns: the sector data, NULL on a miss
+ */
+const BYTE *sdcache_pin( LBA_t sector ) {
+
+    int i;
+
+    if ( nslots == 0 ) {
+        return NULL;
+    }
+
+    i = findSlot( sector );
+    if ( i == -1 ) {
+        stats.misses++;
+        return NULL;
+    }
+
+    if ( slots[i].pins++ == 0 ) {
+        lruUnlink( i );
+    }
+    stats.hits++;
+
+    return SLOT_DATA( i );
+}
+
+/** Releases a pin taken by sdcache_pin(). data may point anywhere in the sector */
+void sdcache_unpin( const BYTE *data ) {
+
+    int i = (int)((data - slotData) / FF_MAX_SS);
+
+    if ( --slots[i].pins == 0 ) {
+        if ( slots[i].valid ) {
+            lruPushHead( i );
+        } else {
+            lruPushTail( i );
+        }
+    }
+}
+
+/** Drops every cached sector, e.g., on media change */
+void sdcache_invalidate( void ) {
+
+    resetSlots();
+}
+
+void sdcache_get_stats( SDCACHE_STATS *out ) {
+
+    if ( out != NULL ) {
+        *out = stats;
+    }
+}
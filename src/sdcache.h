@@ -0,0 +1,62 @@
+/**
+ * Sector cache for the SD card transport
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SDCACHE_DEFINED
+#define _SDCACHE_DEFINED
+
+#include "ff.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Cache counters */
+typedef struct {
+    QWORD hits;
+    QWORD misses;
+    QWORD inserts;
+    QWORD evictions;
+    UINT nsectors;          /** Capacity in sectors */
+    UINT nused;             /** Sectors currently held */
+} SDCACHE_STATS;
+
+/**
+ * The cache is not locked internally. All callers go through diskio.c
+ * which serialises access alongside the transport.
+ *
+ * A cache of 0 sectors is valid and disables caching entirely.
+ */
+int sdcache_init( UINT nsectors );
+void sdcache_free( void );
+int sdcache_read( LBA_t sector, BYTE *buff );
+int sdcache_contains( LBA_t sector );
+void sdcache_store( LBA_t sector, const BYTE *buff );
+void sdcache_discard( LBA_t sector );
+const BYTE *sdcache_pin( LBA_t sector );
+void sdcache_unpin( const BYTE *data );
+void sdcache_invalidate( void );
+void sdcache_get_stats( SDCACHE_STATS *stats );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
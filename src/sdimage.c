@@ -0,0 +1,301 @@
+/*------------------------------------------------------------------------/
+/  Disk image file transport
+/-------------------------------------------------------------------------/
+/
+/  Copyright (C) 2021, Alligator Descartes <https://hermitretro.com>, all right reserved.
+/
+/ * This software is a free software and there is NO WARRANTY.
+/ * No restriction on use. You can use, modify and redistribute it for
+/   personal, non-profit or commercial products UNDER YOUR RESPONSIBILITY.
+/ * Redistributions of source code must retain the above copyright notice.
+/
+/-------------------------------------------------------------------------/
+  Serves the disk_*() layer from a raw card image (e.g. dd of a card) so
+  the filesystem, caches and daemons can be run and benchmarked on any
+  Linux machine. There is no bus, so only the operation and byte counters
+  of MMC_GET_BUSSTATS are maintained.
+/-------------------------------------------------------------------------*/
+
+
+#define _GNU_SOURCE		/* fallocate() */
+
+#include "ff.h"
+#include "diskio.h"
+#include "sdimage.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+
+static
+const char* Path;		/* Image file (img_set_path) */
+
+static
+int Fd = -1;			/* Open image, -1:closed */
+
+static
+DSTATUS Stat = STA_NOINIT;	/* Disk status */
+
+static
+LBA_t Sectors;			/* Image size in sectors */
+
+static
+DISKBUSSTATS BusStats;	/* Operation and byte counters (MMC_GET_BUSSTATS) */
+
+static
+DISKINITSTATS InitStats;	/* Open counters (MMC_GET_INITSTATS) */
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Transfer whole sectors, restarting short transfers                    */
+/*-----------------------------------------------------------------------*/
+
+static
+int xfer (			/* 1:OK, 0:Error */
+	int write,		/* 1:pwrite, 0:pread */
+	BYTE* buff,		/* Data buffer */
+	LBA_t sector,	/* Start sector */
+	UINT count		/* Sector count */
+)
+{
+	size_t len = (size_t)count * FF_MAX_SS;
+	off_t ofs = (off_t)sector * FF_MAX_SS;
+	ssize_t n;
+
+
+	if (Fd < 0 || sector + count > Sectors) return 0;
+
+	BusStats.bytes += len;
+	while (len) {
+		n = write ? pwrite(Fd, buff, len, ofs) : pread(Fd, buff, len, ofs);
+		if (n <= 0) return 0;
+		buff += n; ofs += n; len -= (size_t)n;
+	}
+
+	return 1;
+}
+
+
+
+/*--------------------------------------------------------------------------
+
+   Public Functions
+
+---------------------------------------------------------------------------*/
+
+
+/*-----------------------------------------------------------------------*/
+/* Set the image file used by the next initialization                    */
+/*-----------------------------------------------------------------------*/
+
+int img_set_path (
+	const char* path	/* Image file, must stay valid */
+)
+{
+	Path = path;
+	Stat = STA_NOINIT;
+
+	return 0;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Get Disk Status                                                       */
+/*-----------------------------------------------------------------------*/
+
+DSTATUS img_disk_status (
+	BYTE drv			/* Drive number (always 0) */
+)
+{
+	if (drv) return STA_NOINIT;
+
+	return Stat;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Initialize Disk Drive                                                 */
+/*-----------------------------------------------------------------------*/
+
+DSTATUS img_disk_initialize (
+	BYTE drv		/* Physical drive nmuber (0) */
+)
+{
+	struct stat st;
+	DSTATUS s = 0;
+
+
+	if (drv || !Path) return STA_NOINIT;
+
+	InitStats.inits++;
+	if (Fd >= 0) close(Fd);
+	Fd = open(Path, O_RDWR);
+	if (Fd < 0) {
+		Fd = open(Path, O_RDONLY);		/* Read-only image */
+		s = STA_PROTECT;
+	}
+	if (Fd < 0 || fstat(Fd, &st) != 0) {
+		if (Fd >= 0) close(Fd);
+		Fd = -1;
+		InitStats.failures++;
+		return Stat = STA_NOINIT;
+	}
+	Sectors = (LBA_t)(st.st_size / FF_MAX_SS);
+	Stat = s;
+
+	return Stat;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Read Sector(s)                                                        */
+/*-----------------------------------------------------------------------*/
+
+DRESULT img_disk_read (
+	BYTE drv,			/* Physical drive nmuber (0) */
+	BYTE *buff,			/* Pointer to the data buffer to store read data */
+	LBA_t sector,		/* Start sector number (LBA) */
+	UINT count			/* Sector count (1..128) */
+)
+{
+	if (drv || !count) return RES_PARERR;
+	if (Stat & STA_NOINIT) return RES_NOTRDY;
+
+	BusStats.ops++;
+	return xfer(0, buff, sector, count) ? RES_OK : RES_ERROR;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Write Sector(s)                                                       */
+/*-----------------------------------------------------------------------*/
+
+DRESULT img_disk_write (
+	BYTE drv,			/* Physical drive nmuber (0) */
+	const BYTE *buff,	/* Pointer to the data to be written */
+	LBA_t sector,		/* Start sector number (LBA) */
+	UINT count			/* Sector count (1..128) */
+)
+{
+	if (drv || !count) return RES_PARERR;
+	if (Stat & STA_NOINIT) return RES_NOTRDY;
+	if (Stat & STA_PROTECT) return RES_WRPRT;
+
+	BusStats.ops++;
+	return xfer(1, (BYTE*)buff, sector, count) ? RES_OK : RES_ERROR;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Read/Write several sector ranges                                      */
+/*-----------------------------------------------------------------------*/
+
+DRESULT img_disk_readv (
+	BYTE drv,			/* Physical drive nmuber (0) */
+	const DISKSEG* segs,	/* Sector ranges */
+	UINT nsegs			/* Number of ranges */
+)
+{
+	UINT i;
+
+
+	if (drv || !nsegs) return RES_PARERR;
+	if (Stat & STA_NOINIT) return RES_NOTRDY;
+
+	BusStats.ops++;
+	for (i = 0; i < nsegs; i++) {
+		if (!xfer(0, segs[i].buff, segs[i].sector, segs[i].count)) return RES_ERROR;
+	}
+
+	return RES_OK;
+}
+
+
+DRESULT img_disk_writev (
+	BYTE drv,			/* Physical drive nmuber (0) */
+	const DISKSEG* segs,	/* Sector ranges */
+	UINT nsegs			/* Number of ranges */
+)
+{
+	UINT i;
+
+
+	if (drv || !nsegs) return RES_PARERR;
+	if (Stat & STA_NOINIT) return RES_NOTRDY;
+	if (Stat & STA_PROTECT) return RES_WRPRT;
+
+	BusStats.ops++;
+	for (i = 0; i < nsegs; i++) {
+		if (!xfer(1, segs[i].buff, segs[i].sector, segs[i].count)) return RES_ERROR;
+	}
+
+	return RES_OK;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Miscellaneous Functions                                               */
+/*-----------------------------------------------------------------------*/
+
+DRESULT img_disk_ioctl (
+	BYTE drv,		/* Physical drive nmuber (0) */
+	BYTE ctrl,		/* Control code */
+	void *buff		/* Buffer to send/receive control data */
+)
+{
+	if (drv) return RES_PARERR;
+
+	switch (ctrl) {			/* Host side, no image access */
+		case MMC_GET_BUSSTATS :	/* Copy operation and byte counters */
+			*(DISKBUSSTATS*)buff = BusStats;
+			return RES_OK;
+
+		case MMC_RESET_BUSSTATS :	/* Zero counters */
+			memset(&BusStats, 0, sizeof BusStats);
+			return RES_OK;
+
+		case MMC_GET_INITSTATS :	/* Copy open counters */
+			*(DISKINITSTATS*)buff = InitStats;
+			return RES_OK;
+
+		case MMC_SET_BUSYWORK :	/* Writes never leave the card busy */
+		case MMC_RESYNC :		/* No bus to resynchronise */
+			return RES_OK;
+	}
+
+	if (Stat & STA_NOINIT) return RES_NOTRDY;
+
+	switch (ctrl) {
+		case CTRL_SYNC :		/* Flush the image to its backing store */
+			return fsync(Fd) == 0 ? RES_OK : RES_ERROR;
+
+		case GET_SECTOR_COUNT :	/* Get number of sectors on the disk (LBA_t) */
+			*(LBA_t*)buff = Sectors;
+			return RES_OK;
+
+		case GET_SECTOR_SIZE :	/* Get sector size (WORD) */
+			*(WORD*)buff = FF_MAX_SS;
+			return RES_OK;
+
+		case GET_BLOCK_SIZE :	/* Get erase block size in unit of sector (DWORD) */
+			*(DWORD*)buff = 1;
+			return RES_OK;
+
+		case MMC_ZERO_RANGE :	/* The image's erase: punch out the range, it then reads as zeros */
+			BusStats.ops++;
+			return fallocate(Fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+							 (off_t)((LBA_t*)buff)[0] * FF_MAX_SS,
+							 (off_t)(((LBA_t*)buff)[1] - ((LBA_t*)buff)[0] + 1) * FF_MAX_SS) == 0 ? RES_OK : RES_PARERR;
+	}
+
+	return RES_PARERR;
+}
@@ -0,0 +1,29 @@
+/*-----------------------------------------------------------------------
+/  Disk image file transport entry points
+/-----------------------------------------------------------------------*/
+
+#ifndef _SDIMAGE_DEFINED
+#define _SDIMAGE_DEFINED
+
+#include "diskio.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A card image in a regular file, for benchmarks and development away
+   from the hardware. Selected with disk_set_image() */
+int img_set_path (const char* path);
+DSTATUS img_disk_initialize (BYTE pdrv);
+DSTATUS img_disk_status (BYTE pdrv);
+DRESULT img_disk_read (BYTE pdrv, BYTE* buff, LBA_t sector, UINT count);
+DRESULT img_disk_write (BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count);
+DRESULT img_disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
+DRESULT img_disk_readv (BYTE pdrv, const DISKSEG* segs, UINT nsegs);
+DRESULT img_disk_writev (BYTE pdrv, const DISKSEG* segs, UINT nsegs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,76 @@
+/*------------------------------------------------------------------------/
+/  Card initialization helpers shared by the SD transports
+/-------------------------------------------------------------------------/
+/
+/  Copyright (C) 2021, Alligator Descartes <https://hermitretro.com>, all right reserved.
+/
+/ * This software is a free software and there is NO WARRANTY.
+/ * No restriction on use. You can use, modify and redistribute it for
+/   personal, non-profit or commercial products UNDER YOUR RESPONSIBILITY.
+/ * Redistributions of source code must retain the above copyright notice.
+/
+/-------------------------------------------------------------------------/
+  The parts of card initialization that do not depend on the bus: how
+  sdmm.c, sdnative.c and sdspidev.c wait for a card to leave idle state.
+/-------------------------------------------------------------------------*/
+
+
+#include "ff.h"
+#include "diskio.h"
+#include "sdinit.h"
+
+#include <time.h>
+
+
+static
+QWORD get_us (void)		/* Monotonic time in microseconds */
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (QWORD)ts.tv_sec * 1000000 + (QWORD)(ts.tv_nsec / 1000);
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Poll an initialization command until the card leaves idle state       */
+/*-----------------------------------------------------------------------*/
+
+/* Most cards are ready within a few tens of ms, so poll back-to-back at
+   first and then back off with the elapsed time (el/8, 50us..1ms) so the
+   overshoot stays small. Short gaps are spun rather than slept as a
+   nanosleep() costs far more than it asks for without root. */
+
+int sd_wait_idle_exit (	/* 1:Ready, 0:Timeout */
+	int (*poll)(BYTE cmd, DWORD arg),	/* Sends the command once, 1:Card left idle state */
+	BYTE cmd,			/* ACMD41 or CMD1 */
+	DWORD arg,			/* Argument */
+	void (*dly)(UINT us),	/* The transport's delay */
+	QWORD t0,			/* Start of initialization [us] */
+	DISKINITSTATS* st	/* Counts the polls and records the time to ready */
+)
+{
+	DWORD el, n;
+	QWORD t;
+
+
+	for (;;) {
+		st->polls++;
+		if (poll(cmd, arg)) break;
+		t = get_us();
+		el = (DWORD)(t - t0);
+		if (el > 1000000) return 0;		/* Timeout of 1s */
+		n = el / 8;
+		if (n < 50) n = 50;
+		if (n > 1000) n = 1000;
+		if (n < 200) {
+			while (get_us() - t < n) ;
+		} else {
+			dly(n);
+		}
+	}
+	st->ready_us = (DWORD)(get_us() - t0);
+
+	return 1;
+}
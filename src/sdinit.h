@@ -0,0 +1,21 @@
+/*-----------------------------------------------------------------------
+/  Card initialization helpers shared by the SD transports
+/-----------------------------------------------------------------------*/
+
+#ifndef _SDINIT_DEFINED
+#define _SDINIT_DEFINED
+
+#include "diskio.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Polls until the card leaves idle state, backing off between polls */
+int sd_wait_idle_exit (int (*poll)(BYTE cmd, DWORD arg), BYTE cmd, DWORD arg, void (*dly)(UINT us), QWORD t0, DISKINITSTATS* st);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -30,8 +30,13 @@
 
 #include "ff.h"		/* Obtains integer types for FatFs */
 #include "diskio.h"	/* Common include file for FatFs and disk I/O layer */
+#include "sdmm.h"	/* Transport entry points used by diskio.c */
+#include "sdinit.h"	/* Initialization shared with the other SD transports */
+#include "spifat-trace.h"	/* USDT tracepoints */
 
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include "bcm2835.h"
 
 /*-------------------------------------------------------------------------*/
@@ -55,11 +60,18 @@
 
 #define NEEDS_SLOWDOWN
 #ifdef NEEDS_SLOWDOWN
-#define NOP() bcm2835_gpio_lev(DO_PIN); bcm2835_gpio_lev(DO_PIN)         /** ~40ns no-op */
+#define NOP() bcm2835_gpio_lev(DO_PIN); bcm2835_gpio_lev(DO_PIN); if (SlowClk) dly_clk()         /** ~40ns no-op */
 #else
-#define NOP()
+#define NOP() if (SlowClk) dly_clk()
 #endif
 
+/**
+ * The card must be clocked at 400kHz or less until it has left the idle
+ * state. Each clock edge is padded with this many extra GPIO reads while
+ * SlowClk is set (roughly 400kHz on a Pi 3) and runs at full speed after.
+ */
+#define SDMM_ID_PAD 32
+
 #define DO_INIT()	bcm2835_gpio_set_pud(DO_PIN, BCM2835_GPIO_PUD_UP)				/* Initialize port for MMC DO as input */
 #define DO		bcm2835_gpio_lev(DO_PIN)	/* Test for MMC DO ('H':true, 'L':false) */
 
@@ -71,6 +83,13 @@
 #define CK_H()		bcm2835_gpio_set(CK_PIN); NOP()		/* Set MMC SCLK "high" */
 #define	CK_L()		bcm2835_gpio_clr(CK_PIN); NOP() 		/* Set MMC SCLK "low" */
 
+/**
+ * The card is the only device on these pins so chip select can stay
+ * asserted between operations. Set to 0 to release the bus after every
+ * public call (e.g. if another SPI device is wired to DI/DO/SCLK).
+ */
+#define SDMM_HOLD_CS 1
+
 #define CS_INIT()	bcm2835_gpio_set_pud(CS_PIN, BCM2835_GPIO_PUD_UP); bcm2835_gpio_fsel(CS_PIN, BCM2835_GPIO_FSEL_OUTP); bcm2835_gpio_set(CS_PIN)
 #define	CS_H()		bcm2835_gpio_set(CS_PIN); NOP()	/* Set MMC CS "high" */
 #define CS_L()		bcm2835_gpio_clr(CS_PIN); NOP()	/* Set MMC CS "low" */
@@ -82,6 +101,15 @@ void dly_us (UINT n)	/* Delay n microseconds (avr-gcc -Os) */
     bcm2835_delayMicroseconds(n);
 }
 
+static
+QWORD get_us (void)		/* Monotonic time in microseconds */
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (QWORD)ts.tv_sec * 1000000 + (QWORD)(ts.tv_nsec / 1000);
+}
+
 
 
 /*--------------------------------------------------------------------------
@@ -112,6 +140,8 @@ void dly_us (UINT n)	/* Delay n microseconds (avr-gcc -Os) */
 #define CMD38	(38)		/* ERASE */
 #define CMD55	(55)		/* APP_CMD */
 #define CMD58	(58)		/* READ_OCR */
+#define ACMD13	(0x80+13)	/* SD_STATUS (SDC) */
+#define ACMD51	(0x80+51)	/* SEND_SCR (SDC) */
 
 
 static
@@ -120,6 +150,50 @@ DSTATUS Stat = STA_NOINIT;	/* Disk status */
 static
 BYTE CardType;			/* b0:MMC, b1:SDv1, b2:SDv2, b3:Block addressing */
 
+static
+BYTE EraseZero;			/* 1:Erased blocks read as zeros (SCR DATA_STAT_AFTER_ERASE = 0) */
+
+static
+DWORD EraseAu;			/* Allocation unit in sectors (SD status AU_SIZE), 0:Unknown */
+
+static
+DWORD EraseMs;			/* Erase timeout per allocation unit in ms (SD status ERASE_TIMEOUT/ERASE_OFFSET) */
+
+static
+BYTE Selected;			/* CS# is asserted */
+
+static
+BYTE Ready;				/* Card is known to be idle (not busy programming) */
+
+static
+DISKBUSSTATS BusStats;	/* Bus framing counters (MMC_GET_BUSSTATS) */
+
+static
+DISKBUSYWORK BusyWork;	/* Host work run while the card programs (MMC_SET_BUSYWORK) */
+
+static
+DWORD ProgUs;			/* Running average of the block programming time [us] */
+
+static
+QWORD ProgStart;		/* Time the last data block was accepted [us] */
+
+static
+BYTE SlowClk;			/* Identification clock profile is in use */
+
+static
+DISKINITSTATS InitStats;	/* Card initialisation timing (MMC_GET_INITSTATS) */
+
+
+
+static
+void dly_clk (void)		/* Pad one clock edge to the identification rate */
+{
+	UINT n;
+
+
+	for (n = SDMM_ID_PAD; n; n--) bcm2835_gpio_lev(DO_PIN);
+}
+
 
 
 /*-----------------------------------------------------------------------*/
@@ -135,6 +209,7 @@ void xmit_mmc (
 	BYTE d;
 
 
+	BusStats.bytes += bc;
 	do {
 		d = *buff++;	/* Get a byte to be sent */
 		if (d & 0x80) { DI_H(); } else { DI_L(); }	/* bit7 */
@@ -171,6 +246,7 @@ void rcvr_mmc (
 	BYTE r;
 
 
+	BusStats.bytes += bc;
 	DI_H();	/* Send 0xFF */
 
 	do {
@@ -207,13 +283,99 @@ int wait_ready (void)	/* 1:OK, 0:Timeout */
 	UINT tmr;
 
 
+	BusStats.ready_polls++;
 	for (tmr = 5000; tmr; tmr--) {	/* Wait for ready in timeout of 500ms */
 		rcvr_mmc(&d, 1);
 		if (d == 0xFF) break;
 		dly_us(100);
 	}
+	Ready = tmr ? 1 : 0;
+	SPIFAT_TRACE(wait_ready, Ready, 5000 - tmr);
 
-	return tmr ? 1 : 0;
+	return Ready;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Wait for the card to finish an erase                                  */
+/*-----------------------------------------------------------------------*/
+
+static
+int wait_erase (	/* 1:OK, 0:Timeout */
+	DWORD ms		/* Timeout in ms */
+)
+{
+	BYTE d;
+	QWORD t0 = get_us();
+
+
+	BusStats.ready_polls++;
+	for (;;) {
+		rcvr_mmc(&d, 1);
+		if (d == 0xFF || get_us() - t0 > (QWORD)ms * 1000) break;
+		dly_us(1000);
+	}
+	Ready = (d == 0xFF);
+
+	return Ready;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Wait for the card to finish programming a written block               */
+/*-----------------------------------------------------------------------*/
+
+/* Instead of sleeping between polls, runs the registered host work one
+   slice at a time. With no work left it sleeps through most of the
+   expected programming time in one go (long delays yield the CPU, short
+   ones spin on the system timer) and then polls at a fraction of it. */
+
+static
+int wait_prog (void)	/* 1:OK, 0:Timeout */
+{
+	BYTE d;
+	DWORD el, n;
+	int slept = 0;
+
+
+	rcvr_mmc(&d, 1);	/* Also provides the Nwr gap before the next token */
+	if (d == 0xFF) {
+		Ready = 1;
+		return 1;
+	}
+
+	BusStats.ready_polls++;
+	for (;;) {
+		if (BusyWork.fn && BusyWork.fn(BusyWork.arg)) {
+			BusStats.busy_slices++;
+		} else {
+			el = (DWORD)(get_us() - ProgStart);
+			if (!slept && ProgUs > el + 100) {
+				n = (ProgUs - el) * 3 / 4;
+			} else {
+				n = ProgUs / 8;
+				if (n < 10) n = 10;
+				if (n > 100) n = 100;
+			}
+			dly_us(n);
+			slept = 1;
+		}
+		rcvr_mmc(&d, 1);
+		if (d == 0xFF) break;
+		if (get_us() - ProgStart > 500000) {	/* Timeout of 500ms */
+			Ready = 0;
+			return 0;
+		}
+	}
+
+	el = (DWORD)(get_us() - ProgStart);
+	ProgUs = ProgUs ? ProgUs - ProgUs / 8 + el / 8 : el;
+	BusStats.prog_us = ProgUs;
+	Ready = 1;
+
+	return 1;
 }
 
 
@@ -227,12 +389,29 @@ void deselect (void)
 {
 	BYTE d;
 
+	BusStats.deselects++;
 	CS_H();				/* Set CS# high */
+	Selected = 0;
 	rcvr_mmc(&d, 1);	/* Dummy clock (force DO hi-z for multiple slave SPI) */
 }
 
 
 
+/*-----------------------------------------------------------------------*/
+/* End of a public operation                                             */
+/*-----------------------------------------------------------------------*/
+
+static
+void release (
+	int ok			/* 0: the operation failed, resynchronise the card */
+)
+{
+	if (!ok) Ready = 0;		/* Unknown card state, poll before the next command */
+	if (!ok || !SDMM_HOLD_CS) deselect();
+}
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Select the card and wait for ready                                    */
 /*-----------------------------------------------------------------------*/
@@ -242,9 +421,20 @@ int selectSD (void)	/* 1:OK, 0:Timeout */
 {
 	BYTE d;
 
-	CS_L();				/* Set CS# low */
-	rcvr_mmc(&d, 1);	/* Dummy clock (force DO enabled) */
-	if (wait_ready()) return 1;	/* Wait for card ready */
+	if (Selected) {		/* Still selected from the previous command */
+		if (Ready) {	/* Idle: one byte satisfies the command gap (Nrc) */
+			BusStats.ready_skipped++;
+			rcvr_mmc(&d, 1);
+			return 1;
+		}
+		if (wait_ready()) return 1;
+	} else {
+		BusStats.selects++;
+		CS_L();				/* Set CS# low */
+		Selected = 1;
+		rcvr_mmc(&d, 1);	/* Dummy clock (force DO enabled) */
+		if (wait_ready()) return 1;	/* Wait for card ready */
+	}
 
 	deselect();
 	return 0;			/* Failed */
@@ -294,16 +484,20 @@ int xmit_datablock (	/* 1:OK, 0:Failed */
 	BYTE d[2];
 
 
-	if (!wait_ready()) return 0;
+	if (!wait_prog()) return 0;	/* Previous block, if any, programmed */
 
 	d[0] = token;
 	xmit_mmc(d, 1);				/* Xmit a token */
+	Ready = 0;					/* The card goes busy after the block or stop token */
 	if (token != 0xFD) {		/* Is it data token? */
 		xmit_mmc(buff, 512);	/* Xmit the 512 byte data block to MMC */
 		rcvr_mmc(d, 2);			/* Xmit dummy CRC (0xFF,0xFF) */
 		rcvr_mmc(d, 1);			/* Receive data response */
 		if ((d[0] & 0x1F) != 0x05)	/* If not accepted, return with error */
 			return 0;
+		ProgStart = get_us();
+	} else {
+		rcvr_mmc(d, 1);			/* The card goes busy a byte after a stop token (Nbr) */
 	}
 
 	return 1;
@@ -312,30 +506,18 @@ int xmit_datablock (	/* 1:OK, 0:Failed */
 
 
 /*-----------------------------------------------------------------------*/
-/* Send a command packet to the card                                     */
+/* Transmit a command packet and receive its response (card selected)    */
 /*-----------------------------------------------------------------------*/
 
 static
-BYTE send_cmd (		/* Returns command response (bit7==1:Send failed)*/
-	BYTE cmd,		/* Command byte */
+BYTE xmit_cmd (		/* Returns command response (bit7==1:Send failed)*/
+	BYTE cmd,		/* Command byte (not ACMD) */
 	DWORD arg		/* Argument */
 )
 {
 	BYTE n, d, buf[6];
 
 
-	if (cmd & 0x80) {	/* ACMD<n> is the command sequense of CMD55-CMD<n> */
-		cmd &= 0x7F;
-		n = send_cmd(CMD55, 0);
-		if (n > 1) return n;
-	}
-
-	/* Select the card and wait for ready except to stop multiple block read */
-	if (cmd != CMD12) {
-		deselect();
-		if (!selectSD()) return 0xFF;
-	}
-
 	/* Send a command packet */
 	buf[0] = 0x40 | cmd;			/* Start + Command index */
 	buf[1] = (BYTE)(arg >> 24);		/* Argument[31..24] */
@@ -346,6 +528,7 @@ BYTE send_cmd (		/* Returns command response (bit7==1:Send failed)*/
 	if (cmd == CMD0) n = 0x95;		/* (valid CRC for CMD0(0)) */
 	if (cmd == CMD8) n = 0x87;		/* (valid CRC for CMD8(0x1AA)) */
 	buf[5] = n;
+	BusStats.commands++;
 	xmit_mmc(buf, 6);
 
 	/* Receive command response */
@@ -355,11 +538,108 @@ BYTE send_cmd (		/* Returns command response (bit7==1:Send failed)*/
 		rcvr_mmc(&d, 1);
 	while ((d & 0x80) && --n);
 
+	/* R1b commands and failed commands leave the card in an unknown state */
+	Ready = (cmd != CMD12 && cmd != CMD38 && cmd != CMD0 && !(d & 0x80));
+
 	return d;			/* Return with the response value */
 }
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Send a command packet to the card                                     */
+/*-----------------------------------------------------------------------*/
+
+static
+BYTE send_cmd (		/* Returns command response (bit7==1:Send failed)*/
+	BYTE cmd,		/* Command byte */
+	DWORD arg		/* Argument */
+)
+{
+	BYTE n;
+
+
+	if (cmd & 0x80) {	/* ACMD<n> is the command sequense of CMD55-CMD<n> */
+		cmd &= 0x7F;
+		n = send_cmd(CMD55, 0);
+		if (n > 1) return n;
+	}
+
+	/* Select the card and wait for ready except to stop multiple block read.
+	   If it is still selected and idle from the previous command (e.g. the
+	   CMD55 of an ACMD) this costs one byte rather than a CS# cycle. */
+	if (cmd != CMD12) {
+		if (!selectSD()) {
+			SPIFAT_TRACE(send_cmd, cmd, arg, 0xFF);
+			return 0xFF;
+		}
+	}
+
+	n = xmit_cmd(cmd, arg);
+	SPIFAT_TRACE(send_cmd, cmd, arg, n);
+
+	return n;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Poll an initialization command until the card leaves idle state       */
+/*-----------------------------------------------------------------------*/
+
+static
+int poll_idle (		/* 1:Card left idle state */
+	BYTE cmd,		/* ACMD41 or CMD1 */
+	DWORD arg		/* Argument */
+)
+{
+	return send_cmd(cmd, arg) == 0;
+}
+
+
+static
+int wait_idle_exit (	/* 1:Ready, 0:Timeout */
+	BYTE cmd,		/* ACMD41 or CMD1 */
+	DWORD arg,		/* Argument */
+	QWORD t0		/* Start of initialization [us] */
+)
+{
+	if (!sd_wait_idle_exit(poll_idle, cmd, arg, dly_us, t0, &InitStats)) return 0;
+	SlowClk = 0;		/* Full speed from here on */
+
+	return 1;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Read allocation unit and erase timeout from the SD status             */
+/*-----------------------------------------------------------------------*/
+
+static
+void read_sd_status (void)
+{
+	static const DWORD au_sectors[16] = {0, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 24576, 32768, 49152, 65536, 131072};
+	BYTE sds[64];
+	WORD es;
+
+
+	EraseAu = 0; EraseMs = 1000;	/* Unknown: assume a second per erase unit */
+	if (send_cmd(ACMD13, 0) == 0) {
+		rcvr_mmc(sds, 1);				/* Second byte of the R2 response */
+		if (rcvr_datablock(sds, 64)) {
+			EraseAu = au_sectors[sds[10] >> 4];
+			es = (WORD)sds[11] << 8 | sds[12];
+			if (es) {				/* ERASE_TIMEOUT seconds covers ERASE_SIZE AUs, plus ERASE_OFFSET seconds per erase */
+				EraseMs = ((DWORD)(sds[13] >> 2) * 1000 + es - 1) / es + (sds[13] & 3) * 1000;
+				if (EraseMs < 250) EraseMs = 250;
+			}
+		}
+	}
+}
+
+
+
 /*--------------------------------------------------------------------------
 
    Public Functions
@@ -367,11 +647,12 @@ BYTE send_cmd (		/* Returns command response (bit7==1:Send failed)*/
 ---------------------------------------------------------------------------*/
 
 
+
 /*-----------------------------------------------------------------------*/
 /* Get Disk Status                                                       */
 /*-----------------------------------------------------------------------*/
 
-DSTATUS disk_status (
+DSTATUS mmc_disk_status (
 	BYTE drv			/* Drive number (always 0) */
 )
 {
@@ -386,19 +667,26 @@ DSTATUS disk_status (
 /* Initialize Disk Drive                                                 */
 /*-----------------------------------------------------------------------*/
 
-DSTATUS disk_initialize (
+DSTATUS mmc_disk_initialize (
 	BYTE drv		/* Physical drive nmuber (0) */
 )
 {
-	BYTE n, ty, cmd, buf[4];
-	UINT tmr;
+	BYTE n, ty, cmd, buf[4], buf8[8];
+	QWORD t0;
 	DSTATUS s;
 
 
 	if (drv) return RES_NOTRDY;
 
-	dly_us(10000);			/* 10ms */
+	t0 = get_us();
+	InitStats.inits++;
+	InitStats.polls = 0;
+	InitStats.ready_us = 0;
+
+	dly_us(1000);			/* 1ms after the supply is up */
+	SlowClk = 1;			/* Identification clock until the card leaves idle state */
 	CS_INIT(); CS_H();		/* Initialize port pin tied to CS */
+	Selected = 0; Ready = 0;
 	CK_INIT(); CK_L();		/* Initialize port pin tied to SCLK */
 	DI_INIT();				/* Initialize port pin tied to DI */
 	DO_INIT();				/* Initialize port pin tied to DO */
@@ -406,15 +694,21 @@ DSTATUS disk_initialize (
 	for (n = 10; n; n--) rcvr_mmc(buf, 1);	/* Apply 80 dummy clocks and the card gets ready to receive command */
 
 	ty = 0;
-	if (send_cmd(CMD0, 0) == 1) {			/* Enter Idle state */
+	if (CardType && send_cmd(CMD58, 0) == 0) {	/* Re-initialization and the card is still out of idle state? */
+		rcvr_mmc(buf, 4);
+		if ((buf[0] & 0x80)								/* Powered up */
+			&& !(buf[0] & 0x40) == !(CardType & CT_BLOCK)	/* and addressed as before */
+			&& ((CardType & CT_BLOCK) || send_cmd(CMD16, 512) == 0)) {	/* Byte addressed: block length 512 again */
+			ty = CardType;
+			InitStats.early_exits++;
+		}
+	}
+	if (!ty && send_cmd(CMD0, 0) == 1) {	/* Enter Idle state */
 		if (send_cmd(CMD8, 0x1AA) == 1) {	/* SDv2? */
 			rcvr_mmc(buf, 4);							/* Get trailing return value of R7 resp */
 			if (buf[2] == 0x01 && buf[3] == 0xAA) {		/* The card can work at vdd range of 2.7-3.6V */
-				for (tmr = 1000; tmr; tmr--) {			/* Wait for leaving idle state (ACMD41 with HCS bit) */
-					if (send_cmd(ACMD41, 1UL << 30) == 0) break;
-					dly_us(1000);
-				}
-				if (tmr && send_cmd(CMD58, 0) == 0) {	/* Check CCS bit in the OCR */
+				if (wait_idle_exit(ACMD41, 1UL << 30, t0)	/* Wait for leaving idle state (ACMD41 with HCS bit) */
+					&& send_cmd(CMD58, 0) == 0) {		/* Check CCS bit in the OCR */
 					rcvr_mmc(buf, 4);
 					ty = (buf[0] & 0x40) ? CT_SDC2 | CT_BLOCK : CT_SDC2;	/* SDv2+ */
 				}
@@ -425,19 +719,25 @@ DSTATUS disk_initialize (
 			} else {
 				ty = CT_MMC3; cmd = CMD1;	/* MMCv3 */
 			}
-			for (tmr = 1000; tmr; tmr--) {			/* Wait for leaving idle state */
-				if (send_cmd(cmd, 0) == 0) break;
-				dly_us(1000);
-			}
-			if (!tmr || send_cmd(CMD16, 512) != 0)	/* Set R/W block length to 512 */
+			if (!wait_idle_exit(cmd, 0, t0)	/* Wait for leaving idle state */
+				|| send_cmd(CMD16, 512) != 0)	/* Set R/W block length to 512 */
 				ty = 0;
 		}
 	}
+	SlowClk = 0;
 	CardType = ty;
+	EraseZero = 0;
+	if ((ty & CT_SDC) && send_cmd(ACMD51, 0) == 0 && rcvr_datablock(buf8, 8)) {	/* Read SCR */
+		EraseZero = (buf8[1] & 0x80) ? 0 : 1;	/* DATA_STAT_AFTER_ERASE (SCR bit 55) */
+	}
+	if (ty & CT_SDC) read_sd_status();
 	s = ty ? 0 : STA_NOINIT;
 	Stat = s;
 
-	deselect();
+	release(ty != 0);
+
+	InitStats.last_us = (DWORD)(get_us() - t0);
+	if (!ty) InitStats.failures++;
 
 	return s;
 }
@@ -448,7 +748,7 @@ DSTATUS disk_initialize (
 /* Read Sector(s)                                                        */
 /*-----------------------------------------------------------------------*/
 
-DRESULT disk_read (
+DRESULT mmc_disk_read (
 	BYTE drv,			/* Physical drive nmuber (0) */
 	BYTE *buff,			/* Pointer to the data buffer to store read data */
 	LBA_t sector,		/* Start sector number (LBA) */
@@ -459,9 +759,10 @@ DRESULT disk_read (
 	DWORD sect = (DWORD)sector;
 
 
-	if (disk_status(drv) & STA_NOINIT) return RES_NOTRDY;
+	if (mmc_disk_status(drv) & STA_NOINIT) return RES_NOTRDY;
 	if (!(CardType & CT_BLOCK)) sect *= 512;	/* Convert LBA to byte address if needed */
 
+	BusStats.ops++;
 	cmd = count > 1 ? CMD18 : CMD17;			/*  READ_MULTIPLE_BLOCK : READ_SINGLE_BLOCK */
 	if (send_cmd(cmd, sect) == 0) {
 		do {
@@ -470,7 +771,7 @@ DRESULT disk_read (
 		} while (--count);
 		if (cmd == CMD18) send_cmd(CMD12, 0);	/* STOP_TRANSMISSION */
 	}
-	deselect();
+	release(!count);
 
 	return count ? RES_ERROR : RES_OK;
 }
@@ -481,7 +782,7 @@ DRESULT disk_read (
 /* Write Sector(s)                                                       */
 /*-----------------------------------------------------------------------*/
 
-DRESULT disk_write (
+DRESULT mmc_disk_write (
 	BYTE drv,			/* Physical drive nmuber (0) */
 	const BYTE *buff,	/* Pointer to the data to be written */
 	LBA_t sector,		/* Start sector number (LBA) */
@@ -491,9 +792,10 @@ DRESULT disk_write (
 	DWORD sect = (DWORD)sector;
 
 
-	if (disk_status(drv) & STA_NOINIT) return RES_NOTRDY;
+	if (mmc_disk_status(drv) & STA_NOINIT) return RES_NOTRDY;
 	if (!(CardType & CT_BLOCK)) sect *= 512;	/* Convert LBA to byte address if needed */
 
+	BusStats.ops++;
 	if (count == 1) {	/* Single block write */
 		if ((send_cmd(CMD24, sect) == 0)	/* WRITE_BLOCK */
 			&& xmit_datablock(buff, 0xFE))
@@ -510,17 +812,106 @@ DRESULT disk_write (
 				count = 1;
 		}
 	}
-	deselect();
+	release(!count);
 
 	return count ? RES_ERROR : RES_OK;
 }
 
 
+/*-----------------------------------------------------------------------*/
+/* Read several sector ranges in one chip-select session                 */
+/*-----------------------------------------------------------------------*/
+
+DRESULT mmc_disk_readv (
+	BYTE drv,			/* Physical drive nmuber (0) */
+	const DISKSEG* segs,	/* Sector ranges, executed in the given order */
+	UINT nsegs			/* Number of ranges */
+)
+{
+	BYTE cmd, *buff;
+	DWORD sect;
+	UINT count;
+
+
+	if (mmc_disk_status(drv) & STA_NOINIT) return RES_NOTRDY;
+
+	BusStats.ops++;
+	for (; nsegs; nsegs--, segs++) {
+		sect = (DWORD)segs->sector;
+		if (!(CardType & CT_BLOCK)) sect *= 512;
+		buff = segs->buff;
+		count = segs->count;
+
+		cmd = count > 1 ? CMD18 : CMD17;
+		if (send_cmd(cmd, sect) == 0) {
+			do {
+				if (!rcvr_datablock(buff, 512)) break;
+				buff += 512;
+			} while (--count);
+			if (cmd == CMD18) send_cmd(CMD12, 0);	/* STOP_TRANSMISSION */
+		}
+		if (count) break;
+	}
+	release(!nsegs);
+
+	return nsegs ? RES_ERROR : RES_OK;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Write several sector ranges in one chip-select session                */
+/*-----------------------------------------------------------------------*/
+
+DRESULT mmc_disk_writev (
+	BYTE drv,			/* Physical drive nmuber (0) */
+	const DISKSEG* segs,	/* Sector ranges, executed in the given order */
+	UINT nsegs			/* Number of ranges */
+)
+{
+	const BYTE *buff;
+	DWORD sect;
+	UINT count;
+
+
+	if (mmc_disk_status(drv) & STA_NOINIT) return RES_NOTRDY;
+
+	BusStats.ops++;
+	for (; nsegs; nsegs--, segs++) {
+		sect = (DWORD)segs->sector;
+		if (!(CardType & CT_BLOCK)) sect *= 512;
+		buff = segs->buff;
+		count = segs->count;
+
+		if (count == 1) {	/* Single block write */
+			if ((send_cmd(CMD24, sect) == 0)	/* WRITE_BLOCK */
+				&& xmit_datablock(buff, 0xFE))
+				count = 0;
+		}
+		else {				/* Multiple block write */
+			if (send_cmd(CMD25, sect) == 0) {	/* WRITE_MULTIPLE_BLOCK */
+				do {
+					if (!xmit_datablock(buff, 0xFC)) break;
+					buff += 512;
+				} while (--count);
+				if (!xmit_datablock(0, 0xFD))	/* STOP_TRAN token */
+					count = 1;
+			}
+		}
+		if (count) break;
+	}
+	release(!nsegs);
+
+	return nsegs ? RES_ERROR : RES_OK;
+}
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Miscellaneous Functions                                               */
 /*-----------------------------------------------------------------------*/
 
-DRESULT disk_ioctl (
+DRESULT mmc_disk_ioctl (
 	BYTE drv,		/* Physical drive nmuber (0) */
 	BYTE ctrl,		/* Control code */
 	void *buff		/* Buffer to send/receive control data */
@@ -529,9 +920,42 @@ DRESULT disk_ioctl (
 	DRESULT res;
 	BYTE n, csd[16];
 	DWORD cs;
+	LBA_t st, ed, en;
 
 
-	if (disk_status(drv) & STA_NOINIT) return RES_NOTRDY;	/* Check if card is in the socket */
+	switch (ctrl) {			/* Host side counters, no card access */
+		case MMC_GET_BUSSTATS :	/* Copy bus framing counters (DISKBUSSTATS) */
+			*(DISKBUSSTATS*)buff = BusStats;
+			return RES_OK;
+
+		case MMC_RESET_BUSSTATS :	/* Zero bus framing counters */
+			memset(&BusStats, 0, sizeof BusStats);
+			BusStats.prog_us = ProgUs;
+			return RES_OK;
+
+		case MMC_GET_INITSTATS :	/* Copy card initialization timing (DISKINITSTATS) */
+			*(DISKINITSTATS*)buff = InitStats;
+			return RES_OK;
+
+		case MMC_SET_BUSYWORK :	/* Register (or clear with NULL) work to run while the card is busy */
+			if (buff) {
+				BusyWork = *(const DISKBUSYWORK*)buff;
+			} else {
+				memset(&BusyWork, 0, sizeof BusyWork);
+			}
+			return RES_OK;
+
+		case MMC_RESYNC :		/* Abort any transfer and resynchronise the bus */
+			deselect();
+			for (n = 10; n; n--) rcvr_mmc(csd, 1);	/* Dummy clocks with CS# high */
+			if (!selectSD()) return RES_ERROR;
+			xmit_cmd(CMD12, 0);	/* Stop a stuck multiple block read, harmless otherwise */
+			res = wait_ready() ? RES_OK : RES_ERROR;
+			release(0);
+			return res;
+	}
+
+	if (mmc_disk_status(drv) & STA_NOINIT) return RES_NOTRDY;	/* Check if card is in the socket */
 
 	res = RES_ERROR;
 	switch (ctrl) {
@@ -558,11 +982,33 @@ DRESULT disk_ioctl (
 			res = RES_OK;
 			break;
 
+		case MMC_ZERO_RANGE :	/* Erase a sector range that then reads as zeros (LBA_t[2]) */
+			if (!EraseZero) {
+				res = RES_PARERR;
+				break;
+			}
+			st = ((LBA_t*)buff)[0]; ed = ((LBA_t*)buff)[1];
+			cs = EraseAu ? EraseAu : 8192;	/* One allocation unit per erase, 4MB if unknown */
+			res = RES_OK;
+			while (res == RES_OK && st <= ed) {
+				en = (st / cs + 1) * cs - 1;
+				if (en > ed) en = ed;
+				if (send_cmd(CMD32, (CardType & CT_BLOCK) ? st : st * 512) != 0	/* Convert LBA to byte address if needed */
+					|| send_cmd(CMD33, (CardType & CT_BLOCK) ? en : en * 512) != 0
+					|| send_cmd(CMD38, 0) != 0) {
+					res = RES_ERROR;
+				} else if (!wait_erase(EraseMs)) {
+					res = RES_NOTRDY;		/* Still busy after the card's own erase timeout */
+				}
+				st = en + 1;
+			}
+			break;
+
 		default:
 			res = RES_PARERR;
 	}
 
-	deselect();
+	release(res != RES_ERROR);
 
 	return res;
 }
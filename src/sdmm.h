@@ -0,0 +1,27 @@
+/*-----------------------------------------------------------------------
+/  MMC/SDC (in SPI mode) transport entry points
+/-----------------------------------------------------------------------*/
+
+#ifndef _SDMM_DEFINED
+#define _SDMM_DEFINED
+
+#include "diskio.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Bit-banged SPI transport. These are wrapped by disk_*() in diskio.c */
+DSTATUS mmc_disk_initialize (BYTE pdrv);
+DSTATUS mmc_disk_status (BYTE pdrv);
+DRESULT mmc_disk_read (BYTE pdrv, BYTE* buff, LBA_t sector, UINT count);
+DRESULT mmc_disk_write (BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count);
+DRESULT mmc_disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
+DRESULT mmc_disk_readv (BYTE pdrv, const DISKSEG* segs, UINT nsegs);
+DRESULT mmc_disk_writev (BYTE pdrv, const DISKSEG* segs, UINT nsegs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
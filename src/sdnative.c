@@ -0,0 +1,966 @@
+/*------------------------------------------------------------------------/
+/  SDv1/SDv2 (in native 4-bit bus mode) control module
+/-------------------------------------------------------------------------/
+/
+/  Copyright (C) 2021, Alligator Descartes <https://hermitretro.com>, all right reserved.
+/
+/ * This software is a free software and there is NO WARRANTY.
+/ * No restriction on use. You can use, modify and redistribute it for
+/   personal, non-profit or commercial products UNDER YOUR RESPONSIBILITY.
+/ * Redistributions of source code must retain the above copyright notice.
+/
+/-------------------------------------------------------------------------/
+  Features and Limitations:
+
+  * Bit-banging SD bus with four data lines
+    It uses six GPIO pins: CMD, CLK and DAT0-DAT3. CMD, CLK, DAT0 and DAT3
+    are the pins sdmm.c uses for DI, SCLK, DO and CS# so a board wired for
+    SPI only needs DAT1 and DAT2 adding.
+
+  * Four bits per GPIO sample
+    All four data lines sit in GPLEV0 so one register read per clock
+    receives a nibble where the SPI transport receives one bit.
+
+  * SD cards only
+    MMC has no ACMD6 bus width switch. Cards are initialised straight into
+    4-bit mode, there is no 1-bit fallback.
+
+  * CRC7 is generated and checked on every command and response, CRC16 is
+    generated and checked on each data line.
+
+  * A card enters SPI mode if it sees CMD0 with DAT3 (CS#) low and only
+    leaves it on power cycle, so a card used by sdmm.c must be re-inserted
+    before switching transport.
+
+/-------------------------------------------------------------------------*/
+
+
+#include "ff.h"		/* Obtains integer types for FatFs */
+#include "diskio.h"	/* Common include file for FatFs and disk I/O layer */
+#include "sdnative.h"	/* Transport entry points used by diskio.c */
+#include "sdinit.h"	/* Initialization shared with the other SD transports */
+#include "spifat-trace.h"	/* USDT tracepoints */
+
+#include <string.h>
+#include <time.h>
+#include "bcm2835.h"
+
+/*-------------------------------------------------------------------------*/
+/* Platform dependent macros and functions needed to be modified           */
+/*-------------------------------------------------------------------------*/
+
+#define CMD_PIN  RPI_GPIO_P1_19	/* SPI DI */
+#define CLK_PIN  RPI_GPIO_P1_23	/* SPI SCLK */
+#define DAT0_PIN RPI_GPIO_P1_21	/* SPI DO */
+#define DAT1_PIN RPI_GPIO_P1_22
+#define DAT2_PIN RPI_GPIO_P1_18
+#define DAT3_PIN RPI_GPIO_P1_24	/* SPI CS# */
+
+#define DAT_MASK	((1UL << DAT0_PIN) | (1UL << DAT1_PIN) | (1UL << DAT2_PIN) | (1UL << DAT3_PIN))
+
+/** See sdmm.c: give the GPIO edges some shape */
+#define NEEDS_SLOWDOWN
+#ifdef NEEDS_SLOWDOWN
+#define NOP() bcm2835_gpio_lev(CLK_PIN); bcm2835_gpio_lev(CLK_PIN); if (SlowClk) dly_clk()         /** ~40ns no-op */
+#else
+#define NOP() if (SlowClk) dly_clk()
+#endif
+
+/** Identification mode runs at 400kHz or less, see sdmm.c */
+#define SDN_ID_PAD 32
+
+#define CLK_INIT()	bcm2835_gpio_set_pud(CLK_PIN, BCM2835_GPIO_PUD_DOWN); bcm2835_gpio_fsel(CLK_PIN, BCM2835_GPIO_FSEL_OUTP); bcm2835_gpio_clr(CLK_PIN)
+#define CK_H()		bcm2835_gpio_set(CLK_PIN); NOP()	/* Set SD CLK "high" (card samples) */
+#define CK_L()		bcm2835_gpio_clr(CLK_PIN); NOP()	/* Set SD CLK "low" (card drives) */
+
+#define CMD_INIT()	bcm2835_gpio_set_pud(CMD_PIN, BCM2835_GPIO_PUD_UP); bcm2835_gpio_set(CMD_PIN); CMD_IN()
+#define CMD_OUT()	bcm2835_gpio_fsel(CMD_PIN, BCM2835_GPIO_FSEL_OUTP)
+#define CMD_IN()	bcm2835_gpio_fsel(CMD_PIN, BCM2835_GPIO_FSEL_INPT)
+#define CMD_H()		bcm2835_gpio_set(CMD_PIN)
+#define CMD_L()		bcm2835_gpio_clr(CMD_PIN)
+#define CMD			bcm2835_gpio_lev(CMD_PIN)	/* Test for SD CMD ('H':true, 'L':false) */
+
+#define DAT_LEV()	bcm2835_peri_read(bcm2835_gpio + BCM2835_GPLEV0/4)	/* DAT0-DAT3 in one read */
+#define DAT0		bcm2835_gpio_lev(DAT0_PIN)	/* Test for SD DAT0 (busy, CRC status) */
+
+/* Gather DAT3..DAT0 from a GPLEV0 value into a nibble */
+#define NIBBLE(lev)	((((lev) >> DAT0_PIN) & 1) | ((((lev) >> DAT1_PIN) & 1) << 1) | \
+					 ((((lev) >> DAT2_PIN) & 1) << 2) | ((((lev) >> DAT3_PIN) & 1) << 3))
+
+
+static
+void dly_us (UINT n)	/* Delay n microseconds */
+{
+	bcm2835_delayMicroseconds(n);
+}
+
+static
+QWORD get_us (void)		/* Monotonic time in microseconds */
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (QWORD)ts.tv_sec * 1000000 + (QWORD)(ts.tv_nsec / 1000);
+}
+
+
+
+/*--------------------------------------------------------------------------
+
+   Module Private Functions
+
+---------------------------------------------------------------------------*/
+
+/* SD command (native mode) */
+#define CMD0	(0)			/* GO_IDLE_STATE */
+#define CMD2	(2)			/* ALL_SEND_CID */
+#define CMD3	(3)			/* SEND_RELATIVE_ADDR */
+#define	ACMD6	(0x80+6)	/* SET_BUS_WIDTH (SDC) */
+#define CMD7	(7)			/* SELECT_CARD */
+#define CMD8	(8)			/* SEND_IF_COND */
+#define CMD9	(9)			/* SEND_CSD */
+#define CMD12	(12)		/* STOP_TRANSMISSION */
+#define CMD16	(16)		/* SET_BLOCKLEN */
+#define CMD17	(17)		/* READ_SINGLE_BLOCK */
+#define CMD18	(18)		/* READ_MULTIPLE_BLOCK */
+#define	ACMD23	(0x80+23)	/* SET_WR_BLK_ERASE_COUNT (SDC) */
+#define CMD24	(24)		/* WRITE_BLOCK */
+#define CMD25	(25)		/* WRITE_MULTIPLE_BLOCK */
+#define	ACMD41	(0x80+41)	/* SEND_OP_COND (SDC) */
+#define CMD55	(55)		/* APP_CMD */
+
+/* Response types */
+#define RESP_NONE	0		/* No response (CMD0) */
+#define RESP_R1		1		/* 48-bit, card status checked */
+#define RESP_R1B	2		/* R1 followed by busy on DAT0 */
+#define RESP_R2		3		/* 136-bit CID/CSD */
+#define RESP_R3		4		/* 48-bit OCR, no index or CRC */
+#define RESP_R6		5		/* 48-bit, index and CRC checked only (R6/R7) */
+
+/* Card status error bits of an R1 response */
+#define R1_ERRORS	0xFDF98008UL
+
+
+static
+DSTATUS Stat = STA_NOINIT;	/* Disk status */
+
+static
+BYTE CardType;			/* b2:SDv1, b3:SDv2, b4:Block addressing */
+
+static
+WORD Rca;				/* Relative card address (CMD3) */
+
+static
+BYTE Csd[16];			/* CSD register, read in stand-by state */
+
+static
+DWORD NibbleSet[16];	/* GPSET0 mask for each DAT3..DAT0 nibble */
+
+static
+DWORD Spread[256];		/* Data byte spread into 2 bits per data line */
+
+static
+WORD Crc16Tbl[256];		/* CRC16-CCITT byte table */
+
+static
+DISKBUSSTATS BusStats;	/* Bus counters (MMC_GET_BUSSTATS) */
+
+static
+QWORD CmdBits, DatNibbles;	/* Clocks with CMD/DAT traffic, folded into BusStats.bytes */
+
+static
+DISKBUSYWORK BusyWork;	/* Host work run while the card programs (MMC_SET_BUSYWORK) */
+
+static
+DWORD ProgUs;			/* Running average of the block programming time [us] */
+
+static
+QWORD ProgStart;		/* Time the last data block was accepted [us] */
+
+static
+BYTE SlowClk;			/* Identification clock profile is in use */
+
+static
+DISKINITSTATS InitStats;	/* Card initialization timing (MMC_GET_INITSTATS) */
+
+static
+BYTE Ocr;				/* OCR[31..24] from the last ACMD41 response */
+
+
+
+static
+void dly_clk (void)		/* Pad one clock edge to the identification rate */
+{
+	UINT n;
+
+
+	for (n = SDN_ID_PAD; n; n--) bcm2835_gpio_lev(CLK_PIN);
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Build the bit-twiddling tables                                        */
+/*-----------------------------------------------------------------------*/
+
+static
+void init_tables (void)
+{
+	UINT i, k;
+	WORD crc;
+
+
+	for (i = 0; i < 16; i++) {
+		NibbleSet[i] = ((i & 1) ? 1UL << DAT0_PIN : 0) | ((i & 2) ? 1UL << DAT1_PIN : 0)
+					 | ((i & 4) ? 1UL << DAT2_PIN : 0) | ((i & 8) ? 1UL << DAT3_PIN : 0);
+	}
+
+	for (i = 0; i < 256; i++) {
+		Spread[i] = 0;
+		for (k = 0; k < 4; k++) {	/* High nibble is sent first */
+			Spread[i] |= (DWORD)((((i >> (4 + k)) & 1) << 1) | ((i >> k) & 1)) << (k * 8);
+		}
+
+		crc = (WORD)(i << 8);
+		for (k = 0; k < 8; k++) crc = (crc & 0x8000) ? (WORD)((crc << 1) ^ 0x1021) : (WORD)(crc << 1);
+		Crc16Tbl[i] = crc;
+	}
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* CRC7 of a command or response                                         */
+/*-----------------------------------------------------------------------*/
+
+static
+BYTE crc7 (
+	const BYTE* buf,	/* Data */
+	UINT n				/* Number of bytes */
+)
+{
+	BYTE crc = 0, d, b;
+
+
+	while (n--) {
+		d = *buf++;
+		for (b = 0; b < 8; b++) {
+			crc <<= 1;
+			if ((d ^ crc) & 0x80) crc ^= 0x09;
+			d <<= 1;
+		}
+	}
+
+	return crc & 0x7F;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* CRC16 of a data block on each of the four data lines                  */
+/*-----------------------------------------------------------------------*/
+
+static
+void crc16_lines (
+	const BYTE* buff,	/* 512 byte data block */
+	WORD* crc			/* CRC of DAT0..DAT3 */
+)
+{
+	DWORD acc = 0;
+	UINT i, k;
+	BYTE d;
+
+
+	crc[0] = crc[1] = crc[2] = crc[3] = 0;
+	for (i = 0; i < 512; i++) {
+		acc = ((acc << 2) & 0xFCFCFCFCUL) | Spread[buff[i]];	/* 4 bytes give 8 bits per line */
+		if ((i & 3) == 3) {
+			for (k = 0; k < 4; k++) {
+				d = (BYTE)(acc >> (k * 8));
+				crc[k] = (WORD)((crc[k] << 8) ^ Crc16Tbl[((crc[k] >> 8) ^ d) & 0xFF]);
+			}
+		}
+	}
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Clock the bus with CMD and DAT released                               */
+/*-----------------------------------------------------------------------*/
+
+static
+void idle_clocks (
+	UINT n			/* Number of clocks */
+)
+{
+	while (n--) {
+		CK_H(); CK_L();
+	}
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Put DAT0-DAT3 in output or input mode                                 */
+/*-----------------------------------------------------------------------*/
+
+static
+void dat_dir (
+	int out			/* 1:Host drives DAT, 0:Card drives DAT */
+)
+{
+	BYTE mode = out ? BCM2835_GPIO_FSEL_OUTP : BCM2835_GPIO_FSEL_INPT;
+
+
+	if (out) bcm2835_gpio_set_multi(DAT_MASK);	/* Idle high before driving */
+	bcm2835_gpio_fsel(DAT0_PIN, mode);
+	bcm2835_gpio_fsel(DAT1_PIN, mode);
+	bcm2835_gpio_fsel(DAT2_PIN, mode);
+	bcm2835_gpio_fsel(DAT3_PIN, mode);
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Drive a nibble on DAT3..DAT0 for one clock                            */
+/*-----------------------------------------------------------------------*/
+
+static
+void xmit_nibble (
+	BYTE n
+)
+{
+	bcm2835_gpio_clr_multi(DAT_MASK & ~NibbleSet[n]);
+	bcm2835_gpio_set_multi(NibbleSet[n]);
+	NOP();
+	CK_H(); CK_L();
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Wait for the card to release DAT0 (not busy)                          */
+/*-----------------------------------------------------------------------*/
+
+static
+int wait_busy (void)	/* 1:OK, 0:Timeout */
+{
+	UINT tmr;
+
+
+	BusStats.ready_polls++;
+	for (tmr = 5000; tmr; tmr--) {	/* Wait for ready in timeout of 500ms */
+		if (DAT0) break;
+		CK_H(); CK_L();
+		dly_us(100);
+	}
+
+	return tmr ? 1 : 0;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Wait for the card to finish programming a written block               */
+/*-----------------------------------------------------------------------*/
+
+/* As sdmm.c: host work runs between polls, otherwise sleep through most
+   of the expected programming time and then poll at a fraction of it */
+
+static
+int wait_prog (void)	/* 1:OK, 0:Timeout */
+{
+	DWORD el, n;
+	int slept = 0;
+
+
+	if (DAT0) return 1;
+
+	BusStats.ready_polls++;
+	for (;;) {
+		if (BusyWork.fn && BusyWork.fn(BusyWork.arg)) {
+			BusStats.busy_slices++;
+		} else {
+			el = (DWORD)(get_us() - ProgStart);
+			if (!slept && ProgUs > el + 100) {
+				n = (ProgUs - el) * 3 / 4;
+			} else {
+				n = ProgUs / 8;
+				if (n < 10) n = 10;
+				if (n > 100) n = 100;
+			}
+			dly_us(n);
+			slept = 1;
+		}
+		CK_H(); CK_L();
+		if (DAT0) break;
+		if (get_us() - ProgStart > 500000) return 0;	/* Timeout of 500ms */
+	}
+
+	el = (DWORD)(get_us() - ProgStart);
+	ProgUs = ProgUs ? ProgUs - ProgUs / 8 + el / 8 : el;
+	BusStats.prog_us = ProgUs;
+
+	return 1;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Send a command packet and receive its response                        */
+/*-----------------------------------------------------------------------*/
+
+static
+int xmit_cmd (		/* 1:OK, 0:No response or bad response */
+	BYTE cmd,		/* Command index (not ACMD) */
+	DWORD arg,		/* Argument */
+	BYTE type,		/* Response type (RESP_*) */
+	BYTE* resp		/* Response buffer (6 or 17 bytes) */
+)
+{
+	BYTE buf[6], d, b;
+	UINT n, i;
+	DWORD st;
+
+
+	buf[0] = 0x40 | cmd;			/* Start + Transmission + Command index */
+	buf[1] = (BYTE)(arg >> 24);		/* Argument[31..24] */
+	buf[2] = (BYTE)(arg >> 16);		/* Argument[23..16] */
+	buf[3] = (BYTE)(arg >> 8);		/* Argument[15..8] */
+	buf[4] = (BYTE)arg;				/* Argument[7..0] */
+	buf[5] = (BYTE)(crc7(buf, 5) << 1) | 1;	/* CRC7 + Stop */
+
+	idle_clocks(8);					/* Ncc/Nrc: 8 clocks since the last response */
+
+	BusStats.commands++;
+	CmdBits += 48;
+	CMD_OUT();
+	for (i = 0; i < 6; i++) {
+		d = buf[i];
+		for (b = 0; b < 8; b++) {
+			if (d & 0x80) { CMD_H(); } else { CMD_L(); }
+			CK_H(); CK_L();
+			d <<= 1;
+		}
+	}
+	CMD_H();
+	CMD_IN();
+
+	if (type == RESP_NONE) return 1;
+
+	for (n = 64; n && CMD; n--) {	/* Wait for the start bit in Ncr (64 clocks) */
+		CK_H(); CK_L();
+	}
+	if (!n) return 0;
+
+	n = (type == RESP_R2) ? 17 : 6;
+	CmdBits += n * 8;
+	for (i = 0; i < n; i++) {
+		d = 0;
+		for (b = 0; b < 8; b++) {
+			d <<= 1; if (CMD) d++;
+			CK_H(); CK_L();
+		}
+		resp[i] = d;
+	}
+
+	switch (type) {
+		case RESP_R2 :
+			if ((resp[16] >> 1) != crc7(resp + 1, 15)) return 0;
+			break;
+
+		case RESP_R3 :
+			break;
+
+		default :
+			if ((resp[0] & 0x3F) != cmd || (resp[5] >> 1) != crc7(resp, 5)) return 0;
+			if (type == RESP_R1 || type == RESP_R1B) {
+				st = ((DWORD)resp[1] << 24) | ((DWORD)resp[2] << 16) | ((DWORD)resp[3] << 8) | resp[4];
+				if (st & R1_ERRORS) return 0;
+			}
+	}
+
+	if (type == RESP_R1B) return wait_busy();
+
+	return 1;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Send a command, expanding ACMD<n> into CMD55-CMD<n>                   */
+/*-----------------------------------------------------------------------*/
+
+static
+int send_cmd (		/* 1:OK, 0:Failed */
+	BYTE cmd,		/* Command byte */
+	DWORD arg,		/* Argument */
+	BYTE type,		/* Response type (RESP_*) */
+	BYTE* resp		/* Response buffer (6 or 17 bytes) */
+)
+{
+	int ok;
+
+
+	if (cmd & 0x80) {
+		cmd &= 0x7F;
+		ok = xmit_cmd(CMD55, (DWORD)Rca << 16, RESP_R1, resp);
+		SPIFAT_TRACE(send_cmd, CMD55, (DWORD)Rca << 16, ok);
+		if (!ok) return 0;
+	}
+
+	ok = xmit_cmd(cmd, arg, type, resp);
+	SPIFAT_TRACE(send_cmd, cmd, arg, ok);
+
+	return ok;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Receive a data block on DAT0-DAT3                                     */
+/*-----------------------------------------------------------------------*/
+
+static
+int rcvr_datablock (	/* 1:OK, 0:Failed */
+	BYTE *buff			/* 512 byte data buffer to store received data */
+)
+{
+	WORD crc[4], rcrc[4];
+	DWORD lev;
+	UINT tmr, i, k;
+	BYTE hi, n;
+
+
+	/* The card needs clocks to reach the data, not time. ~100ms at the
+	   bit-banged clock rate */
+	for (tmr = 100000; tmr; tmr--) {
+		if (NIBBLE(DAT_LEV()) == 0) break;	/* Start bit on all four lines */
+		CK_H(); CK_L();
+	}
+	if (!tmr) return 0;
+	CK_H(); CK_L();
+
+	DatNibbles += 1 + 1024 + 16 + 1;
+	for (i = 0; i < 512; i++) {
+		lev = DAT_LEV();
+		CK_H(); CK_L();
+		hi = (BYTE)NIBBLE(lev);
+		lev = DAT_LEV();
+		CK_H(); CK_L();
+		buff[i] = (BYTE)((hi << 4) | NIBBLE(lev));
+	}
+
+	rcrc[0] = rcrc[1] = rcrc[2] = rcrc[3] = 0;
+	for (i = 0; i < 16; i++) {			/* CRC16, one bit per line per clock */
+		lev = DAT_LEV();
+		CK_H(); CK_L();
+		n = (BYTE)NIBBLE(lev);
+		for (k = 0; k < 4; k++) rcrc[k] = (WORD)((rcrc[k] << 1) | ((n >> k) & 1));
+	}
+	n = (BYTE)NIBBLE(DAT_LEV());		/* End bit */
+	CK_H(); CK_L();
+	if (n != 0x0F) return 0;
+
+	crc16_lines(buff, crc);
+	for (k = 0; k < 4; k++) {
+		if (crc[k] != rcrc[k]) return 0;
+	}
+
+	return 1;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Compute the CRC16 nibbles that follow a data block                    */
+/*-----------------------------------------------------------------------*/
+
+static
+void stage_crc (
+	const BYTE *buff,	/* 512 byte data block */
+	BYTE *nib			/* 16 nibbles to send after the data, MSB first on each line */
+)
+{
+	WORD crc[4];
+	UINT i, n;
+
+
+	crc16_lines(buff, crc);
+	for (i = 0; i < 16; i++) {
+		nib[i] = 0;
+		for (n = 0; n < 4; n++) nib[i] |= (BYTE)(((crc[n] >> (15 - i)) & 1) << n);
+	}
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Send a data block on DAT0-DAT3                                        */
+/*-----------------------------------------------------------------------*/
+
+static
+int xmit_datablock (	/* 1:Accepted (card now busy), 0:Failed */
+	const BYTE *buff,	/* 512 byte data block to be transmitted */
+	const BYTE *nib		/* Its CRC nibbles from stage_crc() */
+)
+{
+	UINT i, n;
+	BYTE d;
+
+
+	DatNibbles += 2 + 1 + 1024 + 16 + 1;
+	dat_dir(1);
+	xmit_nibble(0x0F); xmit_nibble(0x0F);	/* Nwr */
+	xmit_nibble(0x00);						/* Start bit */
+	for (i = 0; i < 512; i++) {
+		xmit_nibble(buff[i] >> 4);
+		xmit_nibble(buff[i] & 0x0F);
+	}
+	for (i = 0; i < 16; i++) xmit_nibble(nib[i]);	/* CRC16 */
+	xmit_nibble(0x0F);						/* End bit */
+	dat_dir(0);
+
+	/* CRC status token on DAT0: start bit, 3 status bits, end bit */
+	for (n = 8; n && DAT0; n--) {
+		CK_H(); CK_L();
+	}
+	if (!n) return 0;
+	CK_H(); CK_L();
+	d = 0;
+	for (i = 0; i < 3; i++) {
+		d <<= 1; if (DAT0) d++;
+		CK_H(); CK_L();
+	}
+	CK_H(); CK_L();							/* End bit */
+	if (d != 0x02) return 0;				/* 010: Data accepted */
+	ProgStart = get_us();
+
+	return 1;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Poll ACMD41 until the card leaves idle state                          */
+/*-----------------------------------------------------------------------*/
+
+static
+int poll_idle (		/* 1:Card left idle state */
+	BYTE cmd,		/* ACMD41 */
+	DWORD arg		/* Argument: voltage window and HCS */
+)
+{
+	BYTE resp[17];
+
+
+	if (!send_cmd(cmd, arg, RESP_R3, resp)) return 0;
+	Ocr = resp[1];
+
+	return (Ocr & 0x80) != 0;	/* Power up status (busy) bit */
+}
+
+
+
+/*--------------------------------------------------------------------------
+
+   Public Functions
+
+---------------------------------------------------------------------------*/
+
+
+/*-----------------------------------------------------------------------*/
+/* Get Disk Status                                                       */
+/*-----------------------------------------------------------------------*/
+
+DSTATUS sdn_disk_status (
+	BYTE drv			/* Drive number (always 0) */
+)
+{
+	if (drv) return STA_NOINIT;
+
+	return Stat;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Initialize Disk Drive                                                 */
+/*-----------------------------------------------------------------------*/
+
+DSTATUS sdn_disk_initialize (
+	BYTE drv		/* Physical drive nmuber (0) */
+)
+{
+	BYTE ty, ocr, resp[17];
+	DWORD hcs;
+	QWORD t0;
+	DSTATUS s;
+
+
+	if (drv) return STA_NOINIT;
+
+	t0 = get_us();
+	InitStats.inits++;
+	InitStats.polls = 0;
+	InitStats.ready_us = 0;
+
+	init_tables();
+
+	dly_us(1000);			/* 1ms after the supply is up */
+	SlowClk = 1;			/* Identification clock until the card has an RCA */
+	CLK_INIT();				/* Initialize port pin tied to CLK */
+	CMD_INIT();				/* Initialize port pin tied to CMD */
+	bcm2835_gpio_set_pud(DAT0_PIN, BCM2835_GPIO_PUD_UP);	/* DAT3 must be high at CMD0 or the card goes to SPI mode */
+	bcm2835_gpio_set_pud(DAT1_PIN, BCM2835_GPIO_PUD_UP);
+	bcm2835_gpio_set_pud(DAT2_PIN, BCM2835_GPIO_PUD_UP);
+	bcm2835_gpio_set_pud(DAT3_PIN, BCM2835_GPIO_PUD_UP);
+	dat_dir(0);
+
+	idle_clocks(80);		/* Apply 80 dummy clocks and the card gets ready to receive command */
+
+	ty = 0; Rca = 0;
+	send_cmd(CMD0, 0, RESP_NONE, resp);		/* Enter Idle state */
+
+	hcs = 0;
+	if (send_cmd(CMD8, 0x1AA, RESP_R6, resp)) {	/* SDv2? */
+		if (resp[3] != 0x01 || resp[4] != 0xAA) goto done;	/* Can't work at vdd range of 2.7-3.6V */
+		hcs = 1UL << 30;
+	}
+
+	if (!sd_wait_idle_exit(poll_idle, ACMD41, 0x00FF8000UL | hcs, dly_us, t0, &InitStats)) goto done;	/* Wait for leaving idle state (ACMD41) */
+	ocr = Ocr;								/* OCR[31..24], CCS in bit 6 */
+
+	if (!send_cmd(CMD2, 0, RESP_R2, resp)) goto done;	/* Identification */
+	if (!send_cmd(CMD3, 0, RESP_R6, resp)) goto done;	/* Get RCA, enter stand-by */
+	Rca = (WORD)((resp[1] << 8) | resp[2]);
+	SlowClk = 0;							/* Data transfer mode: full speed from here on */
+	if (!send_cmd(CMD9, (DWORD)Rca << 16, RESP_R2, resp)) goto done;	/* CSD is only readable in stand-by */
+	memcpy(Csd, resp + 1, 16);
+	if (!send_cmd(CMD7, (DWORD)Rca << 16, RESP_R1B, resp)) goto done;	/* Select, enter transfer state */
+	if (!send_cmd(ACMD6, 2, RESP_R1, resp)) goto done;	/* 4-bit bus */
+
+	if (!(hcs && (ocr & 0x40))		/* Byte addressed cards: set R/W block length to 512 */
+		&& !send_cmd(CMD16, 512, RESP_R1, resp)) goto done;
+
+	ty = hcs ? ((ocr & 0x40) ? CT_SDC2 | CT_BLOCK : CT_SDC2) : CT_SDC1;
+
+done:
+	SlowClk = 0;
+	CardType = ty;
+	s = ty ? 0 : STA_NOINIT;
+	Stat = s;
+
+	InitStats.last_us = (DWORD)(get_us() - t0);
+	if (!ty) InitStats.failures++;
+
+	return s;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Read Sector(s)                                                        */
+/*-----------------------------------------------------------------------*/
+
+DRESULT sdn_disk_read (
+	BYTE drv,			/* Physical drive nmuber (0) */
+	BYTE *buff,			/* Pointer to the data buffer to store read data */
+	LBA_t sector,		/* Start sector number (LBA) */
+	UINT count			/* Sector count (1..128) */
+)
+{
+	BYTE resp[6];
+	DWORD sect = (DWORD)sector;
+
+
+	if (sdn_disk_status(drv) & STA_NOINIT) return RES_NOTRDY;
+	if (!(CardType & CT_BLOCK)) sect *= 512;	/* Convert LBA to byte address if needed */
+
+	BusStats.ops++;
+	if (count == 1) {	/* Single block read */
+		if (send_cmd(CMD17, sect, RESP_R1, resp)	/* READ_SINGLE_BLOCK */
+			&& rcvr_datablock(buff))
+			count = 0;
+	}
+	else {				/* Multiple block read */
+		if (send_cmd(CMD18, sect, RESP_R1, resp)) {	/* READ_MULTIPLE_BLOCK */
+			do {
+				if (!rcvr_datablock(buff)) break;
+				buff += 512;
+			} while (--count);
+			if (!send_cmd(CMD12, 0, RESP_R1B, resp))	/* STOP_TRANSMISSION */
+				count = 1;
+		}
+	}
+
+	return count ? RES_ERROR : RES_OK;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Write Sector(s)                                                       */
+/*-----------------------------------------------------------------------*/
+
+DRESULT sdn_disk_write (
+	BYTE drv,			/* Physical drive nmuber (0) */
+	const BYTE *buff,	/* Pointer to the data to be written */
+	LBA_t sector,		/* Start sector number (LBA) */
+	UINT count			/* Sector count (1..128) */
+)
+{
+	BYTE resp[6], nib[16];
+	DWORD sect = (DWORD)sector;
+
+
+	if (sdn_disk_status(drv) & STA_NOINIT) return RES_NOTRDY;
+	if (!(CardType & CT_BLOCK)) sect *= 512;	/* Convert LBA to byte address if needed */
+
+	BusStats.ops++;
+	stage_crc(buff, nib);
+	if (count == 1) {	/* Single block write */
+		if (send_cmd(CMD24, sect, RESP_R1, resp)	/* WRITE_BLOCK */
+			&& xmit_datablock(buff, nib) && wait_prog())
+			count = 0;
+	}
+	else {				/* Multiple block write */
+		send_cmd(ACMD23, count, RESP_R1, resp);	/* Pre-erase hint, failure is harmless */
+		if (send_cmd(CMD25, sect, RESP_R1, resp)) {	/* WRITE_MULTIPLE_BLOCK */
+			do {
+				if (!xmit_datablock(buff, nib)) break;
+				if (count > 1) stage_crc(buff + 512, nib);	/* Next block's CRC while this one programs */
+				if (!wait_prog()) break;
+				buff += 512;
+			} while (--count);
+			if (!send_cmd(CMD12, 0, RESP_R1B, resp))	/* STOP_TRANSMISSION */
+				count = 1;
+		}
+	}
+
+	return count ? RES_ERROR : RES_OK;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Read/write several sector ranges                                      */
+/*-----------------------------------------------------------------------*/
+
+/* There is no chip select to hold on the SD bus so these simply run the
+   ranges back to back */
+
+DRESULT sdn_disk_readv (
+	BYTE drv,			/* Physical drive nmuber (0) */
+	const DISKSEG* segs,	/* Sector ranges, executed in the given order */
+	UINT nsegs			/* Number of ranges */
+)
+{
+	DRESULT res = RES_OK;
+
+
+	for (; nsegs && res == RES_OK; nsegs--, segs++) {
+		res = sdn_disk_read(drv, segs->buff, segs->sector, segs->count);
+	}
+
+	return res;
+}
+
+
+DRESULT sdn_disk_writev (
+	BYTE drv,			/* Physical drive nmuber (0) */
+	const DISKSEG* segs,	/* Sector ranges, executed in the given order */
+	UINT nsegs			/* Number of ranges */
+)
+{
+	DRESULT res = RES_OK;
+
+
+	for (; nsegs && res == RES_OK; nsegs--, segs++) {
+		res = sdn_disk_write(drv, segs->buff, segs->sector, segs->count);
+	}
+
+	return res;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Miscellaneous Functions                                               */
+/*-----------------------------------------------------------------------*/
+
+DRESULT sdn_disk_ioctl (
+	BYTE drv,		/* Physical drive nmuber (0) */
+	BYTE ctrl,		/* Control code */
+	void *buff		/* Buffer to send/receive control data */
+)
+{
+	DRESULT res;
+	BYTE n, resp[6];
+	DWORD cs;
+
+
+	switch (ctrl) {			/* Host side counters, no card access */
+		case MMC_GET_BUSSTATS :	/* Copy bus counters (DISKBUSSTATS) */
+			BusStats.bytes = (CmdBits + DatNibbles * 4) / 8;
+			*(DISKBUSSTATS*)buff = BusStats;
+			return RES_OK;
+
+		case MMC_RESET_BUSSTATS :	/* Zero bus counters */
+			memset(&BusStats, 0, sizeof BusStats);
+			BusStats.prog_us = ProgUs;
+			CmdBits = DatNibbles = 0;
+			return RES_OK;
+
+		case MMC_GET_INITSTATS :	/* Copy card initialization timing (DISKINITSTATS) */
+			*(DISKINITSTATS*)buff = InitStats;
+			return RES_OK;
+
+		case MMC_SET_BUSYWORK :	/* Register (or clear with NULL) work to run while the card is busy */
+			if (buff) {
+				BusyWork = *(const DISKBUSYWORK*)buff;
+			} else {
+				memset(&BusyWork, 0, sizeof BusyWork);
+			}
+			return RES_OK;
+
+		case MMC_RESYNC :		/* Abort any transfer and resynchronise the bus */
+			dat_dir(0);
+			CMD_IN();
+			idle_clocks(80);
+			xmit_cmd(CMD12, 0, RESP_R1, resp);	/* Stop a stuck transfer, harmless otherwise */
+			return wait_busy() ? RES_OK : RES_ERROR;
+	}
+
+	if (sdn_disk_status(drv) & STA_NOINIT) return RES_NOTRDY;	/* Check if card is in the socket */
+
+	res = RES_ERROR;
+	switch (ctrl) {
+		case CTRL_SYNC :		/* Make sure that no pending write process */
+			if (wait_busy()) res = RES_OK;
+			break;
+
+		case GET_SECTOR_COUNT :	/* Get number of sectors on the disk (LBA_t) */
+			if ((Csd[0] >> 6) == 1) {	/* SDC ver 2.00 */
+				cs = Csd[9] + ((WORD)Csd[8] << 8) + ((DWORD)(Csd[7] & 63) << 16) + 1;
+				*(LBA_t*)buff = cs << 10;
+			} else {					/* SDC ver 1.XX */
+				n = (Csd[5] & 15) + ((Csd[10] & 128) >> 7) + ((Csd[9] & 3) << 1) + 2;
+				cs = (Csd[8] >> 6) + ((WORD)Csd[7] << 2) + ((WORD)(Csd[6] & 3) << 10) + 1;
+				*(LBA_t*)buff = cs << (n - 9);
+			}
+			res = RES_OK;
+			break;
+
+		case GET_BLOCK_SIZE :	/* Get erase block size in unit of sector (DWORD) */
+			*(DWORD*)buff = 128;
+			res = RES_OK;
+			break;
+
+		default:
+			res = RES_PARERR;
+	}
+
+	return res;
+}
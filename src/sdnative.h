@@ -0,0 +1,27 @@
+/*-----------------------------------------------------------------------
+/  SD (native 4-bit bus mode) transport entry points
+/-----------------------------------------------------------------------*/
+
+#ifndef _SDNATIVE_DEFINED
+#define _SDNATIVE_DEFINED
+
+#include "diskio.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Bit-banged 4-bit SD bus transport. Selected with disk_set_transport() */
+DSTATUS sdn_disk_initialize (BYTE pdrv);
+DSTATUS sdn_disk_status (BYTE pdrv);
+DRESULT sdn_disk_read (BYTE pdrv, BYTE* buff, LBA_t sector, UINT count);
+DRESULT sdn_disk_write (BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count);
+DRESULT sdn_disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
+DRESULT sdn_disk_readv (BYTE pdrv, const DISKSEG* segs, UINT nsegs);
+DRESULT sdn_disk_writev (BYTE pdrv, const DISKSEG* segs, UINT nsegs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,1138 @@
+/*------------------------------------------------------------------------/
+/  MMCv3/SDv1/SDv2 (in SPI mode) control module over Linux spidev
+/-------------------------------------------------------------------------/
+/
+/  Copyright (C) 2019, ChaN, all right reserved.
+/  Copyright (C) 2021, Alligator Descartes <https://hermitretro.com>, all right reserved.
+/
+/ * This software is a free software and there is NO WARRANTY.
+/ * No restriction on use. You can use, modify and redistribute it for
+/   personal, non-profit or commercial products UNDER YOUR RESPONSIBILITY.
+/ * Redistributions of source code must retain the above copyright notice.
+/
+/-------------------------------------------------------------------------/
+  The SPI mode protocol of sdmm.c, with the bytes clocked by the kernel's
+  SPI controller driver (DMA where it has it) through /dev/spidevX.Y
+  rather than bit-banged on GPIO. It needs neither root nor a Broadcom SoC.
+
+  Every exchange with the driver is a system call, so bytes are not
+  moved one at a time. Outgoing bytes are queued as spi_ioc_transfer
+  segments and only sent, in one SPI_IOC_MESSAGE, when a response is
+  needed: a command goes out with its response, a data block with its
+  data response and the first busy bytes. Receives clock ahead of what
+  was asked for (a multiple block read asks for all of its blocks) and
+  keep the surplus for the next receive, which is harmless in SPI mode as
+  the card only ever sees 0xFF. A message is limited to the driver's
+  bufsiz (/sys/module/spidev/parameters/bufsiz, 4096 by default).
+
+  Chip select stays asserted between messages (cs_change on the last
+  segment) until deselect().
+/-------------------------------------------------------------------------*/
+
+
+#include "ff.h"		/* Obtains integer types for FatFs */
+#include "diskio.h"	/* Common include file for FatFs and disk I/O layer */
+#include "sdspidev.h"	/* Transport entry points used by diskio.c */
+#include "sdinit.h"	/* Initialization shared with the other SD transports */
+#include "spifat-trace.h"	/* USDT tracepoints */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+
+/*-------------------------------------------------------------------------*/
+/* Platform dependent settings                                             */
+/*-------------------------------------------------------------------------*/
+
+#define SPD_DEVICE		"/dev/spidev0.0"	/* Default device, see spd_set_device() */
+#define SPD_FAST_HZ		20000000	/* Clock after initialization (the controller rounds it down) */
+#define SPD_SLOW_HZ		400000		/* Identification clock */
+#define SPD_MAX_BUF		65536		/* Largest message used, whatever bufsiz allows */
+#define SPD_MAX_XFERS	8			/* Segments queued for one message */
+#define SPD_POLL		8			/* Bytes clocked at once when polling */
+#define SPD_TOKEN_WIN	16			/* Bytes clocked per block for the read latency (Nac) */
+
+/* Same as sdmm.c: keep CS# asserted between operations */
+#define SDMM_HOLD_CS 1
+
+
+static
+void dly_us (UINT n)	/* Delay n microseconds */
+{
+	struct timespec ts = { 0, (long)n * 1000 };
+
+	nanosleep(&ts, 0);
+}
+
+static
+QWORD get_us (void)		/* Monotonic time in microseconds */
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (QWORD)ts.tv_sec * 1000000 + (QWORD)(ts.tv_nsec / 1000);
+}
+
+static
+int sys_ioctl (int fd, unsigned long req, void* arg)
+{
+	return ioctl(fd, req, arg);
+}
+
+
+
+/*--------------------------------------------------------------------------
+
+   Module Private Functions
+
+---------------------------------------------------------------------------*/
+
+/* MMC/SD command (SPI mode) */
+#define CMD0	(0)			/* GO_IDLE_STATE */
+#define CMD1	(1)			/* SEND_OP_COND */
+#define	ACMD41	(0x80+41)	/* SEND_OP_COND (SDC) */
+#define CMD8	(8)			/* SEND_IF_COND */
+#define CMD9	(9)			/* SEND_CSD */
+#define CMD12	(12)		/* STOP_TRANSMISSION */
+#define CMD16	(16)		/* SET_BLOCKLEN */
+#define CMD17	(17)		/* READ_SINGLE_BLOCK */
+#define CMD18	(18)		/* READ_MULTIPLE_BLOCK */
+#define	ACMD23	(0x80+23)	/* SET_WR_BLK_ERASE_COUNT (SDC) */
+#define CMD24	(24)		/* WRITE_BLOCK */
+#define CMD25	(25)		/* WRITE_MULTIPLE_BLOCK */
+#define CMD32	(32)		/* ERASE_ER_BLK_START */
+#define CMD33	(33)		/* ERASE_ER_BLK_END */
+#define CMD38	(38)		/* ERASE */
+#define CMD55	(55)		/* APP_CMD */
+#define CMD58	(58)		/* READ_OCR */
+#define ACMD13	(0x80+13)	/* SD_STATUS (SDC) */
+#define ACMD51	(0x80+51)	/* SEND_SCR (SDC) */
+
+
+static
+DSTATUS Stat = STA_NOINIT;	/* Disk status */
+
+static
+BYTE CardType;			/* b0:MMC, b1:SDv1, b2:SDv2, b3:Block addressing */
+
+static
+BYTE EraseZero;			/* 1:Erased blocks read as zeros (SCR DATA_STAT_AFTER_ERASE = 0) */
+
+static
+DWORD EraseAu;			/* Allocation unit in sectors (SD status AU_SIZE), 0:Unknown */
+
+static
+DWORD EraseMs;			/* Erase timeout per allocation unit in ms (SD status ERASE_TIMEOUT/ERASE_OFFSET) */
+
+static
+BYTE Selected;			/* CS# is asserted */
+
+static
+BYTE Ready;				/* Card is known to be idle (not busy programming) */
+
+static
+BYTE SlowClk;			/* Identification clock is in use */
+
+static
+DISKBUSSTATS BusStats;	/* Bus framing counters (MMC_GET_BUSSTATS) */
+
+static
+DISKBUSYWORK BusyWork;	/* Host work run while the card programs (MMC_SET_BUSYWORK) */
+
+static
+DWORD ProgUs;			/* Running average of the block programming time [us] */
+
+static
+QWORD ProgStart;		/* Time the last data block was accepted [us] */
+
+static
+DISKINITSTATS InitStats;	/* Card initialisation timing (MMC_GET_INITSTATS) */
+
+static
+const char* DevPath = SPD_DEVICE;	/* spidev device node */
+
+static
+int Fd = -1;			/* Open spidev device */
+
+static
+int (*SpiIoctl)(int fd, unsigned long req, void* arg) = sys_ioctl;
+
+static
+UINT BufSize = 4096;	/* Most bytes in one message (spidev bufsiz) */
+
+static
+struct spi_ioc_transfer Xfer[SPD_MAX_XFERS];	/* Segments of the next message */
+
+static
+UINT NXfer, QBytes;		/* Segments and bytes queued */
+
+static
+BYTE TxQ[64];			/* Copies of short outgoing packets (commands, tokens) */
+
+static
+UINT TxQLen;
+
+static
+BYTE Ones[SPD_MAX_BUF];	/* 0xFF sent while receiving */
+
+static
+BYTE Ahead[SPD_MAX_BUF];	/* Received bytes not consumed yet */
+
+static
+UINT AheadPos, AheadLen;
+
+static
+UINT Prefetch = SPD_POLL;	/* Bytes to clock when a receive finds nothing left over */
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Send the queued segments and receive n bytes as one message           */
+/*-----------------------------------------------------------------------*/
+
+static
+void xchg_msg (
+	BYTE* rx,		/* Receive buffer, 0xFF is sent meanwhile */
+	UINT n,			/* Number of bytes to receive (0: just send) */
+	int keep		/* 1: CS# stays asserted after the message */
+)
+{
+	struct spi_ioc_transfer* t;
+	UINT i;
+
+
+	if (n) {
+		t = &Xfer[NXfer++];
+		memset(t, 0, sizeof *t);
+		t->tx_buf = (uintptr_t)Ones;
+		t->rx_buf = (uintptr_t)rx;
+		t->len = n;
+		QBytes += n;
+	}
+	if (!NXfer) return;
+
+	for (i = 0; i < NXfer; i++) {
+		Xfer[i].speed_hz = SlowClk ? SPD_SLOW_HZ : SPD_FAST_HZ;
+		Xfer[i].bits_per_word = 8;
+		Xfer[i].cs_change = 0;
+	}
+	Xfer[NXfer - 1].cs_change = keep;	/* On the last segment: leave CS# asserted */
+
+	BusStats.bytes += QBytes;
+	if (Fd < 0 || SpiIoctl(Fd, SPI_IOC_MESSAGE(NXfer), Xfer) < 0) {
+		if (n) memset(rx, 0xFF, n);	/* Reads as a bus with no card on it */
+	}
+	NXfer = 0; QBytes = 0; TxQLen = 0;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Queue bytes to the card                                               */
+/*-----------------------------------------------------------------------*/
+
+static
+void xmit_spi (
+	const BYTE* buff,	/* Data to be sent, must stay valid until the next receive */
+	UINT bc				/* Number of bytes to send */
+)
+{
+	struct spi_ioc_transfer* t;
+
+
+	AheadPos = AheadLen = 0;		/* Anything the card sent before this is stale */
+	if (NXfer + 1 >= SPD_MAX_XFERS || QBytes + bc + SPD_POLL > BufSize
+		|| (bc <= sizeof TxQ && bc > sizeof TxQ - TxQLen)) {	/* Message or packet copies full */
+		xchg_msg(0, 0, 1);
+	}
+	if (bc <= sizeof TxQ - TxQLen) {	/* Short packets may be on the caller's stack */
+		memcpy(TxQ + TxQLen, buff, bc);
+		buff = TxQ + TxQLen;
+		TxQLen += bc;
+		t = NXfer ? &Xfer[NXfer - 1] : 0;
+		if (t && !t->rx_buf && t->tx_buf + t->len == (uintptr_t)buff) {	/* Follows on from the last packet */
+			t->len += bc;
+			QBytes += bc;
+			return;
+		}
+	}
+	t = &Xfer[NXfer++];
+	memset(t, 0, sizeof *t);
+	t->tx_buf = (uintptr_t)buff;
+	t->len = bc;
+	QBytes += bc;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Receive bytes from the card                                           */
+/*-----------------------------------------------------------------------*/
+
+static
+void rcvr_spi (
+	BYTE *buff,	/* Pointer to read buffer */
+	UINT bc		/* Number of bytes to receive */
+)
+{
+	UINT n;
+
+
+	while (bc) {
+		if (AheadPos == AheadLen) {	/* Nothing left over: clock at least bc bytes */
+			n = bc > Prefetch ? bc : Prefetch;
+			if (n > BufSize - QBytes) n = BufSize - QBytes;
+			xchg_msg(Ahead, n, 1);
+			AheadPos = 0; AheadLen = n;
+		}
+		n = AheadLen - AheadPos;
+		if (n > bc) n = bc;
+		memcpy(buff, Ahead + AheadPos, n);
+		AheadPos += n; buff += n; bc -= n;
+	}
+}
+
+static
+int ahead_empty (void)	/* 1: the next receive is a new message */
+{
+	return AheadPos == AheadLen;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Wait for card ready                                                   */
+/*-----------------------------------------------------------------------*/
+
+static
+int wait_ready (void)	/* 1:OK, 0:Timeout */
+{
+	BYTE d;
+	QWORD t0 = 0;
+	UINT polls = 0, ahead = Prefetch;
+
+
+	BusStats.ready_polls++;
+	Prefetch = SPD_POLL;	/* Not the read-ahead of a command about to be sent */
+	for (;;) {
+		rcvr_spi(&d, 1);
+		polls++;
+		if (d == 0xFF) break;
+		if (ahead_empty()) {
+			if (!t0) t0 = get_us();
+			if (get_us() - t0 > 500000) break;	/* Timeout of 500ms */
+			dly_us(100);
+		}
+	}
+	Prefetch = ahead;
+	Ready = (d == 0xFF);
+	SPIFAT_TRACE(wait_ready, Ready, polls);
+
+	return Ready;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Wait for the card to finish an erase                                  */
+/*-----------------------------------------------------------------------*/
+
+static
+int wait_erase (	/* 1:OK, 0:Timeout */
+	DWORD ms		/* Timeout in ms */
+)
+{
+	BYTE d;
+	QWORD t0 = get_us();
+	UINT ahead = Prefetch;
+
+
+	BusStats.ready_polls++;
+	Prefetch = SPD_POLL;
+	for (;;) {
+		rcvr_spi(&d, 1);
+		if (d == 0xFF) break;
+		if (ahead_empty()) {
+			if (get_us() - t0 > (QWORD)ms * 1000) break;
+			dly_us(1000);
+		}
+	}
+	Prefetch = ahead;
+	Ready = (d == 0xFF);
+
+	return Ready;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Wait for the card to finish programming a written block               */
+/*-----------------------------------------------------------------------*/
+
+/* As sdmm.c: runs the registered host work or sleeps through most of the
+   expected programming time rather than polling straight away */
+
+static
+int wait_prog (void)	/* 1:OK, 0:Timeout */
+{
+	BYTE d;
+	DWORD el, n;
+	int slept = 0;
+
+
+	do {		/* Busy bytes clocked with the data response */
+		rcvr_spi(&d, 1);
+	} while (d != 0xFF && !ahead_empty());
+	if (d == 0xFF) {
+		Ready = 1;
+		return 1;
+	}
+
+	BusStats.ready_polls++;
+	for (;;) {
+		if (BusyWork.fn && BusyWork.fn(BusyWork.arg)) {
+			BusStats.busy_slices++;
+		} else {
+			el = (DWORD)(get_us() - ProgStart);
+			if (!slept && ProgUs > el + 100) {
+				n = (ProgUs - el) * 3 / 4;
+			} else {
+				n = ProgUs / 8;
+				if (n < 10) n = 10;
+				if (n > 100) n = 100;
+			}
+			dly_us(n);
+			slept = 1;
+		}
+		do {
+			rcvr_spi(&d, 1);
+		} while (d != 0xFF && !ahead_empty());
+		if (d == 0xFF) break;
+		if (get_us() - ProgStart > 500000) {	/* Timeout of 500ms */
+			Ready = 0;
+			return 0;
+		}
+	}
+
+	el = (DWORD)(get_us() - ProgStart);
+	ProgUs = ProgUs ? ProgUs - ProgUs / 8 + el / 8 : el;
+	BusStats.prog_us = ProgUs;
+	Ready = 1;
+
+	return 1;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Deselect the card and release SPI bus                                 */
+/*-----------------------------------------------------------------------*/
+
+static
+void deselect (void)
+{
+	BYTE d;
+
+	BusStats.deselects++;
+	xchg_msg(&d, 1, 0);		/* Flush anything queued and let CS# go high after it */
+	Selected = 0;
+	AheadPos = AheadLen = 0;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* End of a public operation                                             */
+/*-----------------------------------------------------------------------*/
+
+static
+void release (
+	int ok			/* 0: the operation failed, resynchronise the card */
+)
+{
+	Prefetch = SPD_POLL;
+	if (!ok) Ready = 0;		/* Unknown card state, poll before the next command */
+	if (!ok || !SDMM_HOLD_CS) deselect();
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Select the card and wait for ready                                    */
+/*-----------------------------------------------------------------------*/
+
+static
+int selectSD (void)	/* 1:OK, 0:Timeout */
+{
+	if (Selected) {		/* Still selected from the previous command */
+		if (Ready) {	/* Idle: one byte satisfies the command gap (Nrc), sent with the command */
+			BusStats.ready_skipped++;
+			xmit_spi(Ones, 1);
+			return 1;
+		}
+		if (wait_ready()) return 1;
+	} else {
+		BusStats.selects++;
+		Selected = 1;		/* CS# goes low with the next message */
+		xmit_spi(Ones, 1);	/* Dummy clock (force DO enabled) */
+		if (wait_ready()) return 1;	/* Wait for card ready */
+	}
+
+	deselect();
+	return 0;			/* Failed */
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Receive a data packet from the card                                   */
+/*-----------------------------------------------------------------------*/
+
+static
+int rcvr_datablock (	/* 1:OK, 0:Failed */
+	BYTE *buff,			/* Data buffer to store received data */
+	UINT btr			/* Byte count */
+)
+{
+	BYTE d[2];
+	QWORD t0 = 0;
+
+
+	for (;;) {		/* Wait for data packet in timeout of 100ms */
+		rcvr_spi(d, 1);
+		if (d[0] != 0xFF) break;
+		if (ahead_empty()) {
+			if (!t0) t0 = get_us();
+			if (get_us() - t0 > 100000) break;
+			dly_us(100);
+		}
+	}
+	if (d[0] != 0xFE) return 0;		/* If not valid data token, return with error */
+
+	rcvr_spi(buff, btr);			/* Receive the data block into buffer */
+	rcvr_spi(d, 2);					/* Discard CRC */
+
+	return 1;						/* Return with success */
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Send a data packet to the card                                        */
+/*-----------------------------------------------------------------------*/
+
+static
+int xmit_datablock (	/* 1:OK, 0:Failed */
+	const BYTE *buff,	/* 512 byte data block to be transmitted */
+	BYTE token			/* Data/Stop token */
+)
+{
+	BYTE d[3];
+
+
+	if (!wait_prog()) return 0;	/* Previous block, if any, programmed */
+
+	d[0] = token;
+	xmit_spi(d, 1);				/* Queue a token */
+	Ready = 0;					/* The card goes busy after the block or stop token */
+	if (token != 0xFD) {		/* Is it data token? */
+		xmit_spi(buff, 512);	/* Queue the 512 byte data block */
+		rcvr_spi(d, 3);			/* Send it all with a dummy CRC (0xFF,0xFF), receive data response */
+		if ((d[2] & 0x1F) != 0x05)	/* If not accepted, return with error */
+			return 0;
+		ProgStart = get_us();
+	} else {
+		xmit_spi(Ones, 1);		/* The card goes busy a byte after a stop token (Nbr) */
+	}
+
+	return 1;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Transmit a command packet and receive its response (card selected)    */
+/*-----------------------------------------------------------------------*/
+
+static
+BYTE xmit_cmd (		/* Returns command response (bit7==1:Send failed)*/
+	BYTE cmd,		/* Command byte (not ACMD) */
+	DWORD arg		/* Argument */
+)
+{
+	BYTE n, d, buf[6];
+
+
+	/* Queue a command packet */
+	buf[0] = 0x40 | cmd;			/* Start + Command index */
+	buf[1] = (BYTE)(arg >> 24);		/* Argument[31..24] */
+	buf[2] = (BYTE)(arg >> 16);		/* Argument[23..16] */
+	buf[3] = (BYTE)(arg >> 8);		/* Argument[15..8] */
+	buf[4] = (BYTE)arg;				/* Argument[7..0] */
+	n = 0x01;						/* Dummy CRC + Stop */
+	if (cmd == CMD0) n = 0x95;		/* (valid CRC for CMD0(0)) */
+	if (cmd == CMD8) n = 0x87;		/* (valid CRC for CMD8(0x1AA)) */
+	buf[5] = n;
+	BusStats.commands++;
+	xmit_spi(buf, 6);
+
+	/* Receive command response, sending the packet with it */
+	if (cmd == CMD12) rcvr_spi(&d, 1);	/* Skip a stuff byte when stop reading */
+	n = 10;								/* Wait for a valid response in timeout of 10 attempts */
+	do
+		rcvr_spi(&d, 1);
+	while ((d & 0x80) && --n);
+
+	/* R1b commands and failed commands leave the card in an unknown state */
+	Ready = (cmd != CMD12 && cmd != CMD38 && cmd != CMD0 && !(d & 0x80));
+
+	return d;			/* Return with the response value */
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Send a command packet to the card                                     */
+/*-----------------------------------------------------------------------*/
+
+static
+BYTE send_cmd (		/* Returns command response (bit7==1:Send failed)*/
+	BYTE cmd,		/* Command byte */
+	DWORD arg		/* Argument */
+)
+{
+	BYTE n;
+
+
+	if (cmd & 0x80) {	/* ACMD<n> is the command sequense of CMD55-CMD<n> */
+		cmd &= 0x7F;
+		n = send_cmd(CMD55, 0);
+		if (n > 1) return n;
+	}
+
+	if (cmd != CMD12) {
+		if (!selectSD()) {
+			SPIFAT_TRACE(send_cmd, cmd, arg, 0xFF);
+			return 0xFF;
+		}
+	}
+
+	n = xmit_cmd(cmd, arg);
+	SPIFAT_TRACE(send_cmd, cmd, arg, n);
+
+	return n;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Poll an initialization command until the card leaves idle state       */
+/*-----------------------------------------------------------------------*/
+
+static
+int poll_idle (		/* 1:Card left idle state */
+	BYTE cmd,		/* ACMD41 or CMD1 */
+	DWORD arg		/* Argument */
+)
+{
+	return send_cmd(cmd, arg) == 0;
+}
+
+
+static
+int wait_idle_exit (	/* 1:Ready, 0:Timeout */
+	BYTE cmd,		/* ACMD41 or CMD1 */
+	DWORD arg,		/* Argument */
+	QWORD t0		/* Start of initialization [us] */
+)
+{
+	if (!sd_wait_idle_exit(poll_idle, cmd, arg, dly_us, t0, &InitStats)) return 0;
+	SlowClk = 0;		/* Full speed from here on */
+
+	return 1;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Open and configure the device                                         */
+/*-----------------------------------------------------------------------*/
+
+static
+int open_dev (void)	/* 1:OK, 0:Failed */
+{
+	BYTE mode = SPI_MODE_0, bits = 8;
+	uint32_t speed = SPD_FAST_HZ;
+	unsigned long sz;
+	FILE* fp;
+
+
+	if (Fd < 0) {
+		Fd = open(DevPath, O_RDWR);
+		if (Fd < 0) return 0;
+	}
+	if (SpiIoctl(Fd, SPI_IOC_WR_MODE, &mode) < 0
+		|| SpiIoctl(Fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0
+		|| SpiIoctl(Fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0) {
+		return 0;
+	}
+
+	BufSize = 4096;
+	fp = fopen("/sys/module/spidev/parameters/bufsiz", "r");
+	if (fp) {
+		if (fscanf(fp, "%lu", &sz) == 1 && sz >= 1024) BufSize = sz < SPD_MAX_BUF ? (UINT)sz : SPD_MAX_BUF;
+		fclose(fp);
+	}
+	memset(Ones, 0xFF, sizeof Ones);
+
+	return 1;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Read allocation unit and erase timeout from the SD status             */
+/*-----------------------------------------------------------------------*/
+
+static
+void read_sd_status (void)
+{
+	static const DWORD au_sectors[16] = {0, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 24576, 32768, 49152, 65536, 131072};
+	BYTE sds[64];
+	WORD es;
+
+
+	EraseAu = 0; EraseMs = 1000;	/* Unknown: assume a second per erase unit */
+	if (send_cmd(ACMD13, 0) == 0) {
+		rcvr_spi(sds, 1);				/* Second byte of the R2 response */
+		if (rcvr_datablock(sds, 64)) {
+			EraseAu = au_sectors[sds[10] >> 4];
+			es = (WORD)sds[11] << 8 | sds[12];
+			if (es) {				/* ERASE_TIMEOUT seconds covers ERASE_SIZE AUs, plus ERASE_OFFSET seconds per erase */
+				EraseMs = ((DWORD)(sds[13] >> 2) * 1000 + es - 1) / es + (sds[13] & 3) * 1000;
+				if (EraseMs < 250) EraseMs = 250;
+			}
+		}
+	}
+}
+
+
+
+/*--------------------------------------------------------------------------
+
+   Public Functions
+
+---------------------------------------------------------------------------*/
+
+
+/*-----------------------------------------------------------------------*/
+/* Choose the spidev device                                              */
+/*-----------------------------------------------------------------------*/
+
+int spd_set_device (	/* 0:OK */
+	const char* path	/* e.g. "/dev/spidev0.0" */
+)
+{
+	if (Fd >= 0) close(Fd);
+	Fd = -1;
+	DevPath = path;
+	Stat = STA_NOINIT;
+	CardType = 0;			/* Another card: no early exit on its first initialization */
+
+	return 0;
+}
+
+
+
+void spd_set_ioctl (
+	int (*fn)(int fd, unsigned long req, void* arg)	/* NULL: ioctl() */
+)
+{
+	SpiIoctl = fn ? fn : sys_ioctl;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Get Disk Status                                                       */
+/*-----------------------------------------------------------------------*/
+
+DSTATUS spd_disk_status (
+	BYTE drv			/* Drive number (always 0) */
+)
+{
+	if (drv) return STA_NOINIT;
+
+	return Stat;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Initialize Disk Drive                                                 */
+/*-----------------------------------------------------------------------*/
+
+DSTATUS spd_disk_initialize (
+	BYTE drv		/* Physical drive nmuber (0) */
+)
+{
+	BYTE ty, cmd, buf[8], mode;
+	QWORD t0;
+	DSTATUS s;
+
+
+	if (drv) return RES_NOTRDY;
+
+	t0 = get_us();
+	InitStats.inits++;
+	InitStats.polls = 0;
+	InitStats.ready_us = 0;
+
+	NXfer = 0; QBytes = 0; TxQLen = 0;
+	AheadPos = AheadLen = 0;
+	Prefetch = SPD_POLL;
+	Selected = 0; Ready = 0;
+	if (!open_dev()) {
+		Stat = STA_NOINIT;
+		InitStats.failures++;
+		return Stat;
+	}
+
+	dly_us(1000);			/* 1ms after the supply is up */
+	SlowClk = 1;			/* Identification clock until the card leaves idle state */
+
+	/* 80 dummy clocks with CS# high: the controller can only clock with
+	   CS# asserted, so make asserted mean high for one message */
+	mode = SPI_MODE_0 | SPI_CS_HIGH;
+	SpiIoctl(Fd, SPI_IOC_WR_MODE, &mode);
+	xchg_msg(Ahead, 10, 0);
+	mode = SPI_MODE_0;
+	SpiIoctl(Fd, SPI_IOC_WR_MODE, &mode);
+
+	ty = 0;
+	if (CardType && send_cmd(CMD58, 0) == 0) {	/* Re-initialization and the card is still out of idle state? */
+		rcvr_spi(buf, 4);
+		if ((buf[0] & 0x80)								/* Powered up */
+			&& !(buf[0] & 0x40) == !(CardType & CT_BLOCK)	/* and addressed as before */
+			&& ((CardType & CT_BLOCK) || send_cmd(CMD16, 512) == 0)) {	/* Byte addressed: block length 512 again */
+			ty = CardType;
+			InitStats.early_exits++;
+		}
+	}
+	if (!ty && send_cmd(CMD0, 0) == 1) {	/* Enter Idle state */
+		if (send_cmd(CMD8, 0x1AA) == 1) {	/* SDv2? */
+			rcvr_spi(buf, 4);							/* Get trailing return value of R7 resp */
+			if (buf[2] == 0x01 && buf[3] == 0xAA) {		/* The card can work at vdd range of 2.7-3.6V */
+				if (wait_idle_exit(ACMD41, 1UL << 30, t0)	/* Wait for leaving idle state (ACMD41 with HCS bit) */
+					&& send_cmd(CMD58, 0) == 0) {		/* Check CCS bit in the OCR */
+					rcvr_spi(buf, 4);
+					ty = (buf[0] & 0x40) ? CT_SDC2 | CT_BLOCK : CT_SDC2;	/* SDv2+ */
+				}
+			}
+		} else {							/* SDv1 or MMCv3 */
+			if (send_cmd(ACMD41, 0) <= 1) 	{
+				ty = CT_SDC2; cmd = ACMD41;	/* SDv1 */
+			} else {
+				ty = CT_MMC3; cmd = CMD1;	/* MMCv3 */
+			}
+			if (!wait_idle_exit(cmd, 0, t0)	/* Wait for leaving idle state */
+				|| send_cmd(CMD16, 512) != 0)	/* Set R/W block length to 512 */
+				ty = 0;
+		}
+	}
+	SlowClk = 0;
+	CardType = ty;
+	EraseZero = 0;
+	if ((ty & CT_SDC) && send_cmd(ACMD51, 0) == 0 && rcvr_datablock(buf, 8)) {	/* Read SCR */
+		EraseZero = (buf[1] & 0x80) ? 0 : 1;	/* DATA_STAT_AFTER_ERASE (SCR bit 55) */
+	}
+	if (ty & CT_SDC) read_sd_status();
+	s = ty ? 0 : STA_NOINIT;
+	Stat = s;
+
+	release(ty != 0);
+
+	InitStats.last_us = (DWORD)(get_us() - t0);
+	if (!ty) InitStats.failures++;
+
+	return s;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Read Sector(s)                                                        */
+/*-----------------------------------------------------------------------*/
+
+/* Clocks every block of the read, and the latency ahead of each, along
+   with the command: typically one message per bufsiz of data */
+
+static
+int read_blocks (		/* 1:OK, 0:Failed */
+	BYTE *buff,			/* Pointer to the data buffer to store read data */
+	DWORD sect,			/* Start sector (card address) */
+	UINT count			/* Sector count */
+)
+{
+	BYTE cmd;
+
+
+	cmd = count > 1 ? CMD18 : CMD17;			/*  READ_MULTIPLE_BLOCK : READ_SINGLE_BLOCK */
+	Prefetch = 8 + count * (SPD_TOKEN_WIN + 514);
+	if (send_cmd(cmd, sect) == 0) {
+		do {
+			Prefetch = count * (SPD_TOKEN_WIN + 514);
+			if (!rcvr_datablock(buff, 512)) break;
+			buff += 512;
+		} while (--count);
+		Prefetch = SPD_POLL;
+		if (cmd == CMD18) send_cmd(CMD12, 0);	/* STOP_TRANSMISSION */
+	}
+	Prefetch = SPD_POLL;
+
+	return !count;
+}
+
+DRESULT spd_disk_read (
+	BYTE drv,			/* Physical drive nmuber (0) */
+	BYTE *buff,			/* Pointer to the data buffer to store read data */
+	LBA_t sector,		/* Start sector number (LBA) */
+	UINT count			/* Sector count (1..128) */
+)
+{
+	DWORD sect = (DWORD)sector;
+	int ok;
+
+
+	if (spd_disk_status(drv) & STA_NOINIT) return RES_NOTRDY;
+	if (!(CardType & CT_BLOCK)) sect *= 512;	/* Convert LBA to byte address if needed */
+
+	BusStats.ops++;
+	ok = read_blocks(buff, sect, count);
+	release(ok);
+
+	return ok ? RES_OK : RES_ERROR;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Write Sector(s)                                                       */
+/*-----------------------------------------------------------------------*/
+
+static
+int write_blocks (		/* 1:OK, 0:Failed */
+	const BYTE *buff,	/* Pointer to the data to be written */
+	DWORD sect,			/* Start sector (card address) */
+	UINT count,			/* Sector count */
+	int hint			/* 1: send the pre-erase count (ACMD23) */
+)
+{
+	if (count == 1) {	/* Single block write */
+		if ((send_cmd(CMD24, sect) == 0)	/* WRITE_BLOCK */
+			&& xmit_datablock(buff, 0xFE))
+			count = 0;
+	}
+	else {				/* Multiple block write */
+		if (hint && (CardType & CT_SDC)) send_cmd(ACMD23, count);
+		if (send_cmd(CMD25, sect) == 0) {	/* WRITE_MULTIPLE_BLOCK */
+			do {
+				if (!xmit_datablock(buff, 0xFC)) break;
+				buff += 512;
+			} while (--count);
+			if (!xmit_datablock(0, 0xFD))	/* STOP_TRAN token */
+				count = 1;
+		}
+	}
+
+	return !count;
+}
+
+DRESULT spd_disk_write (
+	BYTE drv,			/* Physical drive nmuber (0) */
+	const BYTE *buff,	/* Pointer to the data to be written */
+	LBA_t sector,		/* Start sector number (LBA) */
+	UINT count			/* Sector count (1..128) */
+)
+{
+	DWORD sect = (DWORD)sector;
+	int ok;
+
+
+	if (spd_disk_status(drv) & STA_NOINIT) return RES_NOTRDY;
+	if (!(CardType & CT_BLOCK)) sect *= 512;	/* Convert LBA to byte address if needed */
+
+	BusStats.ops++;
+	ok = write_blocks(buff, sect, count, 1);
+	release(ok);
+
+	return ok ? RES_OK : RES_ERROR;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Read several sector ranges in one chip-select session                 */
+/*-----------------------------------------------------------------------*/
+
+DRESULT spd_disk_readv (
+	BYTE drv,			/* Physical drive nmuber (0) */
+	const DISKSEG* segs,	/* Sector ranges, executed in the given order */
+	UINT nsegs			/* Number of ranges */
+)
+{
+	DWORD sect;
+
+
+	if (spd_disk_status(drv) & STA_NOINIT) return RES_NOTRDY;
+
+	BusStats.ops++;
+	for (; nsegs; nsegs--, segs++) {
+		sect = (DWORD)segs->sector;
+		if (!(CardType & CT_BLOCK)) sect *= 512;
+		if (!read_blocks(segs->buff, sect, segs->count)) break;
+	}
+	release(!nsegs);
+
+	return nsegs ? RES_ERROR : RES_OK;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Write several sector ranges in one chip-select session                */
+/*-----------------------------------------------------------------------*/
+
+DRESULT spd_disk_writev (
+	BYTE drv,			/* Physical drive nmuber (0) */
+	const DISKSEG* segs,	/* Sector ranges, executed in the given order */
+	UINT nsegs			/* Number of ranges */
+)
+{
+	DWORD sect;
+
+
+	if (spd_disk_status(drv) & STA_NOINIT) return RES_NOTRDY;
+
+	BusStats.ops++;
+	for (; nsegs; nsegs--, segs++) {
+		sect = (DWORD)segs->sector;
+		if (!(CardType & CT_BLOCK)) sect *= 512;
+		if (!write_blocks(segs->buff, sect, segs->count, 0)) break;
+	}
+	release(!nsegs);
+
+	return nsegs ? RES_ERROR : RES_OK;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Miscellaneous Functions                                               */
+/*-----------------------------------------------------------------------*/
+
+DRESULT spd_disk_ioctl (
+	BYTE drv,		/* Physical drive nmuber (0) */
+	BYTE ctrl,		/* Control code */
+	void *buff		/* Buffer to send/receive control data */
+)
+{
+	DRESULT res;
+	BYTE n, csd[16];
+	DWORD cs;
+	LBA_t st, ed, en;
+
+
+	switch (ctrl) {			/* Host side counters, no card access */
+		case MMC_GET_BUSSTATS :	/* Copy bus framing counters (DISKBUSSTATS) */
+			*(DISKBUSSTATS*)buff = BusStats;
+			return RES_OK;
+
+		case MMC_RESET_BUSSTATS :	/* Zero bus framing counters */
+			memset(&BusStats, 0, sizeof BusStats);
+			BusStats.prog_us = ProgUs;
+			return RES_OK;
+
+		case MMC_GET_INITSTATS :	/* Copy card initialization timing (DISKINITSTATS) */
+			*(DISKINITSTATS*)buff = InitStats;
+			return RES_OK;
+
+		case MMC_SET_BUSYWORK :	/* Register (or clear with NULL) work to run while the card is busy */
+			if (buff) {
+				BusyWork = *(const DISKBUSYWORK*)buff;
+			} else {
+				memset(&BusyWork, 0, sizeof BusyWork);
+			}
+			return RES_OK;
+
+		case MMC_RESYNC :		/* Abort any transfer and resynchronise the bus */
+			deselect();
+			if (!selectSD()) return RES_ERROR;
+			xmit_cmd(CMD12, 0);	/* Stop a stuck multiple block read, harmless otherwise */
+			res = wait_ready() ? RES_OK : RES_ERROR;
+			release(0);
+			return res;
+	}
+
+	if (spd_disk_status(drv) & STA_NOINIT) return RES_NOTRDY;	/* Check if card is in the socket */
+
+	res = RES_ERROR;
+	switch (ctrl) {
+		case CTRL_SYNC :		/* Make sure that no pending write process */
+			if (selectSD()) res = RES_OK;
+			break;
+
+		case GET_SECTOR_COUNT :	/* Get number of sectors on the disk (DWORD) */
+			if ((send_cmd(CMD9, 0) == 0) && rcvr_datablock(csd, 16)) {
+				if ((csd[0] >> 6) == 1) {	/* SDC ver 2.00 */
+					cs = csd[9] + ((WORD)csd[8] << 8) + ((DWORD)(csd[7] & 63) << 16) + 1;
+					*(LBA_t*)buff = cs << 10;
+				} else {					/* SDC ver 1.XX or MMC */
+					n = (csd[5] & 15) + ((csd[10] & 128) >> 7) + ((csd[9] & 3) << 1) + 2;
+					cs = (csd[8] >> 6) + ((WORD)csd[7] << 2) + ((WORD)(csd[6] & 3) << 10) + 1;
+					*(LBA_t*)buff = cs << (n - 9);
+				}
+				res = RES_OK;
+			}
+			break;
+
+		case GET_BLOCK_SIZE :	/* Get erase block size in unit of sector (DWORD) */
+			*(DWORD*)buff = 128;
+			res = RES_OK;
+			break;
+
+		case MMC_ZERO_RANGE :	/* Erase a sector range that then reads as zeros (LBA_t[2]) */
+			if (!EraseZero) {
+				res = RES_PARERR;
+				break;
+			}
+			st = ((LBA_t*)buff)[0]; ed = ((LBA_t*)buff)[1];
+			cs = EraseAu ? EraseAu : 8192;	/* One allocation unit per erase, 4MB if unknown */
+			res = RES_OK;
+			while (res == RES_OK && st <= ed) {
+				en = (st / cs + 1) * cs - 1;
+				if (en > ed) en = ed;
+				if (send_cmd(CMD32, (CardType & CT_BLOCK) ? st : st * 512) != 0	/* Convert LBA to byte address if needed */
+					|| send_cmd(CMD33, (CardType & CT_BLOCK) ? en : en * 512) != 0
+					|| send_cmd(CMD38, 0) != 0) {
+					res = RES_ERROR;
+				} else if (!wait_erase(EraseMs)) {
+					res = RES_NOTRDY;		/* Still busy after the card's own erase timeout */
+				}
+				st = en + 1;
+			}
+			break;
+
+		default:
+			res = RES_PARERR;
+	}
+
+	release(res != RES_ERROR);
+
+	return res;
+}
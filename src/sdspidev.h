@@ -0,0 +1,33 @@
+/*-----------------------------------------------------------------------
+/  MMC/SDC (in SPI mode) over Linux spidev transport entry points
+/-----------------------------------------------------------------------*/
+
+#ifndef _SDSPIDEV_DEFINED
+#define _SDSPIDEV_DEFINED
+
+#include "diskio.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The kernel's SPI controller driver through /dev/spidevX.Y. Selected
+   with disk_set_spidev() */
+int spd_set_device (const char* path);
+DSTATUS spd_disk_initialize (BYTE pdrv);
+DSTATUS spd_disk_status (BYTE pdrv);
+DRESULT spd_disk_read (BYTE pdrv, BYTE* buff, LBA_t sector, UINT count);
+DRESULT spd_disk_write (BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count);
+DRESULT spd_disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
+DRESULT spd_disk_readv (BYTE pdrv, const DISKSEG* segs, UINT nsegs);
+DRESULT spd_disk_writev (BYTE pdrv, const DISKSEG* segs, UINT nsegs);
+
+/* Replaces ioctl() on the device, e.g. with a card model for testing.
+   NULL restores the real one */
+void spd_set_ioctl (int (*fn)(int fd, unsigned long req, void* arg));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -38,8 +38,15 @@
 #include <stddef.h>
 #include <assert.h>
 
-#include "bcm2835.h"
-#include "ff.h"
+#include "spifat.h"
+#include "spifat-trace.h"
+
+/** FUSE over io_uring arrived in libfuse 3.18 */
+#ifdef FUSE_MAKE_VERSION
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 18)
+#define HAVE_FUSE_URING 1
+#endif
+#endif
 
 /*
  * Command line options
@@ -50,6 +57,17 @@
  */
 static struct options {
 	const char *filename;
+	const char *hashdb;
+	const char *image;
+	const char *spidev;
+	const char *alloc;
+	unsigned int cache_kb;
+	unsigned int proc_limit_ms;
+	unsigned int delalloc_kb;
+	int native;
+	int readonly;
+	int no_uring;
+	int no_splice;
 	int show_help;
 } options;
 
@@ -57,19 +75,27 @@ static struct options {
     { t, offsetof(struct options, p), 1 }
 static const struct fuse_opt option_spec[] = {
 	OPTION("--name=%s", filename),
+	OPTION("--cache=%u", cache_kb),
+	OPTION("--hashdb=%s", hashdb),
+	OPTION("--native", native),
+	OPTION("--image=%s", image),
+	OPTION("--spidev=%s", spidev),
+	OPTION("--proc-limit=%u", proc_limit_ms),
+	OPTION("--alloc=%s", alloc),
+	OPTION("--delalloc=%u", delalloc_kb),
+	OPTION("--readonly", readonly),
+	OPTION("--no-io-uring", no_uring),
+	OPTION("--no-splice", no_splice),
 	OPTION("-h", show_help),
 	OPTION("--help", show_help),
 	FUSE_OPT_END
 };
 
-/** Persistent filesystem handle */
-static FATFS *fatfs = NULL;
-
-#define LAZY_MOUNT \
-    int lmrv = _lazy_mount(); \
-    if ( lmrv != 0 ) { \
-        return lmrv; \
-    }
+/**
+ * The filesystem itself lives in libspifat (spifat.c). This file only
+ * translates between FUSE and the library: hidden file names, struct stat
+ * and directory offsets.
+ */
 
 /**
  * Rename files starting with '.' into starting with '_', e.g., macOS
@@ -99,279 +125,215 @@ int renameHidden( const char *inpath, char *outpath, size_t outpathsz ) {
     return 1;
 }
 
+/**
+ * Charges what the library does for this callback to the process that
+ * made the request. FUSE gives the calling thread's id, the library maps
+ * it to its process.
+ */
+static inline void accountCaller( void ) {
 
-static int FRESULT_TO_OSCODE( int res ) {
-    switch ( res ) {
-        case FR_OK: {
-            return 0;
-        }
-        case FR_DISK_ERR: {
-            return -EINTR;
-        }
-        case FR_INT_ERR: {
-            return -ENOMEM;
-        }
-        case FR_NOT_READY: {
-            return -EINTR;
-        }
-        case FR_NO_FILE: {
-            return -ENOENT;
-        }
-        case FR_NO_PATH: {
-            return -ENOENT;
-        }
-        case FR_INVALID_NAME: {
-            return -ENOENT;
-        }
-        case FR_DENIED: {
-            return -EACCES;
-        }
-        case FR_EXIST: {
-            return -EACCES;
-        }
-        case FR_INVALID_OBJECT: {
-            return -ENOENT;
-        }
-        case FR_WRITE_PROTECTED: {
-            return -EACCES;
-        }
-        case FR_INVALID_DRIVE: {
-            return -EACCES;
-        }
-        case FR_NOT_ENABLED: {
-            return -ENOSPC;
-        }
-        case FR_NO_FILESYSTEM: {
-            return -ENODEV;
-        }
-        case FR_MKFS_ABORTED: {
-            return -ENODEV;
-        }
-        case FR_TIMEOUT: {
-            return -EACCES;
-        }
-        case FR_LOCKED: {
-            return -EACCES;
-        }
-        case FR_NOT_ENOUGH_CORE: {
-            return -ENAMETOOLONG;
-        }
-        case FR_TOO_MANY_OPEN_FILES: {
-            return -ENFILE;
-        }
-        default: {
-            return -ENOENT;
-        }
-    }
-
-    return ENOENT;
-}
-
-/** Timestamp conversion */
-unsigned long unixTimestampToFATTimestamp( struct tm *unixTime ) {
-
-    unsigned long fatTimestamp =
-        ( ((unixTime->tm_year - 80) << 25) | 
-          ((unixTime->tm_mon + 1) << 21) |
-          (unixTime->tm_mday << 16) |
-          (unixTime->tm_hour << 11) |
-          (unixTime->tm_min << 5) |
-          unixTime->tm_sec >> 1
-        );
+    struct fuse_context *ctx = fuse_get_context();
 
-    return fatTimestamp;
+    spifat_account_begin( ctx->pid, ctx->uid );
 }
 
-void FATTimestampToDateTime( unsigned long fatTimestamp, unsigned short *fdate, unsigned short *ftime ) {
+/**
+ * Fires the fuse_return probe on the way out of a callback. Every
+ * callback fires fuse_entry with the same op name on the way in and
+ * calls accountCaller().
+ */
+static inline int traceReturn( const char *op, const char *path, int rv ) {
 
-    if ( fdate == NULL || ftime == NULL ) {
-        return;
-    }
+    spifat_account_end();
+    SPIFAT_TRACE( fuse_return, op, path, rv );
 
-    *fdate = (fatTimestamp & 0xffff0000) >> 16;
-    *ftime = fatTimestamp & 0x0000ffff;
+    return rv;
 }
 
-void FATTimestampToUNIX( unsigned long fatTimestamp, struct tm *unixTimestamp ) {
+/**
+ * The kernel only offers FUSE over io_uring when the fuse module was
+ * loaded with enable_uring=1 (Linux 6.14 onwards)
+ *
+ * Returns: 0 = unavailable, 1 = available
+ */
+static int uringAvailable( void ) {
 
-    if ( unixTimestamp == NULL ) {
-        return;
+#ifdef HAVE_FUSE_URING
+    char buf[4] = { 0 };
+    FILE *fp = fopen( "/sys/module/fuse/parameters/enable_uring", "r" );
+    if ( fp == NULL ) {
+        return 0;
     }
-
-    unixTimestamp->tm_year = ((fatTimestamp & 0xfe000000) >> 25) + 80;
-    unixTimestamp->tm_mon = ((fatTimestamp & 0x1e00000) >> 21) - 1;
-    unixTimestamp->tm_mday = (fatTimestamp & 0x1f0000) >> 16;
-    unixTimestamp->tm_hour = (fatTimestamp & 0xf800) >> 11;
-    unixTimestamp->tm_min = (fatTimestamp & 0x7e0) >> 5;
-    unixTimestamp->tm_sec = (fatTimestamp & 0x1f) >> 1;  
-}
-
-/** Populates the passed in struct */
-void FATDateTimeToUNIX( WORD fdate, WORD ftime, struct tm *unixTimestamp ) {
-   
-    if ( unixTimestamp == NULL ) {
-        return;
+    if ( fgets( buf, sizeof( buf ), fp ) == NULL ) {
+        buf[0] = '\0';
     }
+    fclose( fp );
 
-    unsigned long fatTimestamp = ((unsigned long)fdate << 16) | ftime;
-    return FATTimestampToUNIX( fatTimestamp, unixTimestamp );
-}
-
-/** Returns the current time as a FAT timestamp */
-static unsigned long nowAsFATTimestamp() {
-
-    time_t lnow = time( NULL );
-    struct tm *ltime = localtime( &lnow );
-    return unixTimestampToFATTimestamp( ltime );
+    return buf[0] == 'Y' || buf[0] == '1';
+#else
+    return 0;
+#endif
 }
 
 static void *spi_fat_fuse_init(struct fuse_conn_info *conn,
 			struct fuse_config *cfg)
 {
-	(void) conn;
 	cfg->auto_cache = 1;
     cfg->attr_timeout = 3600;
 
-    bcm2835_init();
+    SPIFAT_CONFIG config;
+    int rv;
 
-    fatfs = NULL;
+    config.cache_kb = options.cache_kb;
+    config.hashdb = options.hashdb;
+    config.native = options.native;
+    config.image = options.image;
+    config.spidev = options.spidev;
+    config.readonly = options.readonly;
+    config.proc_limit_ms = options.proc_limit_ms;
+    config.alloc_next = options.alloc != NULL && strcmp( options.alloc, "next" ) == 0;
+    config.delalloc_kb = options.delalloc_kb;
 
-	return NULL;
-}
-
-static int _lazy_mount() {
+    /**
+     * Nothing changes underneath a read-only mount, so the kernel can keep
+     * pages, names and misses for as long as it likes
+     */
+    if ( options.readonly ) {
+        cfg->auto_cache = 0;
+        cfg->kernel_cache = 1;
+        cfg->entry_timeout = 3600;
+        cfg->negative_timeout = 3600;
+    }
 
-//    printf( "_lazy_mount: in: fatfs: %X\n", fatfs ); 
+    rv = spifat_init( &config );
+    if ( rv != 0 ) {
+        if ( options.image != NULL ) {
+            fprintf( stderr, "failed to open image %s: %s\n", options.image, strerror( -rv ) );
+        } else if ( options.spidev != NULL ) {
+            fprintf( stderr, "failed to open %s: %s\n", options.spidev, strerror( -rv ) );
+        } else {
+            fprintf( stderr, "failed to initialise GPIO: /dev/gpiomem or /dev/mem can't be mapped\n" );
+        }
+    }
 
-    /** Lazy filesystem mount */
-    if ( fatfs == NULL ) {
+    /** Write payloads stay in a pipe until spi_fat_fuse_write_buf() places them */
+    if ( !options.no_splice && (conn->capable & FUSE_CAP_SPLICE_READ) ) {
+        conn->want |= FUSE_CAP_SPLICE_READ;
+    }
 
-//        printf( "volume unmounted.... mounting...\n" );
+#ifdef FUSE_CAP_OVER_IO_URING
+    printf( "request transport: %s\n",
+            (conn->want & FUSE_CAP_OVER_IO_URING) ? "io_uring" : "/dev/fuse" );
+#endif
 
-        fatfs = malloc( sizeof( FATFS ) );
-        if ( fatfs == NULL ) {
-//            printf( "_lazy_mount: failed to mount\n" );
-            return FRESULT_TO_OSCODE( FR_DISK_ERR );
-        }
-        memset( fatfs, 0, sizeof( FATFS ) );
+	return NULL;
+}
 
-        FRESULT res = f_mount( fatfs, "", 0 );
-        if ( res != FR_OK ) {
-//            printf( "f_mount failed: %d\n", res );
-        fatfs = NULL;
-            return FRESULT_TO_OSCODE( res );
-        }
-    } else {
-//      printf( "_lazy_mount: already mounted\n" );
-    }
+static void spi_fat_fuse_destroy( void *private_data ) {
 
-//    printf( "_lazy_mount: out: fatfs: %X\n", fatfs );
+    (void) private_data;
 
-    return FRESULT_TO_OSCODE( FR_OK );
+    spifat_shutdown();
 }
 
 static int spi_fat_fuse_getattr( const char *path, struct stat *stbuf,
 			         struct fuse_file_info *fi ) {
 
+    SPIFAT_TRACE( fuse_entry, "getattr", path );
+    accountCaller();
     (void) fi;
-    FRESULT res;
-    FILINFO finfo;
+    SPIFAT_STAT st;
+    int rv;
 
     memset(stbuf, 0, sizeof(struct stat));
 
     printf( "getattr: %s\n", path );
 
-    LAZY_MOUNT
-
-    if ( strcmp( path, "/" ) == 0 ) {
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = 2;
-        return 0;
-    }
-
     /** Demangle the path for hidden files */
     char lpath[255];
     renameHidden( path, lpath, 255 ); 
 
-    /**
-     * Retry loop. Depending on the access rate to the underlying card
-     * the f_stat() call can transiently fail
-     */
-    int ntries = 0;
-    int maxtries = 1;
-fstat_retry:
-    res = f_stat( lpath, &finfo );
-    if ( res != FR_OK ) {
-        printf( "f_stat failed: %d\n", res );
-        if ( ntries >= maxtries ) {
-            return FRESULT_TO_OSCODE( res );
-        } else {
-            ntries++;
-            bcm2835_delay( 50 );
-            goto fstat_retry;
-        }
+    rv = spifat_stat( lpath, &st );
+    if ( rv != 0 ) {
+        printf( "spifat_stat failed: %d\n", rv );
+        return traceReturn( "getattr", path, rv );
     }
 
-    if ( (finfo.fattrib & AM_DIR) == AM_DIR ) {
+    if ( st.isdir ) {
         stbuf->st_mode = S_IFDIR | 0755;
         stbuf->st_nlink = 2;
     } else {
-        stbuf->st_size = finfo.fsize;
+        stbuf->st_size = st.size;
         stbuf->st_mode = S_IFREG | 0644;
         stbuf->st_nlink = 1;
     }
 
-	return 0;
+	return traceReturn( "getattr", path, 0 );
 }
 
-static int spi_fat_fuse_setxattr( const char *arg1, const char *arg2, const char *arg3, size_t arg4, int arg5 ) {
-    printf( "setxattr\n" );
+static int spi_fat_fuse_setxattr( const char *path, const char *name, const char *value, size_t size, int flags ) {
 
-    LAZY_MOUNT
+    SPIFAT_TRACE( fuse_entry, "setxattr", path );
+    accountCaller();
+    char lpath[255];
 
-    return 0;
+    printf( "setxattr: %s %s\n", path, name );
+
+    renameHidden( path, lpath, 255 );
+
+    return traceReturn( "setxattr", path, spifat_setxattr( lpath, name, value, size ) );
 }
 
-static int spi_fat_fuse_mkdir( const char *path, mode_t mode ) {
+static int spi_fat_fuse_getxattr( const char *path, const char *name, char *value, size_t size ) {
 
-    LAZY_MOUNT
+    SPIFAT_TRACE( fuse_entry, "getxattr", path );
+    accountCaller();
+    char lpath[255];
 
-    FRESULT res = f_mkdir( path );
+    renameHidden( path, lpath, 255 );
 
-    return FRESULT_TO_OSCODE( res );
+    return traceReturn( "getxattr", path, spifat_getxattr( lpath, name, value, size ) );
 }
 
-static int spi_fat_fuse_rmdir( const char *path ) {
+static int spi_fat_fuse_listxattr( const char *path, char *list, size_t size ) {
 
-    LAZY_MOUNT
+    SPIFAT_TRACE( fuse_entry, "listxattr", path );
+    accountCaller();
+    char lpath[255];
 
-    FRESULT res = f_rmdir( path );
+    renameHidden( path, lpath, 255 );
 
-    return FRESULT_TO_OSCODE( res );
+    return traceReturn( "listxattr", path, spifat_listxattr( lpath, list, size ) );
 }
 
-static int spi_fat_fuse_opendir( const char *path, struct fuse_file_info *fi ) {
+static int spi_fat_fuse_mkdir( const char *path, mode_t mode ) {
 
-    FRESULT res;
-    DIR *dir;
-    int rv = 0;
+    SPIFAT_TRACE( fuse_entry, "mkdir", path );
+    accountCaller();
+    return traceReturn( "mkdir", path, spifat_mkdir( path ) );
+}
 
-    LAZY_MOUNT
-    
-    dir = malloc( sizeof( DIR ) );
-    memset( dir, 0, sizeof( DIR ) );
+static int spi_fat_fuse_rmdir( const char *path ) {
 
-    res = f_opendir( dir, path );
-    if ( res != FR_OK ) {
-        fprintf( stderr, "f_opendir failed: %d\n", res );
-        fi->fh = 0;
-    } else {
-        fi->fh = (uint64_t)dir;
-    }
+    SPIFAT_TRACE( fuse_entry, "rmdir", path );
+    accountCaller();
+    return traceReturn( "rmdir", path, spifat_rmdir( path ) );
+}
 
-    rv = FRESULT_TO_OSCODE( res );
+static int spi_fat_fuse_opendir( const char *path, struct fuse_file_info *fi ) {
 
-    return rv;
+    SPIFAT_TRACE( fuse_entry, "opendir", path );
+    accountCaller();
+    SPIFAT_DIR *dir;
+    int rv;
+
+    rv = spifat_opendir( path, &dir );
+    if ( rv != 0 ) {
+        fprintf( stderr, "spifat_opendir failed: %d\n", rv );
+    }
+    fi->fh = (uint64_t)dir;
+
+    return traceReturn( "opendir", path, rv );
 }
 
 static int spi_fat_fuse_readdir( const char *path, void *buf, 
@@ -379,27 +341,22 @@ static int spi_fat_fuse_readdir( const char *path, void *buf,
 			                     off_t offset, struct fuse_file_info *fi,
 			                     enum fuse_readdir_flags flags )
 {
-    FRESULT res;
-    FRESULT rv = FR_OK;
-
-    DIR *dir = NULL;
+    SPIFAT_TRACE( fuse_entry, "readdir", path );
+    accountCaller();
+    SPIFAT_DIR *dir = NULL;
+    SPIFAT_DIRENT ent;
+    int rv;
 
     int hasRDP = ((flags & FUSE_READDIR_PLUS) == FUSE_READDIR_PLUS);
 
-    int i;
-
     printf( "readdir: offset: %lld, readdirplus: %d\n", offset, hasRDP );
 
-    LAZY_MOUNT
-
-    dir = (DIR *)fi->fh; 
+    dir = (SPIFAT_DIR *)fi->fh; 
     if ( dir == NULL ) {
-        return -ENOENT;
+        return traceReturn( "readdir", path, -ENOENT );
     }
 
     unsigned int nfileinfo = offset;
-    FILINFO finfo;
-    memset( &finfo, 0, sizeof( FILINFO ) );
 
     struct stat st;
     memset( &st, 0, sizeof( st ) );
@@ -420,51 +377,31 @@ static int spi_fat_fuse_readdir( const char *path, void *buf,
         }
     }
 
-    res = f_readdir( dir, &finfo );
-    if ( res != FR_OK ) {
-        fprintf( stderr, "f_readdir failed: %d\n", res );
-        if ( res == FR_DISK_ERR ) {
-            /** SD card has probably been ejected */
-            printf( "card has probably been ejected. invalidate filesystem for remounting\n" );
-            if ( fatfs != NULL ) {
-                free( fatfs );
-                fatfs = NULL;
-            }
-        }
-            
-        rv = res;
-        goto readdir_cleanup;
-    }
-
-    while ( res == FR_OK && finfo.fname[0] ) {
+    /** A card that fails here has been invalidated for remounting by libspifat */
+    while ( (rv = spifat_readdir( dir, &ent )) == 1 ) {
         memset( &st, 0, sizeof( st ) );
 
-        /** Timestamp */
-        struct tm unixTimestamp;
-        FATDateTimeToUNIX( finfo.fdate, finfo.ftime, &unixTimestamp );
-        time_t ltime = mktime( &unixTimestamp );
-
-        if ( (finfo.fattrib & AM_DIR) == AM_DIR ) {
+        if ( ent.st.isdir ) {
             st.st_mode = S_IFDIR | 0755;
             st.st_nlink = 2;
             st.st_size = 0;
         } else {
-            st.st_size = finfo.fsize;
+            st.st_size = ent.st.size;
             st.st_mode = S_IFREG | 0644;
             st.st_nlink = 1;
 
             /** Compute blocks used for 'ls -l' total */
-            st.st_blocks = (finfo.fsize / 512);
-            if ( (finfo.fsize % 512) != 0 ) {
+            st.st_blocks = (ent.st.size / 512);
+            if ( (ent.st.size % 512) != 0 ) {
                 st.st_blocks++;
             }
             st.st_blksize = 512;
 
             /** Times */
-            if ( ltime != -1 ) {
-            	st.st_atim.tv_sec = ltime;
-            	st.st_mtim.tv_sec = ltime;
-            	st.st_ctim.tv_sec = ltime;
+            if ( ent.st.mtime != -1 ) {
+            	st.st_atim.tv_sec = ent.st.mtime;
+            	st.st_mtim.tv_sec = ent.st.mtime;
+            	st.st_ctim.tv_sec = ent.st.mtime;
             }
         }
 
@@ -473,167 +410,193 @@ static int spi_fat_fuse_readdir( const char *path, void *buf,
          * the fly to start with '.' to behave as per a UNIX hidden file.
          * These are demangled in open() and getattr()
          */
-        if ( finfo.fname[0] == '_' ) {
-            finfo.fname[0] = '.';
+        if ( ent.name[0] == '_' ) {
+            ent.name[0] = '.';
         }
 
-        if ( filler( buf, finfo.fname, &st, nfileinfo, FUSE_FILL_DIR_PLUS ) ) {
+        if ( filler( buf, ent.name, &st, nfileinfo, FUSE_FILL_DIR_PLUS ) ) {
             /** We need to rewind the readdir call here... */
-            int lrv = f_seekdir( dir, -1 );
-            if ( lrv != FR_OK ) {
+            int lrv = spifat_unreaddir( dir );
+            if ( lrv != 0 ) {
                 printf( "seekdir failed: %d\n", lrv );
             }
-            goto readdir_cleanup;
+            return traceReturn( "readdir", path, 0 );
         }
 
         nfileinfo++;
+    }
 
-        res = f_readdir( dir, &finfo );
-        if ( res != FR_OK ) {
-            printf( "f_readdir failed: %d\n", res );
-            rv = res;
-            goto readdir_cleanup;
-        }
+    if ( rv < 0 ) {
+        fprintf( stderr, "spifat_readdir failed: %d\n", rv );
+        return traceReturn( "readdir", path, rv );
     }
 
-readdir_cleanup:
-	return FRESULT_TO_OSCODE( rv );
+	return traceReturn( "readdir", path, 0 );
 }
 
 static int spi_fat_fuse_releasedir( const char *path, struct fuse_file_info *fi ) {
 
-    FRESULT res;
-    DIR *dir = NULL;
+    SPIFAT_TRACE( fuse_entry, "releasedir", path );
+    accountCaller();
+    SPIFAT_DIR *dir = NULL;
+    int rv;
 
-    dir = (DIR *)fi->fh;
+    dir = (SPIFAT_DIR *)fi->fh;
     if ( dir == NULL ) {
-        return -ENOENT;
+        return traceReturn( "releasedir", path, -ENOENT );
     }
 
-    res = f_closedir( dir );
-    if ( res != FR_OK ) {
-        printf( "f_closedir() failed: %d\n", res );
+    rv = spifat_closedir( dir );
+    if ( rv != 0 ) {
+        printf( "spifat_closedir() failed: %d\n", rv );
     }
 
-    free( dir );
     fi->fh = 0;
 
-    return FRESULT_TO_OSCODE( res );
+    return traceReturn( "releasedir", path, rv );
 }
 
 static int spi_fat_fuse_open(const char *path, struct fuse_file_info *fi)
 {
-    FRESULT res;
-    int i;
+    SPIFAT_TRACE( fuse_entry, "open", path );
+    accountCaller();
+    SPIFAT_FILE *sf;
+    int rv;
 
     printf( "fuse_open: %s (mode %d)\n", path, fi->flags );
 
-    int mode = FA_READ | FA_WRITE;
-    if ( (fi->flags & O_ASYNC) == O_ASYNC ) {
-        mode = FA_READ;
+    int mode = SPIFAT_READ | SPIFAT_WRITE;
+    if ( (fi->flags & O_ASYNC) == O_ASYNC ||
+         (options.readonly && (fi->flags & O_ACCMODE) == O_RDONLY) ) {
+        mode = SPIFAT_READ;
     } else {
       if ( (fi->flags & O_CREAT) == O_CREAT ) {
           printf( "open: create mode\n" );
-          mode = FA_WRITE | FA_CREATE_NEW;
+          mode = SPIFAT_WRITE | SPIFAT_CREATE;
       }
     }
 
-    FIL *fp = malloc( sizeof( FIL ) );
-    if ( fp == NULL ) {
-        return ENOENT;
-    }
-
     /**
      * If the filename starts with a '.', translate it to '_'
      */
     char lpath[255];
     renameHidden( path, lpath, 255 );
 
-    res = f_open( fp, lpath, mode );
-    if ( res != FR_OK ) {
-        printf( "f_open failed: %d\n", res );
+    rv = spifat_open( lpath, mode, &sf );
+    if ( rv != 0 ) {
+        printf( "spifat_open failed: %d\n", rv );
         fi->fh = 0;
-        return FRESULT_TO_OSCODE( res );
-    } else {
-        fi->fh = (uint64_t)fp;
+        return traceReturn( "open", path, rv );
     }
+    fi->fh = (uint64_t)sf;
 
-	return 0;
+	return traceReturn( "open", path, 0 );
 }
 
 static int spi_fat_fuse_release( const char *path, struct fuse_file_info *fi)
 {
-    FRESULT res;
+    SPIFAT_TRACE( fuse_entry, "release", path );
+    accountCaller();
+    int rv;
 
-    FIL *fp = (FIL *)fi->fh;
-    if ( fp == NULL ) {
-        return ENOENT;
+    SPIFAT_FILE *sf = (SPIFAT_FILE *)fi->fh;
+    if ( sf == NULL ) {
+        return traceReturn( "release", path, ENOENT );
     }
 
-    res = f_close( fp );
-    if ( res != FR_OK ) {
-        printf( "f_close failed: %d\n", res );
+    rv = spifat_close( sf );
+    if ( rv != 0 ) {
+        printf( "spifat_close failed: %d\n", rv );
     }
 
-    return FRESULT_TO_OSCODE( res );
+    fi->fh = 0;
+
+    return traceReturn( "release", path, rv );
 }
 
 static int spi_fat_fuse_read(const char *path, char *buf, size_t size, off_t offset,
 		      struct fuse_file_info *fi)
 {
-	(void) fi;
-    FRESULT res;
-    UINT bread = 0;
+    SPIFAT_TRACE( fuse_entry, "read", path );
+    accountCaller();
+    ssize_t rv;
 
     printf( "fuse_read: %s -> %d bytes (%lld offset)\n", path, size, offset );
 
-    FIL *fp = (FIL *)fi->fh;
-    if ( fp == NULL ) {
-        return ENOENT;
-    }
-
-    res = f_lseek( fp, offset );
-    if ( res != FR_OK ) {
-        printf( "failed to f_seek(): %d\n", res );
-        return FRESULT_TO_OSCODE( res );
+    SPIFAT_FILE *sf = (SPIFAT_FILE *)fi->fh;
+    if ( sf == NULL ) {
+        return traceReturn( "read", path, ENOENT );
     }
 
-    res = f_read( fp, buf, size, &bread );
-    if ( res != FR_OK ) {
-        printf( "failed to f_read(): %d\n", res );
-        return FRESULT_TO_OSCODE( res );
+    rv = spifat_pread( sf, buf, size, offset );
+    if ( rv < 0 ) {
+        printf( "spifat_pread failed: %d\n", (int)rv );
     }
 
-	return bread;
+	return traceReturn( "read", path, rv );
 }
 
 static int spi_fat_fuse_write( const char *path, const char *buf, size_t size,
                                off_t offset, struct fuse_file_info *fi )
 {
-    (void) fi;
-    FRESULT res;
-    UINT bwrite = 0;
+    SPIFAT_TRACE( fuse_entry, "write", path );
+    accountCaller();
+    ssize_t rv;
 
     printf( "fuse_write: %s -> %d bytes (%lld offset)\n", path, size, offset );
 
-    FIL *fp = (FIL *)fi->fh;
-    if ( fp == NULL ) {
-        return ENOENT;
+    SPIFAT_FILE *sf = (SPIFAT_FILE *)fi->fh;
+    if ( sf == NULL ) {
+        return traceReturn( "write", path, ENOENT );
     }
 
-    res = f_lseek( fp, offset );
-    if ( res != FR_OK ) {
-        printf( "failed to f_seek(): %d\n", res );
-        return FRESULT_TO_OSCODE( res );
+    rv = spifat_pwrite( sf, buf, size, offset );
+    if ( rv < 0 ) {
+        printf( "spifat_pwrite failed: %d\n", (int)rv );
     }
 
-    res = f_write( fp, buf, size, &bwrite );
-    if ( res != FR_OK ) {
-        printf( "failed to f_write(): %d\n", res );
-        return FRESULT_TO_OSCODE( res );
+    return traceReturn( "write", path, rv );
+}
+
+/** Lands a request payload in the library's staging buffer */
+static ssize_t fillFromBufvec( void *dst, size_t size, void *arg ) {
+
+    struct fuse_bufvec *src = arg;
+    struct fuse_bufvec dstv = FUSE_BUFVEC_INIT( size );
+
+    dstv.buf[0].mem = dst;
+
+    return fuse_buf_copy( &dstv, src, 0 );
+}
+
+/**
+ * With splice enabled the payload is still in a pipe and is read once,
+ * straight into libspifat's page aligned staging buffers. A payload libfuse
+ * has already read into memory is written from where it is.
+ */
+static int spi_fat_fuse_write_buf( const char *path, struct fuse_bufvec *buf,
+                                   off_t offset, struct fuse_file_info *fi )
+{
+    SPIFAT_TRACE( fuse_entry, "write_buf", path );
+    accountCaller();
+    size_t size = fuse_buf_size( buf );
+    ssize_t rv;
+
+    SPIFAT_FILE *sf = (SPIFAT_FILE *)fi->fh;
+    if ( sf == NULL ) {
+        return traceReturn( "write_buf", path, -ENOENT );
     }
 
-    return bwrite;
+    if ( buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD) ) {
+        rv = spifat_pwrite( sf, (const char *)buf->buf[0].mem + buf->off, size, offset );
+    } else {
+        rv = spifat_pwrite_fill( sf, size, offset, fillFromBufvec, buf );
+    }
+    if ( rv < 0 ) {
+        printf( "spifat_pwrite failed: %d\n", (int)rv );
+    }
+
+    return traceReturn( "write_buf", path, rv );
 }
 
 static int spi_fat_fuse_create( const char *name, mode_t mode, struct fuse_file_info *fi ) {
@@ -642,75 +605,101 @@ static int spi_fat_fuse_create( const char *name, mode_t mode, struct fuse_file_
 
 static int spi_fat_fuse_unlink( const char *path ) {
 
-    FRESULT res;
-
+    SPIFAT_TRACE( fuse_entry, "unlink", path );
+    accountCaller();
     printf( "fuse_unlink: %s\n", path );
 
-    res = f_unlink( path );
-    return FRESULT_TO_OSCODE( res );
+    return traceReturn( "unlink", path, spifat_unlink( path ) );
 }
 
 static int spi_fat_fuse_flush( const char *path, struct fuse_file_info *fi ) {
 
-    LAZY_MOUNT
+    SPIFAT_TRACE( fuse_entry, "flush", path );
+    accountCaller();
+    SPIFAT_FILE *sf = (SPIFAT_FILE *)fi->fh;
+    if ( sf == NULL ) {
+        return traceReturn( "flush", path, ENOENT );
+    }
 
-    FRESULT res = FR_OK;
+    return traceReturn( "flush", path, spifat_sync( sf ) );
+}
 
-    FIL *fp = (FIL *)fi->fh;
-    if ( fp == NULL ) {
-        return ENOENT;
+static int spi_fat_fuse_fsync( const char *path, int datasync, struct fuse_file_info *fi ) {
+
+    SPIFAT_TRACE( fuse_entry, "fsync", path );
+    accountCaller();
+    SPIFAT_FILE *sf = (SPIFAT_FILE *)fi->fh;
+    if ( sf == NULL ) {
+        return traceReturn( "fsync", path, -ENOENT );
     }
 
-    res = f_sync( fp );
+    /** The entry holds the size, so datasync has to write it too */
+    (void) datasync;
 
-    return FRESULT_TO_OSCODE( res );
+    return traceReturn( "fsync", path, spifat_fsync( sf ) );
 }
 
-static int spi_fat_fuse_utimens( const char *path, const struct timespec tv[2], struct fuse_file_info *fi ) {
+static int spi_fat_fuse_fsyncdir( const char *path, int datasync, struct fuse_file_info *fi ) {
 
-    /** Convert 'now' FAT timestamp */
-    /** tv doesn't appear to contain anything useful... */
-    unsigned long fatTimestamp = nowAsFATTimestamp();
+    SPIFAT_TRACE( fuse_entry, "fsyncdir", path );
+    accountCaller();
+    SPIFAT_DIR *dir = (SPIFAT_DIR *)fi->fh;
+    if ( dir == NULL ) {
+        return traceReturn( "fsyncdir", path, -ENOENT );
+    }
 
-    WORD fldate, fltime;
-    FATTimestampToDateTime( fatTimestamp, &fldate, &fltime );
+    (void) datasync;
 
-    FILINFO finfo;
-    finfo.fdate = fldate;
-    finfo.ftime = fltime;
+    return traceReturn( "fsyncdir", path, spifat_fsyncdir( dir ) );
+}
 
-    FRESULT res = f_utime( path, &finfo );
+static int spi_fat_fuse_utimens( const char *path, const struct timespec tv[2], struct fuse_file_info *fi ) {
 
-    return FRESULT_TO_OSCODE( res );
+    SPIFAT_TRACE( fuse_entry, "utimens", path );
+    accountCaller();
+    /** tv doesn't appear to contain anything useful... */
+    return traceReturn( "utimens", path, spifat_utime( path, time( NULL ) ) );
 }
 
 static int spi_fat_fuse_chmod( const char *path, mode_t mode, struct fuse_file_info *fi ) {
+    SPIFAT_TRACE( fuse_entry, "chmod", path );
+    accountCaller();
     /** NOP */
-    return FRESULT_TO_OSCODE( FR_OK );
+    return traceReturn( "chmod", path, 0 );
 }
 
 static int spi_fat_fuse_chown( const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi ) {
+    SPIFAT_TRACE( fuse_entry, "chown", path );
+    accountCaller();
     /** NOP */
-    return FRESULT_TO_OSCODE( FR_OK );
+    return traceReturn( "chown", path, 0 );
 }
 
 static int spi_fat_fuse_truncate( const char *path, off_t offset, struct fuse_file_info *fi ) {
+    SPIFAT_TRACE( fuse_entry, "truncate", path );
+    accountCaller();
     /** NOP */
-    return FRESULT_TO_OSCODE( FR_OK );
+    return traceReturn( "truncate", path, 0 );
 }
 
 static const struct fuse_operations spi_fat_fuse_oper = {
 
     .init           = spi_fat_fuse_init,
+    .destroy        = spi_fat_fuse_destroy,
     .flush          = spi_fat_fuse_flush,
+    .fsync          = spi_fat_fuse_fsync,
+    .fsyncdir       = spi_fat_fuse_fsyncdir,
     .getattr        = spi_fat_fuse_getattr,
     .setxattr       = spi_fat_fuse_setxattr,
+    .getxattr       = spi_fat_fuse_getxattr,
+    .listxattr      = spi_fat_fuse_listxattr,
     .opendir        = spi_fat_fuse_opendir,
     .readdir        = spi_fat_fuse_readdir,
     .releasedir     = spi_fat_fuse_releasedir,
     .open           = spi_fat_fuse_open,
     .read           = spi_fat_fuse_read,
     .write          = spi_fat_fuse_write,
+    .write_buf      = spi_fat_fuse_write_buf,
     .create         = spi_fat_fuse_create,
     .unlink         = spi_fat_fuse_unlink,
     .truncate       = spi_fat_fuse_truncate,
@@ -725,6 +714,20 @@ static const struct fuse_operations spi_fat_fuse_oper = {
 static void show_help(const char *progname)
 {
 	printf("usage: %s [options] <mountpoint>\n\n", progname);
+	printf("File-system specific options:\n"
+	       "    --cache=<kb>        Size of the SD sector cache in KB (default: 4096)\n"
+	       "    --hashdb=<file>     Persist content hashes in this file\n"
+	       "    --native            Use the 4-bit SD bus (CMD, CLK, DAT0-DAT3 wiring)\n"
+	       "    --image=<file>      Serve a card image file instead of the card\n"
+	       "    --spidev=<dev>      Reach the card through the kernel SPI driver (e.g. /dev/spidev0.0)\n"
+	       "    --readonly          Mount read-only; lookups and reads run without the filesystem lock\n"
+	       "    --proc-limit=<ms>   Card time each process may use per second (default: unlimited)\n"
+	       "    --alloc=near|next   Allocate clusters near each file's directory or volume-wide next-fit (default: near)\n"
+	       "    --delalloc=<kb>     Gather this much of each file's writes before picking its clusters (default: 256, 0 disables).\n"
+	       "                        Costs that plus a cluster of memory per file open for writing\n"
+	       "    --no-io-uring       Use the classic /dev/fuse loop even if io_uring is available\n"
+	       "    --no-splice         Have libfuse copy write payloads out of /dev/fuse itself\n"
+	       "\n");
 }
 
 int main(int argc, char *argv[])
@@ -736,6 +739,8 @@ int main(int argc, char *argv[])
 	   fuse_opt_parse can free the defaults if other
 	   values are specified */
 	options.filename = strdup("spifat");
+	options.cache_kb = 4096;
+	options.delalloc_kb = 256;
 
 	/* Parse options */
 	if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1)
@@ -752,6 +757,20 @@ int main(int argc, char *argv[])
 		args.argv[0][0] = '\0';
 	}
 
+	/* Requests arrive over per-CPU io_uring queues when both libfuse
+	   and the kernel support it, the /dev/fuse read/write loop
+	   otherwise */
+	if (!options.no_uring && !options.show_help && uringAvailable() &&
+	    fuse_opt_add_arg(&args, "-oio_uring") != 0)
+		fprintf(stderr, "failed to enable io_uring, using /dev/fuse\n");
+
+	/* Have the kernel refuse writes before they reach us */
+	if (options.readonly && fuse_opt_add_arg(&args, "-oro") != 0) {
+		fprintf(stderr, "failed to mount read-only\n");
+		fuse_opt_free_args(&args);
+		return 1;
+	}
+
 	ret = fuse_main(args.argc, args.argv, &spi_fat_fuse_oper, NULL);
 	fuse_opt_free_args(&args);
 	return ret;
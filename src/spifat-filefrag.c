@@ -0,0 +1,187 @@
+/**
+ * Summarise file fragmentation on a spi-fat-fuse mount
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Reads the user.spifat.extents / user.spifat.extentmap attributes of
+ * every file and prints one line per directory:
+ *
+ *   files  fragmented  extents  ext/file  worst  directory
+ *
+ * -r descends into subdirectories, -v also lists each fragmented file
+ * with its extent map.
+ */
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "spifat-xattr.h"
+
+static int recurse = 0;
+static int verbose = 0;
+
+static void usage( const char *progname ) {
+    fprintf( stderr, "usage: %s [-r] [-v] <directory>...\n", progname );
+    fprintf( stderr, "    -r    descend into subdirectories\n" );
+    fprintf( stderr, "    -v    list fragmented files and their extents\n" );
+}
+
+/** Returns: the extent count of path, -1 if unavailable */
+static long getExtents( const char *path ) {
+
+    char buf[32];
+    ssize_t len = getxattr( path, FATEXTENT_COUNT_XATTR, buf, sizeof( buf ) - 1 );
+    if ( len < 0 ) {
+        return -1;
+    }
+    buf[len] = '\0';
+
+    return strtol( buf, NULL, 10 );
+}
+
+static void printExtentMap( const char *path ) {
+
+    ssize_t len = getxattr( path, FATEXTENT_MAP_XATTR, NULL, 0 );
+    if ( len <= 0 ) {
+        return;
+    }
+
+    char *buf = malloc( len + 1 );
+    if ( buf == NULL ) {
+        return;
+    }
+
+    len = getxattr( path, FATEXTENT_MAP_XATTR, buf, len );
+    if ( len > 0 ) {
+        buf[len] = '\0';
+        char *line = strtok( buf, "\n" );
+        while ( line != NULL ) {
+            printf( "        %s\n", line );
+            line = strtok( NULL, "\n" );
+        }
+    }
+
+    free( buf );
+}
+
+static int scanDirectory( const char *dirpath ) {
+
+    DIR *dir;
+    struct dirent *de;
+    struct stat st;
+    char path[PATH_MAX];
+    long nfiles = 0, nfragmented = 0, nextents = 0, worst = 0;
+
+    dir = opendir( dirpath );
+    if ( dir == NULL ) {
+        perror( dirpath );
+        return 1;
+    }
+
+    while ( (de = readdir( dir )) != NULL ) {
+        if ( strcmp( de->d_name, "." ) == 0 || strcmp( de->d_name, ".." ) == 0 ) {
+            continue;
+        }
+
+        snprintf( path, sizeof( path ), "%s/%s", dirpath, de->d_name );
+        if ( stat( path, &st ) != 0 || !S_ISREG( st.st_mode ) ) {
+            continue;
+        }
+
+        long n = getExtents( path );
+        if ( n < 0 ) {
+            fprintf( stderr, "%s: no layout information (not a spi-fat-fuse mount?)\n", path );
+            continue;
+        }
+
+        nfiles++;
+        nextents += n;
+        if ( n > 1 ) {
+            nfragmented++;
+            if ( verbose ) {
+                printf( "    %ld extents, %lld bytes: %s\n", n, (long long)st.st_size, path );
+                printExtentMap( path );
+            }
+        }
+        if ( n > worst ) {
+            worst = n;
+        }
+    }
+
+    printf( "%6ld %10ld %8ld %9.2f %6ld  %s\n", nfiles, nfragmented, nextents,
+            nfiles ? (double)nextents / nfiles : 0.0, worst, dirpath );
+
+    if ( recurse ) {
+        rewinddir( dir );
+        while ( (de = readdir( dir )) != NULL ) {
+            if ( strcmp( de->d_name, "." ) == 0 || strcmp( de->d_name, ".." ) == 0 ) {
+                continue;
+            }
+            snprintf( path, sizeof( path ), "%s/%s", dirpath, de->d_name );
+            if ( stat( path, &st ) == 0 && S_ISDIR( st.st_mode ) ) {
+                scanDirectory( path );
+            }
+        }
+    }
+
+    closedir( dir );
+
+    return 0;
+}
+
+int main( int argc, char *argv[] ) {
+
+    int opt, i, rv = 0;
+
+    while ( (opt = getopt( argc, argv, "rv" )) != -1 ) {
+        switch ( opt ) {
+            case 'r': {
+                recurse = 1;
+                break;
+            }
+            case 'v': {
+                verbose = 1;
+                break;
+            }
+            default: {
+                usage( argv[0] );
+                return 1;
+            }
+        }
+    }
+
+    if ( optind >= argc ) {
+        usage( argv[0] );
+        return 1;
+    }
+
+    printf( "%6s %10s %8s %9s %6s  %s\n", "files", "fragmented", "extents", "ext/file", "worst", "directory" );
+    for ( i = optind ; i < argc ; i++ ) {
+        rv |= scanDirectory( argv[i] );
+    }
+
+    return rv;
+}
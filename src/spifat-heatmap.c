@@ -0,0 +1,250 @@
+/**
+ * Show where a spi-fat-fuse mount's card accesses land and how big a
+ * sector cache they would need
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Reads the user.spifat.heatmap and user.spifat.reuse attributes of the
+ * mount's root and prints:
+ *
+ *   - a read and a write heat strip for the metadata area (boot sector,
+ *     FATs, FAT12/16 root directory) and for the data area, one character
+ *     per LBA bucket from ' ' (untouched) to '@' (hottest)
+ *   - the hit rate an LRU sector cache of each size would have had
+ *
+ * -c prints both CSVs instead. -r zeroes the counters, so a workload can
+ * be run afterwards and measured on its own.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/xattr.h>
+
+#include "spifat-xattr.h"
+
+#define MAX_BUCKETS 1024
+#define STRIP_WIDTH 64
+#define BAR_WIDTH 40
+
+typedef struct {
+    unsigned long long first;
+    unsigned long long last;
+    unsigned long reads;
+    unsigned long writes;
+} Bucket;
+
+static const char shades[] = " .:-=+*#%@";
+
+static void usage( const char *progname ) {
+    fprintf( stderr, "usage: %s [-c] [-r] <mountpoint>\n", progname );
+    fprintf( stderr, "    -c    print the raw CSV\n" );
+    fprintf( stderr, "    -r    reset the counters and exit\n" );
+}
+
+/** Returns: the attribute value, NUL terminated, or NULL */
+static char *readXattr( const char *path, const char *name ) {
+
+    ssize_t len = getxattr( path, name, NULL, 0 );
+    if ( len < 0 ) {
+        perror( path );
+        return NULL;
+    }
+
+    char *buf = malloc( len + 1 );
+    if ( buf == NULL ) {
+        return NULL;
+    }
+
+    len = getxattr( path, name, buf, len );
+    if ( len < 0 ) {
+        perror( path );
+        free( buf );
+        return NULL;
+    }
+    buf[len] = '\0';
+
+    return buf;
+}
+
+/** Returns: the number of buckets of region parsed out of csv */
+static int parseHeat( char *csv, const char *region, Bucket *buckets ) {
+
+    char *line, *save;
+    char name[8];
+    int n = 0;
+
+    for ( line = strtok_r( csv, "\n", &save ) ; line != NULL && n < MAX_BUCKETS ; line = strtok_r( NULL, "\n", &save ) ) {
+        Bucket *b = &buckets[n];
+        if ( sscanf( line, "%7[a-z],%llu,%llu,%lu,%lu", name, &b->first, &b->last, &b->reads, &b->writes ) == 5 &&
+             strcmp( name, region ) == 0 ) {
+            n++;
+        }
+    }
+
+    return n;
+}
+
+/** One character per bucket, shaded on a log scale against the hottest */
+static void printStrip( const char *label, const Bucket *buckets, int n, int writes ) {
+
+    unsigned long v, max = 0;
+    int i, shade;
+
+    for ( i = 0 ; i < n ; i++ ) {
+        v = writes ? buckets[i].writes : buckets[i].reads;
+        if ( v > max ) {
+            max = v;
+        }
+    }
+
+    printf( "  %s (hottest bucket %lu sectors)\n", label, max );
+    for ( i = 0 ; i < n ; i++ ) {
+        if ( i % STRIP_WIDTH == 0 ) {
+            printf( "  %10llu |", buckets[i].first );
+        }
+        v = writes ? buckets[i].writes : buckets[i].reads;
+        shade = 0;
+        if ( v > 0 ) {
+            shade = sizeof( shades ) - 2;
+            if ( v < max ) {
+                shade = 1 + (int)((sizeof( shades ) - 3) * log( (double)v ) / log( (double)max ));
+            }
+        }
+        putchar( shades[shade] );
+        if ( i % STRIP_WIDTH == STRIP_WIDTH - 1 || i == n - 1 ) {
+            printf( "|\n" );
+        }
+    }
+}
+
+static void printRegion( const char *title, char *csv, const char *region ) {
+
+    Bucket *buckets;
+    char *copy;
+    int n;
+
+    buckets = malloc( MAX_BUCKETS * sizeof( Bucket ) );
+    copy = strdup( csv );
+    if ( buckets == NULL || copy == NULL ) {
+        free( buckets );
+        free( copy );
+        return;
+    }
+
+    n = parseHeat( copy, region, buckets );
+    if ( n > 0 ) {
+        printf( "%s: LBA %llu-%llu, %llu sectors per bucket\n", title,
+                buckets[0].first, buckets[n - 1].last, buckets[0].last - buckets[0].first + 1 );
+        printStrip( "reads", buckets, n, 0 );
+        printStrip( "writes", buckets, n, 1 );
+        printf( "\n" );
+    }
+
+    free( buckets );
+    free( copy );
+}
+
+static void printReuse( char *csv ) {
+
+    char *line, *save;
+    unsigned long long kb, macc, mhits, dacc, dhits;
+    double rate;
+    int i;
+
+    printf( "%10s %8s %8s %8s\n", "cache", "meta", "data", "hit rate" );
+    for ( line = strtok_r( csv, "\n", &save ) ; line != NULL ; line = strtok_r( NULL, "\n", &save ) ) {
+        if ( sscanf( line, "%llu,%llu,%llu,%llu,%llu,%lf", &kb, &macc, &mhits, &dacc, &dhits, &rate ) != 6 ) {
+            continue;
+        }
+        if ( kb >= 1024 * 1024 ) {
+            printf( "%8lluGB", kb / (1024 * 1024) );
+        } else if ( kb >= 1024 ) {
+            printf( "%8lluMB", kb / 1024 );
+        } else {
+            printf( "%8lluKB", kb );
+        }
+        printf( " %7.1f%% %7.1f%% %7.1f%% ",
+                macc ? (mhits * 100.0) / macc : 0.0, dacc ? (dhits * 100.0) / dacc : 0.0, rate * 100.0 );
+        for ( i = 0 ; i < (int)(rate * BAR_WIDTH + 0.5) ; i++ ) {
+            putchar( '#' );
+        }
+        printf( "\n" );
+    }
+}
+
+int main( int argc, char *argv[] ) {
+
+    int opt, raw = 0, reset = 0;
+    char *heat, *reuse;
+
+    while ( (opt = getopt( argc, argv, "cr" )) != -1 ) {
+        switch ( opt ) {
+            case 'c': {
+                raw = 1;
+                break;
+            }
+            case 'r': {
+                reset = 1;
+                break;
+            }
+            default: {
+                usage( argv[0] );
+                return 1;
+            }
+        }
+    }
+
+    if ( optind != argc - 1 ) {
+        usage( argv[0] );
+        return 1;
+    }
+
+    if ( reset ) {
+        if ( setxattr( argv[optind], HEATMAP_XATTR, "reset", 5, 0 ) != 0 ) {
+            perror( argv[optind] );
+            return 1;
+        }
+        return 0;
+    }
+
+    heat = readXattr( argv[optind], HEATMAP_XATTR );
+    reuse = readXattr( argv[optind], REUSE_XATTR );
+    if ( heat == NULL || reuse == NULL ) {
+        free( heat );
+        free( reuse );
+        return 1;
+    }
+
+    if ( raw ) {
+        printf( "%s\n%s", heat, reuse );
+    } else {
+        printRegion( "Metadata", heat, "meta" );
+        printRegion( "Data", heat, "data" );
+        printReuse( reuse );
+    }
+
+    free( heat );
+    free( reuse );
+
+    return 0;
+}
@@ -0,0 +1,683 @@
+/**
+ * Back up and restore a card, copying only the clusters the FAT uses
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Images a card without the FUSE mount or another machine:
+ *
+ *   spifat-image backup card.img     card to card.img, with card.img.map
+ *   spifat-image restore card.img    card.img back onto a card
+ *   spifat-image verify card.img     compare a card against card.img.map
+ *
+ * Everything up to the FAT volume's data area (partition table, boot
+ * sector, FATs, FAT12/16 root directory), the clusters in use and
+ * anything after the volume are copied. Free clusters are skipped and
+ * left as holes in the image, which is otherwise a plain sector-for-sector
+ * card image that --image and dd accept. A card without a FAT volume is
+ * copied whole.
+ *
+ * The copied ranges are moved in batches of up to BATCH_SECTORS, each one
+ * card session, so runs become multi-block reads and writes and short
+ * free gaps are read through rather than starting a new command.
+ *
+ * card.img.map lists the copied ranges, at most CHUNK_SECTORS each, with
+ * a CRC32 apiece:
+ *
+ *   spifat-image 1 <card sectors>
+ *   <first sector> <sectors> <crc32>
+ *   ...
+ *   end <ranges>
+ *
+ * Restores check every range against it before writing. A backup appends
+ * ranges as they reach the image and a restore keeps its count in
+ * card.img.restored, so -r carries on an interrupted run with the same
+ * card. -e erases the free space on restore, where the card erases to
+ * zeros, so it starts out as a new card's would.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bcm2835.h"
+#include "chksum.h"
+#include "diskio.h"
+#include "ff.h"
+
+/** Largest range one checksum covers */
+#define CHUNK_SECTORS 256
+
+/** Sectors moved per card session */
+#define BATCH_SECTORS 4096
+
+/** Free sectors read through rather than ending a burst */
+#define READ_GAP 8
+
+typedef struct {
+    LBA_t sector;
+    UINT count;
+    uint32_t crc;
+} Chunk;
+
+typedef struct {
+    Chunk *chunks;
+    UINT n;
+    UINT size;
+} ChunkList;
+
+static void usage( const char *progname ) {
+    fprintf( stderr, "usage: %s [options] backup|restore|verify <image>\n", progname );
+    fprintf( stderr, "    -i <file>     use a card image file instead of the card\n" );
+    fprintf( stderr, "    -n            use the 4-bit SD bus wiring\n" );
+    fprintf( stderr, "    -s <dev>      reach the card through a spidev device\n" );
+    fprintf( stderr, "    -r            resume an interrupted backup or restore\n" );
+    fprintf( stderr, "    -e            restore: erase the free space\n" );
+}
+
+static double monoSeconds( void ) {
+
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+/** Appends count sectors from sector, split into ranges of CHUNK_SECTORS */
+static int addRange( ChunkList *list, LBA_t sector, LBA_t count ) {
+
+    Chunk *c;
+    UINT n;
+
+    while ( count > 0 ) {
+        if ( list->n == list->size ) {
+            list->size = list->size ? list->size * 2 : 1024;
+            c = realloc( list->chunks, list->size * sizeof( Chunk ) );
+            if ( c == NULL ) {
+                return -1;
+            }
+            list->chunks = c;
+        }
+        n = count > CHUNK_SECTORS ? CHUNK_SECTORS : (UINT)count;
+        c = &list->chunks[list->n++];
+        c->sector = sector;
+        c->count = n;
+        c->crc = 0;
+        sector += n;
+        count -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * The ranges a backup copies: the card up to the data area, each run of
+ * clusters in use and the rest of the card after the volume. Everything
+ * if there is no FAT volume (fs NULL).
+ *
+ * Returns: 0 = success, -1 on error
+ */
+static int planRanges( FATFS *fs, LBA_t nsectors, ChunkList *list ) {
+
+    BYTE *map;
+    DWORD nclst, clst, start = 0;
+    LBA_t dataEnd;
+    int inRun = 0, used;
+
+    if ( fs == NULL ) {
+        return addRange( list, 0, nsectors );
+    }
+
+    nclst = fs->n_fatent - 2;
+    map = malloc( (nclst + 7) / 8 );
+    if ( map == NULL ) {
+        return -1;
+    }
+    if ( f_allocmap( "", map ) != FR_OK ) {
+        fprintf( stderr, "failed to read the FAT\n" );
+        free( map );
+        return -1;
+    }
+
+    if ( addRange( list, 0, fs->database ) != 0 ) {
+        free( map );
+        return -1;
+    }
+    for ( clst = 0 ; clst <= nclst ; clst++ ) {
+        used = clst < nclst && (map[clst / 8] & (1 << (clst % 8)));
+        if ( used && !inRun ) {
+            start = clst;
+        } else if ( !used && inRun ) {
+            if ( addRange( list, fs->database + (LBA_t)start * fs->csize,
+                           (LBA_t)(clst - start) * fs->csize ) != 0 ) {
+                free( map );
+                return -1;
+            }
+        }
+        inRun = used;
+    }
+    free( map );
+
+    dataEnd = fs->database + (LBA_t)nclst * fs->csize;
+    if ( dataEnd < nsectors ) {
+        return addRange( list, dataEnd, nsectors - dataEnd );
+    }
+
+    return 0;
+}
+
+/**
+ * Reads image.map into list. complete is set if it has its end line.
+ *
+ * Returns: 0 = success, -1 if it can't be read or isn't a map
+ */
+static int readMap( const char *path, LBA_t *nsectors, ChunkList *list, int *complete ) {
+
+    FILE *fp;
+    char line[128];
+    unsigned long long sector, count;
+    unsigned int crc, n;
+
+    *complete = 0;
+    fp = fopen( path, "r" );
+    if ( fp == NULL ) {
+        perror( path );
+        return -1;
+    }
+    if ( fgets( line, sizeof( line ), fp ) == NULL ||
+         sscanf( line, "spifat-image 1 %llu", &sector ) != 1 ) {
+        fprintf( stderr, "%s: not a spifat-image map\n", path );
+        fclose( fp );
+        return -1;
+    }
+    *nsectors = (LBA_t)sector;
+
+    while ( fgets( line, sizeof( line ), fp ) != NULL ) {
+        if ( sscanf( line, "end %u", &n ) == 1 ) {
+            *complete = (n == list->n);
+            break;
+        }
+        if ( sscanf( line, "%llu %llu %x", &sector, &count, &crc ) != 3 || count == 0 || count > CHUNK_SECTORS ||
+             addRange( list, (LBA_t)sector, (LBA_t)count ) != 0 ) {
+            break;
+        }
+        list->chunks[list->n - 1].crc = crc;
+    }
+    fclose( fp );
+
+    return 0;
+}
+
+/**
+ * Sets up the next batch: up to BATCH_SECTORS of ranges from first, one
+ * segment each, pointing into buf.
+ *
+ * Returns: the number of ranges in the batch
+ */
+static UINT nextBatch( const ChunkList *list, UINT first, BYTE *buf, DISKSEG *segs ) {
+
+    UINT i, total = 0;
+
+    for ( i = first ; i < list->n && total + list->chunks[i].count <= BATCH_SECTORS ; i++ ) {
+        segs[i - first].sector = list->chunks[i].sector;
+        segs[i - first].count = list->chunks[i].count;
+        segs[i - first].buff = buf + (size_t)total * FF_MAX_SS;
+        total += list->chunks[i].count;
+    }
+
+    return i - first;
+}
+
+static int isZero( const BYTE *p, size_t len ) {
+
+    size_t i;
+
+    for ( i = 0 ; i < len ; i++ ) {
+        if ( p[i] != 0 ) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void report( const char *what, uint64_t copied, LBA_t nsectors, double secs ) {
+
+    printf( "%s %.1fMB in %.1fs (%.2fMB/s), %.1fMB of free space skipped\n", what,
+            copied / 1048576.0, secs, secs > 0 ? copied / 1048576.0 / secs : 0.0,
+            ((uint64_t)nsectors * FF_MAX_SS - copied) / 1048576.0 );
+}
+
+static int backup( const char *image, const char *mapPath, LBA_t nsectors, int resume, BYTE *buf, DISKSEG *segs ) {
+
+    static FATFS fatfs;
+    ChunkList plan = { NULL, 0, 0 }, done = { NULL, 0, 0 };
+    LBA_t doneSectors;
+    FILE *map;
+    uint64_t copied = 0;
+    double start = monoSeconds();
+    UINT i, n, next = 0;
+    int fd, complete, rv = 1;
+
+    if ( f_mount( &fatfs, "", 1 ) == FR_OK ) {
+        rv = planRanges( &fatfs, nsectors, &plan );
+    } else {
+        fprintf( stderr, "no FAT volume found, copying every sector\n" );
+        rv = planRanges( NULL, nsectors, &plan );
+    }
+    if ( rv != 0 ) {
+        return 1;
+    }
+    rv = 1;
+
+    /** Carry on after the ranges the map already has, if it is of this card */
+    if ( resume ) {
+        if ( readMap( mapPath, &doneSectors, &done, &complete ) != 0 ) {
+            goto cleanup;
+        }
+        if ( doneSectors != nsectors || done.n > plan.n ) {
+            fprintf( stderr, "%s is of another card\n", mapPath );
+            goto cleanup;
+        }
+        for ( i = 0 ; i < done.n ; i++ ) {
+            if ( done.chunks[i].sector != plan.chunks[i].sector || done.chunks[i].count != plan.chunks[i].count ) {
+                fprintf( stderr, "the card has changed since %s was written, back it up again without -r\n", mapPath );
+                goto cleanup;
+            }
+            copied += (uint64_t)done.chunks[i].count * FF_MAX_SS;
+        }
+        if ( complete ) {
+            printf( "%s is already complete\n", image );
+            rv = 0;
+            goto cleanup;
+        }
+        next = done.n;
+    }
+
+    fd = open( image, O_RDWR | O_CREAT | (resume ? 0 : O_TRUNC), 0644 );
+    if ( fd < 0 || ftruncate( fd, (off_t)nsectors * FF_MAX_SS ) != 0 ) {
+        perror( image );
+        if ( fd >= 0 ) {
+            close( fd );
+        }
+        goto cleanup;
+    }
+
+    /** Rewritten rather than appended to, in case it ends in half a line */
+    map = fopen( mapPath, "w" );
+    if ( map == NULL ) {
+        perror( mapPath );
+        close( fd );
+        goto cleanup;
+    }
+    fprintf( map, "spifat-image 1 %llu\n", (unsigned long long)nsectors );
+    for ( i = 0 ; i < done.n ; i++ ) {
+        const Chunk *c = &done.chunks[i];
+        fprintf( map, "%llu %u %08x\n", (unsigned long long)c->sector, c->count, c->crc );
+    }
+
+    while ( next < plan.n ) {
+        n = nextBatch( &plan, next, buf, segs );
+        if ( disk_readv( 0, segs, n, READ_GAP ) != RES_OK ) {
+            fprintf( stderr, "read error at sector %llu\n", (unsigned long long)segs[0].sector );
+            break;
+        }
+
+        /** The image is sparse: all-zero ranges stay holes */
+        for ( i = 0 ; i < n ; i++ ) {
+            size_t len = (size_t)segs[i].count * FF_MAX_SS;
+            plan.chunks[next + i].crc = chksum_crc32( 0, segs[i].buff, len );
+            if ( !isZero( segs[i].buff, len ) &&
+                 pwrite( fd, segs[i].buff, len, (off_t)segs[i].sector * FF_MAX_SS ) != (ssize_t)len ) {
+                perror( image );
+                break;
+            }
+            copied += len;
+        }
+        if ( i < n ) {
+            break;
+        }
+
+        /** Ranges are listed only once they are safely in the image */
+        if ( fdatasync( fd ) != 0 ) {
+            perror( image );
+            break;
+        }
+        for ( i = 0 ; i < n ; i++ ) {
+            const Chunk *c = &plan.chunks[next + i];
+            fprintf( map, "%llu %u %08x\n", (unsigned long long)c->sector, c->count, c->crc );
+        }
+        fflush( map );
+        fsync( fileno( map ) );
+        next += n;
+    }
+
+    if ( next == plan.n ) {
+        fprintf( map, "end %u\n", plan.n );
+        rv = 0;
+    }
+    if ( fclose( map ) != 0 ) {
+        perror( mapPath );
+        rv = 1;
+    }
+    close( fd );
+
+    if ( rv == 0 ) {
+        report( "backed up", copied, nsectors, monoSeconds() - start );
+    }
+
+cleanup:
+    free( plan.chunks );
+    free( done.chunks );
+
+    return rv;
+}
+
+/** Erases what the map doesn't cover, as far as the card erases to zeros.
+    Returns non-zero if the card failed or timed out part way through */
+static int eraseFree( const ChunkList *list, LBA_t nsectors ) {
+
+    LBA_t from = 0, range[2];
+    DRESULT res;
+    UINT i;
+
+    for ( i = 0 ; i <= list->n ; i++ ) {
+        LBA_t to = i < list->n ? list->chunks[i].sector : nsectors;
+        if ( to > from ) {
+            range[0] = from;
+            range[1] = to - 1;
+            res = disk_ioctl( 0, MMC_ZERO_RANGE, range );
+            if ( res == RES_PARERR ) {
+                fprintf( stderr, "the card doesn't erase to zeros, free space left as it is\n" );
+                return 0;
+            }
+            if ( res == RES_NOTRDY ) {
+                fprintf( stderr, "erase timed out between sectors %llu and %llu\n", (unsigned long long)range[0], (unsigned long long)range[1] );
+                return 1;
+            }
+            if ( res != RES_OK ) {
+                fprintf( stderr, "erase error between sectors %llu and %llu\n", (unsigned long long)range[0], (unsigned long long)range[1] );
+                return 1;
+            }
+        }
+        if ( i < list->n ) {
+            from = list->chunks[i].sector + list->chunks[i].count;
+        }
+    }
+
+    return 0;
+}
+
+static int saveProgress( const char *path, UINT n ) {
+
+    FILE *fp = fopen( path, "w" );
+    int rv;
+
+    if ( fp == NULL ) {
+        return -1;
+    }
+    fprintf( fp, "%u\n", n );
+    fflush( fp );
+    rv = fsync( fileno( fp ) );
+
+    return fclose( fp ) == 0 ? rv : -1;
+}
+
+static int restore( const char *image, const char *mapPath, LBA_t nsectors, int resume, int erase,
+                    BYTE *buf, DISKSEG *segs ) {
+
+    ChunkList list = { NULL, 0, 0 };
+    LBA_t imageSectors;
+    char progress[4096];
+    uint64_t copied = 0;
+    double start = monoSeconds();
+    UINT i, n, next = 0;
+    FILE *fp;
+    int fd, complete, rv = 1;
+
+    if ( readMap( mapPath, &imageSectors, &list, &complete ) != 0 ) {
+        return 1;
+    }
+    if ( !complete ) {
+        fprintf( stderr, "%s is of an unfinished backup\n", mapPath );
+        goto cleanup;
+    }
+    if ( imageSectors > nsectors ) {
+        fprintf( stderr, "the card is smaller than %s\n", image );
+        goto cleanup;
+    }
+
+    snprintf( progress, sizeof( progress ), "%s.restored", image );
+    if ( resume ) {
+        fp = fopen( progress, "r" );
+        if ( fp != NULL ) {
+            if ( fscanf( fp, "%u", &next ) != 1 || next > list.n ) {
+                next = 0;
+            }
+            fclose( fp );
+        }
+        for ( i = 0 ; i < next ; i++ ) {
+            copied += (uint64_t)list.chunks[i].count * FF_MAX_SS;
+        }
+    }
+
+    fd = open( image, O_RDONLY );
+    if ( fd < 0 ) {
+        perror( image );
+        goto cleanup;
+    }
+
+    if ( erase && eraseFree( &list, imageSectors ) != 0 ) {
+        close( fd );
+        goto cleanup;
+    }
+
+    while ( next < list.n ) {
+        n = nextBatch( &list, next, buf, segs );
+        for ( i = 0 ; i < n ; i++ ) {
+            size_t len = (size_t)segs[i].count * FF_MAX_SS;
+            if ( pread( fd, segs[i].buff, len, (off_t)segs[i].sector * FF_MAX_SS ) != (ssize_t)len ) {
+                perror( image );
+                break;
+            }
+            if ( chksum_crc32( 0, segs[i].buff, len ) != list.chunks[next + i].crc ) {
+                fprintf( stderr, "%s is damaged at sector %llu\n", image, (unsigned long long)segs[i].sector );
+                break;
+            }
+            copied += len;
+        }
+        if ( i < n ) {
+            break;
+        }
+
+        if ( disk_writev( 0, segs, n ) != RES_OK || disk_ioctl( 0, CTRL_SYNC, NULL ) != RES_OK ) {
+            fprintf( stderr, "write error at sector %llu\n", (unsigned long long)segs[0].sector );
+            break;
+        }
+        next += n;
+        if ( saveProgress( progress, next ) != 0 ) {
+            perror( progress );
+            break;
+        }
+    }
+    close( fd );
+
+    if ( next == list.n ) {
+        unlink( progress );
+        report( "restored", copied, imageSectors, monoSeconds() - start );
+        rv = 0;
+    }
+
+cleanup:
+    free( list.chunks );
+
+    return rv;
+}
+
+static int verify( const char *mapPath, LBA_t nsectors, BYTE *buf, DISKSEG *segs ) {
+
+    ChunkList list = { NULL, 0, 0 };
+    LBA_t imageSectors;
+    uint64_t copied = 0;
+    double start = monoSeconds();
+    UINT i, n, next = 0, bad = 0;
+    int complete;
+
+    if ( readMap( mapPath, &imageSectors, &list, &complete ) != 0 ) {
+        return 1;
+    }
+    if ( imageSectors > nsectors ) {
+        fprintf( stderr, "the card is smaller than the image\n" );
+        free( list.chunks );
+        return 1;
+    }
+
+    while ( next < list.n ) {
+        n = nextBatch( &list, next, buf, segs );
+        if ( disk_readv( 0, segs, n, READ_GAP ) != RES_OK ) {
+            fprintf( stderr, "read error at sector %llu\n", (unsigned long long)segs[0].sector );
+            free( list.chunks );
+            return 1;
+        }
+        for ( i = 0 ; i < n ; i++ ) {
+            size_t len = (size_t)segs[i].count * FF_MAX_SS;
+            if ( chksum_crc32( 0, segs[i].buff, len ) != list.chunks[next + i].crc ) {
+                printf( "sectors %llu-%llu differ\n", (unsigned long long)segs[i].sector,
+                        (unsigned long long)(segs[i].sector + segs[i].count - 1) );
+                bad++;
+            }
+            copied += len;
+        }
+        next += n;
+    }
+    free( list.chunks );
+
+    if ( !complete ) {
+        printf( "the backup is unfinished, checked the ranges it has\n" );
+    }
+    report( "verified", copied, imageSectors, monoSeconds() - start );
+    printf( "%u of %u ranges differ\n", bad, list.n );
+
+    return bad > 0 ? 1 : 0;
+}
+
+int main( int argc, char *argv[] ) {
+
+    const char *cardImage = NULL;
+    const char *spidev = NULL;
+    const char *command, *image;
+    char mapPath[4096];
+    LBA_t nsectors;
+    BYTE *buf;
+    DISKSEG *segs;
+    int opt, native = 0, resume = 0, erase = 0, rv;
+
+    while ( (opt = getopt( argc, argv, "i:ns:re" )) != -1 ) {
+        switch ( opt ) {
+            case 'i': {
+                cardImage = optarg;
+                break;
+            }
+            case 'n': {
+                native = 1;
+                break;
+            }
+            case 's': {
+                spidev = optarg;
+                break;
+            }
+            case 'r': {
+                resume = 1;
+                break;
+            }
+            case 'e': {
+                erase = 1;
+                break;
+            }
+            default: {
+                usage( argv[0] );
+                return 1;
+            }
+        }
+    }
+    if ( optind != argc - 2 ) {
+        usage( argv[0] );
+        return 1;
+    }
+    command = argv[optind];
+    image = argv[optind + 1];
+    snprintf( mapPath, sizeof( mapPath ), "%s.map", image );
+
+    if ( strcmp( command, "backup" ) != 0 && strcmp( command, "restore" ) != 0 &&
+         strcmp( command, "verify" ) != 0 ) {
+        usage( argv[0] );
+        return 1;
+    }
+
+    if ( cardImage != NULL ) {
+        disk_set_image( cardImage );
+    } else if ( spidev != NULL ) {
+        disk_set_spidev( spidev );
+    } else {
+        if ( !bcm2835_init() ) {
+            fprintf( stderr, "failed to initialise GPIO\n" );
+            return 1;
+        }
+        disk_set_transport( native ? DISK_TRANSPORT_SDNATIVE : DISK_TRANSPORT_SPI );
+    }
+
+    /** No sector cache: every sector is moved once */
+    if ( disk_initialize( 0 ) & STA_NOINIT ) {
+        fprintf( stderr, "card initialisation failed\n" );
+        return 1;
+    }
+    if ( strcmp( command, "restore" ) == 0 && (disk_status( 0 ) & STA_PROTECT) ) {
+        fprintf( stderr, "the card is write protected\n" );
+        return 1;
+    }
+    if ( disk_ioctl( 0, GET_SECTOR_COUNT, &nsectors ) != RES_OK ) {
+        fprintf( stderr, "failed to read the card size\n" );
+        return 1;
+    }
+
+    buf = malloc( (size_t)BATCH_SECTORS * FF_MAX_SS );
+    segs = malloc( BATCH_SECTORS * sizeof( DISKSEG ) );
+    if ( buf == NULL || segs == NULL ) {
+        fprintf( stderr, "out of memory\n" );
+        return 1;
+    }
+
+    if ( strcmp( command, "backup" ) == 0 ) {
+        rv = backup( image, mapPath, nsectors, resume, buf, segs );
+    } else if ( strcmp( command, "restore" ) == 0 ) {
+        rv = restore( image, mapPath, nsectors, resume, erase, buf, segs );
+    } else {
+        rv = verify( mapPath, nsectors, buf, segs );
+    }
+
+    free( buf );
+    free( segs );
+
+    return rv;
+}
@@ -0,0 +1,893 @@
+/**
+ * Export the SD card as a block device over NBD
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * An alternative to the FUSE daemon: the card is served as a raw block
+ * device so the kernel's own vfat driver, with its dentry, inode and page
+ * caches, does the filesystem work:
+ *
+ *   spifat-nbd /run/spifat.sock &
+ *   nbd-client -unix /run/spifat.sock /dev/nbd0 -b 512
+ *   mount -t vfat /dev/nbd0 /mnt/sd
+ *
+ * The server speaks the fixed newstyle NBD handshake on a UNIX socket and
+ * goes through diskio.c, so it gets the sector cache and error recovery
+ * of the FUSE daemon. On top of that:
+ *
+ * - Requests already queued on the socket are read as a batch, and runs of
+ *   reads or writes in it become one disk_readv()/disk_writev() session.
+ * - Sequential reads arm a read-ahead window which is prefetched into the
+ *   sector cache while the socket is idle.
+ * - Optionally (-w), writes are held in a write-back buffer and written in
+ *   LBA order on NBD_CMD_FLUSH, FUA, when the buffer fills, after a second
+ *   of idle or on disconnect. Until then a power cut loses them.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "bcm2835.h"
+#include "diskio.h"
+#include "sdcache.h"
+
+#define NBD_MAGIC               0x4e42444d41474943ULL   /** "NBDMAGIC" */
+#define NBD_OPTS_MAGIC          0x49484156454F5054ULL   /** "IHAVEOPT" */
+#define NBD_REP_MAGIC           0x0003e889045565a9ULL
+#define NBD_REQUEST_MAGIC       0x25609513
+#define NBD_REPLY_MAGIC         0x67446698
+
+#define NBD_FLAG_FIXED_NEWSTYLE 0x0001
+#define NBD_FLAG_NO_ZEROES      0x0002
+
+#define NBD_FLAG_HAS_FLAGS      0x0001
+#define NBD_FLAG_READ_ONLY      0x0002
+#define NBD_FLAG_SEND_FLUSH     0x0004
+#define NBD_FLAG_SEND_FUA       0x0008
+
+#define NBD_OPT_EXPORT_NAME     1
+#define NBD_OPT_ABORT           2
+#define NBD_OPT_INFO            6
+#define NBD_OPT_GO              7
+
+#define NBD_REP_ACK             1
+#define NBD_REP_INFO            3
+#define NBD_REP_ERR_UNSUP       0x80000001
+
+#define NBD_INFO_EXPORT         0
+
+#define NBD_CMD_READ            0
+#define NBD_CMD_WRITE           1
+#define NBD_CMD_DISC            2
+#define NBD_CMD_FLUSH           3
+
+#define NBD_CMD_FLAG_FUA        0x0001
+
+/** Requests taken off the socket in one go */
+#define NBD_BATCH 16
+
+/** Largest request accepted */
+#define NBD_MAX_REQUEST (1024 * 1024)
+
+/** Gap read through when merging reads, in sectors */
+#define NBD_READ_GAP 8
+
+/** Idle time before held writes are written back [ms] */
+#define NBD_IDLE_MS 1000
+
+typedef struct {
+    uint16_t flags;
+    uint16_t type;
+    uint64_t handle;
+    uint64_t offset;
+    uint32_t length;
+    BYTE *data;         /** Payload for reads and writes */
+    uint32_t error;
+} NbdRequest;
+
+static int sock = -1;
+static LBA_t nsectors = 0;
+static int readOnly = 0;
+static UINT raMax = 128;
+
+/** Read-ahead: the next sector expected and the window to prefetch */
+static LBA_t raNext = 0;
+static UINT raWindow = 0;
+static int raArmed = 0;
+
+/**
+ * Write-back buffer. Sectors are indexed by an open addressed table that
+ * is only ever cleared as a whole, after a flush.
+ */
+static UINT wbMax = 0;
+static UINT wbCount = 0;
+static LBA_t *wbSectors = NULL;
+static BYTE *wbData = NULL;
+static int *wbIndex = NULL;
+static UINT wbIndexSize = 0;
+static BYTE *wbBounce = NULL;
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static uint64_t toBE64( uint64_t v ) {
+
+    BYTE b[8];
+    int i;
+
+    for ( i = 0 ; i < 8 ; i++ ) {
+        b[i] = (BYTE)(v >> (56 - (i * 8)));
+    }
+    memcpy( &v, b, 8 );
+
+    return v;
+}
+
+static uint64_t fromBE64( uint64_t v ) {
+    return toBE64( v );
+}
+
+static uint32_t be32( const BYTE *p ) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void putBE32( BYTE *p, uint32_t v ) {
+
+    p[0] = (BYTE)(v >> 24);
+    p[1] = (BYTE)(v >> 16);
+    p[2] = (BYTE)(v >> 8);
+    p[3] = (BYTE)v;
+}
+
+static void putBE16( BYTE *p, uint16_t v ) {
+
+    p[0] = (BYTE)(v >> 8);
+    p[1] = (BYTE)v;
+}
+
+static int readFull( int fd, void *buf, size_t len ) {
+
+    BYTE *p = buf;
+    ssize_t n;
+
+    while ( len > 0 ) {
+        n = read( fd, p, len );
+        if ( n < 0 && errno == EINTR ) {
+            continue;
+        }
+        if ( n <= 0 ) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int writeFull( int fd, const void *buf, size_t len ) {
+
+    const BYTE *p = buf;
+    ssize_t n;
+
+    while ( len > 0 ) {
+        n = write( fd, p, len );
+        if ( n < 0 && errno == EINTR ) {
+            continue;
+        }
+        if ( n <= 0 ) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/** Returns: the write-back slot holding sector, -1 if it isn't held */
+static int wbFind( LBA_t sector ) {
+
+    UINT h = (UINT)((sector * 2654435761u) & (wbIndexSize - 1));
+
+    while ( wbIndex[h] != -1 ) {
+        if ( wbSectors[wbIndex[h]] == sector ) {
+            return wbIndex[h];
+        }
+        h = (h + 1) & (wbIndexSize - 1);
+    }
+
+    return -1;
+}
+
+static void wbInsert( LBA_t sector, const BYTE *data ) {
+
+    UINT h = (UINT)((sector * 2654435761u) & (wbIndexSize - 1));
+
+    while ( wbIndex[h] != -1 ) {
+        if ( wbSectors[wbIndex[h]] == sector ) {
+            memcpy( wbData + ((size_t)wbIndex[h] * FF_MAX_SS), data, FF_MAX_SS );
+            return;
+        }
+        h = (h + 1) & (wbIndexSize - 1);
+    }
+
+    wbIndex[h] = (int)wbCount;
+    wbSectors[wbCount] = sector;
+    memcpy( wbData + ((size_t)wbCount * FF_MAX_SS), data, FF_MAX_SS );
+    wbCount++;
+}
+
+static int compareSlots( const void *a, const void *b ) {
+
+    LBA_t sa = wbSectors[*(const int *)a];
+    LBA_t sb = wbSectors[*(const int *)b];
+
+    return sa < sb ? -1 : (sa > sb ? 1 : 0);
+}
+
+/**
+ * Writes every held sector back in LBA order as contiguous runs, all in
+ * one disk_writev() session.
+ *
+ * Returns: 0 = success, -1 = write failure (the sectors stay held)
+ */
+static int wbFlush( void ) {
+
+    DISKSEG segs[NBD_BATCH * 4];
+    int *order;
+    UINT i, nsegs = 0, done = 0;
+    int rv = 0;
+
+    if ( wbCount == 0 ) {
+        return 0;
+    }
+
+    order = malloc( wbCount * sizeof( int ) );
+    if ( order == NULL ) {
+        return -1;
+    }
+    for ( i = 0 ; i < wbCount ; i++ ) {
+        order[i] = (int)i;
+    }
+    qsort( order, wbCount, sizeof( int ), compareSlots );
+
+    for ( i = 0 ; i < wbCount && rv == 0 ; i++ ) {
+        LBA_t sector = wbSectors[order[i]];
+        BYTE *dst = wbBounce + ((size_t)i * FF_MAX_SS);
+
+        memcpy( dst, wbData + ((size_t)order[i] * FF_MAX_SS), FF_MAX_SS );
+        if ( nsegs > 0 &&
+             segs[nsegs - 1].sector + segs[nsegs - 1].count == sector &&
+             segs[nsegs - 1].count < 128 ) {
+            segs[nsegs - 1].count++;
+        } else {
+            if ( nsegs == sizeof( segs ) / sizeof( segs[0] ) ) {
+                rv = disk_writev( 0, segs, nsegs ) == RES_OK ? 0 : -1;
+                done = i;
+                nsegs = 0;
+            }
+            segs[nsegs].sector = sector;
+            segs[nsegs].count = 1;
+            segs[nsegs].buff = dst;
+            nsegs++;
+        }
+    }
+    if ( rv == 0 && nsegs > 0 ) {
+        rv = disk_writev( 0, segs, nsegs ) == RES_OK ? 0 : -1;
+    }
+
+    free( order );
+
+    if ( rv == 0 ) {
+        wbCount = 0;
+        for ( i = 0 ; i < wbIndexSize ; i++ ) {
+            wbIndex[i] = -1;
+        }
+    } else {
+        fprintf( stderr, "write-back of %u sectors failed after %u\n", wbCount, done );
+    }
+
+    return rv;
+}
+
+static int wbInit( UINT kb ) {
+
+    wbMax = (kb * 1024) / FF_MAX_SS;
+    if ( wbMax == 0 ) {
+        return 0;
+    }
+
+    for ( wbIndexSize = 1 ; wbIndexSize < wbMax * 2 ; wbIndexSize <<= 1 ) ;
+
+    wbSectors = malloc( wbMax * sizeof( LBA_t ) );
+    wbData = malloc( (size_t)wbMax * FF_MAX_SS );
+    wbBounce = malloc( (size_t)wbMax * FF_MAX_SS );
+    wbIndex = malloc( wbIndexSize * sizeof( int ) );
+    if ( wbSectors == NULL || wbData == NULL || wbBounce == NULL || wbIndex == NULL ) {
+        wbMax = 0;
+        return -1;
+    }
+    memset( wbIndex, 0xff, wbIndexSize * sizeof( int ) );
+
+    return 0;
+}
+
+/** Reads a request's sectors and lays any held writes over the top */
+static void wbOverlay( NbdRequest *req ) {
+
+    LBA_t sector = req->offset / FF_MAX_SS;
+    UINT i, count = req->length / FF_MAX_SS;
+    int slot;
+
+    if ( wbCount == 0 ) {
+        return;
+    }
+    for ( i = 0 ; i < count ; i++ ) {
+        slot = wbFind( sector + i );
+        if ( slot != -1 ) {
+            memcpy( req->data + ((size_t)i * FF_MAX_SS),
+                    wbData + ((size_t)slot * FF_MAX_SS), FF_MAX_SS );
+        }
+    }
+}
+
+/** Option haggling reply */
+static int sendOptReply( uint32_t opt, uint32_t type, const void *data, uint32_t len ) {
+
+    BYTE hdr[20];
+    uint64_t magic = toBE64( NBD_REP_MAGIC );
+
+    memcpy( hdr, &magic, 8 );
+    putBE32( hdr + 8, opt );
+    putBE32( hdr + 12, type );
+    putBE32( hdr + 16, len );
+    if ( writeFull( sock, hdr, sizeof( hdr ) ) != 0 ) {
+        return -1;
+    }
+
+    return len > 0 ? writeFull( sock, data, len ) : 0;
+}
+
+static uint16_t transmissionFlags( void ) {
+
+    uint16_t flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA;
+
+    if ( readOnly ) {
+        flags |= NBD_FLAG_READ_ONLY;
+    }
+
+    return flags;
+}
+
+/**
+ * Fixed newstyle handshake. Only the default export exists, so any name
+ * is accepted.
+ *
+ * Returns: 0 = enter transmission, -1 = drop the connection
+ */
+static int handshake( void ) {
+
+    BYTE buf[18];
+    uint64_t v;
+    uint32_t clientFlags, opt, len;
+    uint64_t size = (uint64_t)nsectors * FF_MAX_SS;
+
+    v = toBE64( NBD_MAGIC );
+    memcpy( buf, &v, 8 );
+    v = toBE64( NBD_OPTS_MAGIC );
+    memcpy( buf + 8, &v, 8 );
+    putBE16( buf + 16, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES );
+    if ( writeFull( sock, buf, 18 ) != 0 || readFull( sock, buf, 4 ) != 0 ) {
+        return -1;
+    }
+    clientFlags = be32( buf );
+
+    for ( ;; ) {
+        BYTE *data = NULL;
+
+        if ( readFull( sock, buf, 16 ) != 0 ) {
+            return -1;
+        }
+        memcpy( &v, buf, 8 );
+        if ( fromBE64( v ) != NBD_OPTS_MAGIC ) {
+            return -1;
+        }
+        opt = be32( buf + 8 );
+        len = be32( buf + 12 );
+        if ( len > 4096 ) {
+            return -1;
+        }
+        if ( len > 0 ) {
+            data = malloc( len );
+            if ( data == NULL || readFull( sock, data, len ) != 0 ) {
+                free( data );
+                return -1;
+            }
+        }
+        free( data );
+
+        switch ( opt ) {
+            case NBD_OPT_EXPORT_NAME: {
+                BYTE reply[10 + 124];
+                size_t rlen = 10;
+
+                v = toBE64( size );
+                memcpy( reply, &v, 8 );
+                putBE16( reply + 8, transmissionFlags() );
+                if ( !(clientFlags & NBD_FLAG_NO_ZEROES) ) {
+                    memset( reply + 10, 0, 124 );
+                    rlen += 124;
+                }
+                return writeFull( sock, reply, rlen );
+            }
+            case NBD_OPT_INFO:
+            case NBD_OPT_GO: {
+                BYTE info[12];
+
+                putBE16( info, NBD_INFO_EXPORT );
+                v = toBE64( size );
+                memcpy( info + 2, &v, 8 );
+                putBE16( info + 10, transmissionFlags() );
+                if ( sendOptReply( opt, NBD_REP_INFO, info, sizeof( info ) ) != 0 ||
+                     sendOptReply( opt, NBD_REP_ACK, NULL, 0 ) != 0 ) {
+                    return -1;
+                }
+                if ( opt == NBD_OPT_GO ) {
+                    return 0;
+                }
+                break;
+            }
+            case NBD_OPT_ABORT: {
+                sendOptReply( opt, NBD_REP_ACK, NULL, 0 );
+                return -1;
+            }
+            default: {
+                if ( sendOptReply( opt, NBD_REP_ERR_UNSUP, NULL, 0 ) != 0 ) {
+                    return -1;
+                }
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Reads one request and its write payload.
+ *
+ * Returns: 0 = success, -1 = connection lost or protocol error
+ */
+static int readRequest( NbdRequest *req ) {
+
+    BYTE hdr[28];
+    uint64_t v, size = (uint64_t)nsectors * FF_MAX_SS;
+
+    if ( readFull( sock, hdr, sizeof( hdr ) ) != 0 || be32( hdr ) != NBD_REQUEST_MAGIC ) {
+        return -1;
+    }
+
+    req->flags = (uint16_t)((hdr[4] << 8) | hdr[5]);
+    req->type = (uint16_t)((hdr[6] << 8) | hdr[7]);
+    memcpy( &req->handle, hdr + 8, 8 );         /** Opaque, echoed back as is */
+    memcpy( &v, hdr + 16, 8 );
+    req->offset = fromBE64( v );
+    req->length = be32( hdr + 24 );
+    req->data = NULL;
+    req->error = 0;
+
+    if ( req->type != NBD_CMD_READ && req->type != NBD_CMD_WRITE ) {
+        return 0;
+    }
+
+    if ( req->length > NBD_MAX_REQUEST ) {
+        return -1;      /** The payload can't be skipped safely */
+    }
+    req->data = malloc( req->length ? req->length : 1 );
+    if ( req->data == NULL ) {
+        return -1;
+    }
+    if ( req->type == NBD_CMD_WRITE && readFull( sock, req->data, req->length ) != 0 ) {
+        free( req->data );
+        req->data = NULL;
+        return -1;
+    }
+
+    /** Written so that an offset near 2^64 can't wrap past the end */
+    if ( (req->offset % FF_MAX_SS) != 0 || (req->length % FF_MAX_SS) != 0 ||
+         req->offset > size || req->length > size - req->offset ) {
+        req->error = EINVAL;
+    } else if ( req->type == NBD_CMD_WRITE && readOnly ) {
+        req->error = EPERM;
+    }
+
+    return 0;
+}
+
+static int sendReply( const NbdRequest *req ) {
+
+    BYTE hdr[16];
+
+    putBE32( hdr, NBD_REPLY_MAGIC );
+    putBE32( hdr + 4, req->error );
+    memcpy( hdr + 8, &req->handle, 8 );
+    if ( writeFull( sock, hdr, sizeof( hdr ) ) != 0 ) {
+        return -1;
+    }
+    if ( req->type == NBD_CMD_READ && req->error == 0 ) {
+        return writeFull( sock, req->data, req->length );
+    }
+
+    return 0;
+}
+
+/** Runs reads batch[first..last) as one disk_readv() session */
+static void doReads( NbdRequest *batch, UINT first, UINT last ) {
+
+    DISKSEG segs[NBD_BATCH];
+    UINT i, nsegs = 0;
+
+    for ( i = first ; i < last ; i++ ) {
+        if ( batch[i].error == 0 && batch[i].length > 0 ) {
+            segs[nsegs].sector = batch[i].offset / FF_MAX_SS;
+            segs[nsegs].count = batch[i].length / FF_MAX_SS;
+            segs[nsegs].buff = batch[i].data;
+            nsegs++;
+        }
+    }
+    if ( nsegs > 0 && disk_readv( 0, segs, nsegs, NBD_READ_GAP ) != RES_OK ) {
+        for ( i = first ; i < last ; i++ ) {
+            if ( batch[i].error == 0 ) {
+                batch[i].error = EIO;
+            }
+        }
+    }
+
+    for ( i = first ; i < last ; i++ ) {
+        LBA_t start = batch[i].offset / FF_MAX_SS;
+        UINT count = batch[i].length / FF_MAX_SS;
+
+        if ( batch[i].error != 0 ) {
+            continue;
+        }
+        wbOverlay( &batch[i] );
+
+        /** A read that carries on from the last one (re)arms read-ahead */
+        if ( raMax > 0 ) {
+            if ( start == raNext ) {
+                raWindow = raWindow ? raWindow * 2 : count;
+                if ( raWindow > raMax ) {
+                    raWindow = raMax;
+                }
+                raArmed = 1;
+            } else {
+                raWindow = 0;
+                raArmed = 0;
+            }
+            raNext = start + count;
+        }
+    }
+}
+
+/** Runs writes batch[first..last) through the write-back buffer or as one session */
+static void doWrites( NbdRequest *batch, UINT first, UINT last ) {
+
+    DISKSEG segs[NBD_BATCH];
+    UINT i, j, nsegs = 0;
+    int fua = 0;
+
+    for ( i = first ; i < last ; i++ ) {
+        if ( batch[i].error != 0 || batch[i].length == 0 ) {
+            continue;
+        }
+        fua |= (batch[i].flags & NBD_CMD_FLAG_FUA) != 0;
+
+        if ( wbMax > 0 ) {
+            UINT count = batch[i].length / FF_MAX_SS;
+            for ( j = 0 ; j < count ; j++ ) {
+                if ( wbCount == wbMax && wbFlush() != 0 ) {
+                    batch[i].error = EIO;
+                    break;
+                }
+                wbInsert( batch[i].offset / FF_MAX_SS + j,
+                          batch[i].data + ((size_t)j * FF_MAX_SS) );
+            }
+        } else {
+            segs[nsegs].sector = batch[i].offset / FF_MAX_SS;
+            segs[nsegs].count = batch[i].length / FF_MAX_SS;
+            segs[nsegs].buff = batch[i].data;
+            nsegs++;
+        }
+    }
+
+    if ( nsegs > 0 && disk_writev( 0, segs, nsegs ) != RES_OK ) {
+        for ( i = first ; i < last ; i++ ) {
+            if ( batch[i].error == 0 ) {
+                batch[i].error = EIO;
+            }
+        }
+    }
+
+    /** Forced unit access: nothing in the batch is acknowledged until it is on the card */
+    if ( fua && wbFlush() != 0 ) {
+        for ( i = first ; i < last ; i++ ) {
+            batch[i].error = EIO;
+        }
+    }
+}
+
+/**
+ * Serves one connection until the client disconnects.
+ *
+ * Returns: 0 = clean disconnect, -1 = connection lost
+ */
+static int serve( void ) {
+
+    NbdRequest batch[NBD_BATCH];
+    struct pollfd pfd;
+    UINT n, i, j;
+    int rv, disc = 0;
+
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+
+    while ( !disc && !stopRequested ) {
+
+        /** Idle: read ahead first, then write back */
+        rv = poll( &pfd, 1, raArmed || wbCount > 0 ? 0 : -1 );
+        if ( rv == 0 ) {
+            if ( raArmed ) {
+                UINT count = raWindow;
+                if ( raNext + count > nsectors ) {
+                    count = (UINT)(nsectors - raNext);
+                }
+                if ( count > 0 ) {
+                    disk_prefetch( 0, raNext, count );
+                }
+                raArmed = 0;
+            } else if ( poll( &pfd, 1, NBD_IDLE_MS ) == 0 ) {
+                wbFlush();
+            }
+            continue;
+        }
+        if ( rv < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return -1;
+        }
+
+        /** Take everything already queued, up to a batch */
+        n = 0;
+        do {
+            if ( readRequest( &batch[n] ) != 0 ) {
+                for ( i = 0 ; i < n ; i++ ) {
+                    free( batch[i].data );
+                }
+                return -1;
+            }
+            n++;
+        } while ( n < NBD_BATCH && poll( &pfd, 1, 0 ) > 0 );
+
+        /** Runs of the same command type go to the card together, in order */
+        for ( i = 0 ; i < n ; i = j ) {
+            for ( j = i + 1 ; j < n && batch[j].type == batch[i].type ; j++ ) ;
+
+            switch ( batch[i].type ) {
+                case NBD_CMD_READ: {
+                    doReads( batch, i, j );
+                    break;
+                }
+                case NBD_CMD_WRITE: {
+                    doWrites( batch, i, j );
+                    break;
+                }
+                case NBD_CMD_FLUSH: {
+                    UINT k;
+                    int err = 0;
+                    if ( wbFlush() != 0 || disk_ioctl( 0, CTRL_SYNC, NULL ) != RES_OK ) {
+                        err = EIO;
+                    }
+                    for ( k = i ; k < j ; k++ ) {
+                        batch[k].error = err;
+                    }
+                    break;
+                }
+                case NBD_CMD_DISC: {
+                    disc = 1;
+                    break;
+                }
+                default: {
+                    UINT k;
+                    for ( k = i ; k < j ; k++ ) {
+                        batch[k].error = EINVAL;
+                    }
+                    break;
+                }
+            }
+        }
+
+        /** Replies go out in request order; a disconnect gets none */
+        for ( i = 0 ; i < n ; i++ ) {
+            if ( batch[i].type != NBD_CMD_DISC && sendReply( &batch[i] ) != 0 ) {
+                disc = -1;
+            }
+            free( batch[i].data );
+        }
+    }
+
+    return disc < 0 ? -1 : 0;
+}
+
+static void onSignal( int sig ) {
+
+    (void) sig;
+    stopRequested = 1;
+}
+
+static void usage( const char *progname ) {
+    fprintf( stderr, "usage: %s [options] <socket>\n", progname );
+    fprintf( stderr, "    -c <kb>       sector cache size (default: 4096)\n" );
+    fprintf( stderr, "    -i <file>     serve a card image file instead of the card\n" );
+    fprintf( stderr, "    -n            use the 4-bit SD bus wiring\n" );
+    fprintf( stderr, "    -s <dev>      reach the card through a spidev device\n" );
+    fprintf( stderr, "    -r            export read-only\n" );
+    fprintf( stderr, "    -a <sectors>  largest read-ahead window (default: 128, 0 disables)\n" );
+    fprintf( stderr, "    -w <kb>       hold up to this many KB of writes for write-back (default: 0)\n" );
+}
+
+int main( int argc, char *argv[] ) {
+
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    const char *image = NULL;
+    const char *spidev = NULL;
+    UINT cacheKb = 4096, wbKb = 0;
+    int opt, native = 0, listenfd;
+
+    while ( (opt = getopt( argc, argv, "a:c:i:nrs:w:" )) != -1 ) {
+        switch ( opt ) {
+            case 'a': {
+                raMax = (UINT)strtoul( optarg, NULL, 10 );
+                break;
+            }
+            case 'c': {
+                cacheKb = (UINT)strtoul( optarg, NULL, 10 );
+                break;
+            }
+            case 'i': {
+                image = optarg;
+                break;
+            }
+            case 'n': {
+                native = 1;
+                break;
+            }
+            case 'r': {
+                readOnly = 1;
+                break;
+            }
+            case 's': {
+                spidev = optarg;
+                break;
+            }
+            case 'w': {
+                wbKb = (UINT)strtoul( optarg, NULL, 10 );
+                break;
+            }
+            default: {
+                usage( argv[0] );
+                return 1;
+            }
+        }
+    }
+    if ( optind != argc - 1 ) {
+        usage( argv[0] );
+        return 1;
+    }
+
+    if ( image != NULL ) {
+        disk_set_image( image );
+    } else if ( spidev != NULL ) {
+        disk_set_spidev( spidev );
+    } else {
+        if ( !bcm2835_init() ) {
+            fprintf( stderr, "failed to initialise GPIO\n" );
+            return 1;
+        }
+        disk_set_transport( native ? DISK_TRANSPORT_SDNATIVE : DISK_TRANSPORT_SPI );
+    }
+
+    if ( sdcache_init( (cacheKb * 1024) / FF_MAX_SS ) != 0 ) {
+        fprintf( stderr, "failed to allocate %uKB sector cache. running uncached\n", cacheKb );
+    }
+    if ( wbInit( wbKb ) != 0 ) {
+        fprintf( stderr, "failed to allocate %uKB write-back buffer. writing through\n", wbKb );
+    }
+
+    if ( disk_initialize( 0 ) & STA_NOINIT ) {
+        fprintf( stderr, "card initialisation failed\n" );
+        return 1;
+    }
+    if ( disk_status( 0 ) & STA_PROTECT ) {
+        readOnly = 1;
+    }
+    if ( disk_ioctl( 0, GET_SECTOR_COUNT, &nsectors ) != RES_OK ) {
+        fprintf( stderr, "failed to read the card size\n" );
+        return 1;
+    }
+
+    listenfd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if ( listenfd < 0 ) {
+        perror( "socket" );
+        return 1;
+    }
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sun_family = AF_UNIX;
+    strncpy( addr.sun_path, argv[optind], sizeof( addr.sun_path ) - 1 );
+    unlink( addr.sun_path );
+    if ( bind( listenfd, (struct sockaddr *)&addr, sizeof( addr ) ) != 0 || listen( listenfd, 1 ) != 0 ) {
+        perror( argv[optind] );
+        return 1;
+    }
+
+    /** Held writes are flushed on the way out */
+    memset( &sa, 0, sizeof( sa ) );
+    sa.sa_handler = onSignal;
+    sigaction( SIGINT, &sa, NULL );
+    sigaction( SIGTERM, &sa, NULL );
+    signal( SIGPIPE, SIG_IGN );
+
+    printf( "exporting %llu sectors%s on %s\n", (unsigned long long)nsectors,
+            readOnly ? " read-only" : "", addr.sun_path );
+
+    while ( !stopRequested ) {
+        sock = accept( listenfd, NULL, NULL );
+        if ( sock < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            perror( "accept" );
+            break;
+        }
+
+        if ( handshake() == 0 ) {
+            serve();
+        }
+        wbFlush();
+        close( sock );
+        sock = -1;
+        raArmed = 0;
+        raWindow = 0;
+    }
+
+    wbFlush();
+    disk_ioctl( 0, CTRL_SYNC, NULL );
+    close( listenfd );
+    unlink( addr.sun_path );
+
+    return 0;
+}
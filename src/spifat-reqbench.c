@@ -0,0 +1,168 @@
+/**
+ * Measure FUSE request rates on a spi-fat-fuse mount
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Issues small requests that the kernel can't answer from its own caches,
+ * so each one is a round trip to the daemon, and prints the rate:
+ *
+ *   getattr/s  stat() of a name that doesn't exist (negative lookups
+ *              aren't cached by spi-fat-fuse)
+ *   read4k/s   4KB O_DIRECT reads cycling through <file>
+ *
+ * With an image file behind the mount (--image) the card is out of the
+ * picture and the numbers are dominated by the request transport.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define BENCH_IO_SIZE 4096
+
+static double now( void ) {
+
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void usage( const char *progname ) {
+    fprintf( stderr, "usage: %s [-t <seconds>] <file>\n", progname );
+    fprintf( stderr, "    -t <seconds>  time to run each test for (default: 5)\n" );
+}
+
+/** Returns: getattr requests per second, -1 on failure */
+static double benchGetattr( const char *file, double seconds ) {
+
+    char path[PATH_MAX];
+    char *slash;
+    struct stat st;
+    double start, end;
+    unsigned long n = 0;
+
+    strncpy( path, file, sizeof( path ) - 16 );
+    path[sizeof( path ) - 16] = '\0';
+    slash = strrchr( path, '/' );
+    strcpy( slash != NULL ? slash + 1 : path, "NOSUCH.XYZ" );
+
+    start = now();
+    end = start + seconds;
+    do {
+        if ( stat( path, &st ) == 0 || errno != ENOENT ) {
+            fprintf( stderr, "%s: expected ENOENT\n", path );
+            return -1;
+        }
+        n++;
+    } while ( (n & 63) != 0 || now() < end );
+
+    return n / (now() - start);
+}
+
+/** Returns: 4KB reads per second, -1 on failure */
+static double benchRead( const char *file, double seconds ) {
+
+    void *buf;
+    struct stat st;
+    double start, end;
+    unsigned long n = 0;
+    off_t offset = 0;
+    int fd;
+
+    fd = open( file, O_RDONLY | O_DIRECT );
+    if ( fd < 0 ) {
+        /** Without O_DIRECT the page cache answers after the first pass */
+        perror( file );
+        return -1;
+    }
+    if ( fstat( fd, &st ) != 0 || st.st_size < BENCH_IO_SIZE ) {
+        fprintf( stderr, "%s: needs to be at least %d bytes\n", file, BENCH_IO_SIZE );
+        close( fd );
+        return -1;
+    }
+    if ( posix_memalign( &buf, BENCH_IO_SIZE, BENCH_IO_SIZE ) != 0 ) {
+        close( fd );
+        return -1;
+    }
+
+    start = now();
+    end = start + seconds;
+    do {
+        if ( offset + BENCH_IO_SIZE > st.st_size ) {
+            offset = 0;
+        }
+        if ( pread( fd, buf, BENCH_IO_SIZE, offset ) != BENCH_IO_SIZE ) {
+            perror( file );
+            n = 0;
+            break;
+        }
+        offset += BENCH_IO_SIZE;
+        n++;
+    } while ( (n & 63) != 0 || now() < end );
+
+    end = now();
+    free( buf );
+    close( fd );
+
+    return n > 0 ? n / (end - start) : -1;
+}
+
+int main( int argc, char *argv[] ) {
+
+    double seconds = 5, getattrRate, readRate;
+    int opt;
+
+    while ( (opt = getopt( argc, argv, "t:" )) != -1 ) {
+        switch ( opt ) {
+            case 't': {
+                seconds = strtod( optarg, NULL );
+                break;
+            }
+            default: {
+                usage( argv[0] );
+                return 1;
+            }
+        }
+    }
+    if ( optind != argc - 1 || seconds <= 0 ) {
+        usage( argv[0] );
+        return 1;
+    }
+
+    getattrRate = benchGetattr( argv[optind], seconds );
+    readRate = benchRead( argv[optind], seconds );
+    if ( getattrRate < 0 || readRate < 0 ) {
+        return 1;
+    }
+
+    printf( "getattr/s  %10.0f\n", getattrRate );
+    printf( "read4k/s   %10.0f\n", readRate );
+
+    return 0;
+}
@@ -0,0 +1,291 @@
+/**
+ * Show which processes are loading a spi-fat-fuse mount's card
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Polls user.spifat.procstats on the mount root and prints, per process,
+ * what it did in the last interval, busiest card user first:
+ *
+ *   PID  UID  COMMAND  CARD%  OPS/s  READ KB/s  WRITE KB/s  HIT%  WAIT%  LIMIT
+ *
+ * CARD% is the share of the interval the card spent on the process's
+ * requests, including the FAT and directory I/O they caused. WAIT% is
+ * the share it spent held back by its card time limit.
+ *
+ *   spifat-top /mnt/sd                 refresh every 2 seconds
+ *   spifat-top -d 1 -n 10 -b /mnt/sd   10 one second samples, no screen clearing
+ *   spifat-top -l 1234:100 /mnt/sd     limit pid 1234 to 100ms of card time per second
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/xattr.h>
+
+#include "spifat-xattr.h"
+
+#define MAX_PROCS 256
+
+typedef struct {
+    int pid;
+    unsigned int uid;
+    char comm[16];
+    unsigned long long ops;
+    unsigned long long readBytes;
+    unsigned long long writtenBytes;
+    unsigned long long cardUs;
+    unsigned long long cardSectors;
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long throttledUs;
+    unsigned int limitMs;
+} Proc;
+
+typedef struct {
+    Proc p;
+    unsigned long long cardUs;  /** Over the interval */
+} Row;
+
+static void usage( const char *progname ) {
+    fprintf( stderr, "usage: %s [-b] [-d <seconds>] [-n <count>] [-l <pid>:<ms>] [-r] <mountpoint>\n", progname );
+    fprintf( stderr, "    -b    batch mode: don't clear the screen between samples\n" );
+    fprintf( stderr, "    -d    seconds between samples (default 2)\n" );
+    fprintf( stderr, "    -n    exit after this many samples\n" );
+    fprintf( stderr, "    -l    limit pid to ms of card time per second (0 lifts it) and exit\n" );
+    fprintf( stderr, "    -r    reset the counters and exit\n" );
+}
+
+/** Returns: the number of processes read, -1 on error */
+static int readProcs( const char *path, Proc *procs ) {
+
+    char *buf, *line, *save;
+    ssize_t len;
+    int n = 0;
+
+    len = getxattr( path, PROCSTATS_XATTR, NULL, 0 );
+    if ( len < 0 ) {
+        perror( path );
+        return -1;
+    }
+    buf = malloc( len + 1 );
+    if ( buf == NULL ) {
+        return -1;
+    }
+    len = getxattr( path, PROCSTATS_XATTR, buf, len );
+    if ( len < 0 ) {
+        perror( path );
+        free( buf );
+        return -1;
+    }
+    buf[len] = '\0';
+
+    for ( line = strtok_r( buf, "\n", &save ) ; line != NULL && n < MAX_PROCS ; line = strtok_r( NULL, "\n", &save ) ) {
+        Proc *p = &procs[n];
+        if ( sscanf( line, "%d %u %15s %llu %llu %llu %llu %llu %llu %llu %llu %u",
+                     &p->pid, &p->uid, p->comm, &p->ops, &p->readBytes, &p->writtenBytes,
+                     &p->cardUs, &p->cardSectors, &p->hits, &p->misses, &p->throttledUs, &p->limitMs ) == 12 ) {
+            n++;
+        }
+    }
+    free( buf );
+
+    return n;
+}
+
+static const Proc *findProc( const Proc *procs, int n, int pid ) {
+
+    int i;
+
+    for ( i = 0 ; i < n ; i++ ) {
+        if ( procs[i].pid == pid ) {
+            return &procs[i];
+        }
+    }
+
+    return NULL;
+}
+
+static int compareRows( const void *a, const void *b ) {
+
+    const Row *ra = a, *rb = b;
+
+    return ra->cardUs < rb->cardUs ? 1 : ra->cardUs > rb->cardUs ? -1 : 0;
+}
+
+static double monoSeconds( void ) {
+
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+/** One screen: the difference between two samples secs apart */
+static void printSample( const Proc *prev, int nprev, const Proc *cur, int ncur, double secs ) {
+
+    static Row rows[MAX_PROCS];
+    Proc zero;
+    double us = secs * 1e6, total = 0;
+    int i, nrows = 0;
+
+    memset( &zero, 0, sizeof( zero ) );
+    for ( i = 0 ; i < ncur ; i++ ) {
+        const Proc *p = findProc( prev, nprev, cur[i].pid );
+        Row *r = &rows[nrows];
+
+        /** A pid seen for the first time, or after a reset, counts from zero */
+        if ( p == NULL || p->ops > cur[i].ops ) {
+            p = &zero;
+        }
+        if ( cur[i].ops == p->ops ) {
+            continue;
+        }
+        r->p = cur[i];
+        r->p.ops -= p->ops;
+        r->p.readBytes -= p->readBytes;
+        r->p.writtenBytes -= p->writtenBytes;
+        r->p.hits -= p->hits;
+        r->p.misses -= p->misses;
+        r->p.throttledUs -= p->throttledUs;
+        r->cardUs = cur[i].cardUs - p->cardUs;
+        total += r->cardUs;
+        nrows++;
+    }
+    qsort( rows, nrows, sizeof( Row ), compareRows );
+
+    printf( "card busy %.1f%% over %.1fs\n\n", (total * 100.0) / us, secs );
+    printf( "%7s %5s %-15s %6s %7s %10s %10s %5s %6s %6s\n",
+            "PID", "UID", "COMMAND", "CARD%", "OPS/s", "READ KB/s", "WRITE KB/s", "HIT%", "WAIT%", "LIMIT" );
+    for ( i = 0 ; i < nrows ; i++ ) {
+        const Proc *p = &rows[i].p;
+        unsigned long long reads = p->hits + p->misses;
+        char limit[16];
+
+        if ( p->limitMs ) {
+            snprintf( limit, sizeof( limit ), "%ums", p->limitMs );
+        } else {
+            snprintf( limit, sizeof( limit ), "-" );
+        }
+        printf( "%7d %5u %-15s %6.1f %7.1f %10.1f %10.1f %5.0f %6.1f %6s\n",
+                p->pid, p->uid, p->comm, (rows[i].cardUs * 100.0) / us, p->ops / secs,
+                p->readBytes / 1024.0 / secs, p->writtenBytes / 1024.0 / secs,
+                reads ? (p->hits * 100.0) / reads : 100.0, (p->throttledUs * 100.0) / us, limit );
+    }
+}
+
+int main( int argc, char *argv[] ) {
+
+    static Proc procs[2][MAX_PROCS];
+    int opt, batch = 0, count = -1, reset = 0, pid, n[2], cur = 0;
+    unsigned int ms;
+    double delay = 2.0, then, now;
+    const char *limit = NULL, *path;
+    char value[32];
+
+    while ( (opt = getopt( argc, argv, "bd:n:l:r" )) != -1 ) {
+        switch ( opt ) {
+            case 'b': {
+                batch = 1;
+                break;
+            }
+            case 'd': {
+                delay = atof( optarg );
+                break;
+            }
+            case 'n': {
+                count = atoi( optarg );
+                break;
+            }
+            case 'l': {
+                limit = optarg;
+                break;
+            }
+            case 'r': {
+                reset = 1;
+                break;
+            }
+            default: {
+                usage( argv[0] );
+                return 1;
+            }
+        }
+    }
+
+    if ( optind != argc - 1 || delay <= 0 ) {
+        usage( argv[0] );
+        return 1;
+    }
+    path = argv[optind];
+
+    if ( limit != NULL ) {
+        if ( sscanf( limit, "%d:%u", &pid, &ms ) != 2 ) {
+            usage( argv[0] );
+            return 1;
+        }
+        snprintf( value, sizeof( value ), "%d %u", pid, ms );
+        if ( setxattr( path, PROCLIMIT_XATTR, value, strlen( value ), 0 ) != 0 ) {
+            perror( path );
+            return 1;
+        }
+        return 0;
+    }
+
+    if ( reset ) {
+        if ( setxattr( path, PROCSTATS_XATTR, "reset", 5, 0 ) != 0 ) {
+            perror( path );
+            return 1;
+        }
+        return 0;
+    }
+
+    n[cur] = readProcs( path, procs[cur] );
+    if ( n[cur] < 0 ) {
+        return 1;
+    }
+    then = monoSeconds();
+
+    while ( count != 0 ) {
+        usleep( (useconds_t)(delay * 1e6) );
+
+        cur ^= 1;
+        n[cur] = readProcs( path, procs[cur] );
+        if ( n[cur] < 0 ) {
+            return 1;
+        }
+        now = monoSeconds();
+
+        if ( !batch ) {
+            printf( "\033[H\033[J" );
+        }
+        printSample( procs[cur ^ 1], n[cur ^ 1], procs[cur], n[cur], now - then );
+        printf( "\n" );
+        fflush( stdout );
+
+        then = now;
+        if ( count > 0 ) {
+            count--;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,68 @@
+/**
+ * USDT tracepoints
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SPIFAT_TRACE_DEFINED
+#define _SPIFAT_TRACE_DEFINED
+
+/**
+ * SPIFAT_TRACE( name, args... ) places a static probe "spifat:name" for
+ * bpftrace and perf. With systemtap's <sys/sdt.h> a probe is a single nop
+ * plus an ELF note recording where its arguments live; the tracer reads
+ * them only once it attaches. Without the header, or built with
+ * -DSPIFAT_NO_TRACE, the probes compile away.
+ *
+ * Probes come in _entry/_return pairs where latency matters; the tracer
+ * timestamps both ends so no clock is read when nothing is attached.
+ *
+ *   fuse_entry( op, path )                 spi-fat-fuse.c callbacks
+ *   fuse_return( op, path, rv )
+ *   f_open_entry( path, mode )             ff.c API
+ *   f_open_return( path, res )
+ *   f_read_entry( fp, fptr, btr )
+ *   f_read_return( fp, res, br )
+ *   f_write_entry( fp, fptr, btw )
+ *   f_write_return( fp, res, bw )
+ *   f_sync_entry( fp )
+ *   f_sync_return( fp, res )
+ *   window_miss( old, new )                ff.c move_window() sector change
+ *   disk_read_entry( lba, count )          diskio.c
+ *   disk_read_return( lba, count, res )
+ *   disk_write_entry( lba, count )
+ *   disk_write_return( lba, count, res )
+ *   send_cmd( cmd, arg, resp )             sdmm.c: R1 (bit 7 set if not sent)
+ *                                          sdnative.c: 1 = OK, 0 = failed
+ *   wait_ready( ok, polls )                sdmm.c
+ *
+ * See the scripts in bpftrace/.
+ */
+
+#if !defined(SPIFAT_NO_TRACE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define SPIFAT_TRACE(...) STAP_PROBEV(spifat, __VA_ARGS__)
+#endif
+#endif
+
+#ifndef SPIFAT_TRACE
+#define SPIFAT_TRACE(...) do { } while (0)
+#endif
+
+#endif
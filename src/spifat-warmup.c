@@ -0,0 +1,121 @@
+/**
+ * Warm the spi-fat-fuse sector cache for a directory tree
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Talks to a running spi-fat-fuse through the user.spifat.warmup extended
+ * attribute on the mounted directory:
+ *
+ *   spifat-warmup /mnt/sd/GAMES/ARCADE         start warming a category
+ *   spifat-warmup -w /mnt/sd/GAMES/ARCADE      start and report progress
+ *   spifat-warmup -s /mnt/sd                   show current progress
+ *   spifat-warmup -c /mnt/sd                   cancel
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/xattr.h>
+
+#include "spifat-xattr.h"
+
+static void usage( const char *progname ) {
+    fprintf( stderr, "usage: %s [-c|-s|-w] <path>\n", progname );
+    fprintf( stderr, "    -c    cancel the running warm-up\n" );
+    fprintf( stderr, "    -s    show warm-up progress\n" );
+    fprintf( stderr, "    -w    start and wait, reporting progress\n" );
+}
+
+static int getStatus( const char *path, char *buf, size_t bufsz ) {
+
+    ssize_t len = getxattr( path, WARMUP_XATTR, buf, bufsz - 1 );
+    if ( len < 0 ) {
+        perror( "getxattr" );
+        return -1;
+    }
+    buf[len] = '\0';
+
+    return 0;
+}
+
+int main( int argc, char *argv[] ) {
+
+    int opt;
+    int cancel = 0, show = 0, wait = 0;
+    char status[512];
+
+    while ( (opt = getopt( argc, argv, "csw" )) != -1 ) {
+        switch ( opt ) {
+            case 'c': {
+                cancel = 1;
+                break;
+            }
+            case 's': {
+                show = 1;
+                break;
+            }
+            case 'w': {
+                wait = 1;
+                break;
+            }
+            default: {
+                usage( argv[0] );
+                return 1;
+            }
+        }
+    }
+
+    if ( optind >= argc ) {
+        usage( argv[0] );
+        return 1;
+    }
+
+    const char *path = argv[optind];
+
+    if ( show ) {
+        if ( getStatus( path, status, sizeof( status ) ) != 0 ) {
+            return 1;
+        }
+        printf( "%s\n", status );
+        return 0;
+    }
+
+    const char *value = cancel ? "cancel" : "start";
+    if ( setxattr( path, WARMUP_XATTR, value, strlen( value ), 0 ) != 0 ) {
+        perror( "setxattr" );
+        return 1;
+    }
+
+    while ( wait ) {
+        if ( getStatus( path, status, sizeof( status ) ) != 0 ) {
+            return 1;
+        }
+        printf( "\r%s", status );
+        fflush( stdout );
+        if ( strncmp( status, "running", 7 ) != 0 ) {
+            printf( "\n" );
+            break;
+        }
+        usleep( 200000 );
+    }
+
+    return 0;
+}
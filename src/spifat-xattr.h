@@ -0,0 +1,74 @@
+/**
+ * Extended attribute names understood by spi-fat-fuse
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Kept free of FatFs headers so the command line tools can use it
+ * alongside <dirent.h>
+ */
+
+#ifndef _SPIFAT_XATTR_DEFINED
+#define _SPIFAT_XATTR_DEFINED
+
+/** Directory warm-up control and progress */
+#define WARMUP_XATTR "user.spifat.warmup"
+
+/** Content hashes */
+#define HASHIDX_CRC32_XATTR "user.spifat.crc32"
+#define HASHIDX_SHA1_XATTR "user.spifat.sha1"
+
+/** File layout */
+#define FATEXTENT_SCLUST_XATTR "user.spifat.sclust"
+#define FATEXTENT_COUNT_XATTR "user.spifat.extents"
+#define FATEXTENT_MAP_XATTR "user.spifat.extentmap"
+#define FATEXTENT_ATTR_XATTR "user.spifat.attr"
+
+/** Setting it deletes a directory and its whole subtree in one pass */
+#define RMTREE_XATTR "user.spifat.rmtree"
+
+/** SPI bus framing counters, "reset" zeroes them */
+#define BUSSTATS_XATTR "user.spifat.busstats"
+
+/** Transient card error recovery counters */
+#define RECOVERY_XATTR "user.spifat.recovery"
+
+/** Card initialisation timing */
+#define INITSTATS_XATTR "user.spifat.initstats"
+
+/** Write path copies per byte and CPU per MB, "reset" zeroes them */
+#define COPYSTATS_XATTR "user.spifat.copystats"
+
+/** Card sectors written by cause against logical bytes, "reset" zeroes them */
+#define WRSTATS_XATTR "user.spifat.wrstats"
+
+/** Per LBA bucket read/write heat and LRU hit rate by cache size as CSV, "reset" zeroes both */
+#define HEATMAP_XATTR "user.spifat.heatmap"
+#define REUSE_XATTR "user.spifat.reuse"
+
+/** Per-process ops, bytes, card time and cache use, "reset" zeroes them */
+#define PROCSTATS_XATTR "user.spifat.procstats"
+
+/** Write-only: "<pid> <ms>" limits pid to ms of card time per second, 0 lifts it */
+#define PROCLIMIT_XATTR "user.spifat.proclimit"
+
+/** Read-only mounts: lock-free attribute cache hits and misses */
+#define ATTRCACHE_XATTR "user.spifat.attrcache"
+
+#endif
@@ -0,0 +1,2307 @@
+/**
+ * libspifat: the FatFs, card transport and cache stack as a library
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * FatFs is built without FF_FS_REENTRANT so every entry point takes
+ * fsLock for the whole call. The transport and sector cache have their
+ * own lock in diskio.c which is always taken second, so the warm-up
+ * thread's prefetches still interleave with foreground requests.
+ *
+ * spi-fat-fuse is a thin client of this library; an application linking
+ * it directly gets the same caches without the round trip through the
+ * kernel.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "attrcache.h"
+#include "bcm2835.h"
+#include "diskio.h"
+#include "fatextent.h"
+#include "ff.h"
+#include "hashidx.h"
+#include "heatmap.h"
+#include "procstats.h"
+#include "sdcache.h"
+#include "spifat.h"
+#include "spifat-xattr.h"
+#include "warmup.h"
+
+struct SPIFAT_FILE {
+    FIL fil;
+    HASHSTREAM hash;    /** Content hash built from sequential reads */
+    DWORD sclust;       /** Start cluster at open, keys the hash index */
+    int written;
+    FATEXTENTMAP map;   /** Sector map for spifat_borrow(), built on demand */
+    int hasMap;
+    unsigned gen;       /** volumeGen at open */
+    char path[256];
+    BYTE *stage;        /** Write coalescing buffer, two limits, page aligned */
+    size_t stageLen;
+    uint64_t stageOffset;
+    BYTE *fill;         /** Landing buffer for large spifat_pwrite_fill() writes */
+    size_t fillSize;
+    struct SPIFAT_FILE *prev, *next;    /** openFiles */
+};
+
+struct SPIFAT_DIR {
+    DIR dir;
+    char path[256];
+    struct SPIFAT_DIR *prev, *next;     /** openDirs */
+};
+
+static pthread_mutex_t fsLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Persistent filesystem handle */
+static FATFS *fatfs = NULL;
+
+/**
+ * Volumes unmounted after the card went away while handles were open.
+ * The handles still point at them, so they are freed with the last one.
+ * volumeGen counts the unmounts, so the lock free read path can tell its
+ * sector map is of a card that has gone.
+ */
+static FATFS **retiredFs = NULL;
+static UINT nRetired = 0;
+static UINT openHandles = 0;
+static unsigned volumeGen = 0;
+
+/** Every open file and directory, so a subtree in use isn't deleted. Under fsLock */
+static SPIFAT_FILE *openFiles = NULL;
+static SPIFAT_DIR *openDirs = NULL;
+
+/**
+ * Read-only mode. Lookups are answered from the attribute cache and file
+ * reads go straight to diskio.c through the file's sector map, neither
+ * taking fsLock, so only misses wait for each other
+ */
+static int readOnly = 0;
+
+/** Attribute cache slots in read-only mode */
+#define ATTRCACHE_SLOTS 16384
+
+/** Processes tracked by user.spifat.procstats */
+#define PROCSTATS_SLOTS 128
+
+/** Directories f_rmtree() may have found but not yet scanned */
+#define RMTREE_MAX_PENDING 16384
+
+/** Page alignment for buffers handed to splice() and the transport */
+#define SPIFAT_PAGE_SIZE 4096
+
+/**
+ * Copies made on the write path per byte written, for user.spifat.copystats.
+ * Copies into the sector cache are the same either way and aren't counted.
+ */
+typedef struct {
+    uint64_t written;   /** Bytes accepted */
+    uint64_t inmem;     /** Handed over in caller memory (for FUSE, copied out of /dev/fuse) */
+    uint64_t filled;    /** Filled straight into a staging buffer by spifat_pwrite_fill() */
+    uint64_t staged;    /** Copied from caller memory into the coalescing buffer */
+    uint64_t buffered;  /** Copied through FatFs' sector buffer as partial sectors */
+    uint64_t moved;     /** Partial sector tails moved to the front of the coalescing buffer */
+    uint64_t cpuStart;  /** Process CPU time at reset [us] */
+} COPYSTATS;
+
+static COPYSTATS copyStats;
+
+/** Bytes applications wrote, for user.spifat.wrstats. Reset with FatFs' counters */
+static uint64_t wrLogical;
+
+/**
+ * Delayed allocation: bytes a file gathers before its clusters are picked,
+ * 0 to write out every cluster. Clusters promised to gathered data are
+ * held back in FatFs (f_reserve()) so no other allocation can take them.
+ */
+static size_t delallocBytes = 0;
+
+/** Returns: process CPU time, user and system [us] */
+static uint64_t cpuMicros( void ) {
+
+    struct rusage ru;
+
+    getrusage( RUSAGE_SELF, &ru );
+
+    return ((uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000) +
+           ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/** Returns: monotonic time [us] */
+static uint64_t monoMicros( void ) {
+
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+/**
+ * The request this thread is accounting for (spifat_account_begin()):
+ * disk counters at the start, bytes moved so far and the card time it
+ * owes under its process's limit
+ */
+typedef struct {
+    int active;
+    pid_t pid;
+    uid_t uid;
+    uint64_t owedUs;
+    DISKTHREADSTATS start;
+    PROCSTATS_COST cost;
+} ACCOUNT;
+
+static __thread ACCOUNT account;
+
+/**
+ * A request over its card time limit doesn't sleep on the caller's
+ * thread, which over io_uring is the only worker for a CPU's queue.
+ * Instead it lets everyone else have the card first: yieldCard() holds it
+ * back while other requests are waiting for or holding fsLock (fsWanted),
+ * for at most the time it owes, and not at all when the card is idle.
+ */
+static pthread_mutex_t yieldLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t yieldCond = PTHREAD_COND_INITIALIZER;
+static unsigned fsWanted = 0;
+static unsigned nYielding = 0;
+static __thread int wantsFs = 0;
+
+/** Asynchronous request queue */
+static pthread_mutex_t reqLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reqCond = PTHREAD_COND_INITIALIZER;
+static SPIFAT_REQ *reqHead = NULL;
+static SPIFAT_REQ *reqTail = NULL;
+static pthread_t reqThread;
+static int hasReqThread = 0;
+static int reqStop = 0;
+
+static int FRESULT_TO_OSCODE( int res ) {
+    switch ( res ) {
+        case FR_OK: {
+            return 0;
+        }
+        case FR_DISK_ERR: {
+            return -EINTR;
+        }
+        case FR_INT_ERR: {
+            return -ENOMEM;
+        }
+        case FR_NOT_READY: {
+            return -EINTR;
+        }
+        case FR_NO_FILE: {
+            return -ENOENT;
+        }
+        case FR_NO_PATH: {
+            return -ENOENT;
+        }
+        case FR_INVALID_NAME: {
+            return -ENOENT;
+        }
+        case FR_DENIED: {
+            return -EACCES;
+        }
+        case FR_EXIST: {
+            return -EACCES;
+        }
+        case FR_INVALID_OBJECT: {
+            return -ENOENT;
+        }
+        case FR_WRITE_PROTECTED: {
+            return -EACCES;
+        }
+        case FR_INVALID_DRIVE: {
+            return -EACCES;
+        }
+        case FR_NOT_ENABLED: {
+            return -ENOSPC;
+        }
+        case FR_NO_FILESYSTEM: {
+            return -ENODEV;
+        }
+        case FR_MKFS_ABORTED: {
+            return -ENODEV;
+        }
+        case FR_TIMEOUT: {
+            return -EACCES;
+        }
+        case FR_LOCKED: {
+            return -EACCES;
+        }
+        case FR_NOT_ENOUGH_CORE: {
+            return -ENAMETOOLONG;
+        }
+        case FR_TOO_MANY_OPEN_FILES: {
+            return -ENFILE;
+        }
+        default: {
+            return -ENOENT;
+        }
+    }
+
+    return ENOENT;
+}
+
+/** Directory entry stamp to UNIX time, -1 if it doesn't convert */
+static time_t fatDateTimeToUNIX( WORD fdate, WORD ftime ) {
+
+    struct tm unixTimestamp;
+
+    memset( &unixTimestamp, 0, sizeof( unixTimestamp ) );
+    unixTimestamp.tm_year = ((fdate & 0xfe00) >> 9) + 80;
+    unixTimestamp.tm_mon = ((fdate & 0x1e0) >> 5) - 1;
+    unixTimestamp.tm_mday = fdate & 0x1f;
+    unixTimestamp.tm_hour = (ftime & 0xf800) >> 11;
+    unixTimestamp.tm_min = (ftime & 0x7e0) >> 5;
+    unixTimestamp.tm_sec = (ftime & 0x1f) >> 1;
+
+    return mktime( &unixTimestamp );
+}
+
+static void fillStat( const FILINFO *finfo, SPIFAT_STAT *st ) {
+
+    st->isdir = (finfo->fattrib & AM_DIR) == AM_DIR;
+    st->size = st->isdir ? 0 : finfo->fsize;
+    st->attrib = finfo->fattrib;
+    st->mtime = fatDateTimeToUNIX( finfo->fdate, finfo->ftime );
+}
+
+/** Lets requests within their limit go first if this one is over it */
+static void yieldCard( void ) {
+
+    struct timespec deadline;
+    uint64_t owed = account.owedUs, t0;
+
+    if ( owed == 0 ) {
+        return;
+    }
+    account.owedUs = 0;
+
+    clock_gettime( CLOCK_REALTIME, &deadline );
+    deadline.tv_sec += owed / 1000000;
+    deadline.tv_nsec += (owed % 1000000) * 1000;
+    if ( deadline.tv_nsec >= 1000000000 ) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    t0 = monoMicros();
+    pthread_mutex_lock( &yieldLock );
+    __atomic_add_fetch( &nYielding, 1, __ATOMIC_SEQ_CST );
+    while ( __atomic_load_n( &fsWanted, __ATOMIC_SEQ_CST ) > 0 ) {
+        if ( pthread_cond_timedwait( &yieldCond, &yieldLock, &deadline ) == ETIMEDOUT ) {
+            break;
+        }
+    }
+    __atomic_sub_fetch( &nYielding, 1, __ATOMIC_SEQ_CST );
+    pthread_mutex_unlock( &yieldLock );
+
+    procstats_throttled( account.pid, monoMicros() - t0 );
+}
+
+static void leaveFs( void ) {
+
+    pthread_mutex_unlock( &fsLock );
+
+    if ( wantsFs ) {
+        wantsFs = 0;
+        if ( __atomic_sub_fetch( &fsWanted, 1, __ATOMIC_SEQ_CST ) == 0 &&
+             __atomic_load_n( &nYielding, __ATOMIC_SEQ_CST ) != 0 ) {
+            pthread_mutex_lock( &yieldLock );
+            pthread_cond_broadcast( &yieldCond );
+            pthread_mutex_unlock( &yieldLock );
+        }
+    }
+}
+
+/** Takes the filesystem lock and mounts the volume on first use */
+static int enterFs( void ) {
+
+    FRESULT res;
+
+    if ( account.owedUs != 0 ) {
+        yieldCard();
+    } else {
+        __atomic_add_fetch( &fsWanted, 1, __ATOMIC_SEQ_CST );
+        wantsFs = 1;
+    }
+
+    pthread_mutex_lock( &fsLock );
+
+    if ( fatfs == NULL ) {
+        fatfs = malloc( sizeof( FATFS ) );
+        if ( fatfs == NULL ) {
+            leaveFs();
+            return FRESULT_TO_OSCODE( FR_DISK_ERR );
+        }
+        memset( fatfs, 0, sizeof( FATFS ) );
+
+        res = f_mount( fatfs, "", 0 );
+        if ( res != FR_OK ) {
+            free( fatfs );
+            fatfs = NULL;
+            leaveFs();
+            return FRESULT_TO_OSCODE( res );
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Unmounts the volume of a card that has gone, so the next call mounts
+ * the card afresh. FatFs then refuses the open handles, but their FATFS
+ * is only freed once the last of them is closed. Called with fsLock held.
+ */
+static void retireVolume( void ) {
+
+    FATFS **list;
+
+    f_mount( NULL, "", 0 );
+    __atomic_add_fetch( &volumeGen, 1, __ATOMIC_RELEASE );
+
+    if ( openHandles == 0 ) {
+        free( fatfs );
+    } else {
+        list = realloc( retiredFs, (nRetired + 1) * sizeof( FATFS * ) );
+        if ( list != NULL ) {
+            list[nRetired++] = fatfs;
+            retiredFs = list;
+        }
+        /** else it is leaked rather than freed under the handles */
+    }
+    fatfs = NULL;
+}
+
+/** Called with fsLock held */
+static void freeRetired( void ) {
+
+    UINT i;
+
+    for ( i = 0 ; i < nRetired ; i++ ) {
+        free( retiredFs[i] );
+    }
+    free( retiredFs );
+    retiredFs = NULL;
+    nRetired = 0;
+}
+
+/** Frees the retired volumes once no handle is left. Called with fsLock held */
+static void releaseHandle( void ) {
+
+    if ( openHandles > 0 && --openHandles == 0 ) {
+        freeRetired();
+    }
+}
+
+/**
+ * Initialises the GPIO, card wiring (or spidev or image file), sector cache and hash
+ * index. The card itself is not touched until the first call that needs
+ * the volume.
+ *
+ * Returns: 0 = success, -errno if the image or spidev device can't be
+ * opened, -EIO if the GPIO can't be mapped
+ */
+int spifat_init( const SPIFAT_CONFIG *config ) {
+
+    if ( config->image != NULL ) {
+        if ( access( config->image, config->readonly ? R_OK : R_OK | W_OK ) != 0 ) {
+            return -errno;
+        }
+        disk_set_image( config->image );
+    } else if ( config->spidev != NULL ) {
+        if ( access( config->spidev, R_OK | W_OK ) != 0 ) {
+            return -errno;
+        }
+        disk_set_spidev( config->spidev );
+    } else {
+        if ( !bcm2835_init() ) {
+            return -EIO;
+        }
+
+        /** 6-pin boards can run the card in 4-bit SD bus mode */
+        disk_set_transport( config->native ? DISK_TRANSPORT_SDNATIVE : DISK_TRANSPORT_SPI );
+    }
+
+    if ( sdcache_init( (config->cache_kb * 1024) / FF_MAX_SS ) != 0 ) {
+        fprintf( stderr, "failed to allocate %uKB sector cache. running uncached\n", config->cache_kb );
+    }
+
+    if ( heatmap_init() != 0 ) {
+        fprintf( stderr, "failed to allocate the access heat map\n" );
+    }
+
+    if ( procstats_init( PROCSTATS_SLOTS, config->proc_limit_ms ) != 0 ) {
+        fprintf( stderr, "failed to allocate per-process statistics\n" );
+    }
+
+    if ( hashidx_open( config->hashdb ) != 0 ) {
+        fprintf( stderr, "failed to load hash index %s\n", config->hashdb );
+    }
+
+    readOnly = config->readonly;
+    if ( readOnly && attrcache_init( ATTRCACHE_SLOTS ) != 0 ) {
+        fprintf( stderr, "failed to allocate the attribute cache. running uncached\n" );
+    }
+
+    f_allocpolicy( config->alloc_next ? AL_NEXT : AL_NEAR );
+    delallocBytes = (size_t)config->delalloc_kb * 1024;
+
+    warmup_set_lock( enterFs, leaveFs );
+
+    copyStats.cpuStart = cpuMicros();
+
+    return 0;
+}
+
+/**
+ * Drains the asynchronous queue, stops any warm-up and unmounts. Files,
+ * directories and borrowed sectors must have been released first.
+ */
+void spifat_shutdown( void ) {
+
+    if ( hasReqThread ) {
+        pthread_mutex_lock( &reqLock );
+        reqStop = 1;
+        pthread_cond_signal( &reqCond );
+        pthread_mutex_unlock( &reqLock );
+        pthread_join( reqThread, NULL );
+        hasReqThread = 0;
+        reqStop = 0;
+    }
+
+    warmup_cancel();
+
+    pthread_mutex_lock( &fsLock );
+    if ( fatfs != NULL ) {
+        f_mount( NULL, "", 0 );
+        free( fatfs );
+        fatfs = NULL;
+    }
+    freeRetired();
+    openHandles = 0;
+    openFiles = NULL;
+    openDirs = NULL;
+    sdcache_free();
+    heatmap_free();
+    attrcache_free();
+    pthread_mutex_unlock( &fsLock );
+
+    procstats_free();
+    hashidx_close();
+}
+
+static void accountStart( pid_t pid, uid_t uid ) {
+
+    account.active = 1;
+    account.pid = pid;
+    account.uid = uid;
+    account.owedUs = 0;
+    disk_get_thread_stats( &account.start );
+    memset( &account.cost, 0, sizeof( account.cost ) );
+}
+
+static void accountBytes( uint64_t read, uint64_t written ) {
+
+    account.cost.readBytes += read;
+    account.cost.writtenBytes += written;
+}
+
+void spifat_account_begin( pid_t pid, uid_t uid ) {
+
+    pid = procstats_tgid( pid );
+    accountStart( pid, uid );
+    account.owedUs = procstats_throttle( pid );
+}
+
+void spifat_account_end( void ) {
+
+    DISKTHREADSTATS now;
+
+    account.owedUs = 0;
+    if ( !account.active ) {
+        return;
+    }
+
+    disk_get_thread_stats( &now );
+    account.cost.cardUs = now.card_us - account.start.card_us;
+    account.cost.cardSectors = now.card_sectors - account.start.card_sectors;
+    account.cost.cacheHits = now.cache_hits - account.start.cache_hits;
+    account.cost.cacheMisses = now.cache_misses - account.start.cache_misses;
+    procstats_charge( account.pid, account.uid, &account.cost );
+    account.active = 0;
+}
+
+int spifat_stat( const char *path, SPIFAT_STAT *st ) {
+
+    FRESULT res;
+    FILINFO finfo;
+    int rv;
+
+    memset( st, 0, sizeof( SPIFAT_STAT ) );
+
+    if ( readOnly && attrcache_lookup( path, st, &rv ) ) {
+        return rv;
+    }
+
+    rv = enterFs();
+    if ( rv != 0 ) {
+        return rv;
+    }
+
+    /** The root has no directory entry */
+    if ( strcmp( path, "/" ) == 0 ) {
+        st->isdir = 1;
+        st->attrib = AM_DIR;
+        st->mtime = -1;
+        leaveFs();
+        return 0;
+    }
+
+    /** Transient card errors are retried in diskio.c */
+    res = f_stat( path, &finfo );
+    if ( res == FR_OK ) {
+        fillStat( &finfo, st );
+    }
+
+    leaveFs();
+
+    rv = FRESULT_TO_OSCODE( res );
+    if ( readOnly && (rv == 0 || rv == -ENOENT) ) {
+        attrcache_insert( path, st, rv );
+    }
+
+    return rv;
+}
+
+int spifat_mkdir( const char *path ) {
+
+    FRESULT res;
+    int rv;
+
+    if ( readOnly ) {
+        return -EROFS;
+    }
+
+    rv = enterFs();
+    if ( rv != 0 ) {
+        return rv;
+    }
+    res = f_mkdir( path );
+    leaveFs();
+
+    return FRESULT_TO_OSCODE( res );
+}
+
+int spifat_rmdir( const char *path ) {
+
+    FRESULT res;
+    int rv;
+
+    if ( readOnly ) {
+        return -EROFS;
+    }
+
+    rv = enterFs();
+    if ( rv != 0 ) {
+        return rv;
+    }
+    res = f_rmdir( path );
+    leaveFs();
+
+    return FRESULT_TO_OSCODE( res );
+}
+
+int spifat_unlink( const char *path ) {
+
+    FRESULT res;
+    HASHKEY key;
+    int rv;
+
+    if ( readOnly ) {
+        return -EROFS;
+    }
+
+    rv = enterFs();
+    if ( rv != 0 ) {
+        return rv;
+    }
+
+    /** The clusters are about to be freed and may be reused */
+    if ( hashidx_key( path, &key ) == FR_OK ) {
+        hashidx_invalidate( key.sclust );
+        fatextent_invalidate( key.sclust );
+    }
+
+    res = f_unlink( path );
+    leaveFs();
+
+    return FRESULT_TO_OSCODE( res );
+}
+
+/** Cached hashes and extent maps of an object f_rmtree() is about to free */
+static void rmTreeForget( DWORD sclust ) {
+
+    hashidx_invalidate( sclust );
+    fatextent_invalidate( sclust );
+}
+
+/** Returns: 1 if path is top or below it. FAT names ignore case */
+static int inTree( const char *path, const char *top ) {
+
+    size_t len = strlen( top );
+
+    while ( len > 0 && top[len - 1] == '/' ) {
+        len--;
+    }
+
+    return strncasecmp( path, top, len ) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+/**
+ * Returns: 1 if a file or directory at or below path is open. Its clusters,
+ * and any data still staged for delayed allocation, would otherwise be
+ * freed or written under it. Called with fsLock held
+ */
+static int treeInUse( const char *path ) {
+
+    SPIFAT_FILE *file;
+    SPIFAT_DIR *dir;
+
+    for ( file = openFiles ; file != NULL ; file = file->next ) {
+        if ( file->gen == volumeGen && inTree( file->path, path ) ) {
+            return 1;
+        }
+    }
+    for ( dir = openDirs ; dir != NULL ; dir = dir->next ) {
+        if ( inTree( dir->path, path ) ) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Removes a directory and everything below it in one pass over the
+ * subtree. The work buffer holds a bitmap of every cluster on the volume
+ * plus a stack of directories still to scan.
+ *
+ * Returns: 0 = success, -EBUSY if anything in the subtree is open
+ */
+static int rmTree( const char *path ) {
+
+    FILINFO finfo;
+    FRESULT res;
+    UINT len;
+    void *work;
+
+    if ( readOnly ) {
+        return -EROFS;
+    }
+
+    if ( treeInUse( path ) ) {
+        return -EBUSY;
+    }
+
+    /** Mounts the volume, so n_fatent is known */
+    res = f_stat( path, &finfo );
+    if ( res != FR_OK ) {
+        return FRESULT_TO_OSCODE( res );
+    }
+
+    len = (UINT)((fatfs->n_fatent + 7) / 8) + 4 + RMTREE_MAX_PENDING * sizeof( DWORD );
+    work = malloc( len );
+    if ( work == NULL ) {
+        return -ENOMEM;
+    }
+    res = f_rmtree( path, work, len, rmTreeForget );
+    free( work );
+
+    return FRESULT_TO_OSCODE( res );
+}
+
+int spifat_rmtree( const char *path ) {
+
+    int rv;
+
+    rv = enterFs();
+    if ( rv != 0 ) {
+        return rv;
+    }
+    rv = rmTree( path );
+    leaveFs();
+
+    return rv;
+}
+
+/** Sets the modification stamp (local time, 2 second resolution) */
+int spifat_utime( const char *path, time_t mtime ) {
+
+    FRESULT res;
+    FILINFO finfo;
+    struct tm ltime;
+    int rv;
+
+    if ( readOnly ) {
+        return -EROFS;
+    }
+
+    localtime_r( &mtime, &ltime );
+    finfo.fdate = (WORD)(((ltime.tm_year - 80) << 9) | ((ltime.tm_mon + 1) << 5) | ltime.tm_mday);
+    finfo.ftime = (WORD)((ltime.tm_hour << 11) | (ltime.tm_min << 5) | (ltime.tm_sec >> 1));
+
+    rv = enterFs();
+    if ( rv != 0 ) {
+        return rv;
+    }
+    res = f_utime( path, &finfo );
+    leaveFs();
+
+    return FRESULT_TO_OSCODE( res );
+}
+
+int spifat_open( const char *path, int mode, SPIFAT_FILE **file ) {
+
+    FRESULT res;
+    SPIFAT_FILE *sf;
+    int rv;
+
+    *file = NULL;
+
+    if ( readOnly && (mode & (SPIFAT_WRITE | SPIFAT_CREATE)) ) {
+        return -EROFS;
+    }
+
+    sf = malloc( sizeof( SPIFAT_FILE ) );
+    if ( sf == NULL ) {
+        return -ENOMEM;
+    }
+
+    rv = enterFs();
+    if ( rv != 0 ) {
+        free( sf );
+        return rv;
+    }
+
+    res = f_open( &sf->fil, path, (BYTE)mode );
+
+    /** Reads in read-only mode go through the sector map */
+    sf->hasMap = 0;
+    if ( res == FR_OK && readOnly ) {
+        sf->hasMap = (fatextent_file( path, &sf->map ) == FR_OK);
+    }
+    if ( res == FR_OK ) {
+        openHandles++;
+        strncpy( sf->path, path, sizeof( sf->path ) - 1 );
+        sf->path[sizeof( sf->path ) - 1] = '\0';
+        sf->prev = NULL;
+        sf->next = openFiles;
+        if ( openFiles != NULL ) {
+            openFiles->prev = sf;
+        }
+        openFiles = sf;
+    }
+    sf->gen = volumeGen;
+    leaveFs();
+
+    if ( res != FR_OK ) {
+        free( sf );
+        return FRESULT_TO_OSCODE( res );
+    }
+
+    hashidx_stream_init( &sf->hash );
+    sf->sclust = sf->fil.obj.sclust;
+    sf->written = 0;
+    sf->stage = NULL;
+    sf->stageLen = 0;
+    sf->fill = NULL;
+    sf->fillSize = 0;
+    *file = sf;
+
+    return 0;
+}
+
+/** The handle's own hash stream and sector map are stale from the first write */
+static void markWritten( SPIFAT_FILE *file ) {
+
+    file->written = 1;
+    if ( file->hasMap ) {
+        fatextent_free( &file->map );
+        file->hasMap = 0;
+    }
+}
+
+/**
+ * Drops what is cached about the file's data as more of it reaches the
+ * card, and spoils hashes other handles are gathering by reading it. A
+ * hash is keyed on the directory entry, which only changes on sync or
+ * close, so one taken between two write-outs would outlive the second.
+ * Called with fsLock held.
+ */
+static void forgetContent( SPIFAT_FILE *file ) {
+
+    DWORD sclust = file->fil.obj.sclust;
+    SPIFAT_FILE *other;
+
+    if ( sclust == 0 ) {
+        return;
+    }
+
+    hashidx_invalidate( sclust );
+    fatextent_invalidate( sclust );
+    for ( other = openFiles ; other != NULL ; other = other->next ) {
+        if ( other != file && other->fil.obj.sclust == sclust ) {
+            __atomic_store_n( &other->hash.broken, 1, __ATOMIC_RELAXED );
+        }
+    }
+}
+
+/**
+ * Holds back the free clusters file needs, beyond the ones it has, to
+ * hold end bytes. Lowering end gives clusters back. Called with fsLock
+ * held.
+ *
+ * Returns: 0 = success, -ENOSPC if too few are free and not held back
+ */
+static int reserveTo( SPIFAT_FILE *file, uint64_t end ) {
+
+    uint64_t bcs = (uint64_t)file->fil.obj.fs->csize * FF_MAX_SS;
+    uint64_t have = ((f_size( &file->fil ) + bcs - 1) / bcs) * bcs;
+    DWORD need = 0;
+    FRESULT res;
+
+    if ( delallocBytes == 0 ) {
+        return 0;
+    }
+
+    if ( end > have ) {
+        need = (DWORD)((end - have + bcs - 1) / bcs);
+    }
+    res = f_reserve( &file->fil, need );
+    if ( res == FR_DENIED ) {
+        return -ENOSPC;
+    }
+
+    return FRESULT_TO_OSCODE( res );
+}
+
+/** Returns: the end of the staged data, 0 if nothing is staged */
+static uint64_t stageEnd( const SPIFAT_FILE *file ) {
+    return file->stageLen > 0 ? file->stageOffset + file->stageLen : 0;
+}
+
+/**
+ * Writes through FatFs. With delayed allocation the clusters the write
+ * needs are picked first, as one run where possible. Called with fsLock
+ * held.
+ *
+ * Returns: bytes written, negative errno
+ */
+static ssize_t writeAt( SPIFAT_FILE *file, const void *buf, size_t size, uint64_t offset ) {
+
+    FRESULT res;
+    FIL *fp = &file->fil;
+    UINT bwrite = 0;
+    uint64_t first, last;
+    int rv, nospace = 0;
+
+    markWritten( file );
+
+    /** Staged data being written out already holds its reservation */
+    rv = reserveTo( file, offset + size > stageEnd( file ) ? offset + size : stageEnd( file ) );
+    if ( rv != 0 ) {
+        return rv;
+    }
+
+    /** The clusters this write allocates come out of what the file held back */
+    reserveTo( file, 0 );
+    res = f_lseek( fp, offset );
+    if ( res == FR_OK && delallocBytes > 0 ) {
+        res = f_extend( fp, offset + size );
+        nospace = (res == FR_DENIED);
+    }
+    if ( res == FR_OK ) {
+        res = f_write( fp, buf, size, &bwrite );
+        if ( res != FR_OK || bwrite < size ) {
+            f_trim( fp );
+        }
+    }
+    reserveTo( file, stageEnd( file ) );
+    forgetContent( file );
+    if ( nospace ) {
+        return -ENOSPC;
+    }
+    if ( res != FR_OK ) {
+        return FRESULT_TO_OSCODE( res );
+    }
+
+    /** f_write() sends whole sectors straight to the card and buffers the rest */
+    first = ((offset + FF_MAX_SS - 1) / FF_MAX_SS) * FF_MAX_SS;
+    last = ((offset + bwrite) / FF_MAX_SS) * FF_MAX_SS;
+    copyStats.buffered += last > first ? bwrite - (last - first) : bwrite;
+
+    return bwrite;
+}
+
+/**
+ * Writes out the coalescing buffer. Unless all is set, only up to the
+ * last sector boundary is written and the partial sector tail is kept to
+ * be completed by the next write. Called with fsLock held.
+ *
+ * Returns: 0 = success, negative errno (what wasn't written stays buffered
+ * for the next attempt)
+ */
+static int flushStage( SPIFAT_FILE *file, int all ) {
+
+    uint64_t end = file->stageOffset + file->stageLen;
+    size_t n = file->stageLen;
+    ssize_t rv;
+
+    if ( !all ) {
+        end = (end / FF_MAX_SS) * FF_MAX_SS;
+        n = end > file->stageOffset ? (size_t)(end - file->stageOffset) : 0;
+    }
+    if ( n == 0 ) {
+        return 0;
+    }
+
+    rv = writeAt( file, file->stage, n, file->stageOffset );
+    if ( rv > 0 ) {
+        file->stageLen -= rv;
+        file->stageOffset += rv;
+        if ( file->stageLen > 0 ) {
+            memmove( file->stage, file->stage + rv, file->stageLen );
+            copyStats.moved += file->stageLen;
+        }
+        reserveTo( file, stageEnd( file ) );
+    }
+    if ( rv != (ssize_t)n ) {
+        return rv < 0 ? (int)rv : -ENOSPC;
+    }
+
+    return 0;
+}
+
+/**
+ * Returns: how much the coalescing buffer gathers before it is written out
+ * if this write can join it, 0 if it has to be written directly. Flushes
+ * the buffer when the write doesn't follow on from it. Called with fsLock
+ * held.
+ */
+static size_t stageFor( SPIFAT_FILE *file, size_t size, uint64_t offset, int *rv ) {
+
+    size_t cluster = (size_t)file->fil.obj.fs->csize * FF_MAX_SS;
+    size_t limit = cluster;
+
+    *rv = 0;
+
+    /** Delayed allocation gathers whole clusters, so the run picked for them ends on one */
+    if ( delallocBytes > cluster ) {
+        limit = (delallocBytes / cluster) * cluster;
+    }
+
+    /** A write that doesn't follow on, or a buffer a failed write-out left full */
+    if ( file->stageLen > 0 && (offset != file->stageOffset + file->stageLen || file->stageLen >= limit) ) {
+        *rv = flushStage( file, 1 );
+        if ( *rv != 0 ) {
+            return 0;
+        }
+    }
+
+    /**
+     * Writes of a cluster or more already go to the card as whole sectors,
+     * in one run with delayed allocation
+     */
+    if ( size >= limit || size > cluster ) {
+        *rv = flushStage( file, 1 );
+        return 0;
+    }
+
+    /** Under limit is gathered before a write of at most a cluster joins */
+    if ( file->stage == NULL ) {
+        if ( posix_memalign( (void **)&file->stage, SPIFAT_PAGE_SIZE, limit + cluster ) != 0 ) {
+            file->stage = NULL;
+            return 0;
+        }
+    }
+    if ( file->stageLen == 0 ) {
+        file->stageOffset = offset;
+    }
+
+    /** Short of space, what is gathered already gets its clusters first */
+    if ( reserveTo( file, offset + size ) != 0 ) {
+        *rv = flushStage( file, 1 );
+        if ( *rv == 0 ) {
+            file->stageOffset = offset;
+            *rv = reserveTo( file, offset + size );
+        }
+        if ( *rv != 0 ) {
+            return 0;
+        }
+    }
+
+    return limit;
+}
+
+/**
+ * Hashes read data on its way past. A file read front-to-back by an
+ * unmodified handle gets its hashes indexed for free. Called with fsLock
+ * held.
+ */
+static void hashRead( SPIFAT_FILE *file, const void *buf, UINT bread, uint64_t offset ) {
+
+    if ( !file->written && bread > 0 ) {
+        hashidx_stream_feed( &file->hash, offset, buf, bread );
+        if ( file->hash.offset == f_size( &file->fil ) && !file->hash.broken ) {
+            HASHENTRY entry;
+            if ( hashidx_key( file->path, &entry.key ) == FR_OK &&
+                 hashidx_stream_finish( &file->hash, &entry ) ) {
+                hashidx_store( &entry );
+            }
+        }
+    }
+}
+
+/**
+ * Read-only mode: reads the file through its sector map without fsLock.
+ * Whole sectors land in buf directly, a partial first or last sector goes
+ * through a bounce buffer.
+ *
+ * Returns: bytes read, negative errno
+ */
+static ssize_t readMapped( SPIFAT_FILE *file, BYTE *buf, size_t size, uint64_t offset ) {
+
+    const FATEXTENTMAP *map = &file->map;
+    BYTE bounce[FF_MAX_SS];
+    QWORD index, first = 0;
+    size_t done = 0, inner, n;
+    BYTE pdrv;
+    UINT i = 0, count;
+    LBA_t sector;
+
+    /** The map is of a card that has since gone */
+    if ( __atomic_load_n( &volumeGen, __ATOMIC_ACQUIRE ) != file->gen ) {
+        return -EIO;
+    }
+    pdrv = file->fil.obj.fs->pdrv;
+
+    if ( offset >= map->fsize ) {
+        return 0;
+    }
+    if ( size > map->fsize - offset ) {
+        size = (size_t)(map->fsize - offset);
+    }
+
+    index = offset / FF_MAX_SS;
+    while ( i < map->nextents && index >= first + map->extents[i].nsectors ) {
+        first += map->extents[i].nsectors;
+        i++;
+    }
+
+    while ( done < size && i < map->nextents ) {
+        sector = map->extents[i].sector + (LBA_t)(index - first);
+        count = (UINT)(first + map->extents[i].nsectors - index);
+        inner = (size_t)((offset + done) % FF_MAX_SS);
+
+        if ( inner == 0 && size - done >= FF_MAX_SS ) {
+            if ( count > (size - done) / FF_MAX_SS ) {
+                count = (UINT)((size - done) / FF_MAX_SS);
+            }
+            if ( disk_read( pdrv, buf + done, sector, count ) != RES_OK ) {
+                return -EIO;
+            }
+            n = (size_t)count * FF_MAX_SS;
+        } else {
+            count = 1;
+            if ( disk_read( pdrv, bounce, sector, 1 ) != RES_OK ) {
+                return -EIO;
+            }
+            n = FF_MAX_SS - inner;
+            if ( n > size - done ) {
+                n = size - done;
+            }
+            memcpy( buf + done, bounce + inner, n );
+        }
+
+        done += n;
+        index += count;
+        if ( index >= first + map->extents[i].nsectors ) {
+            first += map->extents[i].nsectors;
+            i++;
+        }
+    }
+
+    /** Nor is the data of it if the card went while it was read */
+    if ( __atomic_load_n( &volumeGen, __ATOMIC_ACQUIRE ) != file->gen ) {
+        return -EIO;
+    }
+
+    return done;
+}
+
+ssize_t spifat_pread( SPIFAT_FILE *file, void *buf, size_t size, uint64_t offset ) {
+
+    FRESULT res;
+    FIL *fp = &file->fil;
+    UINT bread = 0;
+    ssize_t n;
+    int rv;
+
+    if ( readOnly && file->hasMap ) {
+        yieldCard();
+        n = readMapped( file, buf, size, offset );
+        if ( n > 0 ) {
+            accountBytes( n, 0 );
+        }
+
+        /** Only a read that carries the hash stream on needs the lock */
+        if ( n > 0 && !__atomic_load_n( &file->hash.broken, __ATOMIC_RELAXED ) ) {
+            if ( enterFs() == 0 ) {
+                hashRead( file, buf, (UINT)n, offset );
+                leaveFs();
+            }
+        }
+
+        return n;
+    }
+
+    rv = enterFs();
+    if ( rv != 0 ) {
+        return rv;
+    }
+
+    rv = flushStage( file, 1 );
+    if ( rv != 0 ) {
+        leaveFs();
+        return rv;
+    }
+
+    res = f_lseek( fp, offset );
+    if ( res == FR_OK ) {
+        res = f_read( fp, buf, size, &bread );
+    }
+    if ( res != FR_OK ) {
+        leaveFs();
+        return FRESULT_TO_OSCODE( res );
+    }
+
+    hashRead( file, buf, bread, offset );
+    accountBytes( bread, 0 );
+
+    leaveFs();
+
+    return bread;
+}
+
+/**
+ * Writes shorter than a cluster that follow on from each other are
+ * gathered in a page aligned buffer and written as whole sectors, so they
+ * reach the card as multi-block writes instead of going through FatFs'
+ * single sector buffer. Anything gathered is written out before the file
+ * is read, synced, borrowed from or closed.
+ *
+ * With delayed allocation (delalloc_kb) the buffer gathers that much
+ * instead of a cluster, and only its clusters' count is reserved until
+ * it is written out. The clusters themselves are then picked as one run,
+ * so files written a little at a time by several processes don't end up
+ * interleaved on the card.
+ */
+ssize_t spifat_pwrite( SPIFAT_FILE *file, const void *buf, size_t size, uint64_t offset ) {
+
+    ssize_t rv;
+    size_t limit;
+    int frv;
+
+    rv = enterFs();
+    if ( rv != 0 ) {
+        return rv;
+    }
+
+    if ( !(file->fil.flag & FA_WRITE) ) {
+        leaveFs();
+        return -EACCES;
+    }
+
+    copyStats.written += size;
+    copyStats.inmem += size;
+    wrLogical += size;
+    accountBytes( 0, size );
+    markWritten( file );
+
+    limit = stageFor( file, size, offset, &frv );
+    if ( frv != 0 ) {
+        rv = frv;
+    } else if ( limit > 0 ) {
+        memcpy( file->stage + file->stageLen, buf, size );
+        file->stageLen += size;
+        copyStats.staged += size;
+        rv = size;
+        /** A failed write-out keeps the data and fails the next write, sync or close */
+        if ( file->stageLen >= limit ) {
+            flushStage( file, 0 );
+        }
+    } else {
+        rv = writeAt( file, buf, size, offset );
+    }
+
+    leaveFs();
+
+    return rv;
+}
+
+/**
+ * As spifat_pwrite(), but fill() places the data straight into the
+ * library's page aligned staging buffers, e.g., by reading the pipe a FUSE
+ * request was spliced into. fill() is called with the filesystem lock
+ * held and returns the bytes placed or a negative errno.
+ */
+ssize_t spifat_pwrite_fill( SPIFAT_FILE *file, size_t size, uint64_t offset,
+                            ssize_t (*fill)( void *dst, size_t size, void *arg ), void *arg ) {
+
+    ssize_t rv, n;
+    size_t limit;
+    int frv;
+
+    rv = enterFs();
+    if ( rv != 0 ) {
+        return rv;
+    }
+
+    if ( !(file->fil.flag & FA_WRITE) ) {
+        leaveFs();
+        return -EACCES;
+    }
+
+    markWritten( file );
+    limit = stageFor( file, size, offset, &frv );
+    if ( frv != 0 ) {
+        leaveFs();
+        return frv;
+    }
+
+    if ( limit > 0 ) {
+        n = fill( file->stage + file->stageLen, size, arg );
+        if ( n > 0 ) {
+            file->stageLen += n;
+            if ( file->stageLen >= limit ) {
+                flushStage( file, 0 );
+            }
+        }
+    } else {
+        if ( file->fillSize < size ) {
+            free( file->fill );
+            file->fillSize = 0;
+            if ( posix_memalign( (void **)&file->fill, SPIFAT_PAGE_SIZE, size ) != 0 ) {
+                file->fill = NULL;
+                leaveFs();
+                return -ENOMEM;
+            }
+            file->fillSize = size;
+        }
+        n = fill( file->fill, size, arg );
+        if ( n > 0 ) {
+            n = writeAt( file, file->fill, n, offset );
+        }
+    }
+
+    if ( n > 0 ) {
+        copyStats.written += n;
+        copyStats.filled += n;
+        wrLogical += n;
+        accountBytes( 0, n );
+    }
+
+    leaveFs();
+
+    return n;
+}
+
+int spifat_sync( SPIFAT_FILE *file ) {
+
+    FRESULT res;
+    int rv;
+
+    rv = enterFs();
+    if ( rv != 0 ) {
+        return rv;
+    }
+    rv = flushStage( file, 1 );
+    res = f_sync( &file->fil );
+    leaveFs();
+
+    return rv != 0 ? rv : FRESULT_TO_OSCODE( res );
+}
+
+/**
+ * Writes out this file's gathered data, buffered sector, last FAT change
+ * and directory entry, and nothing else. Other files' dirty state and
+ * FSINFO stay put, so an fsync doesn't wait behind someone else's copy
+ */
+int spifat_fsync( SPIFAT_FILE *file ) {
+
+    FRESULT res;
+    int rv;
+
+    rv = enterFs();
+    if ( rv != 0 ) {
+        return rv;
+    }
+    rv = flushStage( file, 1 );
+    res = f_fsync( &file->fil );
+    leaveFs();
+
+    return rv != 0 ? rv : FRESULT_TO_OSCODE( res );
+}
+
+int spifat_close( SPIFAT_FILE *file ) {
+
+    FRESULT res;
+    int rv;
+
+    pthread_mutex_lock( &fsLock );
+
+    rv = flushStage( file, 1 );
+    reserveTo( file, 0 );
+
+    /** Writing may have given an empty file its first cluster */
+    if ( file->written ) {
+        hashidx_invalidate( file->fil.obj.sclust );
+        fatextent_invalidate( file->fil.obj.sclust );
+    }
+
+    res = f_close( &file->fil );
+    if ( file->prev != NULL ) {
+        file->prev->next = file->next;
+    } else {
+        openFiles = file->next;
+    }
+    if ( file->next != NULL ) {
+        file->next->prev = file->prev;
+    }
+    releaseHandle();
+
+    pthread_mutex_unlock( &fsLock );
+
+    if ( file->hasMap ) {
+        fatextent_free( &file->map );
+    }
+    free( file->stage );
+    free( file->fill );
+    free( file );
+
+    return rv != 0 ? rv : FRESULT_TO_OSCODE( res );
+}
+
+int spifat_opendir( const char *path, SPIFAT_DIR **dir ) {
+
+    FRESULT res;
+    SPIFAT_DIR *sd;
+    int rv;
+
+    *dir = NULL;
+
+    sd = malloc( sizeof( SPIFAT_DIR ) );
+    if ( sd == NULL ) {
+        return -ENOMEM;
+    }
+    memset( sd, 0, sizeof( SPIFAT_DIR ) );
+
+    rv = enterFs();
+    if ( rv != 0 ) {
+        free( sd );
+        return rv;
+    }
+    strncpy( sd->path, path, sizeof( sd->path ) - 1 );
+    res = f_opendir( &sd->dir, path );
+    if ( res == FR_OK ) {
+        openHandles++;
+        sd->next = openDirs;
+        if ( openDirs != NULL ) {
+            openDirs->prev = sd;
+        }
+        openDirs = sd;
+    }
+    leaveFs();
+
+    if ( res != FR_OK ) {
+        free( sd );
+        return FRESULT_TO_OSCODE( res );
+    }
+
+    *dir = sd;
+
+    return 0;
+}
+
+int spifat_readdir( SPIFAT_DIR *dir, SPIFAT_DIRENT *ent ) {
+
+    FRESULT res;
+    FILINFO finfo;
+    int rv;
+
+    rv = enterFs();
+    if ( rv != 0 ) {
+        return rv;
+    }
+
+    res = f_readdir( &dir->dir, &finfo );
+    if ( res == FR_DISK_ERR ) {
+        /** diskio.c has already retried and re-initialised, so the SD card has probably been ejected */
+        fprintf( stderr, "card has probably been ejected. invalidate filesystem for remounting\n" );
+        retireVolume();
+        attrcache_invalidate();
+    }
+
+    leaveFs();
+
+    if ( res != FR_OK ) {
+        return FRESULT_TO_OSCODE( res );
+    }
+    if ( finfo.fname[0] == '\0' ) {
+        return 0;
+    }
+
+    strncpy( ent->name, finfo.fname, sizeof( ent->name ) - 1 );
+    ent->name[sizeof( ent->name ) - 1] = '\0';
+    fillStat( &finfo, &ent->st );
+
+    /** A listing is usually followed by a getattr of each entry */
+    if ( readOnly ) {
+        char path[sizeof( dir->path ) + sizeof( ent->name ) + 1];
+        snprintf( path, sizeof( path ), "%s%s%s", dir->path,
+                  strcmp( dir->path, "/" ) == 0 ? "" : "/", ent->name );
+        attrcache_insert( path, &ent->st, 0 );
+    }
+
+    return 1;
+}
+
+/** Steps back one entry so the next spifat_readdir() returns it again */
+int spifat_unreaddir( SPIFAT_DIR *dir ) {
+
+    FRESULT res;
+    int rv;
+
+    rv = enterFs();
+    if ( rv != 0 ) {
+        return rv;
+    }
+    res = f_seekdir( &dir->dir, -1 );
+    leaveFs();
+
+    return FRESULT_TO_OSCODE( res );
+}
+
+/** Writes out the directory's entries if any are still dirty */
+int spifat_fsyncdir( SPIFAT_DIR *dir ) {
+
+    FRESULT res;
+    int rv;
+
+    rv = enterFs();
+    if ( rv != 0 ) {
+        return rv;
+    }
+    res = f_syncdir( &dir->dir );
+    leaveFs();
+
+    return FRESULT_TO_OSCODE( res );
+}
+
+int spifat_closedir( SPIFAT_DIR *dir ) {
+
+    FRESULT res;
+
+    pthread_mutex_lock( &fsLock );
+    res = f_closedir( &dir->dir );
+    if ( dir->prev != NULL ) {
+        dir->prev->next = dir->next;
+    } else {
+        openDirs = dir->next;
+    }
+    if ( dir->next != NULL ) {
+        dir->next->prev = dir->prev;
+    }
+    releaseHandle();
+    pthread_mutex_unlock( &fsLock );
+
+    free( dir );
+
+    return FRESULT_TO_OSCODE( res );
+}
+
+/**
+ * Copies an attribute value out following the getxattr() size protocol
+ * (size 0 queries the length)
+ */
+static int xattrReply( const char *src, size_t len, char *value, size_t size ) {
+
+    if ( size == 0 ) {
+        return len;
+    }
+    if ( size < len ) {
+        return -ERANGE;
+    }
+
+    memcpy( value, src, len );
+
+    return len;
+}
+
+/** Layout attributes: start cluster, extent count and map, attribute bits */
+static int layoutXattr( const char *lpath, const char *name, char *value, size_t size ) {
+
+    FRESULT res;
+    FILINFO finfo;
+    FATEXTENTMAP map;
+    char lbuf[64];
+    int len;
+
+    res = f_stat( lpath, &finfo );
+    if ( res != FR_OK ) {
+        return FRESULT_TO_OSCODE( res );
+    }
+
+    if ( strcmp( name, FATEXTENT_ATTR_XATTR ) == 0 ) {
+        len = fatextent_format_attr( finfo.fattrib, lbuf, sizeof( lbuf ) );
+        return xattrReply( lbuf, len, value, size );
+    }
+
+    if ( (finfo.fattrib & AM_DIR) == AM_DIR ) {
+        DIR dir;
+
+        if ( strcmp( name, FATEXTENT_SCLUST_XATTR ) != 0 ) {
+            return -ENODATA;
+        }
+        res = f_opendir( &dir, lpath );
+        if ( res != FR_OK ) {
+            return FRESULT_TO_OSCODE( res );
+        }
+        len = snprintf( lbuf, sizeof( lbuf ), "%u", dir.obj.sclust );
+        f_closedir( &dir );
+        return xattrReply( lbuf, len, value, size );
+    }
+
+    res = fatextent_cached( lpath, &map );
+    if ( res != FR_OK ) {
+        return FRESULT_TO_OSCODE( res );
+    }
+
+    if ( strcmp( name, FATEXTENT_SCLUST_XATTR ) == 0 ) {
+        len = snprintf( lbuf, sizeof( lbuf ), "%u", map.sclust );
+        len = xattrReply( lbuf, len, value, size );
+    } else if ( strcmp( name, FATEXTENT_COUNT_XATTR ) == 0 ) {
+        len = snprintf( lbuf, sizeof( lbuf ), "%u", map.nextents );
+        len = xattrReply( lbuf, len, value, size );
+    } else {
+        len = fatextent_format_map( &map, NULL, 0 );
+        char *mbuf = malloc( len + 1 );
+        if ( mbuf == NULL ) {
+            len = -ENOMEM;
+        } else {
+            fatextent_format_map( &map, mbuf, len + 1 );
+            len = xattrReply( mbuf, len, value, size );
+            free( mbuf );
+        }
+    }
+
+    fatextent_free( &map );
+
+    return len;
+}
+
+/**
+ * Formats the transport's framing counters, one "name value" per line.
+ * bytes/op is the average number of bytes clocked per read/write,
+ * payload included
+ */
+static int busStatsXattr( char *value, size_t size ) {
+
+    DISKBUSSTATS stats;
+    char lbuf[512];
+    int len;
+
+    if ( disk_ioctl( 0, MMC_GET_BUSSTATS, &stats ) != RES_OK ) {
+        return -EIO;
+    }
+
+    len = snprintf( lbuf, sizeof( lbuf ),
+                    "ops %llu\nbytes %llu\nbytes/op %.1f\ncommands %llu\n"
+                    "selects %llu\ndeselects %llu\nready_polls %llu\nready_skipped %llu\n"
+                    "busy_slices %llu\nprog_us %u\n",
+                    (unsigned long long)stats.ops, (unsigned long long)stats.bytes,
+                    stats.ops ? (double)stats.bytes / stats.ops : 0.0,
+                    (unsigned long long)stats.commands, (unsigned long long)stats.selects,
+                    (unsigned long long)stats.deselects, (unsigned long long)stats.ready_polls,
+                    (unsigned long long)stats.ready_skipped,
+                    (unsigned long long)stats.busy_slices, (unsigned)stats.prog_us );
+
+    return xattrReply( lbuf, len, value, size );
+}
+
+static int recoveryStatsXattr( char *value, size_t size ) {
+
+    DISKRECOVERYSTATS stats;
+    char lbuf[256];
+    int len;
+
+    disk_get_recovery_stats( &stats );
+    len = snprintf( lbuf, sizeof( lbuf ),
+                    "errors %llu\nretries %llu\nresyncs %llu\nreinits %llu\nrecovered %llu\nfailed %llu\n",
+                    (unsigned long long)stats.errors, (unsigned long long)stats.retries,
+                    (unsigned long long)stats.resyncs, (unsigned long long)stats.reinits,
+                    (unsigned long long)stats.recovered, (unsigned long long)stats.failed );
+
+    return xattrReply( lbuf, len, value, size );
+}
+
+static int initStatsXattr( char *value, size_t size ) {
+
+    DISKINITSTATS stats;
+    char lbuf[256];
+    int len;
+
+    if ( disk_ioctl( 0, MMC_GET_INITSTATS, &stats ) != RES_OK ) {
+        return -EIO;
+    }
+    len = snprintf( lbuf, sizeof( lbuf ),
+                    "inits %llu\nfailures %llu\nearly_exits %llu\nlast_us %lu\nready_us %lu\npolls %lu\n",
+                    (unsigned long long)stats.inits, (unsigned long long)stats.failures,
+                    (unsigned long long)stats.early_exits, (unsigned long)stats.last_us,
+                    (unsigned long)stats.ready_us, (unsigned long)stats.polls );
+
+    return xattrReply( lbuf, len, value, size );
+}
+
+static int attrCacheXattr( char *value, size_t size ) {
+
+    char lbuf[256];
+    ATTRCACHE_STATS stats;
+    int len;
+
+    if ( !readOnly ) {
+        return -ENODATA;
+    }
+
+    attrcache_get_stats( &stats );
+    len = snprintf( lbuf, sizeof( lbuf ), "hits %llu\nmisses %llu\nentries %llu\ndropped %llu\n",
+                    (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+                    (unsigned long long)stats.entries, (unsigned long long)stats.dropped );
+
+    return xattrReply( lbuf, len, value, size );
+}
+
+static int copyStatsXattr( char *value, size_t size ) {
+
+    char lbuf[512];
+    uint64_t copies, cpuUs;
+    double mb;
+    int len;
+
+    cpuUs = cpuMicros() - copyStats.cpuStart;
+    copies = copyStats.inmem + copyStats.filled + copyStats.staged +
+             copyStats.buffered + copyStats.moved;
+    mb = copyStats.written / (1024.0 * 1024.0);
+
+    len = snprintf( lbuf, sizeof( lbuf ),
+                    "written %llu\ninmem %llu\nfilled %llu\nstaged %llu\nbuffered %llu\nmoved %llu\n"
+                    "copies/byte %.2f\ncpu_us %llu\ncpu_ms/MB %.1f\n",
+                    (unsigned long long)copyStats.written, (unsigned long long)copyStats.inmem,
+                    (unsigned long long)copyStats.filled, (unsigned long long)copyStats.staged,
+                    (unsigned long long)copyStats.buffered, (unsigned long long)copyStats.moved,
+                    copyStats.written ? (double)copies / copyStats.written : 0.0,
+                    (unsigned long long)cpuUs, mb > 0 ? (cpuUs / 1000.0) / mb : 0.0 );
+
+    return xattrReply( lbuf, len, value, size );
+}
+
+/**
+ * Card sectors written by cause against the bytes applications wrote.
+ * Gathered data not yet written shows up as logical bytes only
+ */
+static int wrStatsXattr( char *value, size_t size ) {
+
+    FFWRSTATS st;
+    char lbuf[512];
+    uint64_t total = 0, meta;
+    int i, len;
+
+    f_wrstats( &st, 0 );
+    for ( i = 0 ; i < WR_CAUSES ; i++ ) {
+        total += st.nsect[i];
+    }
+    meta = total - st.nsect[WR_DATA] - st.nsect[WR_RMW];
+
+    len = snprintf( lbuf, sizeof( lbuf ),
+                    "logical %llu\nfatfs %llu\ndata %llu\nrmw %llu\nfat %llu\nfat_mirror %llu\n"
+                    "dir %llu\nfsinfo %llu\nzero %llu\nerased %llu\nsectors %llu\n"
+                    "amplification %.2f\nmetadata%% %.1f\n",
+                    (unsigned long long)wrLogical, (unsigned long long)st.bytes,
+                    (unsigned long long)st.nsect[WR_DATA], (unsigned long long)st.nsect[WR_RMW],
+                    (unsigned long long)st.nsect[WR_FAT], (unsigned long long)st.nsect[WR_FATMIRROR],
+                    (unsigned long long)st.nsect[WR_DIR], (unsigned long long)st.nsect[WR_FSINFO],
+                    (unsigned long long)st.nsect[WR_ZERO], (unsigned long long)st.erased,
+                    (unsigned long long)total,
+                    wrLogical ? (double)(total * FF_MAX_SS) / wrLogical : 0.0,
+                    total ? (meta * 100.0) / total : 0.0 );
+
+    return xattrReply( lbuf, len, value, size );
+}
+
+/** Largest heat map or reuse profile export (about 24KB for the heat map) */
+#define HEATMAP_CSV_MAX 65536
+
+/** Largest user.spifat.procstats reply, about 100 bytes per process */
+#define PROCSTATS_TEXT_MAX (PROCSTATS_SLOTS * 128)
+
+static int procStatsXattr( char *value, size_t size ) {
+
+    char *text;
+    int len, rv;
+
+    text = malloc( PROCSTATS_TEXT_MAX );
+    if ( text == NULL ) {
+        return -ENOMEM;
+    }
+    len = procstats_text( text, PROCSTATS_TEXT_MAX );
+    rv = xattrReply( text, len, value, size );
+    free( text );
+
+    return rv;
+}
+
+/** "<pid> <ms>": a card time limit for one process */
+static int procLimitXattr( const char *value, size_t size ) {
+
+    char lbuf[32];
+    int pid;
+    unsigned int ms;
+
+    if ( size >= sizeof( lbuf ) ) {
+        return -EINVAL;
+    }
+    memcpy( lbuf, value, size );
+    lbuf[size] = '\0';
+    if ( sscanf( lbuf, "%d %u", &pid, &ms ) != 2 || pid < 0 ) {
+        return -EINVAL;
+    }
+
+    return procstats_set_limit( pid, ms ) == 0 ? 0 : -ENOMEM;
+}
+
+/** LBA heat map or reuse distance profile as CSV, see heatmap.c */
+static int heatmapXattr( int reuse, char *value, size_t size ) {
+
+    char *csv;
+    int len, rv;
+
+    csv = malloc( HEATMAP_CSV_MAX );
+    if ( csv == NULL ) {
+        return -ENOMEM;
+    }
+    len = disk_heatmap_csv( reuse, csv, HEATMAP_CSV_MAX );
+    rv = xattrReply( csv, len, value, size );
+    free( csv );
+
+    return rv;
+}
+
+static int setXattr( const char *path, const char *name, const char *value, size_t size ) {
+
+    /** Any value deletes the object and its whole subtree */
+    if ( strcmp( name, RMTREE_XATTR ) == 0 ) {
+        return rmTree( path );
+    }
+
+    if ( strcmp( name, BUSSTATS_XATTR ) == 0 ) {
+        if ( size == 5 && strncmp( value, "reset", 5 ) == 0 ) {
+            return disk_ioctl( 0, MMC_RESET_BUSSTATS, NULL ) == RES_OK ? 0 : -EIO;
+        }
+        return -EINVAL;
+    }
+
+    if ( strcmp( name, WRSTATS_XATTR ) == 0 ) {
+        if ( size == 5 && strncmp( value, "reset", 5 ) == 0 ) {
+            f_wrstats( NULL, 1 );
+            wrLogical = 0;
+            return 0;
+        }
+        return -EINVAL;
+    }
+
+    if ( strcmp( name, PROCSTATS_XATTR ) == 0 ) {
+        if ( size == 5 && strncmp( value, "reset", 5 ) == 0 ) {
+            procstats_reset();
+            return 0;
+        }
+        return -EINVAL;
+    }
+
+    if ( strcmp( name, PROCLIMIT_XATTR ) == 0 ) {
+        return procLimitXattr( value, size );
+    }
+
+    if ( strcmp( name, HEATMAP_XATTR ) == 0 || strcmp( name, REUSE_XATTR ) == 0 ) {
+        if ( size == 5 && strncmp( value, "reset", 5 ) == 0 ) {
+            disk_heatmap_reset();
+            return 0;
+        }
+        return -EINVAL;
+    }
+
+    if ( strcmp( name, COPYSTATS_XATTR ) == 0 ) {
+        if ( size == 5 && strncmp( value, "reset", 5 ) == 0 ) {
+            memset( &copyStats, 0, sizeof( copyStats ) );
+            copyStats.cpuStart = cpuMicros();
+            return 0;
+        }
+        return -EINVAL;
+    }
+
+    /** FAT has nowhere to keep arbitrary attributes */
+    return -ENOTSUP;
+}
+
+int spifat_setxattr( const char *path, const char *name, const char *value, size_t size ) {
+
+    int rv;
+
+    /**
+     * Directory warm-up. Any value starts streaming the subtree into the
+     * cache, "cancel" stops the current warm-up. Its thread walks the tree
+     * taking fsLock itself, so neither is called with it held
+     */
+    if ( strcmp( name, WARMUP_XATTR ) == 0 ) {
+        if ( size == 6 && strncmp( value, "cancel", 6 ) == 0 ) {
+            warmup_cancel();
+            return 0;
+        }
+
+        return FRESULT_TO_OSCODE( warmup_start( path ) );
+    }
+
+    rv = enterFs();
+    if ( rv != 0 ) {
+        return rv;
+    }
+    rv = setXattr( path, name, value, size );
+    leaveFs();
+
+    return rv;
+}
+
+static int getXattr( const char *path, const char *name, char *value, size_t size ) {
+
+    char lbuf[512];
+    int len;
+
+    if ( strcmp( name, WARMUP_XATTR ) == 0 ) {
+        len = warmup_status( lbuf, sizeof( lbuf ) );
+        return xattrReply( lbuf, len, value, size );
+    }
+
+    if ( strcmp( name, BUSSTATS_XATTR ) == 0 ) {
+        return busStatsXattr( value, size );
+    }
+
+    if ( strcmp( name, RECOVERY_XATTR ) == 0 ) {
+        return recoveryStatsXattr( value, size );
+    }
+    if ( strcmp( name, INITSTATS_XATTR ) == 0 ) {
+        return initStatsXattr( value, size );
+    }
+    if ( strcmp( name, COPYSTATS_XATTR ) == 0 ) {
+        return copyStatsXattr( value, size );
+    }
+    if ( strcmp( name, ATTRCACHE_XATTR ) == 0 ) {
+        return attrCacheXattr( value, size );
+    }
+    if ( strcmp( name, WRSTATS_XATTR ) == 0 ) {
+        return wrStatsXattr( value, size );
+    }
+    if ( strcmp( name, HEATMAP_XATTR ) == 0 ) {
+        return heatmapXattr( 0, value, size );
+    }
+    if ( strcmp( name, REUSE_XATTR ) == 0 ) {
+        return heatmapXattr( 1, value, size );
+    }
+    if ( strcmp( name, PROCSTATS_XATTR ) == 0 ) {
+        return procStatsXattr( value, size );
+    }
+
+    if ( strcmp( name, FATEXTENT_SCLUST_XATTR ) == 0 ||
+         strcmp( name, FATEXTENT_COUNT_XATTR ) == 0 ||
+         strcmp( name, FATEXTENT_MAP_XATTR ) == 0 ||
+         strcmp( name, FATEXTENT_ATTR_XATTR ) == 0 ) {
+        return layoutXattr( path, name, value, size );
+    }
+
+    return -ENODATA;
+}
+
+/** Read size used when hashing a whole file on demand */
+#define HASH_READ_CHUNK (32 * 1024)
+
+/**
+ * Returns the hashes of the file at path from the index, or else reads it
+ * through a handle of its own for hashRead() to index. Each chunk takes
+ * fsLock for itself, so a large file doesn't hold up everyone else, and a
+ * write-out to the file meanwhile spoils the hash (forgetContent()).
+ *
+ * Returns: 0 = success, -EBUSY if the file was written while it was read,
+ * negative errno
+ */
+static int hashFile( const char *path, HASHENTRY *entry ) {
+
+    SPIFAT_FILE *file;
+    HASHSTREAM empty;
+    BYTE *buf;
+    uint64_t offset = 0;
+    ssize_t n;
+    FRESULT res;
+    int rv, found;
+
+    rv = enterFs();
+    if ( rv != 0 ) {
+        return rv;
+    }
+    res = hashidx_key( path, &entry->key );
+    found = res == FR_OK && hashidx_lookup( &entry->key, entry );
+    leaveFs();
+
+    if ( res != FR_OK ) {
+        return res == FR_NO_FILE ? -ENODATA : FRESULT_TO_OSCODE( res );
+    }
+    if ( found ) {
+        return 0;
+    }
+
+    /** Empty files have no cluster to key on and nothing to read */
+    if ( entry->key.fsize == 0 ) {
+        hashidx_stream_init( &empty );
+        hashidx_stream_finish( &empty, entry );
+        return 0;
+    }
+
+    buf = malloc( HASH_READ_CHUNK );
+    if ( buf == NULL ) {
+        return -ENOMEM;
+    }
+    rv = spifat_open( path, SPIFAT_READ, &file );
+    if ( rv != 0 ) {
+        free( buf );
+        return rv;
+    }
+    do {
+        n = spifat_pread( file, buf, HASH_READ_CHUNK, offset );
+        if ( n > 0 ) {
+            offset += n;
+        }
+    } while ( n == HASH_READ_CHUNK );
+    spifat_close( file );
+    free( buf );
+
+    if ( n < 0 ) {
+        return (int)n;
+    }
+
+    rv = enterFs();
+    if ( rv != 0 ) {
+        return rv;
+    }
+    res = hashidx_key( path, &entry->key );
+    found = res == FR_OK && hashidx_lookup( &entry->key, entry );
+    leaveFs();
+
+    return found ? 0 : -EBUSY;
+}
+
+/** Content hashes, from the index or computed once on first use */
+static int hashXattr( const char *path, const char *name, char *value, size_t size ) {
+
+    HASHENTRY entry;
+    char lbuf[SHA1_DIGEST_SIZE * 2 + 1];
+    int i, len, rv;
+
+    rv = hashFile( path, &entry );
+    if ( rv != 0 ) {
+        return rv;
+    }
+
+    if ( strcmp( name, HASHIDX_CRC32_XATTR ) == 0 ) {
+        len = snprintf( lbuf, sizeof( lbuf ), "%08x", entry.crc32 );
+    } else {
+        for ( i = 0 ; i < SHA1_DIGEST_SIZE ; i++ ) {
+            sprintf( lbuf + (i * 2), "%02x", entry.sha1[i] );
+        }
+        len = SHA1_DIGEST_SIZE * 2;
+    }
+
+    return xattrReply( lbuf, len, value, size );
+}
+
+int spifat_getxattr( const char *path, const char *name, char *value, size_t size ) {
+
+    int rv;
+
+    /** Hashing reads the file, taking fsLock a chunk at a time */
+    if ( strcmp( name, HASHIDX_CRC32_XATTR ) == 0 ||
+         strcmp( name, HASHIDX_SHA1_XATTR ) == 0 ) {
+        return hashXattr( path, name, value, size );
+    }
+
+    rv = enterFs();
+    if ( rv != 0 ) {
+        return rv;
+    }
+    rv = getXattr( path, name, value, size );
+    leaveFs();
+
+    return rv;
+}
+
+int spifat_listxattr( const char *path, char *list, size_t size ) {
+
+    static const char rootNames[] =
+        WARMUP_XATTR "\0"
+        BUSSTATS_XATTR "\0"
+        RECOVERY_XATTR "\0"
+        INITSTATS_XATTR "\0"
+        COPYSTATS_XATTR "\0"
+        ATTRCACHE_XATTR "\0"
+        WRSTATS_XATTR "\0"
+        HEATMAP_XATTR "\0"
+        REUSE_XATTR "\0"
+        PROCSTATS_XATTR "\0";
+    static const char dirNames[] =
+        WARMUP_XATTR "\0"
+        FATEXTENT_SCLUST_XATTR "\0"
+        FATEXTENT_ATTR_XATTR "\0";
+    static const char fileNames[] =
+        HASHIDX_CRC32_XATTR "\0"
+        HASHIDX_SHA1_XATTR "\0"
+        FATEXTENT_SCLUST_XATTR "\0"
+        FATEXTENT_COUNT_XATTR "\0"
+        FATEXTENT_MAP_XATTR "\0"
+        FATEXTENT_ATTR_XATTR "\0";
+
+    FILINFO finfo;
+    FRESULT res;
+    int rv;
+
+    rv = enterFs();
+    if ( rv != 0 ) {
+        return rv;
+    }
+
+    if ( strcmp( path, "/" ) == 0 ) {
+        rv = xattrReply( rootNames, sizeof( rootNames ) - 1, list, size );
+    } else {
+        res = f_stat( path, &finfo );
+        if ( res != FR_OK ) {
+            rv = FRESULT_TO_OSCODE( res );
+        } else if ( (finfo.fattrib & AM_DIR) == AM_DIR ) {
+            rv = xattrReply( dirNames, sizeof( dirNames ) - 1, list, size );
+        } else {
+            rv = xattrReply( fileNames, sizeof( fileNames ) - 1, list, size );
+        }
+    }
+
+    leaveFs();
+
+    return rv;
+}
+
+static void *reqWorker( void *arg ) {
+
+    SPIFAT_REQ *req;
+
+    (void) arg;
+
+    for ( ;; ) {
+        pthread_mutex_lock( &reqLock );
+        while ( reqHead == NULL && !reqStop ) {
+            pthread_cond_wait( &reqCond, &reqLock );
+        }
+        req = reqHead;
+        if ( req == NULL ) {
+            pthread_mutex_unlock( &reqLock );
+            return NULL;
+        }
+        reqHead = req->next;
+        if ( reqHead == NULL ) {
+            reqTail = NULL;
+        }
+        pthread_mutex_unlock( &reqLock );
+
+        /** Charged to the submitter but never throttled, the queue is shared */
+        if ( req->accounted ) {
+            accountStart( req->pid, req->uid );
+        }
+
+        switch ( req->op ) {
+            case SPIFAT_OP_READ: {
+                req->result = spifat_pread( req->file, req->buf, req->size, req->offset );
+                break;
+            }
+            case SPIFAT_OP_WRITE: {
+                req->result = spifat_pwrite( req->file, req->buf, req->size, req->offset );
+                break;
+            }
+            case SPIFAT_OP_SYNC: {
+                req->result = spifat_sync( req->file );
+                break;
+            }
+            default: {
+                req->result = -EINVAL;
+                break;
+            }
+        }
+        spifat_account_end();
+
+        if ( req->done != NULL ) {
+            req->done( req );
+        }
+    }
+}
+
+/**
+ * Queues a request for the worker thread, starting it on first use.
+ *
+ * Returns: 0 = queued, negative errno
+ */
+int spifat_submit( SPIFAT_REQ *req ) {
+
+    req->next = NULL;
+    req->accounted = account.active;
+    req->pid = account.pid;
+    req->uid = account.uid;
+
+    pthread_mutex_lock( &reqLock );
+    if ( !hasReqThread ) {
+        if ( pthread_create( &reqThread, NULL, reqWorker, NULL ) != 0 ) {
+            pthread_mutex_unlock( &reqLock );
+            return -EAGAIN;
+        }
+        hasReqThread = 1;
+    }
+    if ( reqTail != NULL ) {
+        reqTail->next = req;
+    } else {
+        reqHead = req;
+    }
+    reqTail = req;
+    pthread_cond_signal( &reqCond );
+    pthread_mutex_unlock( &reqLock );
+
+    return 0;
+}
+
+ssize_t spifat_borrow( SPIFAT_FILE *file, uint64_t offset, size_t size, const void **data ) {
+
+    FRESULT res = FR_OK;
+    DRESULT dres;
+    FSIZE_t fsize;
+    QWORD index, first = 0;
+    const BYTE *sector;
+    UINT i;
+    size_t avail;
+    int rv;
+
+    *data = NULL;
+
+    rv = enterFs();
+    if ( rv != 0 ) {
+        return rv;
+    }
+
+    rv = flushStage( file, 1 );
+    if ( rv != 0 ) {
+        leaveFs();
+        return rv;
+    }
+
+    fsize = f_size( &file->fil );
+    if ( offset >= fsize || size == 0 ) {
+        leaveFs();
+        return 0;
+    }
+
+    /** Written data may still be in the file's own buffer */
+    if ( file->written ) {
+        res = f_sync( &file->fil );
+    }
+    if ( res == FR_OK && !file->hasMap ) {
+        res = fatextent_file( file->path, &file->map );
+        file->hasMap = (res == FR_OK);
+    }
+    if ( res != FR_OK ) {
+        leaveFs();
+        return FRESULT_TO_OSCODE( res );
+    }
+
+    index = offset / FF_MAX_SS;
+    for ( i = 0 ; i < file->map.nextents ; i++ ) {
+        if ( index < first + file->map.extents[i].nsectors ) {
+            break;
+        }
+        first += file->map.extents[i].nsectors;
+    }
+    if ( i == file->map.nextents ) {
+        leaveFs();
+        return -EIO;
+    }
+
+    dres = disk_borrow( 0, file->map.extents[i].sector + (index - first), &sector );
+
+    leaveFs();
+
+    if ( dres == RES_PARERR ) {
+        return -ENOBUFS;
+    }
+    if ( dres != RES_OK ) {
+        return -EIO;
+    }
+
+    avail = FF_MAX_SS - (offset % FF_MAX_SS);
+    if ( avail > fsize - offset ) {
+        avail = fsize - offset;
+    }
+    if ( avail > size ) {
+        avail = size;
+    }
+    *data = sector + (offset % FF_MAX_SS);
+    accountBytes( avail, 0 );
+
+    return avail;
+}
+
+void spifat_unborrow( const void *data ) {
+    disk_unborrow( data );
+}
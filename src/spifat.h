@@ -0,0 +1,162 @@
+/**
+ * libspifat: the FatFs, card transport and cache stack as a library
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SPIFAT_DEFINED
+#define _SPIFAT_DEFINED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Every call is serialised on one lock and the volume is mounted on first
+ * use. Paths are FAT paths ("/DIR/FILE.EXT") and errors are returned as
+ * negative errno values, as FUSE expects.
+ */
+
+/** Set up by spifat_init() */
+typedef struct {
+    unsigned int cache_kb;  /** Sector cache size, 0 runs uncached */
+    const char *hashdb;     /** Content hash index file, NULL for none */
+    int native;             /** 1 = 4-bit SD bus wiring, 0 = SPI */
+    const char *image;      /** Serve a card image file instead, NULL for the card */
+    const char *spidev;     /** Reach the card through this spidev device, NULL for GPIO */
+    int readonly;           /** 1 = mutations fail with -EROFS, lookups and reads skip the lock */
+    unsigned int proc_limit_ms; /** Card time each process may use per second [ms], 0 = unlimited */
+    int alloc_next;         /** 1 = allocate volume-wide next-fit, 0 = near each file's directory */
+    unsigned int delalloc_kb;   /** Writes gathered per file before its clusters are picked [KB], 0 = per cluster */
+} SPIFAT_CONFIG;
+
+/** Open modes, the same bits as FatFs FA_READ/FA_WRITE/FA_CREATE_NEW */
+#define SPIFAT_READ     0x01
+#define SPIFAT_WRITE    0x02
+#define SPIFAT_CREATE   0x04    /** Create, failing if the file exists */
+
+typedef struct SPIFAT_FILE SPIFAT_FILE;
+typedef struct SPIFAT_DIR SPIFAT_DIR;
+
+typedef struct {
+    uint64_t size;
+    int isdir;
+    unsigned int attrib;    /** FAT attribute bits */
+    time_t mtime;           /** -1 if the directory entry has no valid stamp */
+} SPIFAT_STAT;
+
+typedef struct {
+    char name[256];
+    SPIFAT_STAT st;
+} SPIFAT_DIRENT;
+
+int spifat_init( const SPIFAT_CONFIG *config );
+void spifat_shutdown( void );
+
+int spifat_stat( const char *path, SPIFAT_STAT *st );
+int spifat_mkdir( const char *path );
+int spifat_rmdir( const char *path );
+int spifat_unlink( const char *path );
+int spifat_rmtree( const char *path );
+int spifat_utime( const char *path, time_t mtime );
+
+int spifat_open( const char *path, int mode, SPIFAT_FILE **file );
+ssize_t spifat_pread( SPIFAT_FILE *file, void *buf, size_t size, uint64_t offset );
+ssize_t spifat_pwrite( SPIFAT_FILE *file, const void *buf, size_t size, uint64_t offset );
+int spifat_sync( SPIFAT_FILE *file );
+int spifat_fsync( SPIFAT_FILE *file );
+
+/**
+ * Writes without an intermediate buffer: fill() is handed a page aligned
+ * destination inside the library and places size bytes there (e.g. by
+ * reading a pipe), returning the bytes placed or a negative errno. It
+ * runs with the filesystem lock held.
+ */
+ssize_t spifat_pwrite_fill( SPIFAT_FILE *file, size_t size, uint64_t offset,
+                            ssize_t (*fill)( void *dst, size_t size, void *arg ), void *arg );
+int spifat_close( SPIFAT_FILE *file );
+
+/** spifat_readdir() returns 1 per entry, 0 at the end */
+int spifat_opendir( const char *path, SPIFAT_DIR **dir );
+int spifat_readdir( SPIFAT_DIR *dir, SPIFAT_DIRENT *ent );
+int spifat_unreaddir( SPIFAT_DIR *dir );
+int spifat_fsyncdir( SPIFAT_DIR *dir );
+int spifat_closedir( SPIFAT_DIR *dir );
+
+/**
+ * Per-process accounting (user.spifat.procstats). Calls this thread makes
+ * between spifat_account_begin() and spifat_account_end() count as one
+ * request from pid, which is charged the bytes read and written and the
+ * card time and cache use they caused, metadata I/O included. pid may be
+ * a thread id, it is charged to the thread's process. If that is over its
+ * card time limit the request lets other requests have the card first.
+ */
+void spifat_account_begin( pid_t pid, uid_t uid );
+void spifat_account_end( void );
+
+/** The user.spifat.* attributes (spifat-xattr.h), getxattr() size protocol */
+int spifat_getxattr( const char *path, const char *name, char *value, size_t size );
+int spifat_setxattr( const char *path, const char *name, const char *value, size_t size );
+int spifat_listxattr( const char *path, char *list, size_t size );
+
+/**
+ * Asynchronous I/O. Requests are owned by the caller, queued in order and
+ * run on one worker thread, which also calls done() with result set to
+ * what the synchronous call would have returned. The request must stay
+ * valid until then.
+ */
+enum { SPIFAT_OP_READ, SPIFAT_OP_WRITE, SPIFAT_OP_SYNC };
+
+typedef struct SPIFAT_REQ {
+    int op;
+    SPIFAT_FILE *file;
+    void *buf;
+    size_t size;
+    uint64_t offset;
+    void (*done)( struct SPIFAT_REQ *req );
+    void *arg;              /** For the caller */
+    ssize_t result;
+    struct SPIFAT_REQ *next;    /** Private */
+    pid_t pid;                  /** Private: the submitter's accounting */
+    uid_t uid;
+    int accounted;
+} SPIFAT_REQ;
+
+int spifat_submit( SPIFAT_REQ *req );
+
+/**
+ * Zero-copy reads. Points data at the cached sector holding offset and
+ * pins it until spifat_unborrow(). At most the rest of that sector is
+ * lent out per call.
+ *
+ * Returns: bytes available at data (0 at end of file), negative errno;
+ * -ENOBUFS if the sector cache is disabled or full of borrowed sectors
+ */
+ssize_t spifat_borrow( SPIFAT_FILE *file, uint64_t offset, size_t size, const void **data );
+void spifat_unborrow( const void *data );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
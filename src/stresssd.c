@@ -26,6 +26,7 @@
 
 #include "bcm2835.h"
 #include "ff.h"		/* Declarations of FatFs API */
+#include "diskio.h"
 
 typedef enum { NONE, INFO, WARN, TRACE } DebugLevel;
 DebugLevel debugLevel = NONE;
@@ -390,6 +391,23 @@ int main (void)
 
     DEBUG_PRINT( INFO, "Scan Results: %d iterations, %d pass, %d fail, %d corruptions, %d iterations\n", niterations, nmatches, nmismatches, ncorruptions );
 
+    /** Framing overhead of the run: bytes clocked per read/write */
+    DISKBUSSTATS busStats;
+    if ( disk_ioctl( 0, MMC_GET_BUSSTATS, &busStats ) == RES_OK ) {
+        DEBUG_PRINT( INFO, "Bus: %llu ops, %llu bytes (%.1f/op), %llu commands, %llu selects, %llu ready polls, %llu skipped\n",
+                     (unsigned long long)busStats.ops, (unsigned long long)busStats.bytes,
+                     busStats.ops ? (double)busStats.bytes / busStats.ops : 0.0,
+                     (unsigned long long)busStats.commands, (unsigned long long)busStats.selects,
+                     (unsigned long long)busStats.ready_polls, (unsigned long long)busStats.ready_skipped );
+    }
+
+    DISKINITSTATS initStats;
+    if ( disk_ioctl( 0, MMC_GET_INITSTATS, &initStats ) == RES_OK ) {
+        DEBUG_PRINT( INFO, "Init: %lu us (ready after %lu us, %lu polls), %llu early exits\n",
+                     (unsigned long)initStats.last_us, (unsigned long)initStats.ready_us,
+                     (unsigned long)initStats.polls, (unsigned long long)initStats.early_exits );
+    }
+
     /** Tidy up */
     DEBUG_PRINT( INFO, "Removing test files...\n" );
     rv = remove_test_files( "/STRESSSD" );
@@ -0,0 +1,532 @@
+/**
+ * Directory tree warm-up: stream a subtree into the sector cache
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * A warm-up runs on a background thread in two phases:
+ *
+ * 1. The subtree is walked a level at a time. The directory clusters of
+ *    a level are sorted by LBA and prefetched before their entries are
+ *    read, so directories come off the card in LBA order rather than tree
+ *    order, and the extent map of each file is collected on the way.
+ *    FatFs is entered through the lock hooks (warmup_set_lock()) one
+ *    directory entry at a time, so foreground requests get in between.
+ * 2. The file extents are sorted by LBA, merged and handed to
+ *    disk_prefetchv(), which yields the card to any foreground request.
+ *
+ * Both phases can be cancelled between steps. Only one warm-up is active
+ * at a time. Starting a new one cancels the previous, which is what the
+ * front-end wants when the user moves to a different category.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ff.h"
+#include "diskio.h"
+#include "fatextent.h"
+#include "warmup.h"
+
+/** Sectors requested per card session so cancellation stays responsive */
+#define WARMUP_CHUNK 128
+
+/** Ranges per card session */
+#define WARMUP_BATCH_SEGS 16
+
+/** Gaps between runs up to this many sectors are read through */
+#define WARMUP_GAP 8
+
+/** Deepest directory nesting followed */
+#define WARMUP_MAXDEPTH 16
+
+typedef struct {
+    LBA_t sector;
+    DWORD nsectors;
+} WarmRun;
+
+typedef struct {
+    WarmRun *runs;
+    UINT n;
+    UINT max;
+} RunList;
+
+/** The directories of one level of the walk */
+typedef struct {
+    char **paths;
+    UINT n;
+    UINT max;
+} PathList;
+
+static pthread_mutex_t warmLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Serialises warmup_start() and warmup_cancel(), held across the join and create */
+static pthread_mutex_t ctlLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t warmThread;
+static int hasThread = 0;
+static int cancelRequested = 0;
+
+static WarmupState state = WARMUP_IDLE;
+static char warmPath[255];
+static QWORD totalSectors = 0;
+static QWORD doneSectors = 0;
+
+static RunList fileRuns;
+static RunList dirRuns;
+
+/** Serialise FatFs access with the library's other users, NULL if the caller owns it */
+static int (*enterHook)( void ) = NULL;
+static void (*leaveHook)( void ) = NULL;
+
+static int lockFs( void ) {
+    return enterHook != NULL ? enterHook() : 0;
+}
+
+static void unlockFs( void ) {
+
+    if ( leaveHook != NULL ) {
+        leaveHook();
+    }
+}
+
+static int addRun( RunList *list, LBA_t sector, DWORD nsectors ) {
+
+    if ( list->n == list->max ) {
+        UINT newmax = list->max ? list->max * 2 : 256;
+        WarmRun *newruns = realloc( list->runs, newmax * sizeof( WarmRun ) );
+        if ( newruns == NULL ) {
+            return -1;
+        }
+        list->runs = newruns;
+        list->max = newmax;
+    }
+
+    list->runs[list->n].sector = sector;
+    list->runs[list->n].nsectors = nsectors;
+    list->n++;
+
+    return 0;
+}
+
+/** Adds each extent of map as a run. Returns: FR_OK or FR_NOT_ENOUGH_CORE */
+static FRESULT addExtents( RunList *list, const FATEXTENTMAP *map ) {
+
+    UINT i;
+
+    for ( i = 0 ; i < map->nextents ; i++ ) {
+        if ( map->extents[i].nsectors > 0 &&
+             addRun( list, map->extents[i].sector, map->extents[i].nsectors ) != 0 ) {
+            return FR_NOT_ENOUGH_CORE;
+        }
+    }
+
+    return FR_OK;
+}
+
+static int compareRuns( const void *a, const void *b ) {
+
+    const WarmRun *ra = a;
+    const WarmRun *rb = b;
+
+    if ( ra->sector < rb->sector ) {
+        return -1;
+    }
+    if ( ra->sector > rb->sector ) {
+        return 1;
+    }
+    return 0;
+}
+
+/** Sorts the runs by LBA and merges any that touch or overlap */
+static void sortAndMergeRuns( RunList *list ) {
+
+    WarmRun *runs = list->runs;
+    UINT i, out = 0;
+
+    if ( list->n == 0 ) {
+        return;
+    }
+
+    qsort( runs, list->n, sizeof( WarmRun ), compareRuns );
+
+    for ( i = 1 ; i < list->n ; i++ ) {
+        LBA_t end = runs[out].sector + runs[out].nsectors;
+        if ( runs[i].sector <= end ) {
+            LBA_t iend = runs[i].sector + runs[i].nsectors;
+            if ( iend > end ) {
+                runs[out].nsectors = (DWORD)(iend - runs[out].sector);
+            }
+        } else {
+            runs[++out] = runs[i];
+        }
+    }
+    list->n = out + 1;
+}
+
+static int addPath( PathList *list, const char *path ) {
+
+    if ( list->n == list->max ) {
+        UINT newmax = list->max ? list->max * 2 : 64;
+        char **newpaths = realloc( list->paths, newmax * sizeof( char * ) );
+        if ( newpaths == NULL ) {
+            return -1;
+        }
+        list->paths = newpaths;
+        list->max = newmax;
+    }
+
+    list->paths[list->n] = strdup( path );
+    if ( list->paths[list->n] == NULL ) {
+        return -1;
+    }
+    list->n++;
+
+    return 0;
+}
+
+static void freePaths( PathList *list ) {
+
+    UINT i;
+
+    for ( i = 0 ; i < list->n ; i++ ) {
+        free( list->paths[i] );
+    }
+    free( list->paths );
+    memset( list, 0, sizeof( PathList ) );
+}
+
+static int cancelled( void ) {
+    return __atomic_load_n( &cancelRequested, __ATOMIC_ACQUIRE );
+}
+
+static void setState( WarmupState newstate ) {
+
+    pthread_mutex_lock( &warmLock );
+    state = newstate;
+    pthread_mutex_unlock( &warmLock );
+}
+
+/**
+ * Hands the sorted runs to disk_prefetchv() in batches of at most
+ * WARMUP_BATCH_SEGS ranges / WARMUP_CHUNK sectors. Each batch is one card
+ * session and runs separated by small gaps are read through as one
+ * multi-block read.
+ *
+ * Returns: FR_OK, FR_DISK_ERR or FR_TIMEOUT if cancelled
+ */
+static FRESULT prefetchRuns( const RunList *list ) {
+
+    DISKSEG batch[WARMUP_BATCH_SEGS];
+    UINT i = 0, nbatch;
+    DWORD runOffset = 0, nbatchsectors;
+    DRESULT res = RES_OK;
+
+    pthread_mutex_lock( &warmLock );
+    for ( i = 0 ; i < list->n ; i++ ) {
+        totalSectors += list->runs[i].nsectors;
+    }
+    pthread_mutex_unlock( &warmLock );
+
+    i = 0;
+    while ( i < list->n && res == RES_OK ) {
+
+        if ( cancelled() ) {
+            return FR_TIMEOUT;
+        }
+
+        nbatch = 0;
+        nbatchsectors = 0;
+        while ( i < list->n && nbatch < WARMUP_BATCH_SEGS && nbatchsectors < WARMUP_CHUNK ) {
+            DWORD n = list->runs[i].nsectors - runOffset;
+            if ( n > WARMUP_CHUNK - nbatchsectors ) {
+                n = WARMUP_CHUNK - nbatchsectors;
+            }
+
+            batch[nbatch].sector = list->runs[i].sector + runOffset;
+            batch[nbatch].count = n;
+            batch[nbatch].buff = NULL;
+            nbatch++;
+            nbatchsectors += n;
+
+            runOffset += n;
+            if ( runOffset == list->runs[i].nsectors ) {
+                i++;
+                runOffset = 0;
+            }
+        }
+
+        res = disk_prefetchv( 0, batch, nbatch, WARMUP_GAP );
+
+        pthread_mutex_lock( &warmLock );
+        doneSectors += nbatchsectors;
+        pthread_mutex_unlock( &warmLock );
+    }
+
+    return res == RES_OK ? FR_OK : FR_DISK_ERR;
+}
+
+/** Queues the clusters of the directory at path for the level's prefetch */
+static FRESULT addDirRuns( const char *path ) {
+
+    FATEXTENTMAP map;
+    FRESULT res;
+
+    if ( lockFs() != 0 ) {
+        return FR_NOT_READY;
+    }
+    res = fatextent_dir( path, &map );
+    unlockFs();
+
+    if ( res == FR_OK ) {
+        res = addExtents( &dirRuns, &map );
+        fatextent_free( &map );
+    }
+
+    return res;
+}
+
+/**
+ * Reads the entries of the directory at path, an entry per trip into
+ * FatFs. Subdirectories go on next, file extents on fileRuns. The
+ * directory is reopened and sought to the saved position on every trip,
+ * so no FatFs object is held while the lock is released: the volume may
+ * be remounted, or the directory deleted, in between.
+ */
+static FRESULT walkDir( const char *path, PathList *next ) {
+
+    FRESULT res = FR_OK;
+    DIR dir;
+    FILINFO finfo;
+    FATEXTENTMAP map;
+    DWORD pos = 0;
+    char childpath[255];
+
+    while ( !cancelled() ) {
+        if ( lockFs() != 0 ) {
+            res = FR_NOT_READY;
+            break;
+        }
+
+        res = f_opendir( &dir, path );
+        if ( res != FR_OK ) {
+            unlockFs();
+            if ( res == FR_NO_PATH || res == FR_NO_FILE ) {
+                res = FR_OK;    /** Deleted since it was queued */
+            }
+            break;
+        }
+        if ( pos != 0 && f_seekdir( &dir, pos ) != FR_OK ) {
+            finfo.fname[0] = 0; /** Shrunk since the last trip */
+        } else {
+            res = f_readdir( &dir, &finfo );
+            f_telldir( &dir, &pos );
+        }
+        if ( res != FR_OK || finfo.fname[0] == 0 ) {
+            f_closedir( &dir );
+            unlockFs();
+            break;
+        }
+
+        snprintf( childpath, sizeof( childpath ), "%s/%s",
+                  strcmp( path, "/" ) == 0 ? "" : path, finfo.fname );
+
+        if ( (finfo.fattrib & AM_DIR) == AM_DIR ) {
+            if ( addPath( next, childpath ) != 0 ) {
+                res = FR_NOT_ENOUGH_CORE;
+            }
+        } else {
+            res = fatextent_file( childpath, &map );
+            if ( res == FR_OK ) {
+                res = addExtents( &fileRuns, &map );
+                fatextent_free( &map );
+            }
+        }
+        f_closedir( &dir );
+        unlockFs();
+
+        if ( res != FR_OK ) {
+            break;
+        }
+    }
+
+    return res;
+}
+
+static void *warmupThread( void *arg ) {
+
+    PathList level, next;
+    FRESULT res = FR_OK;
+    UINT depth, i;
+
+    (void) arg;
+
+    memset( &level, 0, sizeof( level ) );
+    memset( &next, 0, sizeof( next ) );
+    fileRuns.n = 0;
+
+    if ( addPath( &level, warmPath ) != 0 ) {
+        res = FR_NOT_ENOUGH_CORE;
+    }
+
+    for ( depth = 0 ; res == FR_OK && level.n > 0 && depth <= WARMUP_MAXDEPTH ; depth++ ) {
+
+        /** This level's directories, read ahead in LBA order */
+        dirRuns.n = 0;
+        for ( i = 0 ; i < level.n && res == FR_OK && !cancelled() ; i++ ) {
+            res = addDirRuns( level.paths[i] );
+        }
+        if ( res == FR_OK ) {
+            sortAndMergeRuns( &dirRuns );
+            res = prefetchRuns( &dirRuns );
+        }
+
+        for ( i = 0 ; i < level.n && res == FR_OK && !cancelled() ; i++ ) {
+            res = walkDir( level.paths[i], &next );
+        }
+
+        freePaths( &level );
+        level = next;
+        memset( &next, 0, sizeof( next ) );
+    }
+    freePaths( &level );
+
+    if ( res == FR_OK && !cancelled() ) {
+        sortAndMergeRuns( &fileRuns );
+        res = prefetchRuns( &fileRuns );
+    }
+
+    if ( cancelled() ) {
+        setState( WARMUP_CANCELLED );
+    } else {
+        setState( res == FR_OK ? WARMUP_DONE : WARMUP_FAILED );
+    }
+
+    return NULL;
+}
+
+/**
+ * FatFs is entered through enter() and left through leave() by the
+ * warm-up thread, a directory entry at a time. enter() returns 0 or a
+ * negative errno. Without hooks the caller must not touch FatFs while a
+ * warm-up runs.
+ */
+void warmup_set_lock( int (*enter)( void ), void (*leave)( void ) ) {
+
+    enterHook = enter;
+    leaveHook = leave;
+}
+
+/** Stops the thread and waits for it. Called with ctlLock held */
+static void stopThread( void ) {
+
+    if ( hasThread ) {
+        __atomic_store_n( &cancelRequested, 1, __ATOMIC_RELEASE );
+        pthread_join( warmThread, NULL );
+        hasThread = 0;
+    }
+
+    pthread_mutex_lock( &warmLock );
+    if ( state == WARMUP_RUNNING ) {
+        state = WARMUP_CANCELLED;
+    }
+    pthread_mutex_unlock( &warmLock );
+
+    __atomic_store_n( &cancelRequested, 0, __ATOMIC_RELEASE );
+}
+
+/**
+ * Stops any running warm-up and waits for its thread to exit. Must not
+ * be called with the FatFs lock held as the thread may be waiting for it.
+ */
+void warmup_cancel( void ) {
+
+    pthread_mutex_lock( &ctlLock );
+    stopThread();
+    pthread_mutex_unlock( &ctlLock );
+}
+
+/**
+ * Starts walking the subtree at path and streaming its directories and
+ * file data into the cache in the background. Only the path is checked
+ * before returning. Must not be called with the FatFs lock held.
+ *
+ * Returns: FR_OK if the warm-up has been started
+ */
+FRESULT warmup_start( const TCHAR *path ) {
+
+    FRESULT res;
+    DIR dir;
+
+    pthread_mutex_lock( &ctlLock );
+    stopThread();
+
+    if ( lockFs() != 0 ) {
+        setState( WARMUP_FAILED );
+        pthread_mutex_unlock( &ctlLock );
+        return FR_NOT_READY;
+    }
+    res = f_opendir( &dir, path );
+    if ( res == FR_OK ) {
+        f_closedir( &dir );
+    }
+    unlockFs();
+    if ( res != FR_OK ) {
+        setState( WARMUP_FAILED );
+        pthread_mutex_unlock( &ctlLock );
+        return res;
+    }
+
+    pthread_mutex_lock( &warmLock );
+    strncpy( warmPath, path, sizeof( warmPath ) - 1 );
+    warmPath[sizeof( warmPath ) - 1] = '\0';
+    totalSectors = doneSectors = 0;
+    state = WARMUP_RUNNING;
+    pthread_mutex_unlock( &warmLock );
+
+    if ( pthread_create( &warmThread, NULL, warmupThread, NULL ) != 0 ) {
+        setState( WARMUP_FAILED );
+        pthread_mutex_unlock( &ctlLock );
+        return FR_INT_ERR;
+    }
+    hasThread = 1;
+    pthread_mutex_unlock( &ctlLock );
+
+    return FR_OK;
+}
+
+/**
+ * Formats "<state> <done>/<total> <path>" with sector counts.
+ *
+ * Returns: length of the formatted string (as snprintf())
+ */
+int warmup_status( char *buf, size_t bufsz ) {
+
+    static const char *stateNames[] = { "idle", "running", "done", "cancelled", "failed" };
+    int rv;
+
+    pthread_mutex_lock( &warmLock );
+    rv = snprintf( buf, bufsz, "%s %llu/%llu %s", stateNames[state],
+                   (unsigned long long)doneSectors,
+                   (unsigned long long)totalSectors, warmPath );
+    pthread_mutex_unlock( &warmLock );
+
+    return rv;
+}
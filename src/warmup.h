@@ -0,0 +1,50 @@
+/**
+ * Directory tree warm-up: stream a subtree into the sector cache
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _WARMUP_DEFINED
+#define _WARMUP_DEFINED
+
+#include <stddef.h>
+
+#include "ff.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    WARMUP_IDLE = 0,
+    WARMUP_RUNNING,
+    WARMUP_DONE,
+    WARMUP_CANCELLED,
+    WARMUP_FAILED
+} WarmupState;
+
+void warmup_set_lock( int (*enter)( void ), void (*leave)( void ) );
+FRESULT warmup_start( const TCHAR *path );
+void warmup_cancel( void );
+int warmup_status( char *buf, size_t bufsz );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
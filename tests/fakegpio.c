@@ -0,0 +1,645 @@
+/**
+ * Fake bcm2835 GPIO with the SD card model wired to the card pins
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "bcm2835.h"
+#include "fakegpio.h"
+#include "sdcard-model.h"
+
+/**
+ * The card pins as sdmm.c and sdnative.c wire them. SPI DO/DI/SCLK/CS#
+ * are DAT0/CMD/CLK/DAT3 on the SD bus.
+ */
+#define PIN_DO RPI_GPIO_P1_21
+#define PIN_DI RPI_GPIO_P1_19
+#define PIN_CLK RPI_GPIO_P1_23
+#define PIN_CS RPI_GPIO_P1_24
+#define PIN_CMD PIN_DI
+#define PIN_DAT0 PIN_DO
+#define PIN_DAT1 RPI_GPIO_P1_22
+#define PIN_DAT2 RPI_GPIO_P1_18
+#define PIN_DAT3 PIN_CS
+
+#define NPINS 32
+
+static volatile uint32_t registers[64];
+volatile uint32_t *bcm2835_gpio = registers;
+
+static int bus;
+static unsigned long clocks;
+static BYTE fsel[NPINS];
+static BYTE latch[NPINS];        /** What the host drives on an output */
+static signed char drive[NPINS]; /** What the card drives, -1 for nothing */
+
+/** SPI: the byte being shifted each way and how many bits of it are done */
+static BYTE spiOut;
+static BYTE spiIn;
+static UINT spiBits;
+static int spiLoaded;           /** spiOut came from the card and is not shifted out yet */
+
+/**
+ * SD bus: card state after the 4-bit mode handshake, as far as sdnative.c
+ * takes it
+ */
+#define ST_IDLE 0
+#define ST_READY 1
+#define ST_IDENT 2
+#define ST_STBY 3
+#define ST_TRAN 4
+
+#define RCA 0x1234
+#define BLOCK_NIBBLES (1 + 1024 + 16 + 1)
+
+static int state;
+static int appCommand;
+static UINT width;
+static UINT initPolls;
+
+static uint64_t cmdShift;
+static UINT cmdBits;
+static int inCommand;
+
+static BYTE resp[17];
+static UINT respBits;
+static int respPos;             /** -1: no response going out */
+static UINT respDelay;
+
+static BYTE dataOut[BLOCK_NIBBLES];
+static int dataPos;             /** -1: no data going out */
+static UINT dataDelay;
+static int readMulti;
+static LBA_t readSector;
+static int stopIn;              /** Clocks until a CMD12 ends the data, -1: none */
+
+static int writing;
+static int writeMulti;
+static LBA_t writeSector;
+static BYTE dataIn[BLOCK_NIBBLES];
+static int dataInPos;           /** -1: waiting for the start bit */
+
+static BYTE crcStatus[5];
+static int statusPos;           /** -1: no CRC status going out */
+static UINT statusDelay;
+static UINT busy;               /** Clocks DAT0 stays low */
+
+void fakegpio_attach( int b ) {
+
+    int i;
+
+    bus = b;
+    clocks = 0;
+    for ( i = 0 ; i < NPINS ; i++ ) {
+        fsel[i] = BCM2835_GPIO_FSEL_INPT;
+        latch[i] = 0;
+        drive[i] = -1;
+    }
+    spiOut = 0xFF;
+    spiBits = 0;
+    spiLoaded = 0;
+
+    state = ST_IDLE;
+    appCommand = 0;
+    width = 1;
+    initPolls = 0;
+    inCommand = 0;
+    respPos = -1;
+    dataPos = -1;
+    readMulti = 0;
+    stopIn = -1;
+    writing = 0;
+    dataInPos = -1;
+    statusPos = -1;
+    busy = 0;
+}
+
+unsigned long fakegpio_clocks( void ) {
+    return clocks;
+}
+
+static int spiSelected( void ) {
+    return fsel[PIN_CS] == BCM2835_GPIO_FSEL_OUTP && !latch[PIN_CS];
+}
+
+static int level( uint8_t pin ) {
+
+    if ( pin >= NPINS ) {
+        return 0;
+    }
+    if ( fsel[pin] == BCM2835_GPIO_FSEL_OUTP ) {
+        return latch[pin];
+    }
+    if ( bus == FAKEGPIO_SPI && pin == PIN_DO ) {
+        return spiSelected() ? (spiOut >> (7 - spiBits)) & 1 : 1;
+    }
+    if ( drive[pin] >= 0 ) {
+        return drive[pin];
+    }
+
+    return pin == PIN_CLK ? 0 : 1;    /** Pulled up, SCLK pulled down */
+}
+
+/*
+ * SD bus mode
+ */
+
+static uint32_t cardStatus( void ) {
+    return (uint32_t)state << 9 | (appCommand ? 0x20 : 0) | 0x100;
+}
+
+static void respond48( BYTE index, uint32_t arg, int crc ) {
+
+    resp[0] = index & 0x3F;
+    resp[1] = (BYTE)(arg >> 24);
+    resp[2] = (BYTE)(arg >> 16);
+    resp[3] = (BYTE)(arg >> 8);
+    resp[4] = (BYTE)arg;
+    resp[5] = crc ? (BYTE)(sdcard_crc7( resp, 5 ) << 1 | 1) : 0xFF;
+    respBits = 48;
+    respPos = 0;
+    respDelay = 2;
+}
+
+static void respond136( int which ) {
+
+    resp[0] = 0x3F;
+    sdcard_register( which, resp + 1 );
+    respBits = 136;
+    respPos = 0;
+    respDelay = 2;
+}
+
+static WORD crc16Bits( const BYTE *nibbles, UINT line ) {
+
+    WORD crc = 0;
+    UINT i;
+    int fb;
+
+    for ( i = 0 ; i < 1024 ; i++ ) {
+        fb = ((crc >> 15) & 1) ^ ((nibbles[i] >> line) & 1);
+        crc <<= 1;
+        if ( fb ) {
+            crc ^= 0x1021;
+        }
+    }
+
+    return crc;
+}
+
+/** Start bit, the sector high nibble first, CRC16 per line and end bit */
+static void loadBlock( LBA_t sector ) {
+
+    const BYTE *p = sdcard_image() + (size_t)sector * 512;
+    WORD crc[4];
+    UINT i, line;
+    BYTE n;
+
+    dataOut[0] = 0;
+    for ( i = 0 ; i < 512 ; i++ ) {
+        dataOut[1 + 2 * i] = p[i] >> 4;
+        dataOut[2 + 2 * i] = p[i] & 0x0F;
+    }
+    for ( line = 0 ; line < 4 ; line++ ) {
+        crc[line] = crc16Bits( dataOut + 1, line );
+    }
+    for ( i = 0 ; i < 16 ; i++ ) {
+        n = 0;
+        for ( line = 0 ; line < 4 ; line++ ) {
+            n |= ((crc[line] >> (15 - i)) & 1) << line;
+        }
+        dataOut[1025 + i] = n;
+    }
+    dataOut[BLOCK_NIBBLES - 1] = 0x0F;
+    dataPos = 0;
+}
+
+static LBA_t sectorOf( uint32_t arg ) {
+    return sdcard_sdhc() ? arg : arg / 512;
+}
+
+static void commandNative( const BYTE *c ) {
+
+    BYTE index = c[0] & 0x3F;
+    uint32_t arg = (uint32_t)c[1] << 24 | (uint32_t)c[2] << 16 | (uint32_t)c[3] << 8 | c[4];
+    int app = appCommand;
+    uint32_t ocr;
+
+    if ( !(c[0] & 0x40) ) {
+        sdcard_error( "CMD%u without its transmission bit", index );
+    }
+    if ( sdcard_crc7( c, 5 ) != c[5] >> 1 ) {
+        sdcard_error( "CMD%u with a bad CRC", index );
+        return;
+    }
+
+    appCommand = 0;
+    if ( app ) {
+        switch ( index ) {
+            case 41: {
+                if ( state == ST_IDLE || state == ST_READY ) {
+                    state = ST_READY;
+                    ocr = 0x00FF8000;
+                    if ( ++initPolls >= 3 ) {
+                        ocr |= 0x80000000 | ((sdcard_sdhc() && (arg & 0x40000000)) ? 0x40000000 : 0);
+                        state = ST_IDENT;
+                    }
+                    respond48( 0x3F, ocr, 0 );
+                }
+                return;
+            }
+            case 6: {
+                if ( state != ST_TRAN ) {
+                    sdcard_error( "ACMD6 outside the transfer state" );
+                }
+                width = (arg & 3) == 2 ? 4 : 1;
+                respond48( 6, cardStatus(), 1 );
+                return;
+            }
+            case 23: {
+                respond48( 23, cardStatus(), 1 );
+                return;
+            }
+        }
+    }
+
+    switch ( index ) {
+        case 0: {
+            state = ST_IDLE;
+            initPolls = 0;
+            break;
+        }
+        case 8: {
+            respond48( 8, arg & 0xFFF, 1 );
+            break;
+        }
+        case 55: {
+            appCommand = 1;
+            respond48( 55, cardStatus(), 1 );
+            break;
+        }
+        case 2: {
+            respond136( SDCARD_CID );
+            state = ST_IDENT;
+            break;
+        }
+        case 3: {
+            state = ST_STBY;
+            respond48( 3, (uint32_t)RCA << 16 | 0x0500, 1 );
+            break;
+        }
+        case 9: {
+            respond136( SDCARD_CSD );
+            break;
+        }
+        case 7: {
+            if ( (arg >> 16) != RCA ) {
+                sdcard_error( "CMD7 to RCA %04X", (unsigned)(arg >> 16) );
+            }
+            state = ST_TRAN;
+            respond48( 7, cardStatus(), 1 );
+            busy = 5;
+            break;
+        }
+        case 16: {
+            respond48( 16, cardStatus(), 1 );
+            break;
+        }
+        case 17:
+        case 18: {
+            if ( width != 4 ) {
+                sdcard_error( "CMD%u on a 1-bit bus", index );
+            }
+            readSector = sectorOf( arg );
+            respond48( index, cardStatus(), 1 );
+            readMulti = (index == 18);
+            loadBlock( readSector );
+            dataDelay = 70;
+            break;
+        }
+        case 12: {
+            respond48( 12, cardStatus(), 1 );
+            stopIn = 2;
+            writing = 0;
+            busy = 6;
+            break;
+        }
+        case 24:
+        case 25: {
+            writeSector = sectorOf( arg );
+            respond48( index, cardStatus(), 1 );
+            writing = 1;
+            writeMulti = (index == 25);
+            dataInPos = -1;
+            break;
+        }
+        default: {
+            sdcard_error( "unknown CMD%u", index );
+            break;
+        }
+    }
+}
+
+/** A whole block came in: program it and send the CRC status token */
+static void blockIn( void ) {
+
+    BYTE *p;
+    UINT i, line;
+    WORD crc;
+    int ok = (dataIn[1040] == 0x0F);
+
+    for ( line = 0 ; line < 4 ; line++ ) {
+        crc = 0;
+        for ( i = 0 ; i < 16 ; i++ ) {
+            crc = (WORD)(crc << 1 | ((dataIn[1024 + i] >> line) & 1));
+        }
+        if ( crc != crc16Bits( dataIn, line ) ) {
+            ok = 0;
+        }
+    }
+
+    if ( ok ) {
+        p = sdcard_image() + (size_t)writeSector * 512;
+        for ( i = 0 ; i < 512 ; i++ ) {
+            p[i] = (BYTE)(dataIn[2 * i] << 4 | dataIn[2 * i + 1]);
+        }
+        writeSector++;
+    } else {
+        sdcard_error( "write block with a bad CRC or end bit" );
+    }
+
+    /** Start bit, '010' accepted or '101' CRC error, end bit */
+    crcStatus[0] = 0;
+    crcStatus[1] = ok ? 0 : 1;
+    crcStatus[2] = ok ? 1 : 0;
+    crcStatus[3] = ok ? 0 : 1;
+    crcStatus[4] = 1;
+    statusPos = 0;
+    statusDelay = 2;
+    busy = 0;
+
+    dataInPos = -1;
+    if ( !writeMulti ) {
+        writing = 0;
+    }
+}
+
+/** The card samples CMD and DAT on the rising edge */
+static void risingNative( void ) {
+
+    BYTE c[6];
+    UINT i;
+    int bit;
+
+    if ( fsel[PIN_CMD] == BCM2835_GPIO_FSEL_OUTP ) {
+        bit = latch[PIN_CMD];
+        if ( !inCommand ) {
+            if ( !bit ) {
+                inCommand = 1;
+                cmdShift = 0;
+                cmdBits = 1;
+            }
+        } else {
+            cmdShift = cmdShift << 1 | (uint64_t)bit;
+            if ( ++cmdBits == 48 ) {
+                for ( i = 0 ; i < 6 ; i++ ) {
+                    c[i] = (BYTE)(cmdShift >> (40 - 8 * i));
+                }
+                inCommand = 0;
+                commandNative( c );
+            }
+        }
+    }
+
+    if ( writing && fsel[PIN_DAT0] == BCM2835_GPIO_FSEL_OUTP ) {
+        BYTE n = (BYTE)(latch[PIN_DAT0] | latch[PIN_DAT1] << 1 | latch[PIN_DAT2] << 2 | latch[PIN_DAT3] << 3);
+        if ( dataInPos < 0 ) {
+            if ( n == 0 ) {
+                dataInPos = 0;
+            }
+        } else {
+            dataIn[dataInPos++] = n;
+            if ( dataInPos == BLOCK_NIBBLES - 1 ) {
+                blockIn();
+            }
+        }
+    }
+}
+
+/** The card drives CMD and DAT after the falling edge */
+static void fallingNative( void ) {
+
+    static const uint8_t dat[4] = { PIN_DAT0, PIN_DAT1, PIN_DAT2, PIN_DAT3 };
+    UINT line;
+    BYTE n;
+
+    drive[PIN_CMD] = -1;
+    if ( respPos >= 0 ) {
+        if ( respDelay > 0 ) {
+            respDelay--;
+        } else {
+            drive[PIN_CMD] = (resp[respPos / 8] >> (7 - respPos % 8)) & 1;
+            if ( (UINT)++respPos > respBits ) {
+                respPos = -1;
+                drive[PIN_CMD] = -1;
+            }
+        }
+    }
+
+    for ( line = 0 ; line < 4 ; line++ ) {
+        drive[dat[line]] = -1;
+    }
+    if ( stopIn >= 0 && stopIn-- == 0 ) {
+        dataPos = -1;
+        readMulti = 0;
+    }
+    if ( dataPos >= 0 ) {
+        if ( dataDelay > 0 ) {
+            dataDelay--;
+        } else {
+            n = dataOut[dataPos++];
+            for ( line = 0 ; line < 4 ; line++ ) {
+                drive[dat[line]] = (n >> line) & 1;
+            }
+            if ( dataPos == BLOCK_NIBBLES ) {
+                dataPos = -1;
+                if ( readMulti ) {
+                    loadBlock( ++readSector );
+                }
+            }
+        }
+    } else if ( statusPos >= 0 ) {
+        if ( statusDelay > 0 ) {
+            statusDelay--;
+        } else {
+            drive[PIN_DAT0] = crcStatus[statusPos++];
+            if ( statusPos == 5 ) {
+                statusPos = -1;
+                busy = 7;
+            }
+        }
+    } else if ( busy > 0 ) {
+        drive[PIN_DAT0] = 0;
+        busy--;
+    }
+}
+
+/*
+ * SPI mode, a bit per clock, MSB first. The card samples DI on the rising
+ * edge and moves DO on the falling one
+ */
+
+static void risingSpi( void ) {
+
+    if ( spiSelected() ) {
+        spiIn = (BYTE)(spiIn << 1 | latch[PIN_DI]);
+    }
+}
+
+static void fallingSpi( void ) {
+
+    if ( !spiSelected() ) {
+        return;
+    }
+    if ( ++spiBits == 8 ) {
+        sdcard_spi_feed( spiIn );
+        spiOut = sdcard_spi_next();
+        spiBits = 0;
+        spiLoaded = 1;
+    }
+}
+
+static void edge( int rising ) {
+
+    if ( rising ) {
+        clocks++;
+    }
+    if ( bus == FAKEGPIO_SPI ) {
+        if ( rising ) {
+            risingSpi();
+        } else {
+            fallingSpi();
+        }
+    } else if ( rising ) {
+        risingNative();
+    } else {
+        fallingNative();
+    }
+}
+
+static void setLatch( uint8_t pin, BYTE v ) {
+
+    BYTE was;
+
+    if ( pin >= NPINS ) {
+        return;
+    }
+    was = latch[pin];
+    latch[pin] = v;
+
+    if ( pin == PIN_CLK && was != v && fsel[pin] == BCM2835_GPIO_FSEL_OUTP ) {
+        edge( v );
+    } else if ( bus == FAKEGPIO_SPI && pin == PIN_CS && was != v ) {
+        /** CS# low starts a byte; the card's next byte is ready on DO */
+        sdcard_spi_select( spiSelected() );
+        spiBits = 0;
+        if ( spiSelected() && !spiLoaded ) {
+            spiOut = sdcard_spi_next();
+            spiLoaded = 1;
+        }
+    }
+}
+
+/*
+ * bcm2835 calls made by the transports
+ */
+
+void bcm2835_gpio_fsel( uint8_t pin, uint8_t mode ) {
+
+    if ( pin < NPINS ) {
+        fsel[pin] = mode;
+        if ( bus == FAKEGPIO_SPI && pin == PIN_CS ) {
+            sdcard_spi_select( spiSelected() );
+        }
+    }
+}
+
+void bcm2835_gpio_set( uint8_t pin ) {
+    setLatch( pin, 1 );
+}
+
+void bcm2835_gpio_clr( uint8_t pin ) {
+    setLatch( pin, 0 );
+}
+
+void bcm2835_gpio_set_multi( uint32_t mask ) {
+
+    uint8_t pin;
+
+    for ( pin = 0 ; pin < NPINS ; pin++ ) {
+        if ( mask & (1u << pin) ) {
+            setLatch( pin, 1 );
+        }
+    }
+}
+
+void bcm2835_gpio_clr_multi( uint32_t mask ) {
+
+    uint8_t pin;
+
+    for ( pin = 0 ; pin < NPINS ; pin++ ) {
+        if ( mask & (1u << pin) ) {
+            setLatch( pin, 0 );
+        }
+    }
+}
+
+uint8_t bcm2835_gpio_lev( uint8_t pin ) {
+    return (uint8_t)level( pin );
+}
+
+void bcm2835_gpio_set_pud( uint8_t pin, uint8_t pud ) {
+    (void)pin;
+    (void)pud;
+}
+
+/** Only GPLEV0 is read */
+uint32_t bcm2835_peri_read( volatile uint32_t *paddr ) {
+
+    uint32_t v = 0;
+    uint8_t pin;
+
+    (void)paddr;
+    for ( pin = 0 ; pin < NPINS ; pin++ ) {
+        if ( level( pin ) ) {
+            v |= 1u << pin;
+        }
+    }
+
+    return v;
+}
+
+void bcm2835_delayMicroseconds( uint64_t micros ) {
+    (void)micros;
+}
+
+int bcm2835_init( void ) {
+    return 1;
+}
@@ -0,0 +1,45 @@
+/**
+ * Fake bcm2835 GPIO with the SD card model wired to the card pins
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FAKEGPIO_DEFINED
+#define _FAKEGPIO_DEFINED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** How the card talks over the pins: SPI (sdmm.c) or the 4-bit SD bus (sdnative.c) */
+#define FAKEGPIO_SPI 0
+#define FAKEGPIO_NATIVE 1
+
+/**
+ * Replaces bcm2835.c for the tests. Pin levels are modelled, delays
+ * return at once and each SCLK/CLK edge clocks the card model. Call
+ * sdcard_power() first.
+ */
+void fakegpio_attach( int bus );
+unsigned long fakegpio_clocks( void );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,581 @@
+/**
+ * SD card model for the transport regression tests
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdcard-model.h"
+
+/** R1 bits */
+#define R1_IDLE 0x01
+#define R1_ILLEGAL 0x04
+#define R1_CRC 0x08
+#define R1_ADDRESS 0x20
+#define R1_PARAMETER 0x40
+
+/** Read error token: card ECC failed */
+#define TOKEN_ECC_FAILED 0x04
+
+/** Bytes the card holds DO low after a block, a stop token or an R1b command */
+#define BUSY_BYTES 40
+#define ERASE_BUSY_BYTES 200
+
+/** ACMD41 polls before the card leaves idle state */
+#define INIT_POLLS 3
+
+/** What the card expects the host to send next in SPI mode */
+#define RX_COMMAND 0
+#define RX_TOKEN 1      /** Data token of a write */
+#define RX_DATA 2       /** Data block and its CRC */
+
+static BYTE image[SDCARD_SECTORS * 512];
+static int sdhc = 1;
+static SDCARD_COUNTS counts;
+
+static int spiMode;         /** CMD0 has been seen with CS# low */
+static int selected;
+static int idle;            /** Until ACMD41 completes */
+static int appCommand;      /** CMD55 came before */
+static UINT initPolls;
+
+static BYTE command[6];
+static UINT commandLen;
+
+static int rx;
+static int writeMulti;
+static LBA_t writeSector;
+static BYTE block[512 + 2];
+static UINT blockLen;
+
+static int readMulti;
+static LBA_t readSector;
+
+static LBA_t eraseStart;
+static LBA_t eraseEnd;
+
+/** Bytes queued for DO, then busy bytes, then 0xFF */
+static BYTE out[1024];
+static UINT outPos;
+static UINT outLen;
+static UINT busy;
+static int stuck;           /** Busy until deselected */
+
+/** Transfers each fault is still to spoil */
+static UINT faults[SDCARD_FAULTS];
+
+void sdcard_error( const char *fmt, ... ) {
+
+    va_list ap;
+
+    va_start( ap, fmt );
+    fprintf( stderr, "card: " );
+    vfprintf( stderr, fmt, ap );
+    fprintf( stderr, "\n" );
+    va_end( ap );
+    counts.errors++;
+}
+
+BYTE sdcard_crc7( const BYTE *buf, UINT n ) {
+
+    BYTE crc = 0, d;
+    UINT i, b;
+
+    for ( i = 0 ; i < n ; i++ ) {
+        d = buf[i];
+        for ( b = 0 ; b < 8 ; b++ ) {
+            crc <<= 1;
+            if ( (d ^ crc) & 0x80 ) {
+                crc ^= 0x09;
+            }
+            d <<= 1;
+        }
+    }
+
+    return crc & 0x7F;
+}
+
+static WORD crc16( const BYTE *buf, UINT n ) {
+
+    WORD crc = 0;
+    UINT i, b;
+
+    for ( i = 0 ; i < n ; i++ ) {
+        crc ^= (WORD)buf[i] << 8;
+        for ( b = 0 ; b < 8 ; b++ ) {
+            crc = (crc & 0x8000) ? (WORD)((crc << 1) ^ 0x1021) : (WORD)(crc << 1);
+        }
+    }
+
+    return crc;
+}
+
+void sdcard_power( int blockAddressing ) {
+
+    UINT i;
+
+    srand( 1 );
+    for ( i = 0 ; i < sizeof( image ) ; i++ ) {
+        image[i] = (BYTE)rand();
+    }
+    sdhc = blockAddressing;
+    memset( &counts, 0, sizeof( counts ) );
+
+    spiMode = 0;
+    selected = 0;
+    idle = 1;
+    appCommand = 0;
+    initPolls = 0;
+    commandLen = 0;
+    rx = RX_COMMAND;
+    readMulti = 0;
+    outPos = outLen = 0;
+    busy = 0;
+    stuck = 0;
+    memset( faults, 0, sizeof( faults ) );
+}
+
+int sdcard_sdhc( void ) {
+    return sdhc;
+}
+
+BYTE *sdcard_image( void ) {
+    return image;
+}
+
+void sdcard_get_counts( SDCARD_COUNTS *c ) {
+    *c = counts;
+}
+
+/** Spoils the next count transfers with fault (SDCARD_FAULT_*) */
+void sdcard_fault( int fault, UINT count ) {
+    faults[fault] = count;
+}
+
+/** Returns: 1 if fault is due on this transfer */
+static int takeFault( int fault ) {
+
+    if ( faults[fault] == 0 ) {
+        return 0;
+    }
+    faults[fault]--;
+    counts.faults++;
+
+    return 1;
+}
+
+void sdcard_register( int which, BYTE reg[16] ) {
+
+    static const BYTE cid[15] = { 0x03, 'S', 'D', 'M', 'O', 'D', 'E', 'L', 0x10, 0x12, 0x34, 0x56, 0x78, 0x01, 0x5A };
+
+    memset( reg, 0, 16 );
+    if ( which == SDCARD_CID ) {
+        memcpy( reg, cid, sizeof( cid ) );
+    } else if ( sdhc ) {
+        /** CSD 2.0: (C_SIZE + 1) * 512KB */
+        DWORD csize = SDCARD_SECTORS / 1024 - 1;
+        reg[0] = 0x40;
+        reg[5] = 0x59;
+        reg[7] = (BYTE)(csize >> 16) & 0x3F;
+        reg[8] = (BYTE)(csize >> 8);
+        reg[9] = (BYTE)csize;
+    } else {
+        /** CSD 1.0: READ_BL_LEN 9, C_SIZE_MULT 7, (C_SIZE + 1) * 512 sectors */
+        DWORD csize = SDCARD_SECTORS / 512 - 1;
+        reg[5] = 0x59;
+        reg[6] = (BYTE)(csize >> 10) & 3;
+        reg[7] = (BYTE)(csize >> 2);
+        reg[8] = (BYTE)(csize << 6);
+        reg[9] = 0x03;
+        reg[10] = 0x80;
+    }
+    reg[15] = (BYTE)(sdcard_crc7( reg, 15 ) << 1 | 1);
+}
+
+static void queue( BYTE b ) {
+
+    if ( outLen < sizeof( out ) ) {
+        out[outLen++] = b;
+    } else {
+        sdcard_error( "response queue overflow" );
+    }
+}
+
+/** Nac gap, start token, data and CRC16 */
+static void queueBlock( const BYTE *data, UINT len ) {
+
+    WORD crc = crc16( data, len );
+    UINT i;
+
+    queue( 0xFF );
+    queue( 0xFE );
+    for ( i = 0 ; i < len ; i++ ) {
+        queue( data[i] );
+    }
+    queue( (BYTE)(crc >> 8) );
+    queue( (BYTE)crc );
+}
+
+/** A read block, or the error token sent in its place that ends the read */
+static void queueSector( LBA_t sector ) {
+
+    if ( takeFault( SDCARD_FAULT_DATA_TOKEN ) ) {
+        queue( 0xFF );
+        queue( TOKEN_ECC_FAILED );
+        readMulti = 0;
+        return;
+    }
+    queueBlock( image + (size_t)sector * 512, 512 );
+    counts.blocksRead++;
+}
+
+/** Returns: the sector a data command addresses, or SDCARD_SECTORS if it is bad */
+static LBA_t sectorOf( DWORD arg ) {
+
+    if ( !sdhc ) {
+        if ( arg % 512 ) {
+            sdcard_error( "byte address %lu is not sector aligned", (unsigned long)arg );
+            return SDCARD_SECTORS;
+        }
+        arg /= 512;
+    }
+
+    return arg < SDCARD_SECTORS ? arg : SDCARD_SECTORS;
+}
+
+static void appCommandSpi( BYTE index, DWORD arg, BYTE r1 ) {
+
+    static const BYTE scr[8] = { 0x02, 0x05, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    BYTE status[64];
+
+    switch ( index ) {
+        case 41: {
+            if ( ++initPolls >= INIT_POLLS ) {
+                idle = 0;
+            }
+            queue( idle ? R1_IDLE : 0 );
+            break;
+        }
+        case 13: {
+            /** R2, then AU_SIZE 1MB, ERASE_SIZE 1 AU, ERASE_TIMEOUT 1s, ERASE_OFFSET 1s */
+            memset( status, 0, sizeof( status ) );
+            status[10] = 0x70;
+            status[12] = 0x01;
+            status[13] = (1 << 2) | 1;
+            queue( r1 );
+            queue( 0x00 );
+            queueBlock( status, sizeof( status ) );
+            break;
+        }
+        case 51: {
+            queue( r1 );
+            queueBlock( scr, sizeof( scr ) );
+            break;
+        }
+        case 23: {
+            queue( r1 );
+            break;
+        }
+        default: {
+            sdcard_error( "unknown ACMD%u", index );
+            queue( r1 | R1_ILLEGAL );
+            break;
+        }
+    }
+    (void)arg;
+}
+
+static void commandSpi( void ) {
+
+    BYTE index = command[0] & 0x3F;
+    DWORD arg = (DWORD)command[1] << 24 | (DWORD)command[2] << 16 | (DWORD)command[3] << 8 | command[4];
+    BYTE reg[16], r1;
+    LBA_t sector, s;
+    int app = appCommand;
+
+    if ( !(command[5] & 1) ) {
+        sdcard_error( "CMD%u without its end bit", index );
+    }
+
+    /** Still in SD bus mode: only CMD0 with CS# low gets the card's attention */
+    if ( !spiMode ) {
+        if ( index != 0 ) {
+            return;
+        }
+        spiMode = 1;
+    }
+
+    /** CRC is off in SPI mode except for CMD0 and CMD8 */
+    if ( (index == 0 || index == 8) && sdcard_crc7( command, 5 ) != command[5] >> 1 ) {
+        sdcard_error( "CMD%u with a bad CRC", index );
+        queue( 0xFF );
+        queue( (idle ? R1_IDLE : 0) | R1_CRC );
+        return;
+    }
+
+    counts.commands++;
+    appCommand = 0;
+    r1 = idle ? R1_IDLE : 0;
+
+    /** Ncr: the response comes a byte after the command */
+    queue( 0xFF );
+
+    if ( app ) {
+        appCommandSpi( index, arg, r1 );
+        return;
+    }
+
+    switch ( index ) {
+        case 0: {
+            idle = 1;
+            initPolls = 0;
+            readMulti = 0;
+            rx = RX_COMMAND;
+            queue( R1_IDLE );
+            break;
+        }
+        case 8: {
+            queue( r1 );
+            queue( 0x00 );
+            queue( 0x00 );
+            queue( (BYTE)(arg >> 8) & 0x0F );
+            queue( (BYTE)arg );
+            break;
+        }
+        case 55: {
+            appCommand = 1;
+            queue( r1 );
+            break;
+        }
+        case 58: {
+            /** OCR: power up done and CCS once out of idle, 3.2-3.4V */
+            queue( r1 );
+            queue( idle ? 0x00 : (BYTE)(0x80 | (sdhc ? 0x40 : 0)) );
+            queue( 0xFF );
+            queue( 0x80 );
+            queue( 0x00 );
+            break;
+        }
+        case 9:
+        case 10: {
+            sdcard_register( index == 9 ? SDCARD_CSD : SDCARD_CID, reg );
+            queue( r1 );
+            queueBlock( reg, sizeof( reg ) );
+            break;
+        }
+        case 13: {
+            queue( r1 );
+            queue( 0x00 );
+            break;
+        }
+        case 16: {
+            queue( arg == 512 ? r1 : r1 | R1_PARAMETER );
+            break;
+        }
+        case 12: {
+            /**
+             * Stops a multiple block read mid-stream: a stuff byte, R1, then
+             * busy. After a fault it may also follow a read an error token
+             * ended, or a resync.
+             */
+            if ( !readMulti && counts.faults == 0 ) {
+                sdcard_error( "CMD12 without a multiple block read" );
+            }
+            readMulti = 0;
+            outPos = outLen = 0;
+            queue( 0xFF );
+            queue( r1 );
+            busy = BUSY_BYTES;
+            break;
+        }
+        case 17:
+        case 18: {
+            sector = sectorOf( arg );
+            if ( idle || sector >= SDCARD_SECTORS ) {
+                queue( idle ? r1 | R1_ILLEGAL : r1 | R1_ADDRESS );
+                break;
+            }
+            if ( takeFault( SDCARD_FAULT_NO_RESPONSE ) ) {
+                outPos = outLen = 0;
+                break;
+            }
+            queue( r1 );
+            if ( index == 17 ) {
+                queueSector( sector );
+            } else {
+                readMulti = 1;
+                readSector = sector;
+            }
+            break;
+        }
+        case 24:
+        case 25: {
+            sector = sectorOf( arg );
+            if ( idle || sector >= SDCARD_SECTORS ) {
+                queue( idle ? r1 | R1_ILLEGAL : r1 | R1_ADDRESS );
+                break;
+            }
+            if ( takeFault( SDCARD_FAULT_NO_RESPONSE ) ) {
+                outPos = outLen = 0;
+                break;
+            }
+            queue( r1 );
+            rx = RX_TOKEN;
+            writeMulti = (index == 25);
+            writeSector = sector;
+            break;
+        }
+        case 32:
+        case 33: {
+            sector = sectorOf( arg );
+            if ( sector >= SDCARD_SECTORS ) {
+                queue( r1 | R1_ADDRESS );
+                break;
+            }
+            if ( index == 32 ) {
+                eraseStart = sector;
+            } else {
+                eraseEnd = sector;
+            }
+            queue( r1 );
+            break;
+        }
+        case 38: {
+            /** DATA_STAT_AFTER_ERASE is 0 in the SCR, so erased sectors read as zeros */
+            if ( eraseEnd < eraseStart ) {
+                sdcard_error( "erase of sectors %lu to %lu", (unsigned long)eraseStart, (unsigned long)eraseEnd );
+            }
+            for ( s = eraseStart ; s <= eraseEnd ; s++ ) {
+                memset( image + (size_t)s * 512, 0, 512 );
+            }
+            counts.erases++;
+            queue( r1 );
+            busy = ERASE_BUSY_BYTES;
+            break;
+        }
+        default: {
+            sdcard_error( "unknown CMD%u", index );
+            queue( r1 | R1_ILLEGAL );
+            break;
+        }
+    }
+}
+
+void sdcard_spi_select( int sel ) {
+
+    /** A host giving up on a card stuck busy abandons the write it was in */
+    if ( !sel && stuck ) {
+        stuck = 0;
+        rx = RX_COMMAND;
+    }
+    selected = sel;
+}
+
+BYTE sdcard_spi_next( void ) {
+
+    if ( outPos == outLen ) {
+        outPos = outLen = 0;
+        if ( readMulti ) {
+            queueSector( readSector );
+            readSector = (readSector + 1) % SDCARD_SECTORS;
+        }
+    }
+    if ( outPos < outLen ) {
+        return out[outPos++];
+    }
+    if ( busy > 0 ) {
+        busy--;
+        return 0x00;
+    }
+
+    return stuck ? 0x00 : 0xFF;
+}
+
+void sdcard_spi_feed( BYTE in ) {
+
+    if ( !selected ) {
+        return;
+    }
+
+    switch ( rx ) {
+        case RX_COMMAND: {
+            if ( commandLen == 0 ) {
+                /** Anything but a start and transmission bit is filler */
+                if ( (in & 0xC0) != 0x40 ) {
+                    return;
+                }
+                if ( busy > 0 || stuck ) {
+                    sdcard_error( "CMD%u sent while the card is busy", in & 0x3F );
+                } else if ( outPos < outLen && !readMulti && (in & 0x3F) != 12 ) {
+                    sdcard_error( "CMD%u sent before the last response was read", in & 0x3F );
+                }
+            }
+            command[commandLen++] = in;
+            if ( commandLen == sizeof( command ) ) {
+                commandLen = 0;
+                commandSpi();
+            }
+            break;
+        }
+        case RX_TOKEN: {
+            if ( in == 0xFF ) {
+                return;
+            }
+            if ( busy > 0 || stuck ) {
+                sdcard_error( "token %02X sent while the card is busy", in );
+            }
+            if ( in == (writeMulti ? 0xFC : 0xFE) ) {
+                rx = RX_DATA;
+                blockLen = 0;
+            } else if ( in == 0xFD && writeMulti ) {
+                /** Stop token: a byte, then busy */
+                rx = RX_COMMAND;
+                queue( 0xFF );
+                busy = BUSY_BYTES;
+            } else {
+                sdcard_error( "unexpected token %02X", in );
+                rx = RX_COMMAND;
+            }
+            break;
+        }
+        case RX_DATA: {
+            block[blockLen++] = in;
+            if ( blockLen == sizeof( block ) ) {
+                /** Data response 'accepted', then busy while it programs */
+                if ( writeSector >= SDCARD_SECTORS ) {
+                    queue( 0x0D );
+                } else if ( takeFault( SDCARD_FAULT_DATA_TOKEN ) ) {
+                    queue( 0x0B );
+                } else {
+                    memcpy( image + (size_t)writeSector * 512, block, 512 );
+                    counts.blocksWritten++;
+                    writeSector++;
+                    queue( 0x05 );
+                    stuck = takeFault( SDCARD_FAULT_BUSY );
+                }
+                busy = BUSY_BYTES;
+                rx = writeMulti ? RX_TOKEN : RX_COMMAND;
+            }
+            break;
+        }
+    }
+}
@@ -0,0 +1,83 @@
+/**
+ * SD card model for the transport regression tests
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SDCARD_MODEL_DEFINED
+#define _SDCARD_MODEL_DEFINED
+
+#include "ff.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** An 8MB card with 1MB allocation units */
+#define SDCARD_SECTORS 16384
+#define SDCARD_AU_SECTORS 2048
+
+/** Registers, each 16 bytes with the CRC7 in the last one as sent in an R2 */
+#define SDCARD_CID 0
+#define SDCARD_CSD 1
+
+/** What the card has been asked to do */
+typedef struct {
+    UINT commands;      /** Commands accepted, CMD55 included */
+    UINT blocksRead;
+    UINT blocksWritten;
+    UINT erases;        /** CMD38s */
+    UINT errors;        /** Protocol violations, each also reported on stderr */
+    UINT faults;        /** Faults injected with sdcard_fault() */
+} SDCARD_COUNTS;
+
+/** Faults sdcard_fault() injects in SPI mode, each into a number of transfers */
+#define SDCARD_FAULT_NO_RESPONSE 0  /** A read or write command gets no response */
+#define SDCARD_FAULT_DATA_TOKEN 1   /** A read block comes as an error token, a written one gets a CRC error */
+#define SDCARD_FAULT_BUSY 2         /** A written block leaves the card busy until it is deselected */
+#define SDCARD_FAULTS 3
+
+/**
+ * Powers the card up with random content, in SD bus mode and idle. sdhc
+ * selects block addressing (SDHC) or byte addressing (SDSC).
+ */
+void sdcard_power( int sdhc );
+int sdcard_sdhc( void );
+BYTE *sdcard_image( void );
+void sdcard_register( int which, BYTE reg[16] );
+void sdcard_get_counts( SDCARD_COUNTS *counts );
+void sdcard_fault( int fault, UINT count );
+void sdcard_error( const char *fmt, ... );
+BYTE sdcard_crc7( const BYTE *buf, UINT n );
+
+/**
+ * SPI mode, a byte at a time. The card switches to it on a CMD0 sent
+ * while it is selected. sdcard_spi_next() is the byte the card shifts out
+ * while the host shifts in the byte then passed to sdcard_spi_feed(), so
+ * each exchange is a next() followed by a feed(). Neither is called while
+ * CS# is high.
+ */
+void sdcard_spi_select( int selected );
+BYTE sdcard_spi_next( void );
+void sdcard_spi_feed( BYTE in );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
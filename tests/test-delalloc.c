@@ -0,0 +1,285 @@
+/**
+ * Delayed allocation through libspifat on an image file: interleaved
+ * writers, extent counts, filling the volume and the free count after it
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ff.h"
+#include "spifat.h"
+#include "spifat-xattr.h"
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if ( !(cond) ) { \
+        fprintf( stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond ); \
+        failures++; \
+    } \
+} while ( 0 )
+
+/** FAT16, 2KB clusters: 1 reserved sector, two 32 sector FATs, 512 root entries */
+#define IMG_SECTORS 32768
+#define IMG_CSIZE 4
+#define IMG_FATSZ 32
+#define IMG_DATA (1 + 2 * IMG_FATSZ + 32)
+#define IMG_CLUSTERS ((IMG_SECTORS - IMG_DATA) / IMG_CSIZE)
+#define CLUSTER_BYTES (IMG_CSIZE * 512)
+
+/** Delayed allocation gathers 8 clusters */
+#define DELALLOC_KB 16
+
+#define NWRITERS 4
+#define CHUNK 1024
+#define FILE_BYTES (64 * 1024)
+
+static char imgPath[] = "/tmp/test-delalloc-XXXXXX";
+
+static void put16( BYTE *p, WORD v ) {
+    p[0] = (BYTE)v;
+    p[1] = (BYTE)(v >> 8);
+}
+
+static int formatImage( void ) {
+
+    BYTE bs[512];
+    BYTE fat[4];
+    int fd, fatno, ok = 1;
+
+    fd = mkstemp( imgPath );
+    if ( fd < 0 ) {
+        return 0;
+    }
+    if ( ftruncate( fd, (off_t)IMG_SECTORS * 512 ) != 0 ) {
+        ok = 0;
+    }
+
+    memset( bs, 0, sizeof( bs ) );
+    bs[0] = 0xEB;
+    bs[1] = 0x3C;
+    bs[2] = 0x90;
+    memcpy( bs + 3, "MSWIN4.1", 8 );
+    put16( bs + 11, 512 );
+    bs[13] = IMG_CSIZE;
+    put16( bs + 14, 1 );
+    bs[16] = 2;
+    put16( bs + 17, 512 );
+    put16( bs + 19, IMG_SECTORS );
+    bs[21] = 0xF8;
+    put16( bs + 22, IMG_FATSZ );
+    bs[36] = 0x80;
+    bs[38] = 0x29;
+    memcpy( bs + 43, "DELALLOC   ", 11 );
+    memcpy( bs + 54, "FAT16   ", 8 );
+    bs[510] = 0x55;
+    bs[511] = 0xAA;
+    if ( pwrite( fd, bs, sizeof( bs ), 0 ) != sizeof( bs ) ) {
+        ok = 0;
+    }
+
+    put16( fat, 0xFFF8 );
+    put16( fat + 2, 0xFFFF );
+    for ( fatno = 0 ; fatno < 2 ; fatno++ ) {
+        if ( pwrite( fd, fat, sizeof( fat ), (off_t)(1 + fatno * IMG_FATSZ) * 512 ) != sizeof( fat ) ) {
+            ok = 0;
+        }
+    }
+    close( fd );
+
+    return ok;
+}
+
+/** Free clusters counted straight from the first FAT in the image */
+static DWORD scanFreeClusters( void ) {
+
+    static BYTE fat[IMG_FATSZ * 512];
+    DWORD clst, nfree = 0;
+    FILE *fp;
+
+    fp = fopen( imgPath, "rb" );
+    if ( fp == NULL ) {
+        return 0;
+    }
+    if ( fseek( fp, 512, SEEK_SET ) != 0 || fread( fat, 1, sizeof( fat ), fp ) != sizeof( fat ) ) {
+        fclose( fp );
+        return 0;
+    }
+    fclose( fp );
+
+    for ( clst = 2 ; clst < IMG_CLUSTERS + 2 ; clst++ ) {
+        if ( fat[clst * 2] == 0 && fat[clst * 2 + 1] == 0 ) {
+            nfree++;
+        }
+    }
+
+    return nfree;
+}
+
+static int extentCount( const char *path ) {
+
+    char value[32];
+    int len;
+
+    len = spifat_getxattr( path, FATEXTENT_COUNT_XATTR, value, sizeof( value ) - 1 );
+    if ( len < 0 ) {
+        return len;
+    }
+    value[len] = '\0';
+
+    return atoi( value );
+}
+
+static void fillChunk( BYTE *buf, int writer, uint64_t offset ) {
+
+    UINT i;
+
+    for ( i = 0 ; i < CHUNK ; i++ ) {
+        buf[i] = (BYTE)(writer * 37 + (offset + i) * 13);
+    }
+}
+
+/** Writers taking turns a chunk at a time still get runs of the delalloc size */
+static void testInterleaved( void ) {
+
+    SPIFAT_FILE *files[NWRITERS];
+    BYTE buf[CHUNK], back[CHUNK];
+    char path[32];
+    uint64_t offset;
+    int w;
+
+    for ( w = 0 ; w < NWRITERS ; w++ ) {
+        snprintf( path, sizeof( path ), "/W%d.BIN", w );
+        CHECK( spifat_open( path, SPIFAT_WRITE | SPIFAT_CREATE, &files[w] ) == 0 );
+    }
+    for ( offset = 0 ; offset < FILE_BYTES ; offset += CHUNK ) {
+        for ( w = 0 ; w < NWRITERS ; w++ ) {
+            fillChunk( buf, w, offset );
+            CHECK( spifat_pwrite( files[w], buf, CHUNK, offset ) == CHUNK );
+        }
+    }
+    for ( w = 0 ; w < NWRITERS ; w++ ) {
+        CHECK( spifat_close( files[w] ) == 0 );
+    }
+
+    for ( w = 0 ; w < NWRITERS ; w++ ) {
+        snprintf( path, sizeof( path ), "/W%d.BIN", w );
+        CHECK( extentCount( path ) >= 1 );
+        CHECK( extentCount( path ) <= FILE_BYTES / (DELALLOC_KB * 1024) );
+
+        CHECK( spifat_open( path, SPIFAT_READ, &files[w] ) == 0 );
+        for ( offset = 0 ; offset < FILE_BYTES ; offset += CHUNK ) {
+            fillChunk( buf, w, offset );
+            CHECK( spifat_pread( files[w], back, CHUNK, offset ) == CHUNK );
+            CHECK( memcmp( buf, back, CHUNK ) == 0 );
+        }
+        CHECK( spifat_close( files[w] ) == 0 );
+    }
+}
+
+/** Interleaved writers run the volume out of space. Nothing held back leaks */
+static void testFull( void ) {
+
+    SPIFAT_FILE *files[2];
+    BYTE buf[CHUNK];
+    uint64_t offset = 0;
+    ssize_t rv = CHUNK;
+    int w, nospace = 0;
+
+    memset( buf, 0x5A, sizeof( buf ) );
+    CHECK( spifat_open( "/FULL0.BIN", SPIFAT_WRITE | SPIFAT_CREATE, &files[0] ) == 0 );
+    CHECK( spifat_open( "/FULL1.BIN", SPIFAT_WRITE | SPIFAT_CREATE, &files[1] ) == 0 );
+
+    while ( !nospace && offset < (uint64_t)IMG_SECTORS * 512 ) {
+        for ( w = 0 ; w < 2 ; w++ ) {
+            rv = spifat_pwrite( files[w], buf, CHUNK, offset );
+            if ( rv == -ENOSPC ) {
+                nospace = 1;
+            } else {
+                CHECK( rv == CHUNK );
+            }
+        }
+        offset += CHUNK;
+    }
+    CHECK( nospace );
+
+    /** What was acknowledged had its clusters held back, so it all fits */
+    CHECK( spifat_close( files[0] ) == 0 );
+    CHECK( spifat_close( files[1] ) == 0 );
+}
+
+/** Clusters in use add up from the file sizes, the free count matches the FAT */
+static void checkFreeCount( DWORD *nfree ) {
+
+    SPIFAT_DIR *dir;
+    SPIFAT_DIRENT ent;
+    FATFS *fs;
+    DWORD used = 0;
+
+    *nfree = 0;
+    CHECK( spifat_opendir( "/", &dir ) == 0 );
+    while ( spifat_readdir( dir, &ent ) == 1 ) {
+        used += (DWORD)((ent.st.size + CLUSTER_BYTES - 1) / CLUSTER_BYTES);
+    }
+    CHECK( spifat_closedir( dir ) == 0 );
+
+    CHECK( f_getfree( "", nfree, &fs ) == FR_OK );
+    CHECK( used + *nfree == IMG_CLUSTERS );
+}
+
+int main( int argc, char **argv ) {
+
+    SPIFAT_CONFIG config;
+    SPIFAT_FILE *file;
+    DWORD nfree;
+
+    (void)argc;
+
+    if ( !formatImage() ) {
+        fprintf( stderr, "%s: can't create %s\n", argv[0], imgPath );
+        return EXIT_FAILURE;
+    }
+
+    memset( &config, 0, sizeof( config ) );
+    config.image = imgPath;
+    config.delalloc_kb = DELALLOC_KB;
+    CHECK( spifat_init( &config ) == 0 );
+
+    testInterleaved();
+    testFull();
+    checkFreeCount( &nfree );
+
+    /** A read-only handle is refused as such, not as a full volume */
+    CHECK( spifat_open( "/W0.BIN", SPIFAT_READ, &file ) == 0 );
+    CHECK( spifat_pwrite( file, "x", 1, 0 ) == -EACCES );
+    CHECK( spifat_close( file ) == 0 );
+
+    spifat_shutdown();
+    CHECK( scanFreeClusters() == nfree );
+
+    unlink( imgPath );
+
+    printf( "%s: %s, %u clusters free\n", argv[0], failures ? "FAILED" : "ok", (unsigned)nfree );
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,194 @@
+/**
+ * sdmm.c against the card model over fake GPIO: SPI framing, CS# hold and
+ * per-AU erase
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ff.h"
+#include "diskio.h"
+#include "sdmm.h"
+#include "fakegpio.h"
+#include "sdcard-model.h"
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if ( !(cond) ) { \
+        fprintf( stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond ); \
+        failures++; \
+    } \
+} while ( 0 )
+
+static BYTE buf[64 * 512];
+static BYTE pattern[64 * 512];
+
+static const BYTE *sectorAt( LBA_t sector ) {
+    return sdcard_image() + (size_t)sector * 512;
+}
+
+static void busStats( DISKBUSSTATS *stats ) {
+    mmc_disk_ioctl( 0, MMC_GET_BUSSTATS, stats );
+}
+
+static void cardCounts( SDCARD_COUNTS *counts ) {
+    sdcard_get_counts( counts );
+}
+
+/** Single and multiple block reads, and the CS# being held between them */
+static void testRead( void ) {
+
+    DISKBUSSTATS before, after;
+    SDCARD_COUNTS c0, c1;
+    DISKSEG segs[2];
+
+    busStats( &before );
+    cardCounts( &c0 );
+    CHECK( mmc_disk_read( 0, buf, 100, 1 ) == RES_OK );
+    CHECK( memcmp( buf, sectorAt( 100 ), 512 ) == 0 );
+    CHECK( mmc_disk_read( 0, buf, 200, 17 ) == RES_OK );
+    CHECK( memcmp( buf, sectorAt( 200 ), 17 * 512 ) == 0 );
+    busStats( &after );
+    cardCounts( &c1 );
+
+    /** CMD17, then CMD18 and the CMD12 that stops it */
+    CHECK( c1.commands - c0.commands == 3 );
+    CHECK( after.commands - before.commands == 3 );
+    CHECK( after.selects == before.selects );
+    CHECK( after.deselects == before.deselects );
+
+    /** Two ranges in one session, with a gap read through */
+    segs[0].sector = 300;
+    segs[0].count = 4;
+    segs[0].buff = buf;
+    segs[1].sector = 306;
+    segs[1].count = 3;
+    segs[1].buff = buf + 4 * 512;
+    CHECK( mmc_disk_readv( 0, segs, 2 ) == RES_OK );
+    CHECK( memcmp( buf, sectorAt( 300 ), 4 * 512 ) == 0 );
+    CHECK( memcmp( buf + 4 * 512, sectorAt( 306 ), 3 * 512 ) == 0 );
+}
+
+/** Single and multiple block writes, each followed by a read back */
+static void testWrite( void ) {
+
+    DISKBUSSTATS before, after;
+    SDCARD_COUNTS c0, c1;
+    DISKSEG segs[2];
+    UINT i;
+
+    for ( i = 0 ; i < sizeof( pattern ) ; i++ ) {
+        pattern[i] = (BYTE)(i * 7 + 3);
+    }
+
+    busStats( &before );
+    cardCounts( &c0 );
+    CHECK( mmc_disk_write( 0, pattern, 1000, 1 ) == RES_OK );
+    CHECK( mmc_disk_write( 0, pattern, 1010, 20 ) == RES_OK );
+    CHECK( mmc_disk_ioctl( 0, CTRL_SYNC, NULL ) == RES_OK );
+    busStats( &after );
+    cardCounts( &c1 );
+
+    CHECK( memcmp( sectorAt( 1000 ), pattern, 512 ) == 0 );
+    CHECK( memcmp( sectorAt( 1010 ), pattern, 20 * 512 ) == 0 );
+    CHECK( c1.blocksWritten - c0.blocksWritten == 21 );
+    CHECK( after.selects == before.selects );
+
+    CHECK( mmc_disk_read( 0, buf, 1010, 20 ) == RES_OK );
+    CHECK( memcmp( buf, pattern, 20 * 512 ) == 0 );
+
+    segs[0].sector = 2000;
+    segs[0].count = 3;
+    segs[0].buff = pattern + 512;
+    segs[1].sector = 2100;
+    segs[1].count = 5;
+    segs[1].buff = pattern + 4 * 512;
+    CHECK( mmc_disk_writev( 0, segs, 2 ) == RES_OK );
+    CHECK( memcmp( sectorAt( 2000 ), pattern + 512, 3 * 512 ) == 0 );
+    CHECK( memcmp( sectorAt( 2100 ), pattern + 4 * 512, 5 * 512 ) == 0 );
+}
+
+/** An erase across AU boundaries is one CMD38 per AU touched */
+static void testErase( void ) {
+
+    SDCARD_COUNTS c0, c1;
+    LBA_t range[2];
+    LBA_t s;
+    int zero = 1;
+    UINT i;
+
+    range[0] = SDCARD_AU_SECTORS - 10;
+    range[1] = 2 * SDCARD_AU_SECTORS + 5;
+
+    cardCounts( &c0 );
+    CHECK( mmc_disk_ioctl( 0, MMC_ZERO_RANGE, range ) == RES_OK );
+    cardCounts( &c1 );
+
+    CHECK( c1.erases - c0.erases == 3 );
+    for ( s = range[0] ; s <= range[1] ; s++ ) {
+        for ( i = 0 ; i < 512 ; i++ ) {
+            if ( sectorAt( s )[i] ) {
+                zero = 0;
+            }
+        }
+    }
+    CHECK( zero );
+    CHECK( sectorAt( range[0] - 1 )[0] != 0 || sectorAt( range[0] - 1 )[1] != 0 );
+
+    CHECK( mmc_disk_read( 0, buf, range[1], 2 ) == RES_OK );
+    CHECK( buf[0] == 0 && buf[511] == 0 );
+}
+
+int main( int argc, char **argv ) {
+
+    SDCARD_COUNTS counts;
+    DISKINITSTATS init;
+    LBA_t sectors = 0;
+    int sdhc = !(argc > 1 && strcmp( argv[1], "sdsc" ) == 0);
+
+    sdcard_power( sdhc );
+    fakegpio_attach( FAKEGPIO_SPI );
+
+    CHECK( mmc_disk_initialize( 0 ) == 0 );
+    CHECK( mmc_disk_ioctl( 0, MMC_GET_INITSTATS, &init ) == RES_OK );
+    CHECK( init.early_exits == 0 );
+    CHECK( mmc_disk_ioctl( 0, GET_SECTOR_COUNT, &sectors ) == RES_OK );
+    CHECK( sectors == SDCARD_SECTORS );
+
+    testRead();
+    testWrite();
+    testErase();
+
+    /** A second initialisation of a card that is already up keeps its type */
+    CHECK( mmc_disk_initialize( 0 ) == 0 );
+    CHECK( mmc_disk_ioctl( 0, MMC_GET_INITSTATS, &init ) == RES_OK );
+    CHECK( init.early_exits == 1 );
+    CHECK( mmc_disk_read( 0, buf, 100, 1 ) == RES_OK );
+    CHECK( memcmp( buf, sectorAt( 100 ), 512 ) == 0 );
+
+    sdcard_get_counts( &counts );
+    CHECK( counts.errors == 0 );
+
+    printf( "%s: %s, %lu clocks, %u commands\n", argv[0], failures ? "FAILED" : "ok", fakegpio_clocks(), counts.commands );
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,100 @@
+/**
+ * sdnative.c against the card model over fake GPIO: SD bus commands,
+ * 4-bit data blocks and their CRC16s
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ff.h"
+#include "diskio.h"
+#include "sdnative.h"
+#include "fakegpio.h"
+#include "sdcard-model.h"
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if ( !(cond) ) { \
+        fprintf( stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond ); \
+        failures++; \
+    } \
+} while ( 0 )
+
+static BYTE buf[64 * 512];
+static BYTE pattern[64 * 512];
+
+static const BYTE *sectorAt( LBA_t sector ) {
+    return sdcard_image() + (size_t)sector * 512;
+}
+
+int main( int argc, char **argv ) {
+
+    SDCARD_COUNTS counts;
+    LBA_t sectors = 0;
+    DISKSEG segs[2];
+    UINT i;
+    int sdhc = !(argc > 1 && strcmp( argv[1], "sdsc" ) == 0);
+
+    sdcard_power( sdhc );
+    fakegpio_attach( FAKEGPIO_NATIVE );
+
+    CHECK( sdn_disk_initialize( 0 ) == 0 );
+    CHECK( sdn_disk_ioctl( 0, GET_SECTOR_COUNT, &sectors ) == RES_OK );
+    CHECK( sectors == SDCARD_SECTORS );
+
+    /** Reads */
+    CHECK( sdn_disk_read( 0, buf, 100, 1 ) == RES_OK );
+    CHECK( memcmp( buf, sectorAt( 100 ), 512 ) == 0 );
+    CHECK( sdn_disk_read( 0, buf, 200, 9 ) == RES_OK );
+    CHECK( memcmp( buf, sectorAt( 200 ), 9 * 512 ) == 0 );
+
+    /** Writes, single and multiple, then read back through the bus */
+    for ( i = 0 ; i < sizeof( pattern ) ; i++ ) {
+        pattern[i] = (BYTE)(i * 13 + 5);
+    }
+    CHECK( sdn_disk_write( 0, pattern, 1000, 1 ) == RES_OK );
+    CHECK( sdn_disk_write( 0, pattern + 512, 1010, 12 ) == RES_OK );
+    CHECK( sdn_disk_ioctl( 0, CTRL_SYNC, NULL ) == RES_OK );
+    CHECK( memcmp( sectorAt( 1000 ), pattern, 512 ) == 0 );
+    CHECK( memcmp( sectorAt( 1010 ), pattern + 512, 12 * 512 ) == 0 );
+    CHECK( sdn_disk_read( 0, buf, 1010, 12 ) == RES_OK );
+    CHECK( memcmp( buf, pattern + 512, 12 * 512 ) == 0 );
+
+    segs[0].sector = 3000;
+    segs[0].count = 2;
+    segs[0].buff = pattern;
+    segs[1].sector = 3010;
+    segs[1].count = 3;
+    segs[1].buff = pattern + 2 * 512;
+    CHECK( sdn_disk_writev( 0, segs, 2 ) == RES_OK );
+    segs[0].buff = buf;
+    segs[1].buff = buf + 2 * 512;
+    CHECK( sdn_disk_readv( 0, segs, 2 ) == RES_OK );
+    CHECK( memcmp( buf, pattern, 5 * 512 ) == 0 );
+
+    sdcard_get_counts( &counts );
+    CHECK( counts.errors == 0 );
+
+    printf( "%s: %s, %lu clocks\n", argv[0], failures ? "FAILED" : "ok", fakegpio_clocks() );
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
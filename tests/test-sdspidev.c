@@ -0,0 +1,317 @@
+/**
+ * sdspidev.c against the card model behind a mock spidev ioctl(): init,
+ * single and multiple block transfers, FatFs on top of it, then diskio.c
+ * recovering from card faults under the mounted volume
+ *
+ * Copyright (c)2021 Hermit Retro Products Ltd. <https://hermitretro.com>
+ *
+ * This file is part of spi-fat-fuse.
+ *
+ *     spi-fat-fuse is free software: you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation, either version 3 of the License, or
+ *     (at your option) any later version.
+ *
+ *     spi-fat-fuse is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License
+ *     along with spi-fat-fuse.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+
+#include "ff.h"
+#include "diskio.h"
+#include "sdspidev.h"
+#include "sdcard-model.h"
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if ( !(cond) ) { \
+        fprintf( stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond ); \
+        failures++; \
+    } \
+} while ( 0 )
+
+/** The device is opened for real, only the ioctl()s go to the model */
+#define MOCK_DEVICE "/dev/null"
+
+static BYTE buf[64 * 512];
+static BYTE pattern[64 * 512];
+
+static BYTE spiMode;
+static unsigned long messages;
+
+/**
+ * spidev: SPI_IOC_MESSAGE runs the transfers back to back with CS#
+ * asserted, releasing it after the last one unless cs_change is set on it
+ * (or between two when set on an earlier one). With SPI_CS_HIGH the card
+ * sees CS# high throughout.
+ */
+static int mockIoctl( int fd, unsigned long req, void *arg ) {
+
+    struct spi_ioc_transfer *t = (struct spi_ioc_transfer *)arg;
+    const BYTE *tx;
+    BYTE *rx;
+    BYTE out;
+    UINT n, i, j;
+    int last;
+
+    (void)fd;
+    if ( req == SPI_IOC_WR_MODE ) {
+        spiMode = *(BYTE *)arg;
+        return 0;
+    }
+    if ( req == SPI_IOC_WR_BITS_PER_WORD || req == SPI_IOC_WR_MAX_SPEED_HZ ) {
+        return 0;
+    }
+    if ( _IOC_TYPE( req ) != SPI_IOC_MAGIC || _IOC_NR( req ) != 0 || _IOC_DIR( req ) != _IOC_WRITE ) {
+        sdcard_error( "unexpected ioctl %lx", req );
+        return -1;
+    }
+
+    messages++;
+    n = _IOC_SIZE( req ) / sizeof( struct spi_ioc_transfer );
+    for ( i = 0 ; i < n ; i++ ) {
+        tx = (const BYTE *)(uintptr_t)t[i].tx_buf;
+        rx = (BYTE *)(uintptr_t)t[i].rx_buf;
+        sdcard_spi_select( !(spiMode & SPI_CS_HIGH) );
+        for ( j = 0 ; j < t[i].len ; j++ ) {
+            out = 0xFF;
+            if ( !(spiMode & SPI_CS_HIGH) ) {
+                out = sdcard_spi_next();
+                sdcard_spi_feed( tx ? tx[j] : 0x00 );
+            }
+            if ( rx ) {
+                rx[j] = out;
+            }
+        }
+        last = (i == n - 1);
+        if ( last ? !t[i].cs_change : t[i].cs_change ) {
+            sdcard_spi_select( 0 );
+        }
+    }
+
+    return 0;
+}
+
+static const BYTE *sectorAt( LBA_t sector ) {
+    return sdcard_image() + (size_t)sector * 512;
+}
+
+static void put16( BYTE *p, WORD v ) {
+    p[0] = (BYTE)v;
+    p[1] = (BYTE)(v >> 8);
+}
+
+/**
+ * A FAT16 superfloppy on the card: 2 sector clusters, two 32 sector FATs
+ * and 512 root entries
+ */
+static void formatCard( void ) {
+
+    BYTE *img = sdcard_image();
+    BYTE *bs = img;
+    UINT fat;
+
+    memset( img, 0, (1 + 2 * 32 + 32) * 512 );
+    bs[0] = 0xEB;
+    bs[1] = 0x3C;
+    bs[2] = 0x90;
+    memcpy( bs + 3, "MSWIN4.1", 8 );
+    put16( bs + 11, 512 );
+    bs[13] = 2;
+    put16( bs + 14, 1 );
+    bs[16] = 2;
+    put16( bs + 17, 512 );
+    put16( bs + 19, SDCARD_SECTORS );
+    bs[21] = 0xF8;
+    put16( bs + 22, 32 );
+    bs[36] = 0x80;
+    bs[38] = 0x29;
+    memcpy( bs + 43, "SDMODEL    ", 11 );
+    memcpy( bs + 54, "FAT16   ", 8 );
+    bs[510] = 0x55;
+    bs[511] = 0xAA;
+
+    for ( fat = 0 ; fat < 2 ; fat++ ) {
+        put16( img + (1 + fat * 32) * 512, 0xFFF8 );
+        put16( img + (1 + fat * 32) * 512 + 2, 0xFFFF );
+    }
+}
+
+/** Raw transfers straight through the transport */
+static void testTransport( void ) {
+
+    DISKINITSTATS init;
+    LBA_t sectors = 0;
+    UINT i;
+
+    CHECK( spd_disk_initialize( 0 ) == 0 );
+    CHECK( spd_disk_ioctl( 0, MMC_GET_INITSTATS, &init ) == RES_OK );
+    CHECK( init.early_exits == 0 );
+    CHECK( spd_disk_ioctl( 0, GET_SECTOR_COUNT, &sectors ) == RES_OK );
+    CHECK( sectors == SDCARD_SECTORS );
+
+    CHECK( spd_disk_read( 0, buf, 16000, 1 ) == RES_OK );
+    CHECK( memcmp( buf, sectorAt( 16000 ), 512 ) == 0 );
+    CHECK( spd_disk_read( 0, buf, 16010, 40 ) == RES_OK );
+    CHECK( memcmp( buf, sectorAt( 16010 ), 40 * 512 ) == 0 );
+
+    for ( i = 0 ; i < sizeof( pattern ) ; i++ ) {
+        pattern[i] = (BYTE)(i * 11 + 1);
+    }
+    CHECK( spd_disk_write( 0, pattern, 16100, 1 ) == RES_OK );
+    CHECK( spd_disk_write( 0, pattern + 512, 16110, 33 ) == RES_OK );
+    CHECK( spd_disk_ioctl( 0, CTRL_SYNC, NULL ) == RES_OK );
+    CHECK( memcmp( sectorAt( 16100 ), pattern, 512 ) == 0 );
+    CHECK( memcmp( sectorAt( 16110 ), pattern + 512, 33 * 512 ) == 0 );
+    CHECK( spd_disk_read( 0, buf, 16110, 33 ) == RES_OK );
+    CHECK( memcmp( buf, pattern + 512, 33 * 512 ) == 0 );
+
+    /** Initialising again finds the card up and keeps its type */
+    CHECK( spd_disk_initialize( 0 ) == 0 );
+    CHECK( spd_disk_ioctl( 0, MMC_GET_INITSTATS, &init ) == RES_OK );
+    CHECK( init.early_exits == 1 );
+    CHECK( spd_disk_read( 0, buf, 16100, 1 ) == RES_OK );
+    CHECK( memcmp( buf, pattern, 512 ) == 0 );
+}
+
+/** Directories and a multi-cluster file through diskio.c and FatFs */
+static void testFilesystem( void ) {
+
+    FATFS fs;
+    FIL fil;
+    DIR dir;
+    FILINFO fno;
+    UINT bw, br, n;
+
+    disk_set_spidev( MOCK_DEVICE );
+    CHECK( f_mount( &fs, "", 1 ) == FR_OK );
+    CHECK( f_mkdir( "DIR" ) == FR_OK );
+    CHECK( f_mkdir( "DIR/SUB" ) == FR_OK );
+    CHECK( f_open( &fil, "DIR/SUB/DATA.BIN", FA_WRITE | FA_CREATE_NEW ) == FR_OK );
+    CHECK( f_write( &fil, pattern, sizeof( pattern ), &bw ) == FR_OK && bw == sizeof( pattern ) );
+    CHECK( f_close( &fil ) == FR_OK );
+    CHECK( f_mount( NULL, "", 0 ) == FR_OK );
+
+    /** A fresh mount reads it all back from the card */
+    CHECK( f_mount( &fs, "", 1 ) == FR_OK );
+    CHECK( f_stat( "DIR/SUB", &fno ) == FR_OK && (fno.fattrib & AM_DIR) );
+    CHECK( f_open( &fil, "DIR/SUB/DATA.BIN", FA_READ ) == FR_OK );
+    memset( buf, 0, sizeof( buf ) );
+    CHECK( f_read( &fil, buf, sizeof( buf ), &br ) == FR_OK && br == sizeof( buf ) );
+    CHECK( memcmp( buf, pattern, sizeof( pattern ) ) == 0 );
+    CHECK( f_close( &fil ) == FR_OK );
+
+    n = 0;
+    CHECK( f_opendir( &dir, "DIR" ) == FR_OK );
+    while ( f_readdir( &dir, &fno ) == FR_OK && fno.fname[0] ) {
+        n++;
+    }
+    f_closedir( &dir );
+    CHECK( n == 1 );
+    CHECK( f_mount( NULL, "", 0 ) == FR_OK );
+}
+
+/**
+ * A transfer through diskio.c that fault spoils the first n attempts of:
+ * a plain retry clears one, a resync two and a re-init three
+ */
+static void checkRecovery( int fault, UINT n, int write, LBA_t sector ) {
+
+    DISKRECOVERYSTATS before, after;
+    SDCARD_COUNTS c0, c1;
+
+    disk_get_recovery_stats( &before );
+    sdcard_get_counts( &c0 );
+    sdcard_fault( fault, n );
+
+    if ( write ) {
+        CHECK( disk_write( 0, pattern, sector, 4 ) == RES_OK );
+        CHECK( memcmp( sectorAt( sector ), pattern, 4 * 512 ) == 0 );
+    } else {
+        memset( buf, 0, 4 * 512 );
+        CHECK( disk_read( 0, buf, sector, 4 ) == RES_OK );
+        CHECK( memcmp( buf, sectorAt( sector ), 4 * 512 ) == 0 );
+    }
+
+    disk_get_recovery_stats( &after );
+    sdcard_get_counts( &c1 );
+    CHECK( c1.faults - c0.faults == n );
+    CHECK( after.errors - before.errors == 1 );
+    CHECK( after.retries - before.retries == 1 );
+    CHECK( after.resyncs - before.resyncs == (n >= 2) );
+    CHECK( after.reinits - before.reinits == (n >= 3) );
+    CHECK( after.recovered - before.recovered == 1 );
+    CHECK( after.failed == before.failed );
+}
+
+/** Each fault at each recovery step, then FatFs carries on without a remount */
+static void testRecovery( void ) {
+
+    DISKRECOVERYSTATS stats;
+    SDCARD_COUNTS c0, c1;
+    FATFS fs;
+    FIL fil;
+    UINT n, br, bw;
+    LBA_t sector = 15000;
+
+    disk_set_spidev( MOCK_DEVICE );
+    CHECK( f_mount( &fs, "", 1 ) == FR_OK );
+
+    for ( n = 1 ; n <= 3 ; n++ ) {
+        checkRecovery( SDCARD_FAULT_NO_RESPONSE, n, 0, sector += 8 );
+        checkRecovery( SDCARD_FAULT_NO_RESPONSE, n, 1, sector += 8 );
+        checkRecovery( SDCARD_FAULT_DATA_TOKEN, n, 0, sector += 8 );
+        checkRecovery( SDCARD_FAULT_DATA_TOKEN, n, 1, sector += 8 );
+        checkRecovery( SDCARD_FAULT_BUSY, n, 1, sector += 8 );
+    }
+
+    sdcard_get_counts( &c0 );
+    sdcard_fault( SDCARD_FAULT_DATA_TOKEN, 3 );
+    CHECK( f_open( &fil, "DIR/SUB/DATA.BIN", FA_READ | FA_WRITE ) == FR_OK );
+    memset( buf, 0, sizeof( buf ) );
+    CHECK( f_read( &fil, buf, sizeof( buf ), &br ) == FR_OK && br == sizeof( buf ) );
+    CHECK( memcmp( buf, pattern, sizeof( pattern ) ) == 0 );
+    sdcard_fault( SDCARD_FAULT_BUSY, 2 );
+    CHECK( f_write( &fil, pattern, sizeof( pattern ), &bw ) == FR_OK && bw == sizeof( pattern ) );
+    CHECK( f_close( &fil ) == FR_OK );
+    CHECK( f_mount( NULL, "", 0 ) == FR_OK );
+
+    sdcard_get_counts( &c1 );
+    CHECK( c1.faults - c0.faults == 5 );
+    disk_get_recovery_stats( &stats );
+    CHECK( stats.failed == 0 );
+}
+
+int main( int argc, char **argv ) {
+
+    SDCARD_COUNTS counts;
+    int sdhc = !(argc > 1 && strcmp( argv[1], "sdsc" ) == 0);
+
+    sdcard_power( sdhc );
+    formatCard();
+    spd_set_device( MOCK_DEVICE );
+    spd_set_ioctl( mockIoctl );
+
+    testTransport();
+    testFilesystem();
+    testRecovery();
+
+    sdcard_get_counts( &counts );
+    CHECK( counts.errors == 0 );
+
+    printf( "%s: %s, %lu messages, %u commands\n", argv[0], failures ? "FAILED" : "ok", messages, counts.commands );
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}